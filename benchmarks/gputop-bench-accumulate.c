@@ -0,0 +1,125 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Compares the per report cost of accumulating a stream of OA reports into
+ * the 3 accumulators maintained by the client (timeline, running context
+ * and global) by decoding each pair of reports once per accumulator versus
+ * decoding it once and adding the deltas to all of them.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-bench-util.h"
+
+#define N_ACCUMULATORS 3
+
+int
+main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "help",     no_argument,        0, 'h' },
+        { "reports",  required_argument,  0, 'r' },
+        { "loops",    required_argument,  0, 'l' },
+        { 0, 0, 0, 0 }
+    };
+    struct gputop_devinfo devinfo;
+    struct gputop_metric_set metric_set;
+    struct gputop_cc_oa_accumulator accumulators[N_ACCUMULATORS];
+    int n_reports = 100000, n_loops = 10;
+    uint64_t start, separate_ns = 0, fused_ns = 0;
+    uint8_t *reports;
+    int opt, l, r, a;
+
+    while ((opt = getopt_long(argc, argv, "hr:l:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            fprintf(stdout, "Usage: gputop-bench-accumulate [-r <n_reports>] [-l <n_loops>]\n");
+            return EXIT_SUCCESS;
+        case 'r':
+            n_reports = atoi(optarg);
+            break;
+        case 'l':
+            n_loops = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Unrecognized option: %d\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (n_reports < 2 || n_loops < 1) {
+        fprintf(stderr, "Need at least 2 reports and 1 loop\n");
+        return EXIT_FAILURE;
+    }
+
+    bench_init_devinfo(&devinfo, &metric_set, I915_OA_FORMAT_A32u40_A4u32_B8_C8);
+    reports = bench_generate_reports(I915_OA_FORMAT_A32u40_A4u32_B8_C8, n_reports);
+
+    for (l = 0; l < n_loops; l++) {
+        for (a = 0; a < N_ACCUMULATORS; a++)
+            gputop_cc_oa_accumulator_init(&accumulators[a], &devinfo,
+                                          &metric_set, 0, reports);
+        start = bench_get_time_ns();
+        for (r = 1; r < n_reports; r++) {
+            for (a = 0; a < N_ACCUMULATORS; a++) {
+                gputop_cc_oa_accumulate_reports(&accumulators[a],
+                                                reports + (r - 1) * BENCH_REPORT_SIZE,
+                                                reports + r * BENCH_REPORT_SIZE);
+            }
+        }
+        separate_ns += bench_get_time_ns() - start;
+
+        for (a = 0; a < N_ACCUMULATORS; a++)
+            gputop_cc_oa_accumulator_init(&accumulators[a], &devinfo,
+                                          &metric_set, 0, reports);
+        start = bench_get_time_ns();
+        for (r = 1; r < n_reports; r++) {
+            struct gputop_cc_oa_deltas deltas;
+
+            if (!gputop_cc_oa_decode_deltas(&metric_set,
+                                            reports + (r - 1) * BENCH_REPORT_SIZE,
+                                            reports + r * BENCH_REPORT_SIZE,
+                                            &deltas))
+                continue;
+            for (a = 0; a < N_ACCUMULATORS; a++)
+                gputop_cc_oa_accumulate_deltas(&accumulators[a], &deltas);
+        }
+        fused_ns += bench_get_time_ns() - start;
+    }
+
+    fprintf(stdout, "reports: %i x %i loops, %i accumulators\n",
+            n_reports, n_loops, N_ACCUMULATORS);
+    fprintf(stdout, "separate decode: %.2f ns/report\n",
+            (double) separate_ns / ((n_reports - 1) * (double) n_loops));
+    fprintf(stdout, "fused decode:    %.2f ns/report\n",
+            (double) fused_ns / ((n_reports - 1) * (double) n_loops));
+
+    free(reports);
+
+    return EXIT_SUCCESS;
+}
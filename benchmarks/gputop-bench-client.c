@@ -0,0 +1,1195 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Micro benchmarks of the client library hot paths :
+ *
+ *   - accumulate : gputop_cc_oa_accumulate_reports() over pairs of reports,
+ *                  for both OA report formats
+ *   - i915       : i915 perf messages processed by a client context, with
+ *                  reports rotating over 1, 10 and 100 hw contexts
+ *   - tracepoints: per CPU tracepoint messages arriving out of order
+ *                  and merged into the time sorted lists
+ *   - cpu-stats  : CpuStats protobuf messages
+ *   - counters   : reading all the counters of a metric set through the
+ *                  generated oa_counter_read_* functions, one value at a
+ *                  time and batched, then through evaluate_all()
+ *
+ * Messages go through gputop_client_context_handle_data() (or the zero copy
+ * gputop_client_context_handle_message() for i915 data) exactly as if they
+ * were coming from a server. The inputs are generated, or taken from a
+ * capture recorded with gputop_client_context_start_capture() (--input).
+ *
+ * The process is pinned to one CPU, each case is run a few times to warm up
+ * and then repeated, the setup of each run not being measured. One JSON
+ * object is printed per line and per case with statistics of the time
+ * spent per item (report, message, tracepoint or counter value).
+ */
+
+#include <assert.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <math.h>
+#include <sched.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-bench-util.h"
+#include "gputop-capture.h"
+#include "gputop-client-context.h"
+#include "gputop-i915-perf-compression.h"
+#include "gputop-network.h"
+
+#include "util/macros.h"
+
+#define BENCH_N_CPUS 8
+#define BENCH_HW_ID_BASE 1000
+
+/* Records per i915 message and reports between context switches */
+#define BENCH_RECORDS_PER_MSG 64
+#define BENCH_SWITCH_INTERVAL 8
+
+/* Tracepoints per message & distinct processes submitting work */
+#define BENCH_TRACEPOINTS_PER_MSG 16
+#define BENCH_N_PIDS 16
+
+/* Reports accumulated into each delta vector the counters are read from */
+#define BENCH_REPORTS_PER_SAMPLE 16
+
+#define BENCH_TRACEPOINT_SIZE 32
+static const char bench_tracepoint_format[] =
+    "name: i915_request_add\n"
+    "ID: 1234\n"
+    "format:\n"
+    "\tfield:unsigned short common_type;\toffset:0;\tsize:2;\tsigned:0;\n"
+    "\tfield:unsigned char common_flags;\toffset:2;\tsize:1;\tsigned:0;\n"
+    "\tfield:unsigned char common_preempt_count;\toffset:3;\tsize:1;\tsigned:0;\n"
+    "\tfield:int common_pid;\toffset:4;\tsize:4;\tsigned:1;\n"
+    "\n"
+    "\tfield:u32 dev;\toffset:8;\tsize:4;\tsigned:0;\n"
+    "\tfield:u32 hw_id;\toffset:12;\tsize:4;\tsigned:0;\n"
+    "\tfield:u64 ctx;\toffset:16;\tsize:8;\tsigned:0;\n"
+    "\tfield:u16 class;\toffset:24;\tsize:2;\tsigned:0;\n"
+    "\tfield:u16 instance;\toffset:26;\tsize:2;\tsigned:0;\n"
+    "\tfield:u32 seqno;\toffset:28;\tsize:4;\tsigned:0;\n"
+    "\n"
+    "print fmt: \"dev=%u, engine=%u:%u, hw_id=%u, ctx=%llu, seqno=%u\", "
+    "REC->dev, REC->class, REC->instance, REC->hw_id, REC->ctx, REC->seqno\n";
+
+/* A network message, as given to gputop_client_context_handle_data(). The
+ * stream id in the header is patched before each run.
+ */
+struct bench_msg {
+    uint8_t *data;
+    size_t len;
+
+    /* Tracepoint messages */
+    int tp;
+    int cpu;
+};
+
+struct bench_msgs {
+    struct bench_msg *msgs;
+    int n_msgs;
+    uint64_t n_items;
+};
+
+struct bench_tracepoint {
+    char name[128];
+    char *format;
+    uint32_t event_id;
+};
+
+struct bench_input {
+    const char *name;
+
+    uint8_t *features;
+    size_t features_len;
+
+    /* Metric set of the recorded OA stream, the --metric one otherwise */
+    char *metric_set_uuid;
+
+    char oa_names[3][32];
+    struct bench_msgs oa[3];
+    int n_oa;
+
+    struct bench_tracepoint tracepoints[8];
+    int n_tracepoints;
+    struct bench_msgs tracepoint_msgs;
+
+    Gputop__CpuStatsSet **cpu_stats;
+    int n_cpu_stats;
+};
+
+struct bench_state {
+    int cpu;
+    int n_warmup;
+    int n_repeats;
+    const char *filter;
+    FILE *output;
+
+    const struct bench_input *input;
+    struct gputop_client_context ctx;
+    int n_cpus;
+
+    /* Message buffers handed over to the context by a run */
+    void **bufs;
+
+    struct bench_msgs cpu_stats_msgs;
+
+    uint8_t *reports;
+    int n_reports;
+
+    uint64_t **deltas;
+    int n_deltas;
+    float *values;
+    double *all_values;
+    double sink;
+};
+
+typedef void (*bench_prepare_t)(struct bench_state *state, const void *data);
+typedef uint64_t (*bench_run_t)(struct bench_state *state, const void *data);
+
+void
+gputop_cr_console_log(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+/* The client context never gets a connection, requests it would send to a
+ * server are dropped. */
+void
+gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
+{
+}
+
+/**/
+
+static void
+msgs_add(struct bench_msgs *msgs, uint8_t *data, size_t len,
+         int tp, int cpu, int n_items)
+{
+    msgs->msgs = realloc(msgs->msgs, (msgs->n_msgs + 1) * sizeof(msgs->msgs[0]));
+    msgs->msgs[msgs->n_msgs++] = (struct bench_msg) {
+        .data = data, .len = len, .tp = tp, .cpu = cpu,
+    };
+    msgs->n_items += n_items;
+}
+
+static uint8_t *
+msg_alloc(uint8_t type, uint32_t stream_id, size_t len)
+{
+    uint8_t *data = calloc(1, 8 + len);
+
+    data[0] = type;
+    memcpy(data + 4, &stream_id, sizeof(stream_id));
+
+    return data;
+}
+
+static void
+msg_set_stream_id(uint8_t *data, uint32_t stream_id)
+{
+    memcpy(data + 4, &stream_id, sizeof(stream_id));
+}
+
+static uint8_t *
+pack_message(const Gputop__Message *message, size_t *len)
+{
+    size_t pb_len = gputop__message__get_packed_size(message);
+    uint8_t *data = msg_alloc(2, 0, pb_len);
+
+    gputop__message__pack(message, data + 8);
+    *len = 8 + pb_len;
+
+    return data;
+}
+
+static void
+handle_message(struct gputop_client_context *ctx, const Gputop__Message *message)
+{
+    size_t len;
+    uint8_t *data = pack_message(message, &len);
+
+    gputop_client_context_handle_data(ctx, data, len);
+    free(data);
+}
+
+/* Walks a sequence of records prefixed by a size, the same way for i915
+ * perf records and perf tracepoints. */
+static int
+count_records(const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len;
+    int n = 0;
+
+    while (data + sizeof(struct drm_i915_perf_record_header) <= end) {
+        const struct drm_i915_perf_record_header *header =
+            (const struct drm_i915_perf_record_header *) data;
+
+        if (header->size == 0)
+            break;
+        data += header->size;
+        n++;
+    }
+
+    return n;
+}
+
+/**/
+
+static void
+synthetic_features(struct bench_input *input)
+{
+    uint8_t slices_mask[1] = { 0x1 };
+    uint8_t subslices_mask[1] = { 0x7 };
+    uint8_t eus_mask[3] = { 0xff, 0xff, 0xff };
+
+    Gputop__DevTopology topology = GPUTOP__DEV_TOPOLOGY__INIT;
+    topology.max_slices = 1;
+    topology.max_subslices = 3;
+    topology.max_eus_per_subslice = 8;
+    topology.n_threads_per_eu = 7;
+    topology.slices_mask.len = sizeof(slices_mask);
+    topology.slices_mask.data = slices_mask;
+    topology.subslices_mask.len = sizeof(subslices_mask);
+    topology.subslices_mask.data = subslices_mask;
+    topology.eus_mask.len = sizeof(eus_mask);
+    topology.eus_mask.data = eus_mask;
+
+    Gputop__DevInfo devinfo = GPUTOP__DEV_INFO__INIT;
+    devinfo.devid = 0x1616;
+    devinfo.gen = 8;
+    devinfo.timestamp_frequency = 12500000;
+    devinfo.gt_min_freq = 300000000;
+    devinfo.gt_max_freq = 1000000000;
+    devinfo.devname = (char *) "bdw";
+    devinfo.prettyname = (char *) "Broadwell";
+    devinfo.topology = &topology;
+
+    Gputop__Features features = GPUTOP__FEATURES__INIT;
+    features.devinfo = &devinfo;
+    features.has_i915_oa = true;
+    features.n_cpus = BENCH_N_CPUS;
+    features.cpu_model = (char *) "";
+    features.kernel_release = (char *) "";
+    features.kernel_build = (char *) "";
+    features.fake_mode = true;
+
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_FEATURES;
+    message.features = &features;
+
+    input->features = pack_message(&message, &input->features_len);
+}
+
+static void
+synthetic_i915_msgs(struct bench_msgs *msgs, int n_reports, int n_contexts)
+{
+    const size_t record_size =
+        sizeof(struct drm_i915_perf_record_header) + BENCH_REPORT_SIZE;
+    uint8_t *reports =
+        bench_generate_reports(I915_OA_FORMAT_A32u40_A4u32_B8_C8, n_reports);
+
+    for (int r = 0; r < n_reports; r += BENCH_RECORDS_PER_MSG) {
+        int n_records = MIN2(BENCH_RECORDS_PER_MSG, n_reports - r);
+        uint8_t *data = msg_alloc(3, 0, n_records * record_size);
+        uint8_t *record = data + 8;
+
+        for (int i = 0; i < n_records; i++, record += record_size) {
+            struct drm_i915_perf_record_header *header =
+                (struct drm_i915_perf_record_header *) record;
+            uint32_t *report = (uint32_t *) (header + 1);
+
+            header->type = DRM_I915_PERF_RECORD_SAMPLE;
+            header->size = record_size;
+            memcpy(report, reports + (r + i) * BENCH_REPORT_SIZE, BENCH_REPORT_SIZE);
+
+            /* Gen8 context id valid bit */
+            report[0] |= 1 << 25;
+            report[2] = BENCH_HW_ID_BASE +
+                ((r + i) / BENCH_SWITCH_INTERVAL) % n_contexts;
+        }
+
+        msgs_add(msgs, data, 8 + n_records * record_size, -1, -1, n_records);
+    }
+
+    free(reports);
+}
+
+/* Each CPU sends its tracepoints in order, but the batches of the different
+ * CPUs overlap in time so that most of them have to be inserted before the
+ * last ones received. */
+static void
+synthetic_tracepoint_msgs(struct bench_msgs *msgs, int n_tracepoints)
+{
+    const size_t record_size =
+        DIV_ROUND_UP(offsetof(struct gputop_perf_data_tracepoint, data) +
+                     BENCH_TRACEPOINT_SIZE, 8) * 8;
+    int per_cpu[BENCH_N_CPUS] = { 0 }, sent[BENCH_N_CPUS] = { 0 };
+    uint64_t *times[BENCH_N_CPUS];
+    int n_sent = 0;
+
+    for (int c = 0; c < BENCH_N_CPUS; c++)
+        times[c] = calloc(n_tracepoints, sizeof(uint64_t));
+    for (int i = 0; i < n_tracepoints; i++) {
+        int cpu = rand() % BENCH_N_CPUS;
+        times[cpu][per_cpu[cpu]++] = 1000 + i * 500ULL;
+    }
+
+    while (n_sent < n_tracepoints) {
+        for (int cpu = 0; cpu < BENCH_N_CPUS; cpu++) {
+            int n_records = MIN2(BENCH_TRACEPOINTS_PER_MSG, per_cpu[cpu] - sent[cpu]);
+            uint8_t *data, *record;
+
+            if (n_records == 0)
+                continue;
+
+            data = msg_alloc(1, 0, n_records * record_size);
+            record = data + 8;
+            for (int i = 0; i < n_records; i++, record += record_size) {
+                struct gputop_perf_data_tracepoint *point =
+                    (struct gputop_perf_data_tracepoint *) record;
+                uint32_t pid = 100 + rand() % BENCH_N_PIDS;
+                uint32_t hw_id = BENCH_HW_ID_BASE + pid % 10;
+
+                point->header.type = 9; /* PERF_RECORD_SAMPLE */
+                point->header.size = record_size;
+                point->time = times[cpu][sent[cpu] + i];
+                point->data_size = BENCH_TRACEPOINT_SIZE;
+                memcpy(&point->data[4], &pid, sizeof(pid));
+                memcpy(&point->data[12], &hw_id, sizeof(hw_id));
+            }
+
+            msgs_add(msgs, data, 8 + n_records * record_size, 0, cpu, n_records);
+            sent[cpu] += n_records;
+            n_sent += n_records;
+        }
+    }
+
+    for (int c = 0; c < BENCH_N_CPUS; c++)
+        free(times[c]);
+}
+
+static void
+synthetic_cpu_stats(struct bench_input *input, int n_msgs)
+{
+    input->cpu_stats = calloc(n_msgs, sizeof(input->cpu_stats[0]));
+    input->n_cpu_stats = n_msgs;
+
+    for (int m = 0; m < n_msgs; m++) {
+        Gputop__CpuStatsSet *set = calloc(1, sizeof(*set));
+
+        gputop__cpu_stats_set__init(set);
+        set->n_cpus = BENCH_N_CPUS;
+        set->cpus = calloc(BENCH_N_CPUS, sizeof(set->cpus[0]));
+        for (int c = 0; c < BENCH_N_CPUS; c++) {
+            Gputop__CpuStats *stats = calloc(1, sizeof(*stats));
+
+            gputop__cpu_stats__init(stats);
+            stats->timestamp = m * 100000000ULL;
+            stats->user = m * 30 + c;
+            stats->system = m * 10 + c;
+            stats->idle = m * 60 + c;
+            set->cpus[c] = stats;
+        }
+        input->cpu_stats[m] = set;
+    }
+}
+
+static void
+synthetic_input(struct bench_input *input, int n_reports)
+{
+    static const int n_contexts[] = { 1, 10, 100 };
+
+    input->name = "synthetic";
+
+    synthetic_features(input);
+
+    for (int i = 0; i < ARRAY_SIZE(n_contexts); i++) {
+        snprintf(input->oa_names[i], sizeof(input->oa_names[i]),
+                 "contexts=%i", n_contexts[i]);
+        synthetic_i915_msgs(&input->oa[i], n_reports, n_contexts[i]);
+    }
+    input->n_oa = ARRAY_SIZE(n_contexts);
+
+    snprintf(input->tracepoints[0].name, sizeof(input->tracepoints[0].name),
+             "i915/i915_request_add");
+    input->tracepoints[0].format = strdup(bench_tracepoint_format);
+    input->tracepoints[0].event_id = 1234;
+    input->n_tracepoints = 1;
+    synthetic_tracepoint_msgs(&input->tracepoint_msgs, n_reports);
+
+    synthetic_cpu_stats(input, MAX2(n_reports / 10, 1));
+}
+
+/**/
+
+struct recorded_stream {
+    uint32_t id;
+    int tp;
+    int cpu;
+};
+
+/* Extracts the inputs out of a capture, the stream ids being those used by
+ * the recorded session. */
+static bool
+recorded_input(struct bench_input *input, const char *path)
+{
+    struct gputop_capture_reader *reader = gputop_capture_reader_open(path);
+    const struct gputop_capture_chunk *chunk;
+    Gputop__Request **requests = NULL;
+    Gputop__Message **replies = NULL;
+    struct recorded_stream *streams = NULL;
+    struct bench_msgs oa_msgs = { 0 }, tp_msgs = { 0 };
+    int n_requests = 0, n_replies = 0, n_streams = 0;
+    size_t cursor;
+
+    if (!reader) {
+        fprintf(stderr, "Failed to open capture %s\n", path);
+        return false;
+    }
+
+    input->name = path;
+
+    cursor = gputop_capture_reader_begin(reader);
+    while ((chunk = gputop_capture_reader_next(reader, &cursor))) {
+        const uint8_t *data = gputop_capture_chunk_data(chunk);
+
+        if (chunk->type == GPUTOP_CAPTURE_CHUNK_SEND) {
+            Gputop__Request *request = gputop__request__unpack(NULL, chunk->len, data);
+
+            if (request) {
+                requests = realloc(requests, (n_requests + 1) * sizeof(request));
+                requests[n_requests++] = request;
+            }
+            continue;
+        }
+
+        if (chunk->type != GPUTOP_CAPTURE_CHUNK_RECV || chunk->len <= 8)
+            continue;
+
+        switch (data[0]) {
+        case 1:
+        case 3: {
+            uint8_t *copy = malloc(chunk->len);
+
+            memcpy(copy, data, chunk->len);
+            msgs_add(data[0] == 1 ? &tp_msgs : &oa_msgs, copy, chunk->len, -1, -1,
+                     count_records(copy + 8, chunk->len - 8));
+            break;
+        }
+        case 4: {
+            size_t len = gputop_i915_perf_decompressed_size(data + 8, chunk->len - 8);
+            uint8_t *copy = msg_alloc(3, 0, len);
+
+            memcpy(copy + 4, data + 4, 4);
+            if (!len || !gputop_i915_perf_decompress(data + 8, chunk->len - 8,
+                                                     copy + 8, len)) {
+                free(copy);
+                break;
+            }
+            msgs_add(&oa_msgs, copy, 8 + len, -1, -1, count_records(copy + 8, len));
+            break;
+        }
+        case 2: {
+            Gputop__Message *message =
+                gputop__message__unpack(NULL, chunk->len - 8, data + 8);
+
+            if (!message)
+                break;
+
+            if (message->cmd_case == GPUTOP__MESSAGE__CMD_FEATURES && !input->features) {
+                input->features = malloc(chunk->len);
+                input->features_len = chunk->len;
+                memcpy(input->features, data, chunk->len);
+            } else if (message->cmd_case == GPUTOP__MESSAGE__CMD_CPU_STATS) {
+                input->cpu_stats = realloc(input->cpu_stats,
+                                           (input->n_cpu_stats + 1) * sizeof(input->cpu_stats[0]));
+                input->cpu_stats[input->n_cpu_stats++] = message->cpu_stats;
+                message->cpu_stats = NULL;
+                message->cmd_case = GPUTOP__MESSAGE__CMD__NOT_SET;
+            } else if (message->cmd_case == GPUTOP__MESSAGE__CMD_TRACEPOINT_INFO) {
+                replies = realloc(replies, (n_replies + 1) * sizeof(message));
+                replies[n_replies++] = message;
+                break;
+            }
+            gputop__message__free_unpacked(message, NULL);
+            break;
+        }
+        }
+    }
+
+    gputop_capture_reader_close(reader);
+
+    if (!input->features) {
+        fprintf(stderr, "No features in capture %s\n", path);
+        return false;
+    }
+
+    /* Tracepoints the session asked information about */
+    for (int r = 0; r < n_requests; r++) {
+        if (requests[r]->req_case != GPUTOP__REQUEST__REQ_GET_TRACEPOINT_INFO ||
+            input->n_tracepoints == ARRAY_SIZE(input->tracepoints))
+            continue;
+
+        for (int i = 0; i < n_replies; i++) {
+            if (!replies[i]->reply_uuid || !requests[r]->uuid ||
+                strcmp(replies[i]->reply_uuid, requests[r]->uuid))
+                continue;
+
+            struct bench_tracepoint *tp = &input->tracepoints[input->n_tracepoints++];
+            snprintf(tp->name, sizeof(tp->name), "%s", requests[r]->get_tracepoint_info);
+            tp->format = strdup(replies[i]->tracepoint_info->sample_format);
+            tp->event_id = replies[i]->tracepoint_info->event_id;
+            break;
+        }
+    }
+
+    /* Streams the session opened, only the OA streams of the first metric
+     * set are kept. */
+    for (int r = 0; r < n_requests; r++) {
+        const Gputop__OpenStream *open = requests[r]->open_stream;
+
+        if (requests[r]->req_case != GPUTOP__REQUEST__REQ_OPEN_STREAM)
+            continue;
+
+        if (open->type_case == GPUTOP__OPEN_STREAM__TYPE_OA_STREAM) {
+            if (!input->metric_set_uuid)
+                input->metric_set_uuid = strdup(open->oa_stream->uuid);
+            if (strcmp(input->metric_set_uuid, open->oa_stream->uuid))
+                continue;
+
+            streams = realloc(streams, (n_streams + 1) * sizeof(streams[0]));
+            streams[n_streams++] = (struct recorded_stream) {
+                .id = open->id, .tp = -1, .cpu = -1,
+            };
+        } else if (open->type_case == GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT) {
+            for (int t = 0; t < input->n_tracepoints; t++) {
+                if (input->tracepoints[t].event_id != open->tracepoint->id)
+                    continue;
+
+                streams = realloc(streams, (n_streams + 1) * sizeof(streams[0]));
+                streams[n_streams++] = (struct recorded_stream) {
+                    .id = open->id, .tp = t, .cpu = open->tracepoint->cpu,
+                };
+                break;
+            }
+        }
+    }
+
+    /* Stream ids might be reused by later sessions of the same capture, the
+     * last stream opened with an id wins. */
+    for (int m = 0; m < oa_msgs.n_msgs + tp_msgs.n_msgs; m++) {
+        bool is_oa = m < oa_msgs.n_msgs;
+        struct bench_msg *msg = is_oa ? &oa_msgs.msgs[m] : &tp_msgs.msgs[m - oa_msgs.n_msgs];
+        const struct recorded_stream *stream = NULL;
+        uint32_t id;
+
+        memcpy(&id, msg->data + 4, sizeof(id));
+        for (int s = 0; s < n_streams; s++) {
+            if (streams[s].id == id && (streams[s].tp < 0) == is_oa)
+                stream = &streams[s];
+        }
+
+        if (!stream) {
+            free(msg->data);
+            continue;
+        }
+
+        if (is_oa) {
+            msgs_add(&input->oa[0], msg->data, msg->len, -1, -1,
+                     count_records(msg->data + 8, msg->len - 8));
+        } else {
+            msgs_add(&input->tracepoint_msgs, msg->data, msg->len,
+                     stream->tp, stream->cpu,
+                     count_records(msg->data + 8, msg->len - 8));
+        }
+    }
+    if (input->oa[0].n_msgs) {
+        snprintf(input->oa_names[0], sizeof(input->oa_names[0]), "recorded");
+        input->n_oa = 1;
+    }
+
+    for (int r = 0; r < n_requests; r++)
+        gputop__request__free_unpacked(requests[r], NULL);
+    for (int r = 0; r < n_replies; r++)
+        gputop__message__free_unpacked(replies[r], NULL);
+    free(requests);
+    free(replies);
+    free(streams);
+    free(oa_msgs.msgs);
+    free(tp_msgs.msgs);
+
+    return true;
+}
+
+/**/
+
+static const uint8_t *
+record_report(const struct gputop_client_context *ctx,
+              const struct drm_i915_perf_record_header *header)
+{
+    return (const uint8_t *)
+        gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
+                                      GPUTOP_I915_PERF_FIELD_OA_REPORT);
+}
+
+/* Copies the reports of the recorded OA records in a contiguous array. */
+static void
+recorded_reports(struct bench_state *state)
+{
+    const struct bench_msgs *msgs = &state->input->oa[0];
+
+    state->reports = calloc(msgs->n_items, BENCH_REPORT_SIZE);
+    state->n_reports = 0;
+
+    for (int m = 0; m < msgs->n_msgs; m++) {
+        const uint8_t *data = msgs->msgs[m].data + 8;
+        const uint8_t *end = msgs->msgs[m].data + msgs->msgs[m].len;
+
+        while (data < end) {
+            const struct drm_i915_perf_record_header *header =
+                (const struct drm_i915_perf_record_header *) data;
+
+            if (header->size == 0)
+                break;
+            if (header->type == DRM_I915_PERF_RECORD_SAMPLE) {
+                memcpy(state->reports + state->n_reports++ * BENCH_REPORT_SIZE,
+                       record_report(&state->ctx, header), BENCH_REPORT_SIZE);
+            }
+            data += header->size;
+        }
+    }
+}
+
+/* Accumulates the reports into delta vectors to read the counters from. */
+static void
+prepare_deltas(struct bench_state *state)
+{
+    const struct gputop_metric_set *metric_set = state->ctx.metric_set;
+    int n_samples = (state->n_reports - 1) / BENCH_REPORTS_PER_SAMPLE;
+
+    state->deltas = calloc(MAX2(n_samples, 1), sizeof(state->deltas[0]));
+    state->values = calloc(MAX2(n_samples, 1), sizeof(state->values[0]));
+    state->all_values = calloc(MAX2(n_samples, 1) * metric_set->n_counters,
+                               sizeof(state->all_values[0]));
+    state->n_deltas = n_samples;
+
+    for (int s = 0; s < n_samples; s++) {
+        const uint8_t *first =
+            state->reports + s * BENCH_REPORTS_PER_SAMPLE * BENCH_REPORT_SIZE;
+        struct gputop_cc_oa_accumulator accumulator;
+
+        gputop_cc_oa_accumulator_init(&accumulator, &state->ctx.devinfo,
+                                      metric_set, 0, first);
+        for (int r = 0; r < BENCH_REPORTS_PER_SAMPLE; r++) {
+            gputop_cc_oa_accumulate_reports(&accumulator,
+                                            first + r * BENCH_REPORT_SIZE,
+                                            first + (r + 1) * BENCH_REPORT_SIZE);
+        }
+
+        state->deltas[s] = malloc(sizeof(accumulator.deltas));
+        memcpy(state->deltas[s], accumulator.deltas, sizeof(accumulator.deltas));
+    }
+}
+
+static bool
+setup_context(struct bench_state *state, const char *metric)
+{
+    const struct bench_input *input = state->input;
+    struct gputop_client_context *ctx = &state->ctx;
+
+    gputop_client_context_init(ctx);
+    gputop_client_context_reset(ctx, NULL);
+
+    gputop_client_context_handle_data(ctx, input->features, input->features_len);
+    if (!ctx->features || !ctx->gen_metrics) {
+        fprintf(stderr, "Unsupported device\n");
+        return false;
+    }
+    state->n_cpus = ctx->features->features->n_cpus;
+
+    for (int t = 0; t < input->n_tracepoints; t++) {
+        struct gputop_perf_tracepoint *tp =
+            gputop_client_context_add_tracepoint(ctx, input->tracepoints[t].name);
+
+        Gputop__TracepointInfo info = GPUTOP__TRACEPOINT_INFO__INIT;
+        info.event_id = input->tracepoints[t].event_id;
+        info.sample_format = input->tracepoints[t].format;
+
+        Gputop__Message message = GPUTOP__MESSAGE__INIT;
+        message.reply_uuid = tp->uuid;
+        message.cmd_case = GPUTOP__MESSAGE__CMD_TRACEPOINT_INFO;
+        message.tracepoint_info = &info;
+        handle_message(ctx, &message);
+    }
+
+    ctx->metric_set = input->metric_set_uuid ?
+        gputop_client_context_uuid_to_metric_set(ctx, input->metric_set_uuid) :
+        gputop_client_context_symbol_to_metric_set(ctx, metric);
+    if (!ctx->metric_set) {
+        fprintf(stderr, "Unknown metric set %s\n",
+                input->metric_set_uuid ? input->metric_set_uuid : metric);
+        return false;
+    }
+
+    /* The CpuStats stream stays opened across runs, messages can be packed
+     * with its id once. */
+    gputop_client_context_update_cpu_stream(ctx, 100);
+    for (int m = 0; m < input->n_cpu_stats; m++) {
+        Gputop__Message message = GPUTOP__MESSAGE__INIT;
+        size_t len;
+        uint8_t *data;
+
+        input->cpu_stats[m]->id = ctx->cpu_stats_stream.id;
+        message.cmd_case = GPUTOP__MESSAGE__CMD_CPU_STATS;
+        message.cpu_stats = input->cpu_stats[m];
+        data = pack_message(&message, &len);
+        msgs_add(&state->cpu_stats_msgs, data, len, -1, -1, 1);
+    }
+
+    return true;
+}
+
+/**/
+
+static int
+compare_double(const void *a, const void *b)
+{
+    double da = *(const double *) a, db = *(const double *) b;
+    return da < db ? -1 : da > db;
+}
+
+static void
+run_case(struct bench_state *state,
+         const char *name, const char *variant,
+         bench_prepare_t prepare, bench_run_t run, const void *data)
+{
+    double *samples = calloc(state->n_repeats, sizeof(samples[0]));
+    double mean = 0, variance = 0;
+    uint64_t n_items = 0;
+    char full_name[128];
+
+    snprintf(full_name, sizeof(full_name), "%s/%s", name, variant);
+    if (state->filter && !strstr(full_name, state->filter)) {
+        free(samples);
+        return;
+    }
+
+    for (int w = 0; w < state->n_warmup; w++) {
+        if (prepare)
+            prepare(state, data);
+        run(state, data);
+    }
+
+    for (int r = 0; r < state->n_repeats; r++) {
+        uint64_t start;
+
+        if (prepare)
+            prepare(state, data);
+
+        start = bench_get_time_ns();
+        n_items = run(state, data);
+        samples[r] = (double) (bench_get_time_ns() - start) / MAX2(n_items, 1);
+        mean += samples[r];
+    }
+
+    mean /= state->n_repeats;
+    for (int r = 0; r < state->n_repeats; r++)
+        variance += (samples[r] - mean) * (samples[r] - mean);
+    variance /= state->n_repeats;
+    qsort(samples, state->n_repeats, sizeof(samples[0]), compare_double);
+
+    fprintf(state->output,
+            "{ \"case\": \"%s\", \"variant\": \"%s\", \"input\": \"%s\", "
+            "\"cpu\": %i, \"warmup\": %i, \"repeats\": %i, \"items\": %" PRIu64 ", "
+            "\"ns_per_item\": { \"min\": %.3f, \"median\": %.3f, \"mean\": %.3f, "
+            "\"stddev\": %.3f, \"max\": %.3f } }\n",
+            name, variant, state->input->name,
+            state->cpu, state->n_warmup, state->n_repeats, n_items,
+            samples[0], samples[state->n_repeats / 2], mean,
+            sqrt(variance), samples[state->n_repeats - 1]);
+    fflush(state->output);
+
+    free(samples);
+}
+
+/**/
+
+struct accumulate_case {
+    struct gputop_devinfo devinfo;
+    struct gputop_metric_set metric_set;
+    const struct gputop_devinfo *devinfo_ptr;
+    const struct gputop_metric_set *metric_set_ptr;
+    const uint8_t *reports;
+    int n_reports;
+};
+
+static uint64_t
+run_accumulate(struct bench_state *state, const void *data)
+{
+    const struct accumulate_case *c = data;
+    struct gputop_cc_oa_accumulator accumulator;
+
+    gputop_cc_oa_accumulator_init(&accumulator, c->devinfo_ptr, c->metric_set_ptr,
+                                  0, c->reports);
+    for (int r = 1; r < c->n_reports; r++) {
+        gputop_cc_oa_accumulate_reports(&accumulator,
+                                        c->reports + (r - 1) * BENCH_REPORT_SIZE,
+                                        c->reports + r * BENCH_REPORT_SIZE);
+    }
+    state->sink += accumulator.deltas[0];
+
+    return c->n_reports - 1;
+}
+
+static void
+prepare_i915(struct bench_state *state, const void *data)
+{
+    const struct bench_msgs *msgs = data;
+    struct gputop_client_context *ctx = &state->ctx;
+
+    /* Restarting drops what the previous run accumulated and opens a new
+     * OA stream. */
+    gputop_client_context_start_sampling(ctx);
+
+    for (int m = 0; m < msgs->n_msgs; m++) {
+        state->bufs[m] = gputop_client_context_alloc_message(ctx, msgs->msgs[m].len);
+        memcpy(state->bufs[m], msgs->msgs[m].data, msgs->msgs[m].len);
+        msg_set_stream_id(state->bufs[m], ctx->oa_stream.id);
+    }
+}
+
+static uint64_t
+run_i915(struct bench_state *state, const void *data)
+{
+    const struct bench_msgs *msgs = data;
+
+    for (int m = 0; m < msgs->n_msgs; m++) {
+        gputop_client_context_handle_message(&state->ctx, state->bufs[m],
+                                             msgs->msgs[m].len);
+    }
+
+    return msgs->n_items;
+}
+
+static void
+prepare_tracepoints(struct bench_state *state, const void *data)
+{
+    const struct bench_msgs *msgs = data;
+    const struct bench_input *input = state->input;
+    struct gputop_client_context *ctx = &state->ctx;
+    uint32_t *ids = calloc(input->n_tracepoints * state->n_cpus, sizeof(ids[0]));
+
+    /* Restarting drops the tracepoints of the previous run and opens new
+     * streams. */
+    gputop_client_context_start_sampling(ctx);
+
+    for (int t = 0; t < input->n_tracepoints; t++) {
+        struct gputop_perf_tracepoint *tp =
+            gputop_client_context_add_tracepoint(ctx, input->tracepoints[t].name);
+
+        list_for_each_entry(struct gputop_perf_tracepoint_stream, stream,
+                            &tp->streams, link) {
+            if (stream->cpu < state->n_cpus)
+                ids[t * state->n_cpus + stream->cpu] = stream->base.id;
+        }
+    }
+
+    for (int m = 0; m < msgs->n_msgs; m++) {
+        const struct bench_msg *msg = &msgs->msgs[m];
+
+        if (msg->cpu < state->n_cpus)
+            msg_set_stream_id(msg->data, ids[msg->tp * state->n_cpus + msg->cpu]);
+    }
+
+    free(ids);
+}
+
+static uint64_t
+run_handle_data(struct bench_state *state, const void *data)
+{
+    const struct bench_msgs *msgs = data;
+
+    for (int m = 0; m < msgs->n_msgs; m++) {
+        gputop_client_context_handle_data(&state->ctx, msgs->msgs[m].data,
+                                          msgs->msgs[m].len);
+    }
+
+    return msgs->n_items;
+}
+
+static uint64_t
+run_counters(struct bench_state *state, const void *data)
+{
+    struct gputop_client_context *ctx = &state->ctx;
+    const struct gputop_metric_set *metric_set = ctx->metric_set;
+    double sum = 0;
+
+    for (int s = 0; s < state->n_deltas; s++) {
+        for (int c = 0; c < metric_set->n_counters; c++) {
+            sum += gputop_client_context_read_counter_value(ctx, state->deltas[s],
+                                                            &metric_set->counters[c]);
+        }
+    }
+    state->sink += sum;
+
+    return (uint64_t) state->n_deltas * metric_set->n_counters;
+}
+
+static uint64_t
+run_counters_batch(struct bench_state *state, const void *data)
+{
+    struct gputop_client_context *ctx = &state->ctx;
+    const struct gputop_metric_set *metric_set = ctx->metric_set;
+
+    for (int c = 0; c < metric_set->n_counters; c++) {
+        metric_set->counters[c].oa_counter_read_batch(&ctx->devinfo, metric_set,
+                                                      state->deltas, state->n_deltas,
+                                                      state->values);
+        state->sink += state->values[0];
+    }
+
+    return (uint64_t) state->n_deltas * metric_set->n_counters;
+}
+
+static uint64_t
+run_counters_all(struct bench_state *state, const void *data)
+{
+    struct gputop_client_context *ctx = &state->ctx;
+    const struct gputop_metric_set *metric_set = ctx->metric_set;
+
+    metric_set->evaluate_all(&ctx->devinfo, metric_set,
+                             state->deltas, state->n_deltas,
+                             state->all_values);
+    state->sink += state->all_values[0];
+
+    return (uint64_t) state->n_deltas * metric_set->n_counters;
+}
+
+/**/
+
+static bool
+pin_to_cpu(int cpu)
+{
+    cpu_set_t set;
+
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+
+    return sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+static void
+usage(void)
+{
+    fprintf(stdout,
+            "Usage: gputop-bench-client [options]\n"
+            "\n"
+            " -i, --input <capture>     Take the inputs from a capture instead of\n"
+            "                           generating them\n"
+            " -m, --metric <symbol>     Metric set of the generated inputs\n"
+            "                           (RenderBasic)\n"
+            " -r, --reports <n>         Reports/tracepoints generated (20000)\n"
+            " -C, --cpu <cpu>           CPU to run on (the current one)\n"
+            " -w, --warmup <n>          Runs before measuring (3)\n"
+            " -n, --repeats <n>         Measured runs of each case (15)\n"
+            " -f, --filter <string>     Only run the cases containing string\n"
+            " -o, --output <file>       Write the results to a file\n"
+            " -h, --help                Display this help\n");
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "help",     no_argument,        0, 'h' },
+        { "input",    required_argument,  0, 'i' },
+        { "metric",   required_argument,  0, 'm' },
+        { "reports",  required_argument,  0, 'r' },
+        { "cpu",      required_argument,  0, 'C' },
+        { "warmup",   required_argument,  0, 'w' },
+        { "repeats",  required_argument,  0, 'n' },
+        { "filter",   required_argument,  0, 'f' },
+        { "output",   required_argument,  0, 'o' },
+        { 0, 0, 0, 0 }
+    };
+    struct bench_state state = {
+        .cpu = sched_getcpu(),
+        .n_warmup = 3,
+        .n_repeats = 15,
+        .output = stdout,
+    };
+    struct bench_input input = { 0 };
+    const char *capture = NULL, *metric = "RenderBasic";
+    int n_reports = 20000, max_msgs = 0, opt;
+
+    while ((opt = getopt_long(argc, argv, "hi:m:r:C:w:n:f:o:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        case 'i':
+            capture = optarg;
+            break;
+        case 'm':
+            metric = optarg;
+            break;
+        case 'r':
+            n_reports = atoi(optarg);
+            break;
+        case 'C':
+            state.cpu = atoi(optarg);
+            break;
+        case 'w':
+            state.n_warmup = atoi(optarg);
+            break;
+        case 'n':
+            state.n_repeats = atoi(optarg);
+            break;
+        case 'f':
+            state.filter = optarg;
+            break;
+        case 'o':
+            state.output = fopen(optarg, "w");
+            if (!state.output) {
+                fprintf(stderr, "Failed to open %s\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Unrecognized option: %d\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (n_reports < 2 || state.n_warmup < 0 || state.n_repeats < 1) {
+        fprintf(stderr, "Need at least 2 reports and 1 repeat\n");
+        return EXIT_FAILURE;
+    }
+
+    if (state.cpu < 0 || !pin_to_cpu(state.cpu)) {
+        fprintf(stderr, "Failed to pin to CPU %i\n", state.cpu);
+        return EXIT_FAILURE;
+    }
+
+    /* Same inputs from one run of the benchmark to another */
+    srand(42);
+
+    if (capture) {
+        if (!recorded_input(&input, capture))
+            return EXIT_FAILURE;
+    } else {
+        synthetic_input(&input, n_reports);
+    }
+
+    state.input = &input;
+    if (!setup_context(&state, metric))
+        return EXIT_FAILURE;
+
+    if (capture) {
+        recorded_reports(&state);
+    } else {
+        state.reports =
+            bench_generate_reports(state.ctx.metric_set->perf_oa_format, n_reports);
+        state.n_reports = n_reports;
+    }
+    prepare_deltas(&state);
+
+    /* Accumulation, for both formats when generated */
+    if (capture) {
+        struct accumulate_case c = {
+            .devinfo_ptr = &state.ctx.devinfo,
+            .metric_set_ptr = state.ctx.metric_set,
+            .reports = state.reports,
+            .n_reports = state.n_reports,
+        };
+
+        if (c.n_reports > 1)
+            run_case(&state, "accumulate", "recorded", NULL, run_accumulate, &c);
+    } else {
+        static const struct {
+            uint32_t format;
+            const char *name;
+        } formats[] = {
+            { I915_OA_FORMAT_A32u40_A4u32_B8_C8, "A32u40_A4u32_B8_C8" },
+            { I915_OA_FORMAT_A45_B8_C8, "A45_B8_C8" },
+        };
+
+        for (int f = 0; f < ARRAY_SIZE(formats); f++) {
+            struct accumulate_case c = { .n_reports = n_reports };
+
+            bench_init_devinfo(&c.devinfo, &c.metric_set, formats[f].format);
+            c.devinfo_ptr = &c.devinfo;
+            c.metric_set_ptr = &c.metric_set;
+            c.reports = bench_generate_reports(formats[f].format, n_reports);
+
+            run_case(&state, "accumulate", formats[f].name, NULL, run_accumulate, &c);
+
+            free((void *) c.reports);
+        }
+    }
+
+    for (int i = 0; i < input.n_oa; i++)
+        max_msgs = MAX2(max_msgs, input.oa[i].n_msgs);
+    state.bufs = calloc(MAX2(max_msgs, 1), sizeof(state.bufs[0]));
+    for (int i = 0; i < input.n_oa; i++) {
+        run_case(&state, "i915", input.oa_names[i],
+                 prepare_i915, run_i915, &input.oa[i]);
+    }
+
+    if (input.tracepoint_msgs.n_msgs) {
+        run_case(&state, "tracepoints", capture ? "recorded" : "out-of-order",
+                 prepare_tracepoints, run_handle_data, &input.tracepoint_msgs);
+    }
+
+    if (state.cpu_stats_msgs.n_msgs) {
+        run_case(&state, "cpu-stats", capture ? "recorded" : "synthetic",
+                 NULL, run_handle_data, &state.cpu_stats_msgs);
+    }
+
+    if (state.n_deltas) {
+        run_case(&state, "counters", state.ctx.metric_set->symbol_name,
+                 NULL, run_counters, NULL);
+        run_case(&state, "counters-batch", state.ctx.metric_set->symbol_name,
+                 NULL, run_counters_batch, NULL);
+        run_case(&state, "counters-all", state.ctx.metric_set->symbol_name,
+                 NULL, run_counters_all, NULL);
+    }
+
+    gputop_client_context_stop_sampling(&state.ctx);
+
+    if (state.output != stdout)
+        fclose(state.output);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,811 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Measures the throughput and latency of the whole server -> websocket ->
+ * client pipeline. A gputop-system server is started in fake mode,
+ * generating OA reports at a given rate following a scenario (see
+ * gputop-oa-scenario.h), and headless client contexts connect to it over
+ * loopback. For each combination of report rate, aggregation period and
+ * number of clients, one JSON object is printed per line with :
+ *
+ *   - the rate of reports received, per client and in total
+ *   - percentiles of the latency between the generation of a report (its
+ *     CPU timestamp) and the end of its processing by a client context
+ *   - reports lost, either generated as lost by the scenario, dropped by
+ *     the emulated OA buffer or by the server's flow control
+ *   - the CPU time used by the server, by the client contexts processing
+ *     the data and by the rest of the client process (transport)
+ */
+
+#include <errno.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <uv.h>
+
+#include "gputop-bench-util.h"
+#include "gputop-client-context.h"
+#include "gputop-network.h"
+
+#include "util/macros.h"
+
+#ifndef GPUTOP_SYSTEM_PATH
+#define GPUTOP_SYSTEM_PATH "gputop-system"
+#endif
+
+#define CONNECT_RETRY_MS 100
+#define CONNECT_TIMEOUT_MS 10000
+
+/* Log-linear histogram of latencies in ns, with 16 buckets per power of
+ * two, i.e. values are rounded down by at most 1/16th */
+#define HIST_SUB_BITS 4
+#define HIST_N_BUCKETS (64 << HIST_SUB_BITS)
+
+struct bench_config {
+    const char *server_path;
+    const char *base_scenario;
+    const char *metric;
+    int port;
+    unsigned tick_ms;
+    double warmup_s;
+    double duration_s;
+};
+
+struct bench_run;
+
+struct bench_client {
+    struct gputop_client_context ctx; /* first, see on_accumulate() */
+    struct bench_run *run;
+    gputop_connection_t *conn;
+    uv_timer_t retry_timer;
+
+    bool connected;
+    bool sampling;
+
+    uint64_t processing_ns;
+    uint64_t n_periods;
+};
+
+struct bench_run {
+    const struct bench_config *config;
+    const char *rate;
+    uint64_t period_ns;
+    int n_clients;
+    struct bench_client *clients;
+
+    pid_t server_pid;
+    uv_timer_t timer;
+    uint64_t connect_deadline;
+    int n_sampling;
+    int n_connections;
+    bool measuring;
+    bool done;
+    bool failed;
+
+    uint64_t start_time, end_time;
+    uint64_t server_cpu_start, server_cpu_end;
+    uint64_t process_cpu_start, process_cpu_end;
+
+    uint64_t n_reports;
+    uint64_t n_lost_reports;
+    uint64_t n_buffer_lost;
+    uint64_t n_dropped_reports;
+    uint64_t n_decimated_reports;
+    uint64_t latencies[HIST_N_BUCKETS];
+};
+
+static FILE *output;
+
+void gputop_cr_console_log(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+static uint64_t
+get_cpu_time_ns(clockid_t clock)
+{
+    struct timespec ts;
+
+    clock_gettime(clock, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* utime + stime of a process, from /proc/<pid>/stat */
+static uint64_t
+get_process_cpu_time_ns(pid_t pid)
+{
+    char path[64], buf[1024];
+    unsigned long utime, stime;
+    const char *fields;
+    FILE *file;
+    size_t len;
+
+    snprintf(path, sizeof(path), "/proc/%d/stat", pid);
+    file = fopen(path, "r");
+    if (!file)
+        return 0;
+    len = fread(buf, 1, sizeof(buf) - 1, file);
+    fclose(file);
+    buf[len] = '\0';
+
+    /* Skip the command name, which may contain spaces */
+    fields = strrchr(buf, ')');
+    if (!fields ||
+        sscanf(fields + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu",
+               &utime, &stime) != 2)
+        return 0;
+
+    return (utime + stime) * (1000000000ULL / sysconf(_SC_CLK_TCK));
+}
+
+static int
+hist_bucket(uint64_t value)
+{
+    int shift;
+
+    if (value < (1 << HIST_SUB_BITS))
+        return value;
+
+    shift = (63 - __builtin_clzll(value)) - HIST_SUB_BITS;
+    return ((shift + 1) << HIST_SUB_BITS) +
+        ((value >> shift) & ((1 << HIST_SUB_BITS) - 1));
+}
+
+static uint64_t
+hist_value(int bucket)
+{
+    int shift;
+
+    if (bucket < (1 << HIST_SUB_BITS))
+        return bucket;
+
+    shift = (bucket >> HIST_SUB_BITS) - 1;
+    return ((uint64_t) ((bucket & ((1 << HIST_SUB_BITS) - 1)) |
+                        (1 << HIST_SUB_BITS))) << shift;
+}
+
+static uint64_t
+hist_percentile(const uint64_t *hist, uint64_t count, double percentile)
+{
+    uint64_t target = MAX2(count * percentile / 100.0, 1), seen = 0;
+
+    for (int i = 0; i < HIST_N_BUCKETS; i++) {
+        seen += hist[i];
+        if (seen >= target)
+            return hist_value(i);
+    }
+
+    return 0;
+}
+
+static uint64_t
+hist_max(const uint64_t *hist)
+{
+    for (int i = HIST_N_BUCKETS - 1; i >= 0; i--) {
+        if (hist[i])
+            return hist_value(i);
+    }
+
+    return 0;
+}
+
+/* Accounts the records of an i915 perf message before it's handed over to
+ * the client context. Latencies are taken once the client context is done
+ * with it.
+ */
+static void
+account_i915_perf_message(struct bench_run *run,
+                          struct gputop_client_context *ctx,
+                          const uint8_t *msg, size_t len,
+                          uint64_t *timestamps, int *n_timestamps,
+                          int max_timestamps)
+{
+    const struct drm_i915_perf_record_header *header;
+    const uint8_t *data = msg + 8, *end = msg + len;
+
+    for (header = (const struct drm_i915_perf_record_header *) data;
+         (const uint8_t *) header + sizeof(*header) <= end && header->size;
+         header = (const struct drm_i915_perf_record_header *)
+             ((const uint8_t *) header + header->size)) {
+        switch (header->type) {
+        case DRM_I915_PERF_RECORD_SAMPLE: {
+            const uint64_t *cpu_timestamp =
+                gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
+                                              GPUTOP_I915_PERF_FIELD_CPU_TIMESTAMP);
+
+            run->n_reports++;
+            if (cpu_timestamp && *n_timestamps < max_timestamps)
+                timestamps[(*n_timestamps)++] = *cpu_timestamp;
+            break;
+        }
+        case DRM_I915_PERF_RECORD_OA_REPORT_LOST:
+            run->n_lost_reports++;
+            break;
+        case DRM_I915_PERF_RECORD_OA_BUFFER_LOST:
+            run->n_buffer_lost++;
+            break;
+        }
+    }
+}
+
+static void
+start_measuring(uv_timer_t *timer);
+static void
+stop_measuring(uv_timer_t *timer);
+
+static void
+client_handled_data(struct bench_client *client)
+{
+    struct bench_run *run = client->run;
+    struct gputop_client_context *ctx = &client->ctx;
+
+    if (client->sampling || !ctx->features || run->done)
+        return;
+
+    ctx->metric_set =
+        gputop_client_context_symbol_to_metric_set(ctx, run->config->metric);
+    if (!ctx->metric_set) {
+        fprintf(stderr, "Unknown metric set '%s'\n", run->config->metric);
+        run->failed = true;
+        uv_stop(uv_default_loop());
+        return;
+    }
+    if (!ctx->i915_perf_config.cpu_timestamps)
+        fprintf(stderr, "Server doesn't support CPU timestamps, no latencies\n");
+
+    gputop_client_context_start_sampling(ctx);
+    client->sampling = true;
+
+    if (++run->n_sampling == run->n_clients)
+        uv_timer_start(&run->timer, start_measuring,
+                       run->config->warmup_s * 1000, 0);
+}
+
+static void
+client_handle_message(struct bench_client *client, void *msg, size_t len,
+                      bool zero_copy)
+{
+    struct bench_run *run = client->run;
+    uint64_t timestamps[4096];
+    int n_timestamps = 0;
+    uint64_t cpu_start = get_cpu_time_ns(CLOCK_THREAD_CPUTIME_ID);
+
+    if (run->measuring && len > 8 && ((const uint8_t *) msg)[0] == 3) {
+        account_i915_perf_message(run, &client->ctx, msg, len,
+                                  timestamps, &n_timestamps,
+                                  ARRAY_SIZE(timestamps));
+    }
+
+    if (zero_copy)
+        gputop_client_context_handle_message(&client->ctx, msg, len);
+    else
+        gputop_client_context_handle_data(&client->ctx, msg, len);
+
+    if (n_timestamps) {
+        uint64_t now = bench_get_time_ns();
+
+        for (int i = 0; i < n_timestamps; i++)
+            run->latencies[hist_bucket(now > timestamps[i] ? now - timestamps[i] : 0)]++;
+    }
+
+    if (run->measuring)
+        client->processing_ns +=
+            get_cpu_time_ns(CLOCK_THREAD_CPUTIME_ID) - cpu_start;
+
+    client_handled_data(client);
+}
+
+static void
+on_ready(gputop_connection_t *conn, void *user_data)
+{
+    struct bench_client *client = user_data;
+
+    client->connected = true;
+    gputop_client_context_reset(&client->ctx, conn);
+}
+
+static void
+on_data(gputop_connection_t *conn, const void *data, size_t len,
+        void *user_data)
+{
+    client_handle_message(user_data, (void *) data, len, false);
+}
+
+static void *
+on_msg_alloc(size_t len, void *user_data)
+{
+    struct bench_client *client = user_data;
+
+    return gputop_client_context_alloc_message(&client->ctx, len);
+}
+
+static void
+on_msg_release(void *msg, void *user_data)
+{
+    struct bench_client *client = user_data;
+
+    gputop_client_context_release_message(&client->ctx, msg);
+}
+
+static void
+on_msg(gputop_connection_t *conn, void *msg, size_t len, void *user_data)
+{
+    client_handle_message(user_data, msg, len, true);
+}
+
+static void
+connect_client(struct bench_client *client);
+
+static void
+on_retry_timer(uv_timer_t *timer)
+{
+    connect_client(timer->data);
+}
+
+static void
+on_close(gputop_connection_t *conn, const char *error, void *user_data)
+{
+    struct bench_client *client = user_data;
+    struct bench_run *run = client->run;
+
+    client->conn = NULL;
+    client->ctx.connection = NULL;
+    run->n_connections--;
+
+    /* The server may still be starting up */
+    if (!client->connected && !run->done) {
+        if (bench_get_time_ns() > run->connect_deadline) {
+            fprintf(stderr, "Unable to connect to the server : %s\n",
+                    error ? error : "closed");
+            run->failed = true;
+            uv_stop(uv_default_loop());
+            return;
+        }
+        uv_timer_start(&client->retry_timer, on_retry_timer,
+                       CONNECT_RETRY_MS, 0);
+        return;
+    }
+
+    if (!run->done) {
+        fprintf(stderr, "Lost connection to the server : %s\n",
+                error ? error : "closed");
+        run->failed = true;
+        uv_stop(uv_default_loop());
+        return;
+    }
+
+    if (run->n_connections == 0)
+        uv_stop(uv_default_loop());
+}
+
+static void
+connect_client(struct bench_client *client)
+{
+    client->conn = gputop_connect("localhost", client->run->config->port,
+                                  on_ready, on_data, on_close, client);
+    gputop_connection_set_msg_pool(client->conn, on_msg_alloc,
+                                   on_msg_release, on_msg);
+    client->run->n_connections++;
+}
+
+static void
+start_measuring(uv_timer_t *timer)
+{
+    struct bench_run *run = timer->data;
+
+    run->measuring = true;
+    run->start_time = bench_get_time_ns();
+    run->server_cpu_start = get_process_cpu_time_ns(run->server_pid);
+    run->process_cpu_start = get_cpu_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+    uv_timer_start(&run->timer, stop_measuring,
+                   run->config->duration_s * 1000, 0);
+}
+
+static void
+stop_measuring(uv_timer_t *timer)
+{
+    struct bench_run *run = timer->data;
+
+    run->measuring = false;
+    run->done = true;
+    run->end_time = bench_get_time_ns();
+    run->server_cpu_end = get_process_cpu_time_ns(run->server_pid);
+    run->process_cpu_end = get_cpu_time_ns(CLOCK_PROCESS_CPUTIME_ID);
+
+    for (int i = 0; i < run->n_clients; i++) {
+        struct bench_client *client = &run->clients[i];
+
+        run->n_dropped_reports += client->ctx.oa_stream.n_dropped_reports;
+        run->n_decimated_reports += client->ctx.oa_stream.n_decimated_reports;
+
+        if (client->conn) {
+            gputop_client_context_stop_sampling(&client->ctx);
+            gputop_connection_close(client->conn);
+        }
+    }
+}
+
+static void
+on_accumulate(struct gputop_client_context *ctx,
+              struct gputop_hw_context *context)
+{
+    struct bench_client *client = (struct bench_client *) ctx;
+
+    if (!context && client->run->measuring)
+        client->n_periods++;
+}
+
+static void
+print_run(const struct bench_run *run)
+{
+    double duration_s = (run->end_time - run->start_time) / 1e9;
+    uint64_t processing_ns = 0, n_periods = 0;
+    uint64_t n_latencies = 0;
+    double process_cpu_s;
+
+    for (int i = 0; i < run->n_clients; i++) {
+        processing_ns += run->clients[i].processing_ns;
+        n_periods += run->clients[i].n_periods;
+    }
+    for (int i = 0; i < HIST_N_BUCKETS; i++)
+        n_latencies += run->latencies[i];
+    process_cpu_s = (run->process_cpu_end - run->process_cpu_start) / 1e9;
+
+    fprintf(output,
+            "{\"rate\": \"%s\", \"period_ms\": %.3f, \"clients\": %d, "
+            "\"duration_s\": %.3f, "
+            "\"reports_per_s\": %.0f, \"reports_per_s_per_client\": %.0f, "
+            "\"periods_per_client\": %.1f, ",
+            run->rate, run->period_ns / 1e6, run->n_clients, duration_s,
+            run->n_reports / duration_s,
+            run->n_reports / duration_s / run->n_clients,
+            (double) n_periods / run->n_clients);
+    fprintf(output,
+            "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+            "\"p999\": %.1f, \"max\": %.1f}, ",
+            hist_percentile(run->latencies, n_latencies, 50) / 1e3,
+            hist_percentile(run->latencies, n_latencies, 90) / 1e3,
+            hist_percentile(run->latencies, n_latencies, 99) / 1e3,
+            hist_percentile(run->latencies, n_latencies, 99.9) / 1e3,
+            hist_max(run->latencies) / 1e3);
+    fprintf(output,
+            "\"lost_reports\": %" PRIu64 ", \"buffer_lost\": %" PRIu64 ", "
+            "\"dropped_reports\": %" PRIu64 ", \"decimated_reports\": %" PRIu64 ", ",
+            run->n_lost_reports, run->n_buffer_lost,
+            run->n_dropped_reports, run->n_decimated_reports);
+    fprintf(output,
+            "\"cpu_s\": {\"server\": %.3f, \"client_processing\": %.3f, "
+            "\"client_transport\": %.3f}}\n",
+            (run->server_cpu_end - run->server_cpu_start) / 1e9,
+            processing_ns / 1e9,
+            MAX2(process_cpu_s - processing_ns / 1e9, 0));
+    fflush(output);
+}
+
+static bool
+run_bench(const struct bench_config *config, pid_t server_pid,
+          const char *rate, uint64_t period_ns,
+          struct bench_client *clients, int n_clients)
+{
+    struct bench_run *run = calloc(1, sizeof(*run));
+    uv_loop_t *loop = uv_default_loop();
+    bool ok;
+
+    run->config = config;
+    run->rate = rate;
+    run->period_ns = period_ns;
+    run->n_clients = n_clients;
+    run->clients = clients;
+    run->server_pid = server_pid;
+    run->connect_deadline = bench_get_time_ns() + CONNECT_TIMEOUT_MS * 1000000ULL;
+
+    uv_timer_init(loop, &run->timer);
+    run->timer.data = run;
+
+    for (int i = 0; i < n_clients; i++) {
+        struct bench_client *client = &clients[i];
+
+        client->run = run;
+        client->connected = false;
+        client->sampling = false;
+        client->processing_ns = 0;
+        client->n_periods = 0;
+        client->ctx.oa_aggregation_period_ns = period_ns;
+        client->ctx.oa_sampling_period_ns = period_ns;
+
+        uv_timer_init(loop, &client->retry_timer);
+        client->retry_timer.data = client;
+
+        connect_client(client);
+    }
+
+    uv_run(loop, UV_RUN_DEFAULT);
+
+    ok = !run->failed;
+    if (ok)
+        print_run(run);
+
+    /* Give up on whatever is left after a failure */
+    for (int i = 0; i < n_clients; i++) {
+        if (clients[i].conn)
+            gputop_connection_close(clients[i].conn);
+        uv_close((uv_handle_t *) &clients[i].retry_timer, NULL);
+    }
+    uv_close((uv_handle_t *) &run->timer, NULL);
+    run->done = true;
+    uv_run(loop, UV_RUN_NOWAIT);
+
+    for (int i = 0; i < n_clients; i++) {
+        if (!clients[i].conn)
+            gputop_client_context_reset(&clients[i].ctx, NULL);
+    }
+
+    free(run);
+
+    return ok;
+}
+
+static pid_t
+start_server(const struct bench_config *config, const char *rate,
+             char *scenario_path)
+{
+    char buf[4096];
+    FILE *scenario;
+    int fd = mkstemp(scenario_path);
+    pid_t pid;
+
+    if (fd < 0 || !(scenario = fdopen(fd, "w"))) {
+        fprintf(stderr, "Unable to create scenario file: %s\n", strerror(errno));
+        return -1;
+    }
+
+    /* Later directives override the base scenario's */
+    if (config->base_scenario) {
+        FILE *base = fopen(config->base_scenario, "r");
+        size_t len;
+
+        if (!base) {
+            fprintf(stderr, "Unable to open scenario '%s': %s\n",
+                    config->base_scenario, strerror(errno));
+            fclose(scenario);
+            return -1;
+        }
+        while ((len = fread(buf, 1, sizeof(buf), base)) > 0)
+            fwrite(buf, 1, len, scenario);
+        fclose(base);
+    }
+    fprintf(scenario, "\nrate %s\ntick %u\n", rate, config->tick_ms);
+    fclose(scenario);
+
+    pid = fork();
+    if (pid == 0) {
+        snprintf(buf, sizeof(buf), "%d", config->port);
+        setenv("GPUTOP_FAKE_MODE", "1", true);
+        setenv("GPUTOP_FAKE_SCENARIO", scenario_path, true);
+        setenv("GPUTOP_PORT", buf, true);
+        execlp(config->server_path, config->server_path, NULL);
+        fprintf(stderr, "Unable to run '%s': %s\n",
+                config->server_path, strerror(errno));
+        _exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+
+static void
+stop_server(pid_t pid, const char *scenario_path)
+{
+    kill(pid, SIGTERM);
+    waitpid(pid, NULL, 0);
+    unlink(scenario_path);
+}
+
+static char **
+split_list(const char *list, int *n_items)
+{
+    char *copy = strdup(list), *save = NULL;
+    char **items = NULL;
+
+    *n_items = 0;
+    for (char *item = strtok_r(copy, ",", &save); item;
+         item = strtok_r(NULL, ",", &save)) {
+        items = realloc(items, (*n_items + 1) * sizeof(items[0]));
+        items[(*n_items)++] = item;
+    }
+
+    return items;
+}
+
+static void
+usage(void)
+{
+    fprintf(stdout,
+            "Usage: gputop-bench-e2e [options]\n"
+            "\n"
+            " -S, --server <path>       gputop-system to run (%s)\n"
+            " -p, --port <port>         Port the server listens to (7891)\n"
+            " -s, --scenario <file>     Base fake mode scenario, see\n"
+            "                           gputop-oa-scenario.h\n"
+            " -r, --rates <list>        Report rates per second, or 'max'\n"
+            "                           (10000,100000,1000000)\n"
+            " -P, --periods <list>      Aggregation periods in ms (10,100,1000)\n"
+            " -c, --clients <list>      Numbers of clients (1,2,4)\n"
+            " -m, --metric <symbol>     Metric set (RenderBasic)\n"
+            " -t, --tick <ms>           Server read period (10)\n"
+            " -w, --warmup <s>          Warm up time of each run (1)\n"
+            " -d, --duration <s>        Measured time of each run (5)\n"
+            " -o, --output <file>       Write the results to a file\n"
+            " -h, --help                Display this help\n",
+            GPUTOP_SYSTEM_PATH);
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "help",     no_argument,        0, 'h' },
+        { "server",   required_argument,  0, 'S' },
+        { "port",     required_argument,  0, 'p' },
+        { "scenario", required_argument,  0, 's' },
+        { "rates",    required_argument,  0, 'r' },
+        { "periods",  required_argument,  0, 'P' },
+        { "clients",  required_argument,  0, 'c' },
+        { "metric",   required_argument,  0, 'm' },
+        { "tick",     required_argument,  0, 't' },
+        { "warmup",   required_argument,  0, 'w' },
+        { "duration", required_argument,  0, 'd' },
+        { "output",   required_argument,  0, 'o' },
+        { 0, 0, 0, 0 }
+    };
+    struct bench_config config = {
+        .server_path = GPUTOP_SYSTEM_PATH,
+        .metric = "RenderBasic",
+        .port = 7891,
+        .tick_ms = 10,
+        .warmup_s = 1,
+        .duration_s = 5,
+    };
+    const char *rates_list = "10000,100000,1000000";
+    const char *periods_list = "10,100,1000";
+    const char *clients_list = "1,2,4";
+    char **rates, **periods, **n_clients;
+    int n_rates, n_periods, n_n_clients, max_clients = 0;
+    struct bench_client *clients;
+    bool ok = true;
+    int opt;
+
+    output = stdout;
+
+    while ((opt = getopt_long(argc, argv, "hS:p:s:r:P:c:m:t:w:d:o:",
+                              long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            usage();
+            return EXIT_SUCCESS;
+        case 'S':
+            config.server_path = optarg;
+            break;
+        case 'p':
+            config.port = atoi(optarg);
+            break;
+        case 's':
+            config.base_scenario = optarg;
+            break;
+        case 'r':
+            rates_list = optarg;
+            break;
+        case 'P':
+            periods_list = optarg;
+            break;
+        case 'c':
+            clients_list = optarg;
+            break;
+        case 'm':
+            config.metric = optarg;
+            break;
+        case 't':
+            config.tick_ms = atoi(optarg);
+            break;
+        case 'w':
+            config.warmup_s = atof(optarg);
+            break;
+        case 'd':
+            config.duration_s = atof(optarg);
+            break;
+        case 'o':
+            output = fopen(optarg, "w");
+            if (!output) {
+                fprintf(stderr, "Unable to open '%s': %s\n",
+                        optarg, strerror(errno));
+                return EXIT_FAILURE;
+            }
+            break;
+        default:
+            fprintf(stderr, "Unrecognized option: %d\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    rates = split_list(rates_list, &n_rates);
+    periods = split_list(periods_list, &n_periods);
+    n_clients = split_list(clients_list, &n_n_clients);
+    for (int i = 0; i < n_n_clients; i++) {
+        if (atoi(n_clients[i]) < 1) {
+            fprintf(stderr, "Invalid number of clients '%s'\n", n_clients[i]);
+            return EXIT_FAILURE;
+        }
+        max_clients = MAX2(max_clients, atoi(n_clients[i]));
+    }
+    if (!n_rates || !n_periods || !max_clients || config.duration_s <= 0) {
+        fprintf(stderr, "Nothing to measure\n");
+        return EXIT_FAILURE;
+    }
+
+    clients = calloc(max_clients, sizeof(clients[0]));
+    for (int i = 0; i < max_clients; i++) {
+        gputop_client_context_init(&clients[i].ctx);
+        clients[i].ctx.accumulate_cb = on_accumulate;
+    }
+
+    for (int r = 0; ok && r < n_rates; r++) {
+        char scenario_path[] = "/tmp/gputop-bench-e2e-XXXXXX";
+        pid_t server_pid = start_server(&config, rates[r], scenario_path);
+
+        if (server_pid < 0) {
+            ok = false;
+            break;
+        }
+
+        for (int p = 0; ok && p < n_periods; p++) {
+            for (int c = 0; ok && c < n_n_clients; c++) {
+                ok = run_bench(&config, server_pid, rates[r],
+                               atof(periods[p]) * 1000000,
+                               clients, atoi(n_clients[c]));
+            }
+        }
+
+        stop_server(server_pid, scenario_path);
+    }
+
+    if (output != stdout)
+        fclose(output);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,300 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Measures the compression ratio and the encoding/decoding throughput of
+ * the compressed OA frames (see gputop-i915-perf-compression.h) on
+ * synthetic streams, one mimicking the server's fake mode and one with
+ * randomly increasing counters, and on the OA data of captured sessions
+ * (see gputop-wrapper -r).
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-bench-util.h"
+#include "gputop-capture.h"
+#include "gputop-i915-perf-compression.h"
+
+#include "util/macros.h"
+
+/* Same as the server's read buffer */
+#define FRAME_SIZE (64 * 1024)
+
+#define RECORD_SIZE (sizeof(struct drm_i915_perf_record_header) + BENCH_REPORT_SIZE)
+
+void gputop_cr_console_log(const char *format, ...)
+{
+    va_list ap;
+
+    va_start(ap, format);
+    vfprintf(stderr, format, ap);
+    va_end(ap);
+    fprintf(stderr, "\n");
+}
+
+struct records {
+    uint8_t *data;
+    size_t len;
+    size_t capacity;
+};
+
+static void
+records_append(struct records *records, const void *data, size_t len)
+{
+    if (records->len + len > records->capacity) {
+        records->capacity = MAX2(records->capacity * 2, records->len + len);
+        records->data = realloc(records->data, records->capacity);
+    }
+    memcpy(records->data + records->len, data, len);
+    records->len += len;
+}
+
+static void
+records_append_reports(struct records *records, const uint8_t *reports,
+                       int n_reports)
+{
+    struct drm_i915_perf_record_header header = {
+        .type = DRM_I915_PERF_RECORD_SAMPLE,
+        .size = RECORD_SIZE,
+    };
+
+    for (int i = 0; i < n_reports; i++) {
+        records_append(records, &header, sizeof(header));
+        records_append(records, reports + i * BENCH_REPORT_SIZE, BENCH_REPORT_SIZE);
+    }
+}
+
+/* Same counter values as gputop_perf_fake_read() for a Gen9 GT2 */
+static void
+generate_fake_mode_records(struct records *records, int n_reports)
+{
+    uint8_t *reports = calloc(n_reports, BENCH_REPORT_SIZE);
+    uint64_t period = 100000, n_eus = 24;
+    uint32_t timestamp = 0, clocks = 0;
+
+    for (int i = 0; i < n_reports; i++) {
+        uint32_t *report = (uint32_t *) (reports + i * BENCH_REPORT_SIZE);
+        uint8_t *high_bytes = (uint8_t *) (report + 40);
+        uint64_t counter;
+
+        report[0] = 1 << 19;
+        report[1] = timestamp += period / 80;
+        report[3] = clocks += period / 2;
+
+        counter = clocks * n_eus;
+        for (int j = 0; j < 32; j++) {
+            report[4 + j] = counter;
+            high_bytes[j] = counter >> 32;
+        }
+        for (int j = 0; j < 4; j++)
+            report[36 + j] = counter;
+        for (int j = 0; j < 16; j++)
+            report[48 + j] = clocks * 2;
+    }
+
+    records_append_reports(records, reports, n_reports);
+    free(reports);
+}
+
+static bool
+load_capture_records(struct records *records, const char *path)
+{
+    struct gputop_capture_reader *reader = gputop_capture_reader_open(path);
+    const struct gputop_capture_chunk *chunk;
+    size_t cursor;
+
+    if (!reader)
+        return false;
+
+    cursor = gputop_capture_reader_begin(reader);
+    while ((chunk = gputop_capture_reader_next(reader, &cursor))) {
+        const uint8_t *data = gputop_capture_chunk_data(chunk);
+
+        if (chunk->type != GPUTOP_CAPTURE_CHUNK_RECV || chunk->len <= 8)
+            continue;
+
+        /* Messages are i915 perf records (3) or compressed ones (4) */
+        if (data[0] == 3) {
+            records_append(records, data + 8, chunk->len - 8);
+        } else if (data[0] == 4) {
+            size_t len = gputop_i915_perf_decompressed_size(data + 8, chunk->len - 8);
+            uint8_t *decompressed = malloc(len);
+
+            if (len && gputop_i915_perf_decompress(data + 8, chunk->len - 8,
+                                                   decompressed, len))
+                records_append(records, decompressed, len);
+            free(decompressed);
+        }
+    }
+
+    gputop_capture_reader_close(reader);
+
+    return true;
+}
+
+/* Frames end on a record boundary like the server's reads */
+static size_t
+frame_len(const struct records *records, size_t offset)
+{
+    size_t len = 0;
+
+    while (offset + len + sizeof(struct drm_i915_perf_record_header) <= records->len) {
+        const struct drm_i915_perf_record_header *header =
+            (const void *) (records->data + offset + len);
+
+        if (header->size == 0 || len + header->size > FRAME_SIZE)
+            break;
+        len += header->size;
+    }
+
+    return len;
+}
+
+static bool
+bench_records(const char *name, const struct records *records, int n_loops)
+{
+    size_t compressed_len = 0, decompressed_len, offset, len, n_frames = 0;
+    uint8_t *compressed, *decompressed;
+    uint64_t start, encode_ns, decode_ns;
+    int l;
+
+    for (offset = 0; (len = frame_len(records, offset)); offset += len)
+        n_frames++;
+    compressed = malloc(gputop_i915_perf_compress_bound(records->len) +
+                        n_frames * gputop_i915_perf_compress_bound(0));
+    decompressed = malloc(records->len);
+
+    if (!records->len) {
+        fprintf(stdout, "%-24s no OA records\n", name);
+        free(compressed);
+        free(decompressed);
+        return true;
+    }
+
+    start = bench_get_time_ns();
+    for (l = 0; l < n_loops; l++) {
+        compressed_len = 0;
+        for (offset = 0; (len = frame_len(records, offset)); ) {
+            compressed_len += gputop_i915_perf_compress(records->data + offset, len,
+                                                        compressed + compressed_len);
+            offset += len;
+        }
+    }
+    encode_ns = bench_get_time_ns() - start;
+
+    decompressed_len = gputop_i915_perf_decompressed_size(compressed, compressed_len);
+
+    start = bench_get_time_ns();
+    for (l = 0; l < n_loops; l++)
+        gputop_i915_perf_decompress(compressed, compressed_len,
+                                    decompressed, decompressed_len);
+    decode_ns = bench_get_time_ns() - start;
+
+    if (decompressed_len != offset ||
+        memcmp(decompressed, records->data, decompressed_len) != 0) {
+        fprintf(stderr, "%s: decoded records differ from the original ones\n", name);
+        free(compressed);
+        free(decompressed);
+        return false;
+    }
+
+    fprintf(stdout, "%-24s %10zu -> %10zu bytes, ratio %6.2f, "
+            "encode %8.1f MiB/s, decode %8.1f MiB/s\n",
+            name, decompressed_len, compressed_len,
+            (double) decompressed_len / compressed_len,
+            decompressed_len * (double) n_loops * 1000000000.0 / encode_ns / (1024 * 1024),
+            decompressed_len * (double) n_loops * 1000000000.0 / decode_ns / (1024 * 1024));
+
+    free(compressed);
+    free(decompressed);
+
+    return true;
+}
+
+int
+main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "help",     no_argument,        0, 'h' },
+        { "reports",  required_argument,  0, 'r' },
+        { "loops",    required_argument,  0, 'l' },
+        { 0, 0, 0, 0 }
+    };
+    struct records records = { 0 };
+    int n_reports = 100000, n_loops = 10;
+    bool ok = true;
+    uint8_t *reports;
+    int opt, i;
+
+    while ((opt = getopt_long(argc, argv, "hr:l:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            fprintf(stdout, "Usage: gputop-bench-oa-compression [-r <n_reports>] "
+                    "[-l <n_loops>] [capture files...]\n");
+            return EXIT_SUCCESS;
+        case 'r':
+            n_reports = atoi(optarg);
+            break;
+        case 'l':
+            n_loops = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Unrecognized option: %d\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (n_reports < 1 || n_loops < 1) {
+        fprintf(stderr, "Need at least 1 report and 1 loop\n");
+        return EXIT_FAILURE;
+    }
+
+    generate_fake_mode_records(&records, n_reports);
+    ok &= bench_records("fake mode", &records, n_loops);
+
+    records.len = 0;
+    reports = bench_generate_reports(I915_OA_FORMAT_A32u40_A4u32_B8_C8, n_reports);
+    records_append_reports(&records, reports, n_reports);
+    free(reports);
+    ok &= bench_records("random counters", &records, n_loops);
+
+    for (i = optind; i < argc; i++) {
+        records.len = 0;
+        if (!load_capture_records(&records, argv[i])) {
+            fprintf(stderr, "Unable to load capture '%s'\n", argv[i]);
+            ok = false;
+            continue;
+        }
+        ok &= bench_records(argv[i], &records, n_loops);
+    }
+
+    free(records.data);
+
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
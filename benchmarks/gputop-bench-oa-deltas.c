@@ -0,0 +1,124 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Replays synthetic report streams through each of the report decoding
+ * kernels supported by the CPU and prints the number of reports decoded
+ * per second.
+ */
+
+#include <getopt.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-bench-util.h"
+
+static const char *kernel_names[] = { "scalar", "sse4.1", "avx2" };
+
+static const struct {
+    const char *name;
+    uint32_t oa_format;
+} formats[] = {
+    { "A32u40_A4u32_B8_C8", I915_OA_FORMAT_A32u40_A4u32_B8_C8 },
+    { "A45_B8_C8",          I915_OA_FORMAT_A45_B8_C8 },
+};
+
+int
+main(int argc, char **argv)
+{
+    const struct option long_options[] = {
+        { "help",     no_argument,        0, 'h' },
+        { "reports",  required_argument,  0, 'r' },
+        { "loops",    required_argument,  0, 'l' },
+        { 0, 0, 0, 0 }
+    };
+    const char *default_kernels = gputop_cc_oa_get_delta_kernels();
+    int n_reports = 100000, n_loops = 20;
+    int opt, f, k, l, r;
+
+    while ((opt = getopt_long(argc, argv, "hr:l:", long_options, NULL)) != -1) {
+        switch (opt) {
+        case 'h':
+            fprintf(stdout, "Usage: gputop-bench-oa-deltas [-r <n_reports>] [-l <n_loops>]\n");
+            return EXIT_SUCCESS;
+        case 'r':
+            n_reports = atoi(optarg);
+            break;
+        case 'l':
+            n_loops = atoi(optarg);
+            break;
+        default:
+            fprintf(stderr, "Unrecognized option: %d\n", opt);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (n_reports < 2 || n_loops < 1) {
+        fprintf(stderr, "Need at least 2 reports and 1 loop\n");
+        return EXIT_FAILURE;
+    }
+
+    fprintf(stdout, "default kernels: %s\n", default_kernels);
+
+    for (f = 0; f < ARRAY_SIZE(formats); f++) {
+        struct gputop_devinfo devinfo;
+        struct gputop_metric_set metric_set;
+        uint8_t *reports;
+
+        bench_init_devinfo(&devinfo, &metric_set, formats[f].oa_format);
+        reports = bench_generate_reports(formats[f].oa_format, n_reports);
+
+        for (k = 0; k < ARRAY_SIZE(kernel_names); k++) {
+            struct gputop_cc_oa_deltas deltas;
+            uint64_t checksum = 0, start, duration;
+
+            if (!gputop_cc_oa_select_delta_kernels(kernel_names[k]))
+                continue;
+
+            start = bench_get_time_ns();
+            for (l = 0; l < n_loops; l++) {
+                for (r = 1; r < n_reports; r++) {
+                    gputop_cc_oa_decode_deltas(&metric_set,
+                                               reports + (r - 1) * BENCH_REPORT_SIZE,
+                                               reports + r * BENCH_REPORT_SIZE,
+                                               &deltas);
+                    checksum += deltas.deltas[deltas.n_deltas - 1];
+                }
+            }
+            duration = bench_get_time_ns() - start;
+
+            fprintf(stdout, "%-20s %-8s %12.0f reports/s (checksum=%" PRIx64 ")\n",
+                    formats[f].name, kernel_names[k],
+                    (n_reports - 1) * (double) n_loops * 1000000000.0 / duration,
+                    checksum);
+        }
+
+        free(reports);
+    }
+
+    gputop_cc_oa_select_delta_kernels(default_kernels);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,95 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "gputop-oa-counters.h"
+
+#define BENCH_REPORT_SIZE 256
+
+static inline uint64_t
+bench_get_time_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void
+bench_init_devinfo(struct gputop_devinfo *devinfo,
+                   struct gputop_metric_set *metric_set,
+                   uint32_t oa_format)
+{
+    memset(devinfo, 0, sizeof(*devinfo));
+    devinfo->gen = oa_format == I915_OA_FORMAT_A45_B8_C8 ? 7 : 9;
+    devinfo->timestamp_frequency =
+        oa_format == I915_OA_FORMAT_A45_B8_C8 ? 12500000 : 12000000;
+
+    memset(metric_set, 0, sizeof(*metric_set));
+    metric_set->perf_oa_format = oa_format;
+    metric_set->perf_raw_size = BENCH_REPORT_SIZE;
+}
+
+/* Generates a stream of timer triggered reports with counters increasing
+ * by random amounts, 40bit A counters wrap every few thousand reports.
+ */
+static inline uint8_t *
+bench_generate_reports(uint32_t oa_format, int n_reports)
+{
+    uint8_t *reports = calloc(n_reports, BENCH_REPORT_SIZE);
+    uint64_t counters[64] = { 0 };
+    uint32_t timestamp = 1;
+    int i, c;
+
+    for (i = 0; i < n_reports; i++) {
+        uint32_t *report = (uint32_t *) (reports + i * BENCH_REPORT_SIZE);
+        uint8_t *high_bytes = (uint8_t *) (report + 40);
+
+        report[0] = 1 << 19; /* timer reason */
+        report[1] = timestamp;
+        timestamp += 1000;
+
+        for (c = 3; c < 64; c++) {
+            counters[c] += rand() % 100000000;
+
+            if (oa_format == I915_OA_FORMAT_A32u40_A4u32_B8_C8) {
+                if (c >= 40 && c < 48)
+                    continue;
+                if (c >= 4 && c < 36) {
+                    counters[c] &= (1ULL << 40) - 1;
+                    high_bytes[c - 4] = counters[c] >> 32;
+                }
+            }
+            report[c] = counters[c];
+        }
+    }
+
+    return reports;
+}
@@ -0,0 +1,409 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include "gputop-capture.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "gputop-log.h"
+
+#define CHUNK_ALIGN(len) (((size_t)(len) + 7) & ~(size_t)7)
+
+static const uint8_t chunk_padding[8];
+
+struct gputop_capture_writer {
+    FILE *file;
+    uint64_t offset;
+
+    struct gputop_capture_index_entry *index;
+    uint32_t n_index_entries;
+    uint32_t index_capacity;
+    uint64_t next_index_offset;
+};
+
+struct gputop_capture_reader {
+    const uint8_t *data;
+    size_t size;
+    size_t end; /* offset after the last complete chunk */
+
+    struct gputop_capture_index_entry *index;
+    uint32_t n_index_entries;
+
+    uint64_t start_time;
+    uint64_t end_time;
+};
+
+static uint64_t
+capture_timestamp(void)
+{
+    struct timespec t;
+
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (uint64_t) t.tv_sec * 1000000000ULL + t.tv_nsec;
+}
+
+static bool
+capture_append(struct gputop_capture_writer *writer,
+               enum gputop_capture_chunk_type type, uint64_t timestamp,
+               const void *data, size_t len)
+{
+    struct gputop_capture_chunk chunk = {
+        .type = type,
+        .len = len,
+        .timestamp = timestamp,
+    };
+    size_t padding = CHUNK_ALIGN(len) - len;
+
+    if (fwrite(&chunk, sizeof(chunk), 1, writer->file) != 1 ||
+        (len && fwrite(data, len, 1, writer->file) != 1) ||
+        (padding && fwrite(chunk_padding, padding, 1, writer->file) != 1))
+        return false;
+
+    writer->offset += sizeof(chunk) + len + padding;
+
+    return true;
+}
+
+struct gputop_capture_writer *
+gputop_capture_writer_open(const char *path)
+{
+    struct gputop_capture_file_header header = {
+        .magic = GPUTOP_CAPTURE_MAGIC,
+        .version = GPUTOP_CAPTURE_VERSION,
+    };
+    struct gputop_capture_writer *writer;
+    FILE *file = fopen(path, "wb");
+
+    if (!file) {
+        gputop_cr_console_log("Unable to create capture '%s': %s",
+                              path, strerror(errno));
+        return NULL;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, file) != 1) {
+        gputop_cr_console_log("Unable to write capture '%s': %s",
+                              path, strerror(errno));
+        fclose(file);
+        return NULL;
+    }
+
+    writer = (struct gputop_capture_writer *) calloc(1, sizeof(*writer));
+    writer->file = file;
+    writer->offset = sizeof(header);
+    writer->next_index_offset = writer->offset;
+
+    return writer;
+}
+
+void
+gputop_capture_writer_write(struct gputop_capture_writer *writer,
+                            enum gputop_capture_chunk_type type,
+                            const void *data, size_t len)
+{
+    uint64_t timestamp = capture_timestamp();
+
+    if (!writer->file)
+        return;
+
+    if (writer->offset >= writer->next_index_offset) {
+        if (writer->n_index_entries == writer->index_capacity) {
+            writer->index_capacity = writer->index_capacity ?
+                writer->index_capacity * 2 : 64;
+            writer->index = (struct gputop_capture_index_entry *)
+                realloc(writer->index,
+                        writer->index_capacity * sizeof(writer->index[0]));
+        }
+        writer->index[writer->n_index_entries].timestamp = timestamp;
+        writer->index[writer->n_index_entries].offset = writer->offset;
+        writer->n_index_entries++;
+        writer->next_index_offset = writer->offset + GPUTOP_CAPTURE_INDEX_INTERVAL;
+    }
+
+    /* Stop recording on the first error rather than leaving a hole in the
+     * middle of the capture. */
+    if (!capture_append(writer, type, timestamp, data, len)) {
+        gputop_cr_console_log("Unable to write capture: %s", strerror(errno));
+        fclose(writer->file);
+        writer->file = NULL;
+    }
+}
+
+void
+gputop_capture_writer_close(struct gputop_capture_writer *writer)
+{
+    if (writer->file) {
+        struct gputop_capture_trailer trailer = {
+            .magic = GPUTOP_CAPTURE_INDEX_MAGIC,
+            .index_offset = writer->offset,
+        };
+
+        if (!capture_append(writer, GPUTOP_CAPTURE_CHUNK_INDEX,
+                            capture_timestamp(), writer->index,
+                            writer->n_index_entries * sizeof(writer->index[0])) ||
+            fwrite(&trailer, sizeof(trailer), 1, writer->file) != 1)
+            gputop_cr_console_log("Unable to write capture index: %s",
+                                  strerror(errno));
+
+        fclose(writer->file);
+    }
+
+    free(writer->index);
+    free(writer);
+}
+
+/**/
+
+static const struct gputop_capture_chunk *
+chunk_at(const struct gputop_capture_reader *reader, size_t offset)
+{
+    const struct gputop_capture_chunk *chunk;
+
+    if (offset % 8 || offset > reader->size ||
+        reader->size - offset < sizeof(*chunk))
+        return NULL;
+
+    chunk = (const struct gputop_capture_chunk *) (reader->data + offset);
+    if (CHUNK_ALIGN(chunk->len) > reader->size - offset - sizeof(*chunk))
+        return NULL;
+
+    return chunk;
+}
+
+static bool
+load_index(struct gputop_capture_reader *reader)
+{
+    const struct gputop_capture_trailer *trailer;
+    const struct gputop_capture_chunk *chunk;
+
+    if (reader->size < sizeof(struct gputop_capture_file_header) + sizeof(*trailer))
+        return false;
+
+    trailer = (const struct gputop_capture_trailer *)
+        (reader->data + reader->size - sizeof(*trailer));
+    if (memcmp(trailer->magic, GPUTOP_CAPTURE_INDEX_MAGIC, sizeof(trailer->magic)))
+        return false;
+
+    chunk = chunk_at(reader, trailer->index_offset);
+    if (!chunk || chunk->type != GPUTOP_CAPTURE_CHUNK_INDEX)
+        return false;
+
+    reader->n_index_entries = chunk->len / sizeof(reader->index[0]);
+    if (reader->n_index_entries) {
+        reader->index = (struct gputop_capture_index_entry *) malloc(chunk->len);
+        memcpy(reader->index, gputop_capture_chunk_data(chunk), chunk->len);
+    }
+
+    /* Don't walk from offsets outside of the chunks, rather rebuild the
+     * index */
+    for (uint32_t i = 0; i < reader->n_index_entries; i++) {
+        if (reader->index[i].offset < sizeof(struct gputop_capture_file_header) ||
+            reader->index[i].offset >= trailer->index_offset) {
+            free(reader->index);
+            reader->index = NULL;
+            reader->n_index_entries = 0;
+            return false;
+        }
+    }
+    reader->end = trailer->index_offset;
+
+    return true;
+}
+
+/* Rebuilds the index of a capture that wasn't closed properly, dropping any
+ * chunk that was cut short.
+ */
+static void
+scan_index(struct gputop_capture_reader *reader)
+{
+    size_t offset = sizeof(struct gputop_capture_file_header);
+    size_t next_index_offset = offset;
+    uint32_t capacity = 0;
+    const struct gputop_capture_chunk *chunk;
+
+    while ((chunk = chunk_at(reader, offset)) &&
+           chunk->type != GPUTOP_CAPTURE_CHUNK_INDEX) {
+        if (offset >= next_index_offset) {
+            if (reader->n_index_entries == capacity) {
+                capacity = capacity ? capacity * 2 : 64;
+                reader->index = (struct gputop_capture_index_entry *)
+                    realloc(reader->index, capacity * sizeof(reader->index[0]));
+            }
+            reader->index[reader->n_index_entries].timestamp = chunk->timestamp;
+            reader->index[reader->n_index_entries].offset = offset;
+            reader->n_index_entries++;
+            next_index_offset = offset + GPUTOP_CAPTURE_INDEX_INTERVAL;
+        }
+        offset += sizeof(*chunk) + CHUNK_ALIGN(chunk->len);
+    }
+
+    reader->end = offset;
+}
+
+struct gputop_capture_reader *
+gputop_capture_reader_open(const char *path)
+{
+    const struct gputop_capture_file_header *header;
+    struct gputop_capture_reader *reader;
+    const struct gputop_capture_chunk *chunk;
+    size_t cursor;
+    struct stat st;
+    void *data;
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0) {
+        gputop_cr_console_log("Unable to open capture '%s': %s",
+                              path, strerror(errno));
+        return NULL;
+    }
+
+    if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+        gputop_cr_console_log("Invalid capture '%s'", path);
+        close(fd);
+        return NULL;
+    }
+
+    data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        gputop_cr_console_log("Unable to map capture '%s': %s",
+                              path, strerror(errno));
+        return NULL;
+    }
+
+    header = (const struct gputop_capture_file_header *) data;
+    if (memcmp(header->magic, GPUTOP_CAPTURE_MAGIC, sizeof(header->magic)) ||
+        header->version != GPUTOP_CAPTURE_VERSION) {
+        gputop_cr_console_log("Unsupported capture '%s'", path);
+        munmap(data, st.st_size);
+        return NULL;
+    }
+
+    reader = (struct gputop_capture_reader *) calloc(1, sizeof(*reader));
+    reader->data = (const uint8_t *) data;
+    reader->size = st.st_size;
+
+    if (!load_index(reader))
+        scan_index(reader);
+
+    cursor = gputop_capture_reader_begin(reader);
+    if ((chunk = gputop_capture_reader_next(reader, &cursor))) {
+        reader->start_time = reader->end_time = chunk->timestamp;
+
+        /* Only walk the tail of the capture for the end time */
+        if (reader->n_index_entries)
+            cursor = reader->index[reader->n_index_entries - 1].offset;
+        while ((chunk = gputop_capture_reader_next(reader, &cursor)))
+            reader->end_time = chunk->timestamp;
+    }
+
+    return reader;
+}
+
+void
+gputop_capture_reader_close(struct gputop_capture_reader *reader)
+{
+    munmap((void *) reader->data, reader->size);
+    free(reader->index);
+    free(reader);
+}
+
+size_t
+gputop_capture_reader_begin(const struct gputop_capture_reader *reader)
+{
+    return sizeof(struct gputop_capture_file_header);
+}
+
+const struct gputop_capture_chunk *
+gputop_capture_reader_next(const struct gputop_capture_reader *reader,
+                           size_t *cursor)
+{
+    const struct gputop_capture_chunk *chunk;
+
+    if (*cursor >= reader->end)
+        return NULL;
+
+    /* A corrupt chunk ends the capture */
+    chunk = chunk_at(reader, *cursor);
+    if (!chunk)
+        return NULL;
+    *cursor += sizeof(*chunk) + CHUNK_ALIGN(chunk->len);
+
+    return chunk;
+}
+
+/* Returns a cursor to the first chunk at or after timestamp. */
+size_t
+gputop_capture_reader_seek(const struct gputop_capture_reader *reader,
+                           uint64_t timestamp)
+{
+    size_t cursor = gputop_capture_reader_begin(reader);
+    uint32_t lo = 0, hi = reader->n_index_entries;
+    const struct gputop_capture_chunk *chunk;
+
+    /* Find the last index entry before timestamp... */
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+
+        if (reader->index[mid].timestamp < timestamp)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    if (lo > 0)
+        cursor = reader->index[lo - 1].offset;
+
+    /* ...and walk from there */
+    while (cursor < reader->end) {
+        size_t prev = cursor;
+
+        chunk = gputop_capture_reader_next(reader, &cursor);
+        if (!chunk)
+            break;
+        if (chunk->timestamp >= timestamp)
+            return prev;
+    }
+
+    return cursor;
+}
+
+uint64_t
+gputop_capture_reader_start_time(const struct gputop_capture_reader *reader)
+{
+    return reader->start_time;
+}
+
+uint64_t
+gputop_capture_reader_end_time(const struct gputop_capture_reader *reader)
+{
+    return reader->end_time;
+}
@@ -0,0 +1,126 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __GPUTOP_CAPTURE_H__
+#define __GPUTOP_CAPTURE_H__
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* A capture is an append only file recording a client session, so it can be
+ * replayed later as if it was coming from a live server :
+ *
+ *   struct gputop_capture_file_header
+ *   struct gputop_capture_chunk + data, padded to 8 bytes
+ *   ...
+ *   struct gputop_capture_chunk (GPUTOP_CAPTURE_CHUNK_INDEX)
+ *   struct gputop_capture_trailer
+ *
+ * Received chunks hold whole network messages exactly as given to
+ * gputop_client_context_handle_data() (the Features message, i915 perf
+ * records, perf tracepoint samples, CpuStats, etc...) and sent chunks hold
+ * the packed Gputop__Request messages (including the OpenStream requests
+ * that carry the metric set GUIDs).
+ *
+ * The index and trailer are only written when a capture is closed cleanly,
+ * otherwise readers rebuild the index by walking the chunks.
+ */
+
+#define GPUTOP_CAPTURE_MAGIC "GPUTOPCP"
+#define GPUTOP_CAPTURE_INDEX_MAGIC "GPUTOPIX"
+#define GPUTOP_CAPTURE_VERSION 1
+
+/* Distance in bytes between two entries of the index */
+#define GPUTOP_CAPTURE_INDEX_INTERVAL (1024 * 1024)
+
+enum gputop_capture_chunk_type {
+    GPUTOP_CAPTURE_CHUNK_RECV = 1,
+    GPUTOP_CAPTURE_CHUNK_SEND = 2,
+    GPUTOP_CAPTURE_CHUNK_INDEX = 3,
+};
+
+struct gputop_capture_file_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+};
+
+struct gputop_capture_chunk {
+    uint32_t type;
+    uint32_t len;
+    uint64_t timestamp; /* CLOCK_MONOTONIC, in ns */
+};
+
+struct gputop_capture_index_entry {
+    uint64_t timestamp;
+    uint64_t offset;
+};
+
+struct gputop_capture_trailer {
+    char magic[8];
+    uint64_t index_offset;
+};
+
+static inline const uint8_t *
+gputop_capture_chunk_data(const struct gputop_capture_chunk *chunk)
+{
+    return (const uint8_t *) (chunk + 1);
+}
+
+struct gputop_capture_writer;
+
+struct gputop_capture_writer *gputop_capture_writer_open(const char *path);
+void gputop_capture_writer_write(struct gputop_capture_writer *writer,
+                                 enum gputop_capture_chunk_type type,
+                                 const void *data, size_t len);
+void gputop_capture_writer_close(struct gputop_capture_writer *writer);
+
+/* Readers walk the chunks with cursors (file offsets) so several positions
+ * can be tracked in the same capture.
+ */
+struct gputop_capture_reader;
+
+struct gputop_capture_reader *gputop_capture_reader_open(const char *path);
+void gputop_capture_reader_close(struct gputop_capture_reader *reader);
+
+size_t gputop_capture_reader_begin(const struct gputop_capture_reader *reader);
+const struct gputop_capture_chunk *
+gputop_capture_reader_next(const struct gputop_capture_reader *reader,
+                           size_t *cursor);
+size_t gputop_capture_reader_seek(const struct gputop_capture_reader *reader,
+                                  uint64_t timestamp);
+uint64_t gputop_capture_reader_start_time(const struct gputop_capture_reader *reader);
+uint64_t gputop_capture_reader_end_time(const struct gputop_capture_reader *reader);
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* __GPUTOP_CAPTURE_H__ */
@@ -1,10 +1,12 @@
 #include "gputop-client-context.h"
 
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include "gputop-gens-metrics.h"
+#include "gputop-i915-perf-compression.h"
+#include "gputop-oa-expression.h"
 
 #include "gputop-log.h"
 
@@ -133,6 +135,8 @@ send_pb_message(struct gputop_client_context *ctx, ProtobufCMessage *pb_message)
     size_t len = protobuf_c_message_get_packed_size(pb_message);
     uint8_t *data = (uint8_t *) malloc(len);
     protobuf_c_message_pack(pb_message, data);
+    if (ctx->capture)
+        gputop_capture_writer_write(ctx->capture, GPUTOP_CAPTURE_CHUNK_SEND, data, len);
     gputop_connection_send(ctx->connection, data, len);
     free(data);
 }
@@ -163,6 +167,15 @@ get_process_info(struct gputop_client_context *ctx, uint32_t pid)
     return info;
 }
 
+struct gputop_process_info *
+gputop_client_context_hw_id_to_process(struct gputop_client_context *ctx,
+                                       uint32_t hw_id)
+{
+    struct hash_entry *entry =
+        _mesa_hash_table_search(ctx->hw_id_to_process_table, uint_key(hw_id));
+    return entry ? (struct gputop_process_info *) entry->data : NULL;
+}
+
 static void
 update_hw_contexts_process_info(struct gputop_client_context *ctx,
                                 struct gputop_process_info *process)
@@ -178,24 +191,72 @@ update_hw_contexts_process_info(struct gputop_client_context *ctx,
 
 /**/
 
+/* Chunks are recycled through a free list. Their capacity is rounded up to
+ * a power of two so that messages of similar sizes (most i915 perf
+ * messages are the size of the server's read buffer) can reuse each
+ * other's memory.
+ */
+#define MIN_CHUNK_CAPACITY (4096)
+#define MAX_FREE_CHUNKS (64)
+
+static struct gputop_i915_perf_chunk *
+alloc_i915_perf_chunk(struct gputop_client_context *ctx, size_t len)
+{
+    list_for_each_entry(struct gputop_i915_perf_chunk, chunk,
+                        &ctx->free_i915_perf_chunks, link) {
+        if (chunk->capacity < len)
+            continue;
+
+        list_del(&chunk->link);
+        ctx->n_free_i915_perf_chunks--;
+        list_inithead(&chunk->link);
+        return chunk;
+    }
+
+    size_t capacity = MIN_CHUNK_CAPACITY;
+    while (capacity < len)
+        capacity *= 2;
+
+    struct gputop_i915_perf_chunk *chunk =
+        (struct gputop_i915_perf_chunk *) malloc(capacity + sizeof(*chunk));
+    chunk->capacity = capacity;
+    list_inithead(&chunk->link);
+
+    return chunk;
+}
+
+static void
+free_i915_perf_chunk(struct gputop_client_context *ctx,
+                     struct gputop_i915_perf_chunk *chunk)
+{
+    list_del(&chunk->link);
+
+    if (ctx->n_free_i915_perf_chunks >= MAX_FREE_CHUNKS) {
+        free(chunk);
+        return;
+    }
+
+    list_add(&chunk->link, &ctx->free_i915_perf_chunks);
+    ctx->n_free_i915_perf_chunks++;
+}
+
 static void
-put_i915_perf_chunk(struct gputop_i915_perf_chunk *chunk)
+put_i915_perf_chunk(struct gputop_client_context *ctx,
+                    struct gputop_i915_perf_chunk *chunk)
 {
     if (!chunk || --chunk->refcount)
         return;
 
-    list_del(&chunk->link);
-    free(chunk);
+    free_i915_perf_chunk(ctx, chunk);
 }
 
+/* Turns a message held in a chunk into a chunk of i915 perf records. */
 static struct gputop_i915_perf_chunk *
-get_i915_perf_chunk(struct gputop_client_context *ctx,
-                    const uint8_t *data, size_t len)
+init_i915_perf_chunk(struct gputop_client_context *ctx,
+                     struct gputop_i915_perf_chunk *chunk,
+                     const uint8_t *data, size_t len)
 {
-    struct gputop_i915_perf_chunk *chunk =
-        (struct gputop_i915_perf_chunk *) malloc(len + sizeof(*chunk));
-
-    memcpy(chunk->data, data, len);
+    chunk->data = data;
     chunk->length = len;
 
     chunk->refcount = 1;
@@ -204,6 +265,17 @@ get_i915_perf_chunk(struct gputop_client_context *ctx,
     return chunk;
 }
 
+static struct gputop_i915_perf_chunk *
+get_i915_perf_chunk(struct gputop_client_context *ctx,
+                    const uint8_t *data, size_t len)
+{
+    struct gputop_i915_perf_chunk *chunk = alloc_i915_perf_chunk(ctx, len);
+
+    memcpy(chunk->buffer, data, len);
+
+    return init_i915_perf_chunk(ctx, chunk, chunk->buffer, len);
+}
+
 static struct gputop_i915_perf_chunk *
 ref_i915_perf_chunk(struct gputop_i915_perf_chunk *chunk)
 {
@@ -301,7 +373,7 @@ gputop_client_context_add_tracepoint(struct gputop_client_context *ctx, const ch
     tp->hw_id_field = tp->process_field = -1;
     tp->idx = list_length(&ctx->perf_tracepoints);
     list_inithead(&tp->streams);
-    list_inithead(&tp->data);
+    gputop_tracepoint_store_init(&tp->samples);
 
     snprintf(tp->name, sizeof(tp->name), "%s", name);
     generate_uuid(ctx, tp->uuid, sizeof(tp->uuid), tp);
@@ -346,7 +418,7 @@ gputop_client_context_print_tracepoint_data(struct gputop_client_context *ctx,
             !strcmp("common_preempt_count", name))
             continue;
 
-        void *value_ptr = &data->data.data[tp->fields[f].offset];
+        const void *value_ptr = &data->data[tp->fields[f].offset];
         l = 0;
         if (!strcmp("common_pid", name)) {
             uint32_t pid = *((uint32_t *) value_ptr);
@@ -390,6 +462,98 @@ gputop_client_context_print_tracepoint_data(struct gputop_client_context *ctx,
     }
 }
 
+uint64_t
+gputop_client_context_tracepoints_end_time(struct gputop_client_context *ctx)
+{
+    uint64_t end_time = 0;
+
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
+        end_time = MAX2(end_time, gputop_tracepoint_store_last_time(&tp->samples));
+
+    return end_time;
+}
+
+bool
+gputop_client_context_tracepoint_data(struct gputop_perf_tracepoint *tp,
+                                      struct gputop_tracepoint_pos pos,
+                                      struct gputop_perf_tracepoint_data *data)
+{
+    if (!gputop_tracepoint_pos_valid(&tp->samples, pos))
+        return false;
+
+    data->tp = tp;
+    data->pos = pos;
+    data->time = gputop_tracepoint_store_time(&tp->samples, pos);
+    data->cpu = gputop_tracepoint_store_cpu(&tp->samples, pos);
+    data->data = gputop_tracepoint_store_payload(&tp->samples, pos, &data->data_size);
+
+    return true;
+}
+
+void
+gputop_client_context_tracepoint_iterator_init(struct gputop_client_context *ctx,
+                                               struct gputop_perf_tracepoint_iterator *iter,
+                                               uint64_t start, uint64_t end)
+{
+    int n_tps = list_length(&ctx->perf_tracepoints), t = 0;
+
+    memset(iter, 0, sizeof(*iter));
+    iter->end = end;
+    iter->tps = (struct gputop_perf_tracepoint **) calloc(MAX2(n_tps, 1), sizeof(iter->tps[0]));
+    iter->positions = (struct gputop_tracepoint_pos *) calloc(MAX2(n_tps, 1), sizeof(iter->positions[0]));
+
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
+        if (gputop_tracepoint_store_empty(&tp->samples))
+            continue;
+        iter->tps[t] = tp;
+        iter->positions[t] = gputop_tracepoint_store_lower_bound(&tp->samples, start);
+        t++;
+    }
+    iter->n_tps = t;
+}
+
+/* There are only ever a handful of tracepoints, so rather than a heap we
+ * simply look at the next sample of each of them */
+bool
+gputop_client_context_tracepoint_iterator_next(struct gputop_perf_tracepoint_iterator *iter)
+{
+    int next = -1;
+    uint64_t next_time = UINT64_MAX;
+
+    for (int t = 0; t < iter->n_tps; t++) {
+        const struct gputop_tracepoint_store *samples = &iter->tps[t]->samples;
+        uint64_t time;
+
+        if (!gputop_tracepoint_pos_valid(samples, iter->positions[t]))
+            continue;
+        time = gputop_tracepoint_store_time(samples, iter->positions[t]);
+        if (time < next_time) {
+            next = t;
+            next_time = time;
+        }
+    }
+
+    if (next < 0 || next_time > iter->end)
+        return false;
+
+    gputop_client_context_tracepoint_data(iter->tps[next], iter->positions[next],
+                                          &iter->data);
+    iter->positions[next] =
+        gputop_tracepoint_pos_next(&iter->tps[next]->samples, iter->positions[next]);
+
+    return true;
+}
+
+void
+gputop_client_context_tracepoint_iterator_fini(struct gputop_perf_tracepoint_iterator *iter)
+{
+    free(iter->tps);
+    free(iter->positions);
+    iter->tps = NULL;
+    iter->positions = NULL;
+    iter->n_tps = 0;
+}
+
 union value {
     char *string;
     int integer;
@@ -450,61 +614,62 @@ update_tracepoint(struct gputop_perf_tracepoint *tp,
     yyrelease(&ctx);
 }
 
+static void
+evict_perf_tracepoints_data(struct gputop_client_context *ctx, uint64_t end_time)
+{
+    const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
+
+    if (end_time <= max_length)
+        return;
+
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
+        gputop_tracepoint_store_evict(&tp->samples, end_time - max_length);
+}
+
 static void
 add_tracepoint_stream_data(struct gputop_client_context *ctx,
                            struct gputop_perf_tracepoint_stream *stream,
                            const uint8_t *data, size_t len)
 {
     struct gputop_perf_tracepoint *tp = stream->tp;
-    struct gputop_perf_tracepoint_data *tp_data =
-        (struct gputop_perf_tracepoint_data *) malloc(sizeof(*tp_data) - sizeof(tp_data->data) + len);
-    tp_data->tp = tp;
-    tp_data->cpu = stream->cpu;
-    memcpy(&tp_data->data, data, len);
-
-    /* Reunify the per cpu data into one global stream of tracepoints sorted
-     * by time. */
-    struct gputop_perf_tracepoint_data *tp_end_data =
-        list_empty(&ctx->perf_tracepoints_data) ?
-        NULL : list_last_entry(&ctx->perf_tracepoints_data,
-                               struct gputop_perf_tracepoint_data, link);
-    while (tp_end_data && tp_end_data->data.time > tp_data->data.time) {
-        tp_end_data = (tp_end_data->link.prev == &ctx->perf_tracepoints_data) ? NULL :
-            LIST_ENTRY(struct gputop_perf_tracepoint_data, tp_end_data->link.prev, link);
-    }
-    list_add(&tp_data->link, tp_end_data ? &tp_end_data->link : &ctx->perf_tracepoints_data);
-
-    /* Also reunify the per cpu data into the stream of tracepoints sorted by
-     * time. */
-    tp_end_data = list_empty(&tp->data) ?
-        NULL : list_last_entry(&tp->data, struct gputop_perf_tracepoint_data, tp_link);
-    while (tp_end_data && tp_end_data->data.time > tp_data->data.time) {
-        tp_end_data = (tp_end_data->tp_link.prev == &tp->data) ? NULL :
-            LIST_ENTRY(struct gputop_perf_tracepoint_data, tp_end_data->tp_link.prev, tp_link);
-    }
-    list_add(&tp_data->tp_link, tp_end_data ? &tp_end_data->tp_link : &tp->data);
+    const struct gputop_perf_data_tracepoint *point =
+        (const struct gputop_perf_data_tracepoint *) data;
+    /* Records of a merged stream also sample the cpu, between the time and
+     * the raw data */
+    const size_t cpu_offset = offsetof(struct gputop_perf_data_tracepoint, data_size);
+    size_t raw_offset = stream->cpu < 0 ? cpu_offset + 8 : cpu_offset;
+    uint32_t data_size;
+    int cpu = stream->cpu;
+
+    if (len < raw_offset + sizeof(data_size))
+        return;
 
-    /* Remove tracepoints outside the sampling window. */
-    const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
-    struct gputop_perf_tracepoint_data *tp_start_data =
-        list_first_entry(&ctx->perf_tracepoints_data, struct gputop_perf_tracepoint_data, link);
-    tp_end_data =
-        list_last_entry(&ctx->perf_tracepoints_data, struct gputop_perf_tracepoint_data, link);
+    if (stream->cpu < 0) {
+        uint32_t sample_cpu;
 
-    while ((tp_end_data->data.time - tp_start_data->data.time) > max_length) {
-        list_del(&tp_start_data->link);
-        list_del(&tp_start_data->tp_link);
-        free(tp_start_data);
-        tp_start_data = list_first_entry(&ctx->perf_tracepoints_data,
-                                         struct gputop_perf_tracepoint_data, link);
+        memcpy(&sample_cpu, data + cpu_offset, sizeof(sample_cpu));
+        cpu = sample_cpu;
     }
 
+    memcpy(&data_size, data + raw_offset, sizeof(data_size));
+    raw_offset += sizeof(data_size);
+    data_size = MIN2(data_size, len - raw_offset);
+
+    /* With merged streams the samples arrive in time order and this is just
+     * an append */
+    gputop_tracepoint_store_add(&tp->samples, point->time, cpu,
+                                data + raw_offset, data_size);
+
+    /* Remove tracepoints outside the sampling window. */
+    evict_perf_tracepoints_data(ctx, gputop_client_context_tracepoints_end_time(ctx));
+
     if (tp->process_field >= 0) {
-        uint32_t pid = *((uint32_t *)&tp_data->data.data[tp->fields[tp->process_field].offset]);
+        const uint8_t *raw = data + raw_offset;
+        uint32_t pid = *((uint32_t *)&raw[tp->fields[tp->process_field].offset]);
         struct gputop_process_info *process = get_process_info(ctx, pid);
 
         if (process && tp->hw_id_field >= 0) {
-            uint32_t hw_id = *((uint32_t *)&tp_data->data.data[tp->fields[tp->hw_id_field].offset]);
+            uint32_t hw_id = *((uint32_t *)&raw[tp->fields[tp->hw_id_field].offset]);
             _mesa_hash_table_insert(ctx->hw_id_to_process_table, uint_key(hw_id), process);
 
             struct hash_entry *entry =
@@ -549,7 +714,13 @@ open_perf_tracepoint(struct gputop_client_context *ctx, struct gputop_perf_trace
     pb_stream.type_case = GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT;
     pb_stream.tracepoint = &pb_tp_config;
 
-    for (int cpu = 0; cpu < ctx->features->features->n_cpus; cpu++) {
+    /* The server can merge the records of all CPUs for us */
+    int n_cpus = ctx->features->features->has_merged_tracepoints ?
+        1 : ctx->features->features->n_cpus;
+
+    for (int i = 0; i < n_cpus; i++) {
+        int cpu = ctx->features->features->has_merged_tracepoints ? -1 : i;
+
         pb_tp_config.cpu = cpu;
 
         struct gputop_perf_tracepoint_stream *stream =
@@ -569,6 +740,7 @@ gputop_client_context_remove_tracepoint(struct gputop_client_context *ctx,
                                         struct gputop_perf_tracepoint *tp)
 {
     close_perf_tracepoint(ctx, tp);
+    gputop_tracepoint_store_fini(&tp->samples);
     if (tp->format)
         free(tp->format);
     list_del(&tp->link);
@@ -596,13 +768,16 @@ uint64_t
 gputop_client_context_convert_gt_timestamp(struct gputop_client_context *ctx,
                                            uint32_t gt_timestamp)
 {
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
+    const struct gputop_samples_ring *ring = &ctx->timelines;
+
+    for (uint32_t i = 0; i < ring->count; i++) {
+        uint32_t idx = gputop_samples_ring_index(ring, i);
         uint32_t start_gt_ts =
             gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->start_report.header);
+                                              ring->start_reports[idx].header);
         uint32_t end_gt_ts =
             gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->end_report.header);
+                                              ring->end_reports[idx].header);
 
         if (end_gt_ts < gt_timestamp)
             continue;
@@ -610,15 +785,162 @@ gputop_client_context_convert_gt_timestamp(struct gputop_client_context *ctx,
             return 0ULL;
 
         uint32_t gt_delta = gt_timestamp - start_gt_ts;
-        uint64_t delta = gt_delta * (samples->timestamp_end - samples->timestamp_start) /
+        uint64_t delta = gt_delta * (ring->timestamp_end[idx] - ring->timestamp_start[idx]) /
             (end_gt_ts - start_gt_ts);
 
-        return samples->timestamp_start + delta;
+        return ring->timestamp_start[idx] + delta;
     }
 
     return 0ULL;
 }
 
+/**/
+
+static void *
+samples_ring_resize_column(const struct gputop_samples_ring *ring,
+                           void *column, size_t elem_size,
+                           uint32_t n_kept, uint32_t capacity)
+{
+    uint8_t *new_column = (uint8_t *) calloc(capacity, elem_size);
+
+    for (uint32_t i = 0; i < n_kept; i++) {
+        uint32_t idx = gputop_samples_ring_index(ring, ring->count - n_kept + i);
+        memcpy(new_column + i * elem_size,
+               (const uint8_t *) column + idx * elem_size, elem_size);
+    }
+    free(column);
+
+    return new_column;
+}
+
+/* Reallocates the columns to the new capacity, keeping the most recent
+ * samples. Rings tracking reports never shrink below their count as
+ * dropping samples would leak the references they hold.
+ */
+static void
+samples_ring_resize(struct gputop_samples_ring *ring, uint32_t capacity)
+{
+    uint32_t n_kept = MIN2(ring->count, capacity);
+
+    assert(!ring->track_reports || capacity >= ring->count);
+
+    ring->timestamp_start =
+        samples_ring_resize_column(ring, ring->timestamp_start,
+                                   sizeof(uint64_t), n_kept, capacity);
+    ring->timestamp_end =
+        samples_ring_resize_column(ring, ring->timestamp_end,
+                                   sizeof(uint64_t), n_kept, capacity);
+    ring->oa_timestamp =
+        samples_ring_resize_column(ring, ring->oa_timestamp,
+                                   sizeof(uint64_t), n_kept, capacity);
+    ring->deltas =
+        samples_ring_resize_column(ring, ring->deltas,
+                                   MAX_RAW_OA_COUNTERS * sizeof(uint64_t),
+                                   n_kept, capacity);
+    if (ring->track_reports) {
+        ring->contexts =
+            samples_ring_resize_column(ring, ring->contexts,
+                                       sizeof(ring->contexts[0]), n_kept, capacity);
+        ring->start_reports =
+            samples_ring_resize_column(ring, ring->start_reports,
+                                       sizeof(ring->start_reports[0]), n_kept, capacity);
+        ring->end_reports =
+            samples_ring_resize_column(ring, ring->end_reports,
+                                       sizeof(ring->end_reports[0]), n_kept, capacity);
+    }
+
+    ring->capacity = capacity;
+    ring->first = 0;
+    ring->count = n_kept;
+}
+
+static void
+samples_ring_fini(struct gputop_samples_ring *ring)
+{
+    assert(!ring->track_reports || ring->count == 0);
+
+    free(ring->timestamp_start);
+    free(ring->timestamp_end);
+    free(ring->oa_timestamp);
+    free(ring->deltas);
+    free(ring->contexts);
+    free(ring->start_reports);
+    free(ring->end_reports);
+
+    bool track_reports = ring->track_reports;
+    memset(ring, 0, sizeof(*ring));
+    ring->track_reports = track_reports;
+}
+
+static void
+samples_ring_pop(struct gputop_samples_ring *ring)
+{
+    assert(ring->count > 0);
+    ring->first = gputop_samples_ring_index(ring, 1);
+    ring->count--;
+}
+
+/* Copies a sample at the end of the ring. With track_reports the ring takes
+ * over the references on the reports & context held by the sample.
+ */
+static void
+samples_ring_push(struct gputop_samples_ring *ring,
+                  const struct gputop_accumulated_samples *samples)
+{
+    if (ring->count == ring->capacity) {
+        if (ring->track_reports)
+            samples_ring_resize(ring, MAX2(64, ring->capacity * 2));
+        else
+            samples_ring_pop(ring);
+    }
+
+    uint32_t idx = gputop_samples_ring_index(ring, ring->count++);
+
+    ring->timestamp_start[idx] = samples->timestamp_start;
+    ring->timestamp_end[idx] = samples->timestamp_end;
+    ring->oa_timestamp[idx] = samples->accumulator.first_timestamp;
+    memcpy(&ring->deltas[idx * MAX_RAW_OA_COUNTERS], samples->accumulator.deltas,
+           sizeof(samples->accumulator.deltas));
+    if (ring->track_reports) {
+        ring->contexts[idx] = samples->context;
+        ring->start_reports[idx] = samples->start_report;
+        ring->end_reports[idx] = samples->end_report;
+    }
+}
+
+/* Sizes a graph ring to hold the visible part of the timeline. */
+static void
+samples_ring_fit_graphs(struct gputop_client_context *ctx,
+                        struct gputop_samples_ring *ring)
+{
+    uint32_t max_graphs =
+        (ctx->oa_visible_timeline_s * 1000000000.0f) / ctx->oa_aggregation_period_ns;
+    max_graphs = MAX2(max_graphs, 1);
+
+    if (ring->capacity != max_graphs)
+        samples_ring_resize(ring, max_graphs);
+}
+
+void
+gputop_samples_ring_get(const struct gputop_samples_ring *ring, uint32_t idx,
+                        struct gputop_accumulated_samples *sample)
+{
+    uint32_t pos = gputop_samples_ring_index(ring, idx);
+
+    memset(sample, 0, sizeof(*sample));
+    list_inithead(&sample->link);
+    sample->timestamp_start = ring->timestamp_start[pos];
+    sample->timestamp_end = ring->timestamp_end[pos];
+    sample->accumulator.first_timestamp = ring->oa_timestamp[pos];
+    memcpy(sample->accumulator.deltas, &ring->deltas[pos * MAX_RAW_OA_COUNTERS],
+           sizeof(sample->accumulator.deltas));
+    if (ring->track_reports) {
+        sample->context = ring->contexts[pos];
+        sample->start_report = ring->start_reports[pos];
+        sample->end_report = ring->end_reports[pos];
+    }
+}
+
 static struct gputop_accumulated_samples *
 get_accumulated_sample(struct gputop_client_context *ctx,
                        struct gputop_i915_perf_chunk *chunk,
@@ -626,6 +948,8 @@ get_accumulated_sample(struct gputop_client_context *ctx,
                        uint32_t hw_id);
 static void put_accumulated_sample(struct gputop_client_context *ctx,
                                    struct gputop_accumulated_samples *samples);
+static void free_accumulated_sample(struct gputop_client_context *ctx,
+                                    struct gputop_accumulated_samples *samples);
 
 static void
 hw_context_update_process(struct gputop_client_context *ctx,
@@ -664,7 +988,6 @@ get_hw_context(struct gputop_client_context *ctx, uint32_t hw_id)
     new_context->hw_id = hw_id;
     new_context->timeline_row = _mesa_hash_table_num_entries(ctx->hw_contexts_table);
     new_context->n_samples = 1;
-    list_inithead(&new_context->graphs);
 
     hw_context_update_process(ctx, new_context);
 
@@ -691,10 +1014,8 @@ put_hw_context(struct gputop_client_context *ctx, struct gputop_hw_context *old_
         _mesa_hash_table_search(ctx->hw_contexts_table, uint_key(old_context->hw_id));
     _mesa_hash_table_remove(ctx->hw_contexts_table, entry);
 
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &old_context->graphs, link) {
-        put_accumulated_sample(ctx, samples);
-    }
+    samples_ring_fini(&old_context->graphs);
+    gputop_oa_prefix_index_fini(&old_context->oa_index);
     if (old_context->current_graph_samples)
         put_accumulated_sample(ctx, old_context->current_graph_samples);
 
@@ -709,9 +1030,9 @@ put_hw_context(struct gputop_client_context *ctx, struct gputop_hw_context *old_
 
 static void
 hw_context_add_time(struct gputop_hw_context *context,
-                    struct gputop_accumulated_samples *samples, bool add)
+                    uint64_t timestamp_start, uint64_t timestamp_end, bool add)
 {
-    uint64_t delta = samples->timestamp_end - samples->timestamp_start;
+    uint64_t delta = timestamp_end - timestamp_start;
     context->time_spent += add ? delta : -delta;
 }
 
@@ -725,9 +1046,6 @@ hw_context_record_for_time(struct gputop_client_context *ctx,
     assert(context->current_graph_samples != NULL);
     context->current_graph_samples = NULL;
 
-    samples->end_report.chunk = ref_i915_perf_chunk(chunk);
-    samples->end_report.header = header;
-
     /* Put end timestamp */
     const uint64_t *cpu_timestamp = (const uint64_t *)
         gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
@@ -740,18 +1058,10 @@ hw_context_record_for_time(struct gputop_client_context *ctx,
                                  samples->accumulator.clock.clock_count);
     context->usage_percent = (double) usage_ns / ctx->oa_aggregation_period_ns;
 
-    /* Remove excess of samples */
-    uint32_t max_graphs =
-        (ctx->oa_visible_timeline_s * 1000000000.0f) / ctx->oa_aggregation_period_ns;
-    while (context->n_graphs > max_graphs) {
-        struct gputop_accumulated_samples *ex_samples =
-            list_first_entry(&context->graphs, struct gputop_accumulated_samples, link);
-        put_accumulated_sample(ctx, ex_samples);
-        context->n_graphs--;
-    }
-
-    list_addtail(&samples->link, &context->graphs);
-    context->n_graphs++;
+    /* The ring drops the oldest sample once full. */
+    samples_ring_fit_graphs(ctx, &context->graphs);
+    samples_ring_push(&context->graphs, samples);
+    put_accumulated_sample(ctx, samples);
 }
 
 static struct gputop_accumulated_samples *
@@ -793,9 +1103,17 @@ static void
 put_accumulated_sample(struct gputop_client_context *ctx,
                        struct gputop_accumulated_samples *samples)
 {
-    put_i915_perf_chunk(samples->start_report.chunk);
-    put_i915_perf_chunk(samples->end_report.chunk);
+    put_i915_perf_chunk(ctx, samples->start_report.chunk);
+    put_i915_perf_chunk(ctx, samples->end_report.chunk);
     put_hw_context(ctx, samples->context);
+    free_accumulated_sample(ctx, samples);
+}
+
+/* Returns a sample to the free list without releasing its references. */
+static void
+free_accumulated_sample(struct gputop_client_context *ctx,
+                        struct gputop_accumulated_samples *samples)
+{
     list_del(&samples->link);
     list_add(&samples->link, &ctx->free_samples);
 }
@@ -865,24 +1183,57 @@ gputop_accumulated_samples_print(struct gputop_client_context *ctx,
     }
 }
 
+bool
+gputop_client_context_accumulate_range(struct gputop_client_context *ctx,
+                                       const struct gputop_hw_context *context,
+                                       uint64_t start_time, uint64_t end_time,
+                                       struct gputop_cc_oa_accumulator *accumulator)
+{
+    const struct gputop_oa_prefix_index *index =
+        context ? &context->oa_index : &ctx->oa_index;
+    uint32_t first, count;
+
+    gputop_cc_oa_accumulator_init(accumulator, &ctx->devinfo, ctx->metric_set,
+                                  0, NULL);
+
+    if (!gputop_oa_prefix_index_find_range(index, start_time, end_time,
+                                           &first, &count))
+        return false;
+
+    gputop_oa_prefix_index_sum(index, first, count, accumulator->deltas);
+    accumulator->first_timestamp =
+        index->start_times[gputop_oa_prefix_index_pos(index, first)];
+    accumulator->last_timestamp =
+        index->end_times[gputop_oa_prefix_index_pos(index, first + count - 1)];
+
+    return true;
+}
+
 double
 gputop_client_context_read_counter_value(struct gputop_client_context *ctx,
-                                         struct gputop_accumulated_samples *sample,
+                                         uint64_t *deltas,
                                          const struct gputop_metric_set_counter *counter)
 {
+    if (counter->expression) {
+        double value;
+        gputop_oa_expression_evaluate(counter->expression, &ctx->devinfo,
+                                      ctx->metric_set, &deltas, 1, &value);
+        return value;
+    }
+
     switch (counter->data_type) {
     case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
     case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
     case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
         return counter->oa_counter_read_uint64(&ctx->devinfo,
                                                ctx->metric_set,
-                                               sample->accumulator.deltas);
+                                               deltas);
         break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
     case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
         return counter->oa_counter_read_float(&ctx->devinfo,
                                               ctx->metric_set,
-                                              sample->accumulator.deltas);
+                                              deltas);
         break;
     }
 
@@ -897,24 +1248,13 @@ i915_perf_record_for_time(struct gputop_client_context *ctx,
     struct gputop_accumulated_samples *samples = ctx->current_graph_samples;
     ctx->current_graph_samples = NULL;
 
-    samples->end_report.chunk = ref_i915_perf_chunk(chunk);
-    samples->end_report.header = header;
-
     /* Put end timestamp */
     samples->timestamp_end = i915_perf_timestamp(ctx, header);
 
-    /* Remove excess of samples */
-    uint32_t max_graphs =
-        (ctx->oa_visible_timeline_s * 1000000000.0f) / ctx->oa_aggregation_period_ns;
-    while (ctx->n_graphs > max_graphs) {
-        struct gputop_accumulated_samples *ex_samples =
-            list_first_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
-        put_accumulated_sample(ctx, ex_samples);
-        ctx->n_graphs--;
-    }
-
-    list_addtail(&samples->link, &ctx->graphs);
-    ctx->n_graphs++;
+    /* The ring drops the oldest sample once full. */
+    samples_ring_fit_graphs(ctx, &ctx->graphs);
+    samples_ring_push(&ctx->graphs, samples);
+    put_accumulated_sample(ctx, samples);
 }
 
 static void
@@ -933,21 +1273,66 @@ i915_perf_record_for_hw_id(struct gputop_client_context *ctx,
 
     /* Remove excess of samples */
     uint64_t aggregation_period_ns = ctx->oa_visible_timeline_s * 1000000000UL;
-    struct gputop_accumulated_samples *first_samples =
-        list_first_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
-    while (!list_empty(&ctx->timelines) &&
-           (samples->timestamp_end - first_samples->timestamp_start) > aggregation_period_ns) {
-        hw_context_add_time(first_samples->context, first_samples, false);
-        put_accumulated_sample(ctx, first_samples);
-        ctx->n_timelines--;
-        first_samples = list_first_entry(&ctx->timelines,
-                                         struct gputop_accumulated_samples, link);
+    struct gputop_samples_ring *ring = &ctx->timelines;
+    while (ring->count > 0) {
+        uint32_t idx = gputop_samples_ring_index(ring, 0);
+
+        if ((samples->timestamp_end - ring->timestamp_start[idx]) <= aggregation_period_ns)
+            break;
+
+        hw_context_add_time(ring->contexts[idx],
+                            ring->timestamp_start[idx], ring->timestamp_end[idx],
+                            false);
+        put_i915_perf_chunk(ctx, ring->start_reports[idx].chunk);
+        put_i915_perf_chunk(ctx, ring->end_reports[idx].chunk);
+        put_hw_context(ctx, ring->contexts[idx]);
+        samples_ring_pop(ring);
     }
 
-    list_addtail(&samples->link, &ctx->timelines);
-    ctx->n_timelines++;
+    hw_context_add_time(samples->context,
+                        samples->timestamp_start, samples->timestamp_end, true);
+
+    /* Keep the indices covering the same reports as the timeline */
+    uint64_t oldest_ts = ring->count > 0 ?
+        ring->timestamp_start[gputop_samples_ring_index(ring, 0)] : samples->timestamp_start;
+    gputop_oa_prefix_index_drop_before(&ctx->oa_index, oldest_ts);
+    list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link)
+        gputop_oa_prefix_index_drop_before(&context->oa_index, oldest_ts);
+
+    /* The ring takes over the references of the sample. */
+    samples_ring_push(ring, samples);
+    free_accumulated_sample(ctx, samples);
+}
+
+/* Adds the deltas between the last report and header to the prefix sums of
+ * the whole GPU and of the running context. Reports that couldn't be
+ * decoded still get an (empty) entry so the entries match the reports. */
+static void
+i915_perf_index_deltas(struct gputop_client_context *ctx,
+                       const struct drm_i915_perf_record_header *header,
+                       const struct gputop_cc_oa_deltas *deltas)
+{
+    uint64_t end_ts = i915_perf_timestamp(ctx, header);
+    struct gputop_oa_prefix_index *indices[2] = {
+        &ctx->oa_index,
+        ctx->current_timeline_samples ?
+        &ctx->current_timeline_samples->context->oa_index : NULL,
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(indices); i++) {
+        struct gputop_oa_prefix_index *index = indices[i];
+
+        if (!index)
+            continue;
 
-    hw_context_add_time(samples->context, samples, true);
+        if (deltas) {
+            gputop_oa_prefix_index_append(index, ctx->last_oa_timestamp, end_ts,
+                                          deltas->deltas, deltas->n_deltas);
+        } else if (index->n_deltas) {
+            gputop_oa_prefix_index_append(index, ctx->last_oa_timestamp, end_ts,
+                                          NULL, index->n_deltas);
+        }
+    }
 }
 
 static void
@@ -979,6 +1364,7 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
                 gputop_i915_perf_record_field(&ctx->i915_perf_config, header,
                                               GPUTOP_I915_PERF_FIELD_OA_REPORT);
             uint32_t hw_id = gputop_cc_oa_report_get_ctx_id(&ctx->devinfo, samples);
+            struct gputop_cc_oa_deltas deltas;
 
             if (!ctx->current_graph_samples) {
                 /* Global accumulator */
@@ -998,47 +1384,49 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
                                            ctx->last_hw_id);
             }
 
-            if (last) {
+            /* Decode the pair of reports only once and add the resulting
+             * deltas to all the accumulators following it.
+             */
+            bool decoded = last &&
+                gputop_cc_oa_decode_deltas(ctx->metric_set, last, samples, &deltas);
+            if (last)
+                i915_perf_index_deltas(ctx, header, decoded ? &deltas : NULL);
+            if (decoded) {
                 struct gputop_cc_oa_accumulator *accumulator;
 
                 if (ctx->current_timeline_samples) {
                     struct gputop_hw_context *context = ctx->current_timeline_samples->context;
+                    uint64_t elapsed;
+
+                    /* Accumulate for the running context over the
+                     * accumulation period. */
+                    gputop_cc_oa_accumulate_deltas(&context->current_graph_samples->accumulator,
+                                                   &deltas);
 
                     /* Accumulate for the timeline on the currently running context. */
                     accumulator = &ctx->current_timeline_samples->accumulator;
-                    if (gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
-                        uint64_t elapsed =
-                            accumulator->last_timestamp - accumulator->first_timestamp;
-
-                        if (ctx->last_hw_id != hw_id ||
-                            elapsed > (ctx->oa_aggregation_period_ns)) {
-                            i915_perf_record_for_hw_id(ctx, chunk, header);
-                        }
+                    gputop_cc_oa_accumulate_deltas(accumulator, &deltas);
+                    elapsed = accumulator->last_timestamp - accumulator->first_timestamp;
+                    if (ctx->last_hw_id != hw_id ||
+                        elapsed > (ctx->oa_aggregation_period_ns)) {
+                        i915_perf_record_for_hw_id(ctx, chunk, header);
                     }
-
-                    /* Accumulate for the running context over the
-                     * accumulation period. */
-                    accumulator = &context->current_graph_samples->accumulator;
-                    gputop_cc_oa_accumulate_reports(accumulator, last, samples);
                 }
 
                 /* Accumulate globally over the accumulation period. */
                 accumulator =
                     &ctx->current_graph_samples->accumulator;
-                if (gputop_cc_oa_accumulate_reports(accumulator, last, samples)) {
-                    uint64_t elapsed =
-                        accumulator->last_timestamp - accumulator->first_timestamp;
-
-                    if (elapsed > (ctx->oa_aggregation_period_ns)) {
-                        i915_perf_record_for_time(ctx, chunk, header);
+                gputop_cc_oa_accumulate_deltas(accumulator, &deltas);
+                if ((accumulator->last_timestamp - accumulator->first_timestamp) >
+                    ctx->oa_aggregation_period_ns) {
+                    i915_perf_record_for_time(ctx, chunk, header);
+                    if (ctx->accumulate_cb)
+                        ctx->accumulate_cb(ctx, NULL);
+                    list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link) {
+                        assert(context->current_graph_samples != NULL);
+                        hw_context_record_for_time(ctx, context, chunk, header);
                         if (ctx->accumulate_cb)
-                            ctx->accumulate_cb(ctx, NULL);
-                        list_for_each_entry(struct gputop_hw_context, context, &ctx->hw_contexts, link) {
-                            assert(context->current_graph_samples != NULL);
-                            hw_context_record_for_time(ctx, context, chunk, header);
-                            if (ctx->accumulate_cb)
-                                ctx->accumulate_cb(ctx, context);
-                        }
+                            ctx->accumulate_cb(ctx, context);
                     }
                 }
             }
@@ -1047,7 +1435,7 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
             last = samples;
             ctx->last_hw_id = hw_id;
             ctx->last_header = header;
-            if (ctx->last_chunk) put_i915_perf_chunk(ctx->last_chunk);
+            if (ctx->last_chunk) put_i915_perf_chunk(ctx, ctx->last_chunk);
             ctx->last_chunk = ref_i915_perf_chunk(chunk);
             break;
         }
@@ -1064,112 +1452,20 @@ i915_perf_accumulate(struct gputop_client_context *ctx,
 const struct gputop_metric_set *
 gputop_client_context_uuid_to_metric_set(struct gputop_client_context *ctx, const char *uuid)
 {
-    struct hash_entry *entry =
-        _mesa_hash_table_search(ctx->gen_metrics->metric_sets_map, uuid);
-    return entry ? ((struct gputop_metric_set *) entry->data) : NULL;
+    return gputop_gen_find_metric_set(ctx->gen_metrics, uuid);
 }
 
 const struct gputop_metric_set *
 gputop_client_context_symbol_to_metric_set(struct gputop_client_context *ctx,
                                            const char *symbol_name)
 {
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &ctx->gen_metrics->metric_sets, link) {
-        if (!strcmp(metric_set->symbol_name, symbol_name))
-            return metric_set;
-    }
-    return NULL;
-}
-
-static void
-build_equations_variables(struct gputop_devinfo *devinfo)
-{
-    struct gputop_devtopology *topology = &devinfo->topology;
-    int subslice_stride = DIV_ROUND_UP(topology->max_eus_per_subslice, 8);
-    int slice_stride = subslice_stride * topology->max_subslices;
-    int subslice_slice_stride = DIV_ROUND_UP(topology->max_subslices, 8);
-
-    devinfo->n_eus = 0;
-    for (int s = 0; s < topology->max_slices; s++) {
-        for (int ss = 0; ss < topology->max_subslices; ss++) {
-            for (int eug = 0; eug < subslice_stride; eug++) {
-                devinfo->n_eus +=
-                    __builtin_popcount(topology->eus_mask[slice_stride * s +
-                                                          subslice_stride * ss +
-                                                          eug]);
-            }
-        }
-    }
-
-    devinfo->n_eu_slices = 0;
-    for (int s = 0; s < DIV_ROUND_UP(topology->max_slices, 8); s++) {
-        devinfo->n_eu_slices +=
-            __builtin_popcount(topology->slices_mask[s]);
-    }
-
-    devinfo->n_eu_sub_slices = 0;
-    for (int s = 0; s < topology->max_slices * subslice_slice_stride; s++) {
-        devinfo->n_eu_sub_slices +=
-            __builtin_popcount(topology->subslices_mask[s]);
-    }
-
-    devinfo->slice_mask = topology->slices_mask[0];
-
-    /* Unfortunately the equations expect at $SubsliceMask variable were the
-     * meaning of the bits varies from one platform to another. One could hope
-     * that we get special operations to query slice/subslice availability
-     * abstracting the storage of this information...
-     */
-    int subslice_bits_per_slice = 0;
-    if (devinfo->gen <= 10) {
-        /* Subslices are grouped by 3. */
-        subslice_bits_per_slice = 3;
-    } else if (devinfo->gen == 11) {
-        /* Subslices are grouped by 8 */
-        subslice_bits_per_slice = 8;
-    } else {
-        unreachable("Cannot build subslice mask for equations");
-    }
-
-    devinfo->subslice_mask = 0;
-    for (int s = 0; s < topology->max_slices; s++) {
-        for (int ss = 0; ss < MIN2(topology->max_subslices, 3); ss++) {
-            bool enabled =
-                (topology->subslices_mask[slice_stride * s + ss / 8] &
-                 (1UL << (ss % 8))) != 0;
-            if (enabled)
-                devinfo->subslice_mask |= 1ULL << (subslice_bits_per_slice * s + ss);
-        }
-    }
-
-
-    devinfo->eu_threads_count = devinfo->n_eus * topology->n_threads_per_eu;
+    return gputop_gen_find_metric_set_by_symbol(ctx->gen_metrics, symbol_name);
 }
 
 static void
 register_platform_metrics(struct gputop_client_context *ctx,
                           const Gputop__DevInfo *pb_devinfo)
 {
-    static const struct {
-        const char *devname;
-        struct gputop_gen * (*get_metrics_cb)(const struct gputop_devinfo *devinfo);
-    } devname_to_metric_func[] = {
-        { "hsw", gputop_oa_get_metrics_hsw },
-        { "bdw", gputop_oa_get_metrics_bdw },
-        { "chv", gputop_oa_get_metrics_chv },
-        { "sklgt2", gputop_oa_get_metrics_sklgt2 },
-        { "sklgt3", gputop_oa_get_metrics_sklgt3 },
-        { "sklgt4", gputop_oa_get_metrics_sklgt4 },
-        { "kblgt2", gputop_oa_get_metrics_kblgt2 },
-        { "kblgt3", gputop_oa_get_metrics_kblgt3 },
-        { "bxt", gputop_oa_get_metrics_bxt },
-        { "glk", gputop_oa_get_metrics_glk },
-        { "cflgt2", gputop_oa_get_metrics_cflgt2 },
-        { "cflgt3", gputop_oa_get_metrics_cflgt3 },
-        { "cnl", gputop_oa_get_metrics_cnl },
-        { "icl", gputop_oa_get_metrics_icl },
-    };
-
     struct gputop_devinfo *devinfo = &ctx->devinfo;
     snprintf(devinfo->devname, sizeof(devinfo->devname), "%s", pb_devinfo->devname);
     snprintf(devinfo->prettyname, sizeof(devinfo->prettyname), "%s", pb_devinfo->prettyname);
@@ -1198,14 +1494,9 @@ register_platform_metrics(struct gputop_client_context *ctx,
     memcpy(topology->eus_mask, pb_topology->eus_mask.data,
            pb_topology->eus_mask.len);
 
-    build_equations_variables(devinfo);
+    gputop_devinfo_build_equations_variables(devinfo);
 
-    for (uint32_t i = 0; i < ARRAY_SIZE(devname_to_metric_func); i++) {
-        if (!strcmp(devinfo->devname, devname_to_metric_func[i].devname)) {
-            ctx->gen_metrics = devname_to_metric_func[i].get_metrics_cb(devinfo);
-            return;
-        }
-    }
+    ctx->gen_metrics = gputop_oa_get_metrics(devinfo->devname, devinfo);
 }
 
 /**/
@@ -1242,14 +1533,47 @@ open_i915_perf_stream(struct gputop_client_context *ctx)
     oa_stream.per_ctx_mode = false;
     oa_stream.cpu_timestamps = ctx->i915_perf_config.cpu_timestamps;
     oa_stream.gpu_timestamps = ctx->i915_perf_config.gpu_timestamps;
+    oa_stream.has_recorder_seconds = ctx->oa_recorder_seconds != 0;
+    oa_stream.recorder_seconds = ctx->oa_recorder_seconds;
+
+    Gputop__OAAggregationInfo aggregation = GPUTOP__OAAGGREGATION_INFO__INIT;
+    char **counter_names = NULL;
+    if (ctx->n_oa_server_counters) {
+        counter_names = (char **) calloc(ctx->n_oa_server_counters, sizeof(char *));
+        for (int i = 0; i < ctx->n_oa_server_counters; i++)
+            counter_names[i] = (char *) ctx->oa_server_counters[i]->symbol_name;
+
+        aggregation.period_ns = ctx->oa_aggregation_period_ns;
+        aggregation.n_counters = ctx->n_oa_server_counters;
+        aggregation.counters = counter_names;
+        aggregation.per_hw_context = ctx->oa_server_per_hw_context;
+        oa_stream.aggregation = &aggregation;
+    }
 
+    /* With a flight recorder, samples are only sent when dumped */
     Gputop__OpenStream stream = GPUTOP__OPEN_STREAM__INIT;
-    stream.overwrite = false;
-    stream.live_updates = true;
+    stream.overwrite = ctx->oa_recorder_seconds != 0;
+    stream.live_updates = ctx->oa_recorder_seconds == 0;
     stream.type_case = GPUTOP__OPEN_STREAM__TYPE_OA_STREAM;
     stream.oa_stream = &oa_stream;
 
+    Gputop__FlowControl flow_control = GPUTOP__FLOW_CONTROL__INIT;
+    if (ctx->oa_flow_control.policy) {
+        flow_control.policy = ctx->oa_flow_control.policy;
+        flow_control.max_queued_frames = ctx->oa_flow_control.max_queued_frames;
+        flow_control.decimation = ctx->oa_flow_control.decimation;
+        stream.flow_control = &flow_control;
+    }
+
+    if (ctx->oa_compressed_frames &&
+        ctx->features->features->has_i915_perf_compression) {
+        stream.has_compressed_frames = true;
+        stream.compressed_frames = true;
+    }
+
     open_stream(&ctx->oa_stream, ctx, &stream);
+
+    free(counter_names);
 }
 
 /**/
@@ -1276,7 +1600,7 @@ open_perf_tracepoints_streams(struct gputop_client_context *ctx)
 {
     clear_perf_tracepoints_data(ctx);
     list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
-        assert(list_length(&tp->data) == 0);
+        assert(gputop_tracepoint_store_empty(&tp->samples));
         open_perf_tracepoint(ctx, tp);
     }
 }
@@ -1402,6 +1726,26 @@ gputop_client_context_start_sampling(struct gputop_client_context *ctx)
 }
 
 
+void
+gputop_client_context_dump_recorder(struct gputop_client_context *ctx,
+                                    uint32_t duration_ms)
+{
+    if (!is_stream_opened(&ctx->oa_stream) || !ctx->oa_recorder_seconds)
+        return;
+
+    /* Dumps may overlap so start over with each one */
+    i915_perf_empty_samples(ctx);
+
+    Gputop__DumpStream dump = GPUTOP__DUMP_STREAM__INIT;
+    dump.id = ctx->oa_stream.id;
+    dump.duration_ms = duration_ms;
+
+    Gputop__Request request = GPUTOP__REQUEST__INIT;
+    request.req_case = GPUTOP__REQUEST__REQ_DUMP_STREAM;
+    request.dump_stream = &dump;
+    send_pb_message(ctx, &request.base);
+}
+
 /**/
 
 static void
@@ -1430,15 +1774,43 @@ handle_perf_data(struct gputop_client_context *ctx,
 
 static void
 handle_i915_perf_data(struct gputop_client_context *ctx,
-                      uint32_t stream_id, const uint8_t *data, size_t len)
+                      uint32_t stream_id, const uint8_t *data, size_t len,
+                      struct gputop_i915_perf_chunk *msg_chunk)
 {
     if (stream_id == ctx->oa_stream.id) {
-        struct gputop_i915_perf_chunk *chunk = get_i915_perf_chunk(ctx, data, len);
+        struct gputop_i915_perf_chunk *chunk = msg_chunk ?
+            init_i915_perf_chunk(ctx, msg_chunk, data, len) :
+            get_i915_perf_chunk(ctx, data, len);
         i915_perf_accumulate(ctx, chunk);
-        put_i915_perf_chunk(chunk);
-    } else
+        put_i915_perf_chunk(ctx, chunk);
+    } else {
         gputop_cr_console_log("discard wrong oa stream id=%i/%i",
                               stream_id, ctx->oa_stream.id);
+        if (msg_chunk)
+            free_i915_perf_chunk(ctx, msg_chunk);
+    }
+}
+
+static void
+handle_compressed_i915_perf_data(struct gputop_client_context *ctx,
+                                 uint32_t stream_id, const uint8_t *data, size_t len)
+{
+    size_t records_len = gputop_i915_perf_decompressed_size(data, len);
+    struct gputop_i915_perf_chunk *chunk;
+
+    if (!records_len) {
+        gputop_cr_console_log("malformed compressed i915 perf message len=%zu", len);
+        return;
+    }
+
+    chunk = alloc_i915_perf_chunk(ctx, records_len);
+    if (!gputop_i915_perf_decompress(data, len, chunk->buffer, records_len)) {
+        gputop_cr_console_log("malformed compressed i915 perf message len=%zu", len);
+        free_i915_perf_chunk(ctx, chunk);
+        return;
+    }
+
+    handle_i915_perf_data(ctx, stream_id, chunk->buffer, records_len, chunk);
 }
 
 static void
@@ -1509,6 +1881,29 @@ handle_protobuf_message(struct gputop_client_context *ctx,
             stream->fill = message->fill_notify->fill_percentage;
         break;
     }
+    case GPUTOP__MESSAGE__CMD_DROP_NOTIFY: {
+        struct gputop_stream *stream = find_stream(ctx, message->drop_notify->stream_id);
+        if (stream) {
+            stream->n_dropped_reports = message->drop_notify->n_dropped_reports;
+            stream->n_decimated_reports = message->drop_notify->n_decimated_reports;
+        }
+        break;
+    }
+    case GPUTOP__MESSAGE__CMD_STREAM_STATS: {
+        struct gputop_stream *stream = find_stream(ctx, message->stream_stats->stream_id);
+        if (stream) {
+            stream->n_records = message->stream_stats->n_records;
+            stream->n_samples = message->stream_stats->n_samples;
+            stream->n_lost_samples = message->stream_stats->n_lost_samples;
+            stream->n_wrapped_records = message->stream_stats->n_wrapped_records;
+            stream->n_spurious_records = message->stream_stats->n_spurious_records;
+            stream->reader_occupancy = message->stream_stats->reader_occupancy;
+            stream->reader_max_occupancy = message->stream_stats->reader_max_occupancy;
+            stream->n_reader_stalls = message->stream_stats->n_reader_stalls;
+            stream->n_late_records = message->stream_stats->n_late_records;
+        }
+        break;
+    }
     case GPUTOP__MESSAGE__CMD_PROCESS_INFO: {
         struct hash_entry *entry =
             _mesa_hash_table_search(ctx->pid_to_process_table,
@@ -1522,6 +1917,31 @@ handle_protobuf_message(struct gputop_client_context *ctx,
         }
         break;
     }
+    case GPUTOP__MESSAGE__CMD_OA_AGGREGATE: {
+        const Gputop__OAAggregate *aggregate = message->oa_aggregate;
+
+        if (aggregate->stream_id != ctx->oa_stream.id || !ctx->aggregate_cb)
+            break;
+        if (aggregate->global->n_values != ctx->n_oa_server_counters) {
+            gputop_cr_console_log("unexpected number of aggregated values=%zu",
+                                  aggregate->global->n_values);
+            break;
+        }
+
+        ctx->aggregate_cb(ctx, GPUTOP_OA_INVALID_CTX_ID,
+                          aggregate->start_timestamp, aggregate->end_timestamp,
+                          aggregate->global->values);
+        for (size_t i = 0; i < aggregate->n_contexts; i++) {
+            const Gputop__OAAggregateValues *values = aggregate->contexts[i];
+
+            if (values->n_values != ctx->n_oa_server_counters)
+                continue;
+            ctx->aggregate_cb(ctx, values->hw_id,
+                              aggregate->start_timestamp, aggregate->end_timestamp,
+                              values->values);
+        }
+        break;
+    }
     case GPUTOP__MESSAGE__CMD_CPU_STATS:
         if (add_cpu_stats(ctx, message))
             message = NULL;
@@ -1548,13 +1968,19 @@ handle_protobuf_message(struct gputop_client_context *ctx,
         gputop__message__free_unpacked(message, NULL);
 }
 
-void gputop_client_context_handle_data(struct gputop_client_context *ctx,
-                                       const void *payload, size_t payload_len)
+static void
+handle_data(struct gputop_client_context *ctx,
+            const void *payload, size_t payload_len,
+            struct gputop_i915_perf_chunk *msg_chunk)
 {
     const uint8_t *msg_type = (const uint8_t *) payload;
     const uint8_t *data = (const uint8_t *) payload + 8;
     size_t len = payload_len - 8;
 
+    if (ctx->capture)
+        gputop_capture_writer_write(ctx->capture, GPUTOP_CAPTURE_CHUNK_RECV,
+                                    payload, payload_len);
+
     switch (*msg_type) {
     case 1: {
         const uint32_t *stream_id =
@@ -1568,21 +1994,69 @@ void gputop_client_context_handle_data(struct gputop_client_context *ctx,
     case 3: {
         const uint32_t *stream_id =
             (const uint32_t *) ((const uint8_t *) payload + 4);
-        handle_i915_perf_data(ctx, *stream_id, data, len);
+        handle_i915_perf_data(ctx, *stream_id, data, len, msg_chunk);
+        return;
+    }
+    case 4: {
+        const uint32_t *stream_id =
+            (const uint32_t *) ((const uint8_t *) payload + 4);
+        handle_compressed_i915_perf_data(ctx, *stream_id, data, len);
         break;
     }
     default:
         gputop_cr_console_log("unknown msg type=%hhi", *msg_type);
         break;
     }
+
+    if (msg_chunk)
+        free_i915_perf_chunk(ctx, msg_chunk);
+}
+
+void gputop_client_context_handle_data(struct gputop_client_context *ctx,
+                                       const void *payload, size_t payload_len)
+{
+    handle_data(ctx, payload, payload_len, NULL);
+}
+
+static struct gputop_i915_perf_chunk *
+message_to_chunk(void *msg)
+{
+    return (struct gputop_i915_perf_chunk *)
+        ((uint8_t *) msg - offsetof(struct gputop_i915_perf_chunk, buffer));
+}
+
+void *
+gputop_client_context_alloc_message(struct gputop_client_context *ctx,
+                                    size_t len)
+{
+    return alloc_i915_perf_chunk(ctx, len)->buffer;
+}
+
+void
+gputop_client_context_release_message(struct gputop_client_context *ctx,
+                                      void *msg)
+{
+    free_i915_perf_chunk(ctx, message_to_chunk(msg));
+}
+
+void
+gputop_client_context_handle_message(struct gputop_client_context *ctx,
+                                     void *msg, size_t len)
+{
+    handle_data(ctx, msg, len, message_to_chunk(msg));
 }
 
 static void
 i915_perf_empty_samples(struct gputop_client_context *ctx)
 {
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &ctx->timelines, link) {
-        put_accumulated_sample(ctx, samples);
+    struct gputop_samples_ring *ring = &ctx->timelines;
+    while (ring->count > 0) {
+        uint32_t idx = gputop_samples_ring_index(ring, 0);
+
+        put_i915_perf_chunk(ctx, ring->start_reports[idx].chunk);
+        put_i915_perf_chunk(ctx, ring->end_reports[idx].chunk);
+        put_hw_context(ctx, ring->contexts[idx]);
+        samples_ring_pop(ring);
     }
     if (ctx->current_timeline_samples) {
         put_accumulated_sample(ctx, ctx->current_timeline_samples);
@@ -1590,22 +2064,17 @@ i915_perf_empty_samples(struct gputop_client_context *ctx)
     }
     _mesa_hash_table_clear(ctx->hw_contexts_table, NULL);
 
-    ctx->n_timelines = 0;
     ctx->last_hw_id = GPUTOP_OA_INVALID_CTX_ID;
+    gputop_oa_prefix_index_clear(&ctx->oa_index);
 
-    list_for_each_entry_safe(struct gputop_accumulated_samples, samples,
-                             &ctx->graphs, link) {
-        put_accumulated_sample(ctx, samples);
-    }
+    samples_ring_fini(&ctx->graphs);
     if (ctx->current_graph_samples) {
         put_accumulated_sample(ctx, ctx->current_graph_samples);
         ctx->current_graph_samples = NULL;
     }
-    assert(list_empty(&ctx->graphs));
-    ctx->n_graphs = 0;
 
     if (ctx->last_chunk) {
-        put_i915_perf_chunk(ctx->last_chunk);
+        put_i915_perf_chunk(ctx, ctx->last_chunk);
         ctx->last_chunk = NULL;
     }
     ctx->last_header = NULL;
@@ -1630,12 +2099,8 @@ delete_process_entry(struct hash_entry *entry)
 static void
 clear_perf_tracepoints_data(struct gputop_client_context *ctx)
 {
-    list_for_each_entry_safe(struct gputop_perf_tracepoint_data, data,
-                             &ctx->perf_tracepoints_data, link) {
-        list_del(&data->link);
-        list_del(&data->tp_link);
-        free(data);
-    }
+    list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link)
+        gputop_tracepoint_store_clear(&tp->samples);
 }
 
 void
@@ -1646,6 +2111,27 @@ gputop_client_context_clear_logs(struct gputop_client_context *ctx)
     ctx->start_message = ctx->n_messages = 0;
 }
 
+bool
+gputop_client_context_start_capture(struct gputop_client_context *ctx,
+                                    const char *path)
+{
+    gputop_client_context_stop_capture(ctx);
+
+    ctx->capture = gputop_capture_writer_open(path);
+
+    return ctx->capture != NULL;
+}
+
+void
+gputop_client_context_stop_capture(struct gputop_client_context *ctx)
+{
+    if (!ctx->capture)
+        return;
+
+    gputop_capture_writer_close(ctx->capture);
+    ctx->capture = NULL;
+}
+
 void
 gputop_client_context_init(struct gputop_client_context *ctx)
 {
@@ -1665,13 +2151,12 @@ gputop_client_context_init(struct gputop_client_context *ctx)
     _mesa_hash_table_set_freed_key(ctx->hw_contexts_table, uint_key(UINT32_MAX - 1));
     list_inithead(&ctx->hw_contexts);
 
-    list_inithead(&ctx->graphs);
-    list_inithead(&ctx->timelines);
+    ctx->timelines.track_reports = true;
     list_inithead(&ctx->free_samples);
     list_inithead(&ctx->i915_perf_chunks);
+    list_inithead(&ctx->free_i915_perf_chunks);
 
     list_inithead(&ctx->perf_tracepoints);
-    list_inithead(&ctx->perf_tracepoints_data);
     ctx->perf_tracepoints_name_table =
         _mesa_hash_table_create(NULL, _mesa_hash_string, _mesa_key_string_equal);
     ctx->perf_tracepoints_uuid_table =
@@ -1702,7 +2187,6 @@ gputop_client_context_reset(struct gputop_client_context *ctx,
     /**/
     i915_perf_empty_samples(ctx);
     clear_perf_tracepoints_data(ctx);
-    assert(list_length(&ctx->perf_tracepoints_data) == 0);
 
     /**/
     if (ctx->features) {
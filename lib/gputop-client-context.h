@@ -31,9 +31,12 @@
 #include "util/hash_table.h"
 #include "util/list.h"
 
+#include "gputop-capture.h"
 #include "gputop-network.h"
 #include "gputop-oa-counters.h"
 #include "gputop-oa-metrics.h"
+#include "gputop-oa-prefix-index.h"
+#include "gputop-tracepoint-store.h"
 
 #include "gputop.pb-c.h"
 
@@ -43,6 +46,10 @@ extern "C" {
 
 /* A chunk of data coming from the i915 perf driver (contains a sequence of
  * struct drm_i915_perf_record_header fields).
+ *
+ * The data points into buffer, which holds the whole network message the
+ * records came with, so messages received through
+ * gputop_client_context_alloc_message() are parsed in place.
  */
 struct gputop_i915_perf_chunk {
     struct list_head link;
@@ -50,11 +57,67 @@ struct gputop_i915_perf_chunk {
     uint32_t refcount;
 
     uint32_t length;
-    uint8_t data[];
+    const uint8_t *data;
+
+    uint32_t capacity;
+
+    /* Records are read in place as uint64_t, they follow an 8 bytes
+     * message header.
+     */
+    uint8_t buffer[] __attribute__((aligned(8)));
 };
 
 struct gputop_accumulated_samples;
 struct gputop_process_info;
+struct gputop_hw_context;
+
+/* Reference to one record within a chunk. */
+struct gputop_i915_perf_report_ref {
+    struct gputop_i915_perf_chunk *chunk;
+    const struct drm_i915_perf_record_header *header;
+};
+
+/* History of accumulated samples, stored column wise in a ring so that
+ * dropping the oldest sample is O(1) and scanning a single column (for
+ * example the timestamps when looking for the visible range) only touches
+ * the memory of that column.
+ *
+ * Indices passed to the accessors are relative to the oldest sample (0 is
+ * the oldest, count - 1 the newest).
+ */
+struct gputop_samples_ring {
+    uint32_t capacity;
+    uint32_t first;
+    uint32_t count;
+
+    /* When set the ring grows instead of overwriting its oldest sample and
+     * it keeps references to the hw context and reports of each sample.
+     */
+    bool track_reports;
+
+    uint64_t *timestamp_start;
+    uint64_t *timestamp_end;
+    uint64_t *oa_timestamp; /* OA timestamp of the first report, in ns */
+    uint64_t *deltas; /* MAX_RAW_OA_COUNTERS per sample */
+
+    /* Only with track_reports */
+    struct gputop_hw_context **contexts;
+    struct gputop_i915_perf_report_ref *start_reports;
+    struct gputop_i915_perf_report_ref *end_reports;
+};
+
+static inline uint32_t
+gputop_samples_ring_index(const struct gputop_samples_ring *ring, uint32_t idx)
+{
+    uint32_t pos = ring->first + idx;
+    return pos >= ring->capacity ? (pos - ring->capacity) : pos;
+}
+
+static inline uint64_t *
+gputop_samples_ring_deltas(const struct gputop_samples_ring *ring, uint32_t idx)
+{
+    return &ring->deltas[gputop_samples_ring_index(ring, idx) * MAX_RAW_OA_COUNTERS];
+}
 
 struct gputop_hw_context {
     char name[300];
@@ -69,8 +132,11 @@ struct gputop_hw_context {
     struct gputop_process_info *process;
 
     struct gputop_accumulated_samples *current_graph_samples;
-    struct list_head graphs; /* list of gputop_accumulated_samples */
-    uint32_t n_graphs;
+    struct gputop_samples_ring graphs;
+
+    /* Deltas of the reports while the context was running, over the
+     * timeline */
+    struct gputop_oa_prefix_index oa_index;
 
     /* UI state */
     uint64_t visible_time_spent;
@@ -92,10 +158,7 @@ struct gputop_accumulated_samples {
     uint64_t timestamp_start;
     uint64_t timestamp_end;
 
-    struct {
-        struct gputop_i915_perf_chunk *chunk;
-        const struct drm_i915_perf_record_header *header;
-    } start_report, end_report;
+    struct gputop_i915_perf_report_ref start_report, end_report;
 
     struct gputop_cc_oa_accumulator accumulator;
 };
@@ -111,6 +174,31 @@ struct gputop_stream {
 
     int id;
     float fill;
+
+    /* Totals reported by the server's flow control */
+    uint64_t n_dropped_reports;
+    uint64_t n_decimated_reports;
+
+    /* Totals reported by the server's core perf record parser */
+    uint64_t n_records;
+    uint64_t n_samples;
+    uint64_t n_lost_samples;
+    uint64_t n_wrapped_records;
+    uint64_t n_spurious_records;
+
+    /* Server side reader thread ring, if any */
+    uint64_t reader_occupancy;
+    uint64_t reader_max_occupancy;
+    uint64_t n_reader_stalls;
+
+    /* Records of a merged per-CPU stream that were forwarded out of order */
+    uint64_t n_late_records;
+};
+
+struct gputop_flow_control {
+    Gputop__FlowControlPolicy policy; /* 0 = server default */
+    uint32_t max_queued_frames; /* 0 = server default */
+    uint32_t decimation; /* 0 = server default */
 };
 
 struct gputop_perf_event {
@@ -157,7 +245,7 @@ struct gputop_perf_data_tracepoint {
 struct gputop_perf_tracepoint {
     struct list_head link; /* global list (gputop_client_context.perf_tracepoints)*/
 
-    struct list_head data; /* list of gputop_perf_tracepoint_data */
+    struct gputop_tracepoint_store samples;
 
     char name[128];
     uint32_t event_id;
@@ -183,20 +271,33 @@ struct gputop_perf_tracepoint {
 struct gputop_perf_tracepoint_stream {
     struct gputop_stream base;
 
-    int cpu;
+    int cpu; /* -1 for a stream merging all CPUs */
     struct gputop_perf_tracepoint *tp;
 
     struct list_head link; /* list of streams (gputop_perf_tracepoint.streams) */
 };
 
+/* A sample of a tracepoint, pointing into its store (only valid until the
+ * next sample is added) */
 struct gputop_perf_tracepoint_data {
-    struct list_head link; /* global list (gputop_client_context.perf_tracepoints_data) */
-    struct list_head tp_link; /* per tracepoint list (gputop_perf_tracepoint.data) */
-
     struct gputop_perf_tracepoint *tp;
+    struct gputop_tracepoint_pos pos;
 
+    uint64_t time;
     int cpu;
-    struct gputop_perf_data_tracepoint data;
+    const uint8_t *data; /* raw tracepoint struct */
+    uint32_t data_size;
+};
+
+/* Walks the samples of all tracepoints within a time range, in time order */
+struct gputop_perf_tracepoint_iterator {
+    uint64_t end;
+
+    int n_tps;
+    struct gputop_perf_tracepoint **tps;
+    struct gputop_tracepoint_pos *positions;
+
+    struct gputop_perf_tracepoint_data data; /* current sample */
 };
 
 struct gputop_process_info {
@@ -212,9 +313,21 @@ struct gputop_client_context;
 typedef void (*gputop_accumulate_cb)(struct gputop_client_context *ctx,
                                      struct gputop_hw_context *context);
 
+/* Counter values accumulated by the server, hw_id is
+ * GPUTOP_OA_INVALID_CTX_ID for the values accumulated across all contexts.
+ */
+typedef void (*gputop_aggregate_cb)(struct gputop_client_context *ctx,
+                                    uint32_t hw_id,
+                                    uint64_t timestamp_start,
+                                    uint64_t timestamp_end,
+                                    const double *values);
+
 struct gputop_client_context {
     gputop_connection_t *connection;
 
+    /* Records everything sent & received, see gputop-capture.h */
+    struct gputop_capture_writer *capture;
+
     struct list_head streams;
 
     bool is_sampling;
@@ -241,30 +354,46 @@ struct gputop_client_context {
     struct gputop_i915_perf_chunk *last_chunk;
     const struct drm_i915_perf_record_header *last_header;
     struct gputop_stream oa_stream;
+    struct gputop_flow_control oa_flow_control; /* RW */
+    bool oa_compressed_frames; /* RW (when not sampling), if the server supports it */
 
     struct list_head free_samples;
     struct list_head i915_perf_chunks;
+    struct list_head free_i915_perf_chunks;
+    uint32_t n_free_i915_perf_chunks;
 
     uint64_t last_oa_timestamp;
 
     /**/
     struct gputop_accumulated_samples *current_graph_samples;
-    struct list_head graphs;
-    int n_graphs;
+    struct gputop_samples_ring graphs;
     float oa_visible_timeline_s; /* RW */
     uint64_t oa_aggregation_period_ns; /* RW (when not sampling) */
     uint64_t oa_sampling_period_ns; /* RW (when not sampling), always <= oa_aggregation_period_ns */
+    uint32_t oa_recorder_seconds; /* RW (when not sampling), 0 = live samples */
 
     gputop_accumulate_cb accumulate_cb; /* RW */
 
+    /* When non empty, the server accumulates the reports itself and only
+     * sends the values of these counters once per aggregation period. They
+     * are given to aggregate_cb in the same order, the graphs and timelines
+     * are left empty. */
+    const struct gputop_metric_set_counter **oa_server_counters; /* RW (when not sampling) */
+    int n_oa_server_counters; /* RW (when not sampling) */
+    bool oa_server_per_hw_context; /* RW (when not sampling) */
+    gputop_aggregate_cb aggregate_cb; /* RW */
+
     bool warn_report_loss; /* RW */
 
     /**/
     struct gputop_accumulated_samples *current_timeline_samples;
-    struct list_head timelines;
-    int n_timelines;
+    struct gputop_samples_ring timelines;
     uint32_t last_hw_id;
 
+    /* Deltas of all the reports over the timeline, see
+     * gputop_client_context_accumulate_range() */
+    struct gputop_oa_prefix_index oa_index;
+
     struct hash_table *hw_contexts_table;
     struct list_head hw_contexts;
 
@@ -273,7 +402,6 @@ struct gputop_client_context {
     struct hash_table *perf_tracepoints_name_table;
     struct hash_table *perf_tracepoints_stream_table;
     struct list_head perf_tracepoints;
-    struct list_head perf_tracepoints_data;
 
     /**/
     struct hash_table *perf_events_stream_table;
@@ -313,14 +441,35 @@ void gputop_client_context_reset(struct gputop_client_context *ctx,
 void gputop_client_context_handle_data(struct gputop_client_context *ctx,
                                        const void *payload, size_t payload_len);
 
+/* Zero copy variant of gputop_client_context_handle_data(), messages are
+ * received into memory from gputop_client_context_alloc_message() and
+ * handle_message() takes ownership of it. Memory of messages that are never
+ * handled must be given back with release_message().
+ */
+void *gputop_client_context_alloc_message(struct gputop_client_context *ctx,
+                                          size_t len);
+void gputop_client_context_release_message(struct gputop_client_context *ctx,
+                                           void *msg);
+void gputop_client_context_handle_message(struct gputop_client_context *ctx,
+                                          void *msg, size_t len);
+
 void gputop_client_context_update_cpu_stream(struct gputop_client_context *ctx,
                                              int sampling_period_ms);
 
 void gputop_client_context_stop_sampling(struct gputop_client_context *ctx);
 void gputop_client_context_start_sampling(struct gputop_client_context *ctx);
+void gputop_client_context_dump_recorder(struct gputop_client_context *ctx,
+                                         uint32_t duration_ms);
 
 void gputop_client_context_clear_logs(struct gputop_client_context *ctx);
 
+/* Start recording before connecting so the capture includes the Features
+ * message needed to replay it.
+ */
+bool gputop_client_context_start_capture(struct gputop_client_context *ctx,
+                                         const char *path);
+void gputop_client_context_stop_capture(struct gputop_client_context *ctx);
+
 const struct gputop_metric_set *
 gputop_client_context_uuid_to_metric_set(struct gputop_client_context *ctx,
                                          const char *uuid);
@@ -339,10 +488,38 @@ void gputop_client_context_print_tracepoint_data(struct gputop_client_context *c
                                                  struct gputop_perf_tracepoint_data *data,
                                                  bool include_name);
 
+/* Time of the most recent sample of any tracepoint, 0 if there's none */
+uint64_t gputop_client_context_tracepoints_end_time(struct gputop_client_context *ctx);
+
+void gputop_client_context_tracepoint_iterator_init(struct gputop_client_context *ctx,
+                                                    struct gputop_perf_tracepoint_iterator *iter,
+                                                    uint64_t start, uint64_t end);
+bool gputop_client_context_tracepoint_iterator_next(struct gputop_perf_tracepoint_iterator *iter);
+void gputop_client_context_tracepoint_iterator_fini(struct gputop_perf_tracepoint_iterator *iter);
+
+/* Fills data with the sample of a tracepoint at pos, false if pos isn't
+ * valid (e.g. to look at the previous/next samples) */
+bool gputop_client_context_tracepoint_data(struct gputop_perf_tracepoint *tp,
+                                           struct gputop_tracepoint_pos pos,
+                                           struct gputop_perf_tracepoint_data *data);
+
+/* Accumulates the deltas of the reports within [start_time, end_time] on
+ * the timeline, either of a hw context or of the whole GPU (NULL context),
+ * in O(log n). Returns false if there are no reports in the range. */
+bool gputop_client_context_accumulate_range(struct gputop_client_context *ctx,
+                                            const struct gputop_hw_context *context,
+                                            uint64_t start_time, uint64_t end_time,
+                                            struct gputop_cc_oa_accumulator *accumulator);
+
 double gputop_client_context_read_counter_value(struct gputop_client_context *ctx,
-                                                struct gputop_accumulated_samples *sample,
+                                                uint64_t *deltas,
                                                 const struct gputop_metric_set_counter *counter);
 
+/* NULL until a context creation tracepoint reports the hw_id */
+struct gputop_process_info *
+gputop_client_context_hw_id_to_process(struct gputop_client_context *ctx,
+                                       uint32_t hw_id);
+
 uint64_t gputop_client_context_convert_gt_timestamp(struct gputop_client_context *ctx,
                                                     uint32_t gt_timestamp);
 
@@ -351,6 +528,9 @@ double gputop_client_context_calc_busyness(struct gputop_client_context *ctx);
 void gputop_accumulated_samples_print(struct gputop_client_context *ctx,
                                       struct gputop_accumulated_samples *sample);
 
+void gputop_samples_ring_get(const struct gputop_samples_ring *ring, uint32_t idx,
+                             struct gputop_accumulated_samples *sample);
+
 /* Iterator for reports accumulated into gputop_accumulated_samples. */
 struct gputop_record_iterator {
     const struct gputop_accumulated_samples *sample;
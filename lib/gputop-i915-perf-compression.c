@@ -0,0 +1,238 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "gputop-i915-perf-compression.h"
+#include "gputop-oa-counters.h"
+
+/* Largest record the encoder deltas lanes for, OA reports with both
+ * timestamps fit. */
+#define MAX_SAMPLE_LANES (64 + 4)
+
+static inline uint8_t *
+write_varint(uint8_t *out, uint32_t value)
+{
+    while (value >= 0x80) {
+        *(out++) = value | 0x80;
+        value >>= 7;
+    }
+    *(out++) = value;
+
+    return out;
+}
+
+static inline const uint8_t *
+read_varint(const uint8_t *in, const uint8_t *end, uint32_t *value)
+{
+    uint32_t v = 0;
+    int shift;
+
+    for (shift = 0; shift < 35 && in < end; shift += 7) {
+        uint8_t byte = *(in++);
+
+        v |= (uint32_t) (byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            *value = v;
+            return in;
+        }
+    }
+
+    return NULL;
+}
+
+static inline uint32_t
+zigzag_encode(int32_t value)
+{
+    return ((uint32_t) value << 1) ^ (uint32_t) (value >> 31);
+}
+
+static inline int32_t
+zigzag_decode(uint32_t value)
+{
+    return (int32_t) (value >> 1) ^ -(int32_t) (value & 1);
+}
+
+size_t
+gputop_i915_perf_compress(const uint8_t *records, size_t len, uint8_t *out)
+{
+    const uint8_t *p = records;
+    const uint8_t *end = records + len;
+    uint8_t *o = out + GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE;
+    uint32_t prev[MAX_SAMPLE_LANES] = { 0 };
+    uint32_t prev_delta[MAX_SAMPLE_LANES] = { 0 };
+    uint32_t prev_lanes = 0;
+    uint32_t header[2];
+
+    while (p + sizeof(struct drm_i915_perf_record_header) <= end) {
+        const struct drm_i915_perf_record_header *record = (const void *) p;
+        const uint8_t *body = p + sizeof(*record);
+        uint32_t body_len = record->size - sizeof(*record);
+
+        /* i915 perf records are always made of 32bit words */
+        if (record->size < sizeof(*record) || (record->size % 4) ||
+            p + record->size > end)
+            break;
+
+        o = write_varint(o, record->type);
+        o = write_varint(o, record->size);
+
+        if (record->type == DRM_I915_PERF_RECORD_SAMPLE &&
+            body_len / 4 <= MAX_SAMPLE_LANES) {
+            const uint32_t *lanes = (const uint32_t *) body;
+            uint32_t n_lanes = body_len / 4;
+
+            if (n_lanes != prev_lanes) {
+                memset(prev, 0, sizeof(prev));
+                memset(prev_delta, 0, sizeof(prev_delta));
+                prev_lanes = n_lanes;
+            }
+            for (uint32_t i = 0; i < n_lanes; i++) {
+                uint32_t delta = lanes[i] - prev[i];
+
+                o = write_varint(o, zigzag_encode((int32_t) (delta - prev_delta[i])));
+                prev[i] = lanes[i];
+                prev_delta[i] = delta;
+            }
+        } else {
+            memcpy(o, body, body_len);
+            o += body_len;
+        }
+
+        p += record->size;
+    }
+
+    header[0] = p - records;
+    header[1] = o - out - GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE;
+    memcpy(out, header, sizeof(header));
+
+    return o - out;
+}
+
+size_t
+gputop_i915_perf_decompressed_size(const uint8_t *data, size_t len)
+{
+    const uint8_t *end = data + len;
+    size_t total = 0;
+
+    while (data < end) {
+        uint32_t header[2];
+
+        if (end - data < GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE)
+            return 0;
+        memcpy(header, data, sizeof(header));
+        data += GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE;
+        if (header[1] > end - data)
+            return 0;
+
+        data += header[1];
+        total += header[0];
+    }
+
+    return total;
+}
+
+static bool
+decompress_frame(const uint8_t *in, const uint8_t *end,
+                 uint8_t *out, const uint8_t *out_end)
+{
+    uint32_t prev[MAX_SAMPLE_LANES] = { 0 };
+    uint32_t prev_delta[MAX_SAMPLE_LANES] = { 0 };
+    uint32_t prev_lanes = 0;
+
+    while (in < end) {
+        struct drm_i915_perf_record_header *record = (void *) out;
+        uint32_t type, size, body_len;
+
+        if (!(in = read_varint(in, end, &type)) ||
+            !(in = read_varint(in, end, &size)))
+            return false;
+        if (size < sizeof(*record) || (size % 4) || size > UINT16_MAX ||
+            size > out_end - out)
+            return false;
+
+        record->type = type;
+        record->pad = 0;
+        record->size = size;
+        out += sizeof(*record);
+        body_len = size - sizeof(*record);
+
+        if (type == DRM_I915_PERF_RECORD_SAMPLE &&
+            body_len / 4 <= MAX_SAMPLE_LANES) {
+            uint32_t *lanes = (uint32_t *) out;
+            uint32_t n_lanes = body_len / 4;
+
+            if (n_lanes != prev_lanes) {
+                memset(prev, 0, sizeof(prev));
+                memset(prev_delta, 0, sizeof(prev_delta));
+                prev_lanes = n_lanes;
+            }
+            for (uint32_t i = 0; i < n_lanes; i++) {
+                uint32_t residual;
+
+                if (!(in = read_varint(in, end, &residual)))
+                    return false;
+                prev_delta[i] += (uint32_t) zigzag_decode(residual);
+                prev[i] += prev_delta[i];
+                lanes[i] = prev[i];
+            }
+        } else {
+            if (body_len > end - in)
+                return false;
+            memcpy(out, in, body_len);
+            in += body_len;
+        }
+
+        out += body_len;
+    }
+
+    return out == out_end;
+}
+
+bool
+gputop_i915_perf_decompress(const uint8_t *data, size_t len,
+                            uint8_t *out, size_t out_len)
+{
+    const uint8_t *end = data + len;
+    const uint8_t *out_end = out + out_len;
+
+    while (data < end) {
+        uint32_t header[2];
+
+        if (end - data < GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE)
+            return false;
+        memcpy(header, data, sizeof(header));
+        data += GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE;
+        if (header[1] > end - data || header[0] > out_end - out)
+            return false;
+
+        if (!decompress_frame(data, data + header[1], out, out + header[0]))
+            return false;
+
+        data += header[1];
+        out += header[0];
+    }
+
+    return true;
+}
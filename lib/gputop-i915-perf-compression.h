@@ -0,0 +1,83 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Compressed encoding of i915 perf records, used on the wire for OA frames.
+ *
+ * Consecutive OA reports only differ slightly and counters mostly increase
+ * at a steady rate, so each 32bit lane of a sample is delta encoded against
+ * the same lane of the previous sample, and the zigzag varint of how much
+ * that delta differs from the previous one is sent. Frames are encoded
+ * independently so that the server can still drop or decimate them per
+ * client :
+ *
+ *   uint32_t decoded_len
+ *   uint32_t encoded_len (of the records that follow)
+ *   for each record :
+ *     varint type
+ *     varint size
+ *     samples : (size - 8) / 4 zigzag varint lane residuals
+ *     others  : (size - 8) raw bytes
+ *
+ * A message can carry several frames back to back.
+ */
+
+#define GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE 8
+
+/* Worst case size of the encoding of len bytes of records */
+static inline size_t
+gputop_i915_perf_compress_bound(size_t len)
+{
+    return GPUTOP_I915_PERF_COMPRESSED_FRAME_HEADER_SIZE + len + len / 4 + 16;
+}
+
+/* Encodes the records into one frame, out must be at least
+ * gputop_i915_perf_compress_bound(len) bytes. Returns the size of the
+ * frame.
+ */
+size_t gputop_i915_perf_compress(const uint8_t *records, size_t len,
+                                 uint8_t *out);
+
+/* Size of the records carried by a sequence of frames, 0 if malformed */
+size_t gputop_i915_perf_decompressed_size(const uint8_t *data, size_t len);
+
+/* Decodes a sequence of frames, returns false if malformed or if the
+ * records don't fit in out_len bytes.
+ */
+bool gputop_i915_perf_decompress(const uint8_t *data, size_t len,
+                                 uint8_t *out, size_t out_len);
+
+#ifdef __cplusplus
+}
+#endif
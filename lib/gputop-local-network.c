@@ -0,0 +1,383 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Implementation of gputop-network.h for clients running on the same host
+ * as the server, see gputop-local.h. The host is either the path of the
+ * server's local socket or anything else to use the default socket for
+ * the given port.
+ *
+ * Messages are handed to the data callback straight from the ring shared
+ * with the server, so they are only valid for the duration of the
+ * callback.
+ */
+
+#include "gputop-network.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+
+#include <uv.h>
+
+#include "gputop-local.h"
+
+struct _gputop_connection_t {
+    bool open;
+    bool closing;
+
+    int socket_fd;
+    int event_fd;
+    struct gputop_local_ring *ring;
+
+    uv_poll_t socket_poll;
+    uv_poll_t event_poll;
+    uv_timer_t error_timer;
+    const char *error;
+    int n_handles;
+
+    gputop_on_ready_cb_t ready_cb;
+    gputop_on_data_cb_t data_cb;
+    gputop_on_close_cb_t close_cb;
+    void *user_data;
+
+    gputop_msg_alloc_cb_t msg_alloc_cb;
+    gputop_msg_release_cb_t msg_release_cb;
+    gputop_on_msg_cb_t msg_cb;
+};
+
+static void
+on_close_cb(uv_handle_t *handle)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) handle->data;
+
+    if (--conn->n_handles)
+        return;
+
+    if (conn->ring)
+        munmap(conn->ring, GPUTOP_LOCAL_DATA_OFFSET + conn->ring->size);
+    if (conn->event_fd >= 0)
+        close(conn->event_fd);
+    if (conn->socket_fd >= 0)
+        close(conn->socket_fd);
+    free(conn);
+}
+
+static void
+local_close_handle(gputop_connection_t *conn, uv_handle_t *handle)
+{
+    conn->n_handles++;
+    uv_close(handle, on_close_cb);
+}
+
+static void
+local_end(gputop_connection_t *conn, const char *error)
+{
+    if (conn->closing)
+        return;
+
+    conn->closing = true;
+    conn->open = false;
+    conn->close_cb(conn, error, conn->user_data);
+
+    local_close_handle(conn, (uv_handle_t *) &conn->error_timer);
+    if (conn->socket_fd >= 0)
+        local_close_handle(conn, (uv_handle_t *) &conn->socket_poll);
+    if (conn->ring)
+        local_close_handle(conn, (uv_handle_t *) &conn->event_poll);
+}
+
+static void
+on_error_timer_cb(uv_timer_t *timer)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) timer->data;
+
+    local_end(conn, conn->error);
+}
+
+/* Errors are reported from the main loop, as for a network connection */
+static void
+local_fail(gputop_connection_t *conn, const char *error)
+{
+    conn->error = error;
+    uv_timer_start(&conn->error_timer, on_error_timer_cb, 0, 0);
+}
+
+static bool
+write_all(int fd, struct iovec *iov, int n_iov)
+{
+    while (n_iov) {
+        struct msghdr msg;
+        ssize_t ret;
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = n_iov;
+
+        /* NB: a closed connection is reported by the poll, not SIGPIPE */
+        ret = sendmsg(fd, &msg, MSG_NOSIGNAL);
+
+        if (ret < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+
+        while (n_iov && (size_t) ret >= iov->iov_len) {
+            ret -= iov->iov_len;
+            iov++;
+            n_iov--;
+        }
+        if (n_iov) {
+            iov->iov_base = (uint8_t *) iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    return true;
+}
+
+static void
+send_request(gputop_connection_t *conn, const void *data, uint32_t len)
+{
+    struct iovec iov[2] = {
+        { &len, sizeof(len) },
+        { (void *) data, len },
+    };
+
+    if (!write_all(conn->socket_fd, iov, len ? 2 : 1))
+        local_fail(conn, strerror(errno));
+}
+
+static void
+deliver(gputop_connection_t *conn, const uint8_t *data, uint32_t len)
+{
+    /* i915 perf reports outlive the callback, so a pool is worth a copy */
+    if (conn->msg_cb && data[0] == 3) {
+        void *msg = conn->msg_alloc_cb(len, conn->user_data);
+
+        memcpy(msg, data, len);
+        conn->msg_cb(conn, msg, len, conn->user_data);
+    } else
+        conn->data_cb(conn, data, len, conn->user_data);
+}
+
+static void
+on_event_cb(uv_poll_t *poll, int status, int events)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) poll->data;
+    const uint8_t *data;
+    uint64_t count;
+    uint32_t len;
+
+    if (read(conn->event_fd, &count, sizeof(count)) < 0 && errno != EAGAIN) {
+        local_end(conn, strerror(errno));
+        return;
+    }
+
+    while (conn->open && (data = gputop_local_ring_peek(conn->ring, &len))) {
+        deliver(conn, data, len);
+
+        /* Let a blocked server know there's room again */
+        if (gputop_local_ring_release(conn->ring, len) && conn->open)
+            send_request(conn, NULL, 0);
+    }
+}
+
+static const char *
+receive_hello(gputop_connection_t *conn)
+{
+    struct gputop_local_hello hello;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    void *map;
+    ssize_t ret;
+    int ring_fd;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.buf;
+    msg.msg_controllen = sizeof(control.buf);
+
+    while ((ret = recvmsg(conn->socket_fd, &msg, MSG_CMSG_CLOEXEC)) < 0 &&
+           errno == EINTR)
+        ;
+    if (ret < 0)
+        return strerror(errno);
+    if (ret == 0)
+        return "Server closed the local connection";
+
+    cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret != sizeof(hello) || !cmsg ||
+        cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS ||
+        cmsg->cmsg_len != CMSG_LEN(2 * sizeof(int)))
+        return "Unexpected reply from the server's local socket";
+
+    ring_fd = ((int *) CMSG_DATA(cmsg))[0];
+    conn->event_fd = ((int *) CMSG_DATA(cmsg))[1];
+
+    if (memcmp(hello.magic, GPUTOP_LOCAL_MAGIC, sizeof(hello.magic)) != 0 ||
+        hello.version != GPUTOP_LOCAL_VERSION) {
+        close(ring_fd);
+        return "Incompatible server local transport";
+    }
+
+    map = mmap(NULL, GPUTOP_LOCAL_DATA_OFFSET + hello.ring_size,
+               PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    close(ring_fd);
+    if (map == MAP_FAILED)
+        return strerror(errno);
+    conn->ring = (struct gputop_local_ring *) map;
+
+    uv_poll_init(uv_default_loop(), &conn->event_poll, conn->event_fd);
+    conn->event_poll.data = conn;
+    uv_poll_start(&conn->event_poll, UV_READABLE, on_event_cb);
+
+    return NULL;
+}
+
+static void
+on_socket_cb(uv_poll_t *poll, int status, int events)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) poll->data;
+    const char *error;
+    char c;
+
+    if (!conn->ring) {
+        error = receive_hello(conn);
+        if (error) {
+            local_end(conn, error);
+            return;
+        }
+
+        conn->open = true;
+        conn->ready_cb(conn, conn->user_data);
+        return;
+    }
+
+    /* The server never writes to the socket after the hello, so this
+     * is it closing the connection */
+    if (recv(conn->socket_fd, &c, 1, MSG_DONTWAIT) < 0 && errno == EAGAIN)
+        return;
+
+    local_end(conn, NULL);
+}
+
+gputop_connection_t *
+gputop_connect(const char *host, int port,
+               gputop_on_ready_cb_t ready_cb,
+               gputop_on_data_cb_t data_cb,
+               gputop_on_close_cb_t close_cb,
+               void *user_data)
+{
+    gputop_connection_t *conn =
+        (gputop_connection_t *) calloc(1, sizeof(gputop_connection_t));
+    struct sockaddr_un addr;
+
+    conn->ready_cb = ready_cb;
+    conn->data_cb = data_cb;
+    conn->close_cb = close_cb;
+    conn->user_data = user_data;
+    conn->event_fd = -1;
+
+    uv_timer_init(uv_default_loop(), &conn->error_timer);
+    conn->error_timer.data = conn;
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (host && host[0] == '/')
+        snprintf(addr.sun_path, sizeof(addr.sun_path), "%s", host);
+    else
+        gputop_local_socket_path(port, addr.sun_path, sizeof(addr.sun_path));
+
+    /* NB: the socket stays blocking for sending requests, connecting to a
+     * local socket never waits */
+    conn->socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (conn->socket_fd < 0 ||
+        connect(conn->socket_fd, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        if (conn->socket_fd >= 0) {
+            close(conn->socket_fd);
+            conn->socket_fd = -1;
+        }
+        local_fail(conn, strerror(errno));
+        return conn;
+    }
+
+    uv_poll_init(uv_default_loop(), &conn->socket_poll, conn->socket_fd);
+    conn->socket_poll.data = conn;
+    uv_poll_start(&conn->socket_poll, UV_READABLE | UV_DISCONNECT, on_socket_cb);
+
+    return conn;
+}
+
+void
+gputop_connection_set_msg_pool(gputop_connection_t *conn,
+                               gputop_msg_alloc_cb_t alloc_cb,
+                               gputop_msg_release_cb_t release_cb,
+                               gputop_on_msg_cb_t msg_cb)
+{
+    assert(conn != NULL);
+
+    conn->msg_alloc_cb = alloc_cb;
+    conn->msg_release_cb = release_cb;
+    conn->msg_cb = msg_cb;
+}
+
+void
+gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
+{
+    assert(conn != NULL);
+    assert(gputop_connection_connected(conn));
+    assert(data != NULL && len > 0);
+
+    send_request(conn, data, len);
+}
+
+void
+gputop_connection_close(gputop_connection_t *conn)
+{
+    assert(conn != NULL);
+
+    local_end(conn, NULL);
+}
+
+bool
+gputop_connection_connected(gputop_connection_t *conn)
+{
+    assert(conn != NULL);
+
+    return conn->open;
+}
@@ -0,0 +1,274 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#ifndef __GPUTOP_LOCAL_H__
+#define __GPUTOP_LOCAL_H__
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util/macros.h"
+
+/* NB: this is shared by the server and C++ clients so it can't use the
+ * server's portable stdatomic.h, the __atomic builtins work for both.
+ */
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Same-host transport, as an alternative to the websocket.
+ *
+ * A client connects to the server's unix socket and is sent two file
+ * descriptors: a memfd holding a ring of messages written by the server
+ * and an eventfd signalled when new messages are written. Messages are
+ * the same as over the websocket (8 byte header + payload) and are always
+ * contiguous within the ring so that the client can parse them in place.
+ *
+ * Requests from the client are sent over the socket, each prefixed by its
+ * 32bit length. An empty request lets the server know the client has
+ * made room in a ring that was full.
+ */
+
+#define GPUTOP_LOCAL_MAGIC          "GPUTOPLC"
+#define GPUTOP_LOCAL_VERSION        1
+
+#define GPUTOP_LOCAL_SOCKET_ENV     "GPUTOP_LOCAL_SOCKET"
+#define GPUTOP_LOCAL_RING_SIZE      (64 * 1024 * 1024)
+
+/* The ring's data starts on its own page */
+#define GPUTOP_LOCAL_DATA_OFFSET    4096
+
+/* Length of a message header that marks the rest of the ring as unused */
+#define GPUTOP_LOCAL_WRAP           UINT32_MAX
+
+struct gputop_local_hello {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t ring_size; /* size of the data, power of two */
+};
+
+struct gputop_local_ring {
+    char magic[8];
+    uint32_t version;
+    uint32_t pad;
+    uint64_t size;
+
+    /* Byte positions that only ever increase, on their own cachelines */
+    uint64_t head __attribute__((aligned(64))); /* written by the server */
+    uint64_t tail __attribute__((aligned(64))); /* written by the client */
+
+    /* Set by the server if a message didn't fit */
+    uint32_t producer_blocked __attribute__((aligned(64)));
+};
+
+struct gputop_local_msg_header {
+    uint32_t len;
+    uint32_t pad;
+};
+
+#define GPUTOP_LOCAL_ALIGN(len) (((len) + 7) & ~(uint64_t) 7)
+
+static inline uint8_t *
+gputop_local_ring_data(struct gputop_local_ring *ring)
+{
+    return (uint8_t *) ring + GPUTOP_LOCAL_DATA_OFFSET;
+}
+
+/* Default socket path for a server port, or $GPUTOP_LOCAL_SOCKET */
+static inline void
+gputop_local_socket_path(int port, char *path, size_t len)
+{
+    const char *env = getenv(GPUTOP_LOCAL_SOCKET_ENV);
+
+    if (env)
+        snprintf(path, len, "%s", env);
+    else
+        snprintf(path, len, "/tmp/gputop-%d.sock", port);
+}
+
+/* The server's own view of a ring. The client can write to the whole
+ * mapping so the producer keeps the size and head to itself and only ever
+ * reads back the tail, which it checks.
+ */
+struct gputop_local_producer {
+    struct gputop_local_ring *ring;
+    uint64_t size;
+    uint64_t head;
+
+    /* The client moved the tail somewhere impossible */
+    bool broken;
+};
+
+static inline void
+gputop_local_producer_init(struct gputop_local_producer *producer,
+                           struct gputop_local_ring *ring, uint64_t size)
+{
+    producer->ring = ring;
+    producer->size = size;
+    producer->head = 0;
+    producer->broken = false;
+
+    memcpy(ring->magic, GPUTOP_LOCAL_MAGIC, sizeof(ring->magic));
+    ring->version = GPUTOP_LOCAL_VERSION;
+    ring->size = size;
+}
+
+static inline uint8_t *
+gputop_local_ring_try_reserve(struct gputop_local_producer *producer,
+                              uint32_t min_len, uint32_t max_len, uint32_t *len)
+{
+    struct gputop_local_ring *ring = producer->ring;
+    uint64_t size = producer->size;
+    uint64_t head = producer->head;
+    uint64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_SEQ_CST);
+    uint64_t offset = head & (size - 1);
+    uint64_t needed = sizeof(struct gputop_local_msg_header) +
+        GPUTOP_LOCAL_ALIGN(min_len);
+    uint64_t space, contiguous = size - offset;
+
+    /* NB: also catches a tail ahead of the head */
+    if (head - tail > size) {
+        producer->broken = true;
+        return NULL;
+    }
+    space = size - (head - tail);
+
+    /* Wrap if the message can't fit before the end of the ring, even if
+     * that leaves less room overall */
+    if (contiguous < needed) {
+        if (space < contiguous + needed)
+            return NULL;
+
+        ((struct gputop_local_msg_header *)
+         (gputop_local_ring_data(ring) + offset))->len = GPUTOP_LOCAL_WRAP;
+        head += contiguous;
+        space -= contiguous;
+        offset = 0;
+        contiguous = size;
+        producer->head = head;
+        __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    }
+
+    if (space < needed)
+        return NULL;
+
+    *len = MIN2(MIN2(space, contiguous) - sizeof(struct gputop_local_msg_header),
+                max_len);
+    return gputop_local_ring_data(ring) + offset +
+        sizeof(struct gputop_local_msg_header);
+}
+
+/* Producer side. Returns where up to max_len bytes of a message can be
+ * written contiguously, with *len set to how much room there is, or NULL
+ * if there's less than min_len available. In that case the client will
+ * let us know once it has made some room, unless producer->broken got set
+ * in which case the client can't be trusted anymore.
+ */
+static inline uint8_t *
+gputop_local_ring_reserve(struct gputop_local_producer *producer,
+                          uint32_t min_len, uint32_t max_len, uint32_t *len)
+{
+    uint8_t *ptr;
+
+    assert(sizeof(struct gputop_local_msg_header) +
+           GPUTOP_LOCAL_ALIGN(max_len) <= producer->size / 2);
+
+    ptr = gputop_local_ring_try_reserve(producer, min_len, max_len, len);
+    if (ptr || producer->broken)
+        return ptr;
+
+    /* Check again after raising the flag in case the client made room
+     * before it could have seen it */
+    __atomic_store_n(&producer->ring->producer_blocked, 1, __ATOMIC_SEQ_CST);
+
+    return gputop_local_ring_try_reserve(producer, min_len, max_len, len);
+}
+
+/* Publishes a message of len bytes written where reserve() pointed */
+static inline void
+gputop_local_ring_commit(struct gputop_local_producer *producer, uint32_t len)
+{
+    uint64_t head = producer->head;
+    struct gputop_local_msg_header *header = (struct gputop_local_msg_header *)
+        (gputop_local_ring_data(producer->ring) + (head & (producer->size - 1)));
+
+    header->len = len;
+    producer->head = head + sizeof(*header) + GPUTOP_LOCAL_ALIGN(len);
+    __atomic_store_n(&producer->ring->head, producer->head, __ATOMIC_RELEASE);
+}
+
+/* Consumer side. Returns the next message, in place, or NULL. The message
+ * stays valid until it's released with gputop_local_ring_release().
+ */
+static inline const uint8_t *
+gputop_local_ring_peek(struct gputop_local_ring *ring, uint32_t *len)
+{
+    uint64_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    uint64_t tail = ring->tail;
+
+    while (tail != head) {
+        uint64_t offset = tail & (ring->size - 1);
+        const struct gputop_local_msg_header *header =
+            (const struct gputop_local_msg_header *)
+            (gputop_local_ring_data(ring) + offset);
+
+        if (header->len != GPUTOP_LOCAL_WRAP) {
+            *len = header->len;
+            return (const uint8_t *) (header + 1);
+        }
+
+        tail += ring->size - offset;
+        __atomic_store_n(&ring->tail, tail, __ATOMIC_RELEASE);
+    }
+
+    return NULL;
+}
+
+/* Gives the space of the message returned by peek() back to the server,
+ * returning whether the server is waiting for room.
+ */
+static inline bool
+gputop_local_ring_release(struct gputop_local_ring *ring, uint32_t len)
+{
+    __atomic_store_n(&ring->tail,
+                     ring->tail + sizeof(struct gputop_local_msg_header) +
+                     GPUTOP_LOCAL_ALIGN(len),
+                     __ATOMIC_SEQ_CST);
+
+    return __atomic_load_n(&ring->producer_blocked, __ATOMIC_SEQ_CST) &&
+        __atomic_exchange_n(&ring->producer_blocked, 0, __ATOMIC_SEQ_CST);
+}
+
+#ifdef __cplusplus
+} /* extern "C" */
+#endif
+
+#endif /* __GPUTOP_LOCAL_H__ */
@@ -51,6 +51,25 @@ gputop_connection_t *gputop_connect(const char *host, int port,
                                     gputop_on_close_cb_t close_cb,
                                     void *user_data);
 
+/* Optional zero copy receive path. Once set, incoming messages are
+ * assembled directly into memory obtained from alloc_cb and the ownership of
+ * that memory is handed over to msg_cb instead of calling the data callback.
+ * Memory of messages that never complete is given back through release_cb.
+ *
+ * Embedders that can't assemble messages in place can ignore this and keep
+ * calling the data callback.
+ */
+typedef void *(*gputop_msg_alloc_cb_t)(size_t len, void *user_data);
+typedef void (*gputop_msg_release_cb_t)(void *msg, void *user_data);
+typedef void (*gputop_on_msg_cb_t)(gputop_connection_t *conn,
+                                   void *msg, size_t len,
+                                   void *user_data);
+
+void gputop_connection_set_msg_pool(gputop_connection_t *conn,
+                                    gputop_msg_alloc_cb_t alloc_cb,
+                                    gputop_msg_release_cb_t release_cb,
+                                    gputop_on_msg_cb_t msg_cb);
+
 void gputop_connection_send(gputop_connection_t *conn,
                             const void *data, size_t len);
 
@@ -0,0 +1,216 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-oa-aggregator.h"
+
+void
+gputop_oa_aggregator_init(struct gputop_oa_aggregator *aggregator,
+                          const struct gputop_devinfo *devinfo,
+                          const struct gputop_metric_set *metric_set,
+                          const struct gputop_i915_perf_configuration *config,
+                          uint64_t period_ns,
+                          bool per_hw_context)
+{
+    assert(metric_set->perf_raw_size <= sizeof(aggregator->last_report));
+
+    memset(aggregator, 0, sizeof(*aggregator));
+
+    aggregator->devinfo = devinfo;
+    aggregator->metric_set = metric_set;
+    aggregator->config = *config;
+    aggregator->period_ns = period_ns;
+    aggregator->per_hw_context = per_hw_context;
+    aggregator->last_hw_id = GPUTOP_OA_INVALID_CTX_ID;
+
+    gputop_cc_oa_accumulator_init(&aggregator->accumulator, devinfo,
+                                  metric_set, period_ns, NULL);
+    list_inithead(&aggregator->contexts);
+}
+
+static void
+free_contexts(struct gputop_oa_aggregator *aggregator)
+{
+    list_for_each_entry_safe(struct gputop_oa_aggregator_context, context,
+                             &aggregator->contexts, link) {
+        list_del(&context->link);
+        free(context);
+    }
+}
+
+void
+gputop_oa_aggregator_fini(struct gputop_oa_aggregator *aggregator)
+{
+    free_contexts(aggregator);
+    free(aggregator->counters);
+    aggregator->counters = NULL;
+    aggregator->n_counters = 0;
+}
+
+bool
+gputop_oa_aggregator_select_counters(struct gputop_oa_aggregator *aggregator,
+                                     char **symbol_names,
+                                     int n_symbol_names)
+{
+    const struct gputop_metric_set *metric_set = aggregator->metric_set;
+    int n_counters = n_symbol_names ? n_symbol_names : metric_set->n_counters;
+    const struct gputop_metric_set_counter **counters =
+        calloc(n_counters, sizeof(counters[0]));
+
+    for (int i = 0; i < n_counters; i++) {
+        if (!n_symbol_names) {
+            counters[i] = &metric_set->counters[i];
+            continue;
+        }
+
+        for (int j = 0; j < metric_set->n_counters; j++) {
+            if (!strcmp(metric_set->counters[j].symbol_name, symbol_names[i])) {
+                counters[i] = &metric_set->counters[j];
+                break;
+            }
+        }
+
+        if (!counters[i]) {
+            free(counters);
+            return false;
+        }
+    }
+
+    free(aggregator->counters);
+    aggregator->counters = counters;
+    aggregator->n_counters = n_counters;
+
+    return true;
+}
+
+static struct gputop_oa_aggregator_context *
+get_context(struct gputop_oa_aggregator *aggregator, uint32_t hw_id)
+{
+    struct gputop_oa_aggregator_context *context;
+
+    /* Only the few contexts running during the current period are listed */
+    list_for_each_entry(struct gputop_oa_aggregator_context, iter,
+                        &aggregator->contexts, link) {
+        if (iter->hw_id == hw_id)
+            return iter;
+    }
+
+    context = calloc(1, sizeof(*context));
+    context->hw_id = hw_id;
+    gputop_cc_oa_accumulator_init(&context->accumulator, aggregator->devinfo,
+                                  aggregator->metric_set,
+                                  aggregator->period_ns, NULL);
+    list_addtail(&context->link, &aggregator->contexts);
+
+    return context;
+}
+
+void
+gputop_oa_aggregator_process(struct gputop_oa_aggregator *aggregator,
+                             const uint8_t *data, size_t len,
+                             gputop_oa_aggregate_cb callback,
+                             void *user_data)
+{
+    const struct drm_i915_perf_record_header *header;
+    const uint8_t *end = data + len;
+    int report_size = aggregator->metric_set->perf_raw_size;
+
+    for (header = (const struct drm_i915_perf_record_header *) data;
+         (const uint8_t *) header < end;
+         header = (const struct drm_i915_perf_record_header *) (((const uint8_t *) header) + header->size))
+    {
+        struct gputop_cc_oa_accumulator *accumulator = &aggregator->accumulator;
+        struct gputop_cc_oa_deltas deltas;
+        const uint8_t *report;
+        uint32_t hw_id;
+
+        if (header->size == 0)
+            break;
+
+        if (header->type != DRM_I915_PERF_RECORD_SAMPLE)
+            continue;
+
+        report = (const uint8_t *)
+            gputop_i915_perf_record_field(&aggregator->config, header,
+                                          GPUTOP_I915_PERF_FIELD_OA_REPORT);
+        hw_id = gputop_cc_oa_report_get_ctx_id(aggregator->devinfo, report);
+
+        if (aggregator->has_last_report &&
+            gputop_cc_oa_decode_deltas(aggregator->metric_set,
+                                       aggregator->last_report, report,
+                                       &deltas)) {
+            /* The deltas belong to the context running since the
+             * previous report. */
+            if (aggregator->per_hw_context &&
+                aggregator->last_hw_id != GPUTOP_OA_INVALID_CTX_ID) {
+                struct gputop_oa_aggregator_context *context =
+                    get_context(aggregator, aggregator->last_hw_id);
+                gputop_cc_oa_accumulate_deltas(&context->accumulator, &deltas);
+            }
+
+            gputop_cc_oa_accumulate_deltas(accumulator, &deltas);
+            if ((accumulator->last_timestamp - accumulator->first_timestamp) >
+                aggregator->period_ns) {
+                callback(aggregator, user_data);
+                gputop_cc_oa_accumulator_clear(accumulator);
+                free_contexts(aggregator);
+            }
+        }
+
+        memcpy(aggregator->last_report, report, report_size);
+        aggregator->has_last_report = true;
+        aggregator->last_hw_id = hw_id;
+    }
+}
+
+void
+gputop_oa_aggregator_read(const struct gputop_oa_aggregator *aggregator,
+                          const struct gputop_cc_oa_accumulator *accumulator,
+                          double *values)
+{
+    uint64_t *deltas = (uint64_t *) accumulator->deltas;
+
+    for (int i = 0; i < aggregator->n_counters; i++) {
+        const struct gputop_metric_set_counter *counter = aggregator->counters[i];
+
+        switch (counter->data_type) {
+        case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
+        case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
+        case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
+            values[i] = counter->oa_counter_read_uint64(aggregator->devinfo,
+                                                        aggregator->metric_set,
+                                                        deltas);
+            break;
+        case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
+        case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
+            values[i] = counter->oa_counter_read_float(aggregator->devinfo,
+                                                       aggregator->metric_set,
+                                                       deltas);
+            break;
+        }
+    }
+}
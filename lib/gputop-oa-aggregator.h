@@ -0,0 +1,108 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stddef.h>
+
+#include "gputop-oa-counters.h"
+#include "util/list.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Accumulates a stream of i915 perf records the same way
+ * gputop_client_context does, but only keeps the values of a few counters
+ * for each aggregation period. This lets the server send a handful of
+ * derived values per period instead of every raw OA report.
+ */
+
+struct gputop_oa_aggregator_context {
+    uint32_t hw_id;
+    struct gputop_cc_oa_accumulator accumulator;
+
+    struct list_head link; /* gputop_oa_aggregator.contexts */
+};
+
+struct gputop_oa_aggregator;
+
+/* Called at the end of each period, before the accumulators are cleared.
+ * The accumulated values are available through aggregator->accumulator and
+ * aggregator->contexts (the contexts that ran during the period).
+ */
+typedef void (*gputop_oa_aggregate_cb)(struct gputop_oa_aggregator *aggregator,
+                                       void *user_data);
+
+struct gputop_oa_aggregator {
+    const struct gputop_devinfo *devinfo;
+    const struct gputop_metric_set *metric_set;
+    struct gputop_i915_perf_configuration config;
+    uint64_t period_ns;
+    bool per_hw_context;
+
+    const struct gputop_metric_set_counter **counters;
+    int n_counters;
+
+    struct gputop_cc_oa_accumulator accumulator;
+    struct list_head contexts;
+
+    /* Reports are paired across chunks, so the last one is kept around */
+    uint8_t last_report[256];
+    bool has_last_report;
+    uint32_t last_hw_id;
+};
+
+void gputop_oa_aggregator_init(struct gputop_oa_aggregator *aggregator,
+                               const struct gputop_devinfo *devinfo,
+                               const struct gputop_metric_set *metric_set,
+                               const struct gputop_i915_perf_configuration *config,
+                               uint64_t period_ns,
+                               bool per_hw_context);
+void gputop_oa_aggregator_fini(struct gputop_oa_aggregator *aggregator);
+
+/* Selects the counters to read at the end of each period. Returns false if
+ * one of the symbol names isn't part of the metric set. With no names all
+ * the counters of the metric set are selected.
+ */
+bool gputop_oa_aggregator_select_counters(struct gputop_oa_aggregator *aggregator,
+                                          char **symbol_names,
+                                          int n_symbol_names);
+
+void gputop_oa_aggregator_process(struct gputop_oa_aggregator *aggregator,
+                                  const uint8_t *data, size_t len,
+                                  gputop_oa_aggregate_cb callback,
+                                  void *user_data);
+
+/* Reads the selected counters out of an accumulator into values[] */
+void gputop_oa_aggregator_read(const struct gputop_oa_aggregator *aggregator,
+                               const struct gputop_cc_oa_accumulator *accumulator,
+                               double *values);
+
+#ifdef __cplusplus
+}
+#endif
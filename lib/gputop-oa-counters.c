@@ -32,6 +32,10 @@
 
 #include <string.h>
 
+#if (defined(__x86_64__) || defined(__i386__)) && !defined(EMSCRIPTEN)
+#include <immintrin.h>
+#endif
+
 #include "gputop-oa-counters.h"
 
 #ifdef GPUTOP_CLIENT
@@ -84,19 +88,17 @@ gputop_u32_clock_progress(struct gputop_u32_clock *clock,
     clock->clock_count += u32_end_timestamp - u32_start_timestamp;
 }
 
-static void
-accumulate_uint32(const uint32_t *report0,
-                  const uint32_t *report1,
-                  uint64_t *deltas)
+static inline uint64_t
+delta_uint32(const uint32_t *report0,
+             const uint32_t *report1)
 {
-   *deltas += (uint32_t)(*report1 - *report0);
+   return (uint32_t)(*report1 - *report0);
 }
 
-static void
-accumulate_uint40(int a_index,
-                  const uint32_t *report0,
-                  const uint32_t *report1,
-                  uint64_t *deltas)
+static inline uint64_t
+delta_uint40(int a_index,
+             const uint32_t *report0,
+             const uint32_t *report1)
 {
     const uint8_t *high_bytes0 = (uint8_t *)(report0 + 40);
     const uint8_t *high_bytes1 = (uint8_t *)(report1 + 40);
@@ -104,27 +106,288 @@ accumulate_uint40(int a_index,
     uint64_t high1 = (uint64_t)(high_bytes1[a_index]) << 32;
     uint64_t value0 = report0[a_index + 4] | high0;
     uint64_t value1 = report1[a_index + 4] | high1;
-    uint64_t delta;
 
     if (value0 > value1)
-       delta = (1ULL << 40) + value1 - value0;
+       return (1ULL << 40) + value1 - value0;
     else
-       delta = value1 - value0;
+       return value1 - value0;
+}
+
+/* Decoding kernels, one per report format, writing the raw deltas between
+ * two reports :
+ *
+ * I915_OA_FORMAT_A32u40_A4u32_B8_C8 : timestamp, clock, 32x 40bit A
+ * counters, 4x 32bit A counters, 8x 32bit B counters + 8x 32bit C counters
+ * (54 deltas)
+ *
+ * I915_OA_FORMAT_A45_B8_C8 : timestamp, 45x A counters, 8x B counters + 8x
+ * C counters, all 32bit (62 deltas)
+ */
+struct delta_kernels {
+    const char *name;
+    void (*a32u40_a4u32_b8_c8)(const uint32_t *start, const uint32_t *end,
+                               uint64_t *deltas);
+    void (*a45_b8_c8)(const uint32_t *start, const uint32_t *end,
+                      uint64_t *deltas);
+};
 
-    *deltas += delta;
+static void
+a32u40_a4u32_b8_c8_scalar(const uint32_t *start, const uint32_t *end,
+                          uint64_t *deltas)
+{
+    int idx = 0;
+    int i;
+
+    deltas[idx++] = delta_uint32(start + 1, end + 1); /* timestamp */
+    deltas[idx++] = delta_uint32(start + 3, end + 3); /* clock */
+
+    /* 32x 40bit A counters... */
+    for (i = 0; i < 32; i++)
+        deltas[idx++] = delta_uint40(i, start, end);
+
+    /* 4x 32bit A counters... */
+    for (i = 0; i < 4; i++)
+        deltas[idx++] = delta_uint32(start + 36 + i, end + 36 + i);
+
+    /* 8x 32bit B counters + 8x 32bit C counters... */
+    for (i = 0; i < 16; i++)
+        deltas[idx++] = delta_uint32(start + 48 + i, end + 48 + i);
+}
+
+static void
+a45_b8_c8_scalar(const uint32_t *start, const uint32_t *end,
+                 uint64_t *deltas)
+{
+    int i;
+
+    deltas[0] = delta_uint32(start + 1, end + 1); /* timestamp */
+
+    for (i = 0; i < 61; i++)
+        deltas[1 + i] = delta_uint32(start + 3 + i, end + 3 + i);
+}
+
+static const struct delta_kernels scalar_kernels = {
+    .name = "scalar",
+    .a32u40_a4u32_b8_c8 = a32u40_a4u32_b8_c8_scalar,
+    .a45_b8_c8 = a45_b8_c8_scalar,
+};
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && !defined(EMSCRIPTEN)
+#define HAVE_X86_DELTA_KERNELS
+
+/* The 40bit A counters are split between 32 low dwords at dword 4 and 32
+ * high bytes at dword 40. Both halves are widened to 64bit lanes and the
+ * wraparound is taken care of by masking the difference to 40 bits.
+ */
+
+static inline void __attribute__((target("sse4.1")))
+deltas_uint32_sse41(const uint32_t *start, const uint32_t *end,
+                    uint64_t *deltas, int n)
+{
+    int i;
+
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(end + i)),
+                                  _mm_loadu_si128((const __m128i *)(start + i)));
+
+        _mm_storeu_si128((__m128i *)(deltas + i), _mm_cvtepu32_epi64(d));
+        _mm_storeu_si128((__m128i *)(deltas + i + 2),
+                         _mm_cvtepu32_epi64(_mm_srli_si128(d, 8)));
+    }
+    for (; i < n; i++)
+        deltas[i] = delta_uint32(start + i, end + i);
+}
+
+static void __attribute__((target("sse4.1")))
+a32u40_a4u32_b8_c8_sse41(const uint32_t *start, const uint32_t *end,
+                         uint64_t *deltas)
+{
+    const uint8_t *high_bytes0 = (const uint8_t *)(start + 40);
+    const uint8_t *high_bytes1 = (const uint8_t *)(end + 40);
+    const __m128i mask = _mm_set1_epi64x((1ULL << 40) - 1);
+    int i;
+
+    deltas[0] = delta_uint32(start + 1, end + 1); /* timestamp */
+    deltas[1] = delta_uint32(start + 3, end + 3); /* clock */
+
+    for (i = 0; i < 32; i += 2) {
+        uint16_t h0, h1;
+        __m128i v0, v1;
+
+        memcpy(&h0, high_bytes0 + i, sizeof(h0));
+        memcpy(&h1, high_bytes1 + i, sizeof(h1));
+
+        v0 = _mm_or_si128(_mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(start + 4 + i))),
+                          _mm_slli_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(h0)), 32));
+        v1 = _mm_or_si128(_mm_cvtepu32_epi64(_mm_loadl_epi64((const __m128i *)(end + 4 + i))),
+                          _mm_slli_epi64(_mm_cvtepu8_epi64(_mm_cvtsi32_si128(h1)), 32));
+
+        _mm_storeu_si128((__m128i *)(deltas + 2 + i),
+                         _mm_and_si128(_mm_sub_epi64(v1, v0), mask));
+    }
+
+    deltas_uint32_sse41(start + 36, end + 36, deltas + 34, 4);
+    deltas_uint32_sse41(start + 48, end + 48, deltas + 38, 16);
+}
+
+static void __attribute__((target("sse4.1")))
+a45_b8_c8_sse41(const uint32_t *start, const uint32_t *end,
+                uint64_t *deltas)
+{
+    deltas[0] = delta_uint32(start + 1, end + 1); /* timestamp */
+    deltas_uint32_sse41(start + 3, end + 3, deltas + 1, 61);
+}
+
+static const struct delta_kernels sse41_kernels = {
+    .name = "sse4.1",
+    .a32u40_a4u32_b8_c8 = a32u40_a4u32_b8_c8_sse41,
+    .a45_b8_c8 = a45_b8_c8_sse41,
+};
+
+static inline void __attribute__((target("avx2")))
+deltas_uint32_avx2(const uint32_t *start, const uint32_t *end,
+                   uint64_t *deltas, int n)
+{
+    int i;
+
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m256i d = _mm256_sub_epi32(_mm256_loadu_si256((const __m256i *)(end + i)),
+                                     _mm256_loadu_si256((const __m256i *)(start + i)));
+
+        _mm256_storeu_si256((__m256i *)(deltas + i),
+                            _mm256_cvtepu32_epi64(_mm256_castsi256_si128(d)));
+        _mm256_storeu_si256((__m256i *)(deltas + i + 4),
+                            _mm256_cvtepu32_epi64(_mm256_extracti128_si256(d, 1)));
+    }
+    for (; i + 4 <= n; i += 4) {
+        __m128i d = _mm_sub_epi32(_mm_loadu_si128((const __m128i *)(end + i)),
+                                  _mm_loadu_si128((const __m128i *)(start + i)));
+
+        _mm256_storeu_si256((__m256i *)(deltas + i), _mm256_cvtepu32_epi64(d));
+    }
+    for (; i < n; i++)
+        deltas[i] = delta_uint32(start + i, end + i);
+}
+
+static void __attribute__((target("avx2")))
+a32u40_a4u32_b8_c8_avx2(const uint32_t *start, const uint32_t *end,
+                        uint64_t *deltas)
+{
+    const uint8_t *high_bytes0 = (const uint8_t *)(start + 40);
+    const uint8_t *high_bytes1 = (const uint8_t *)(end + 40);
+    const __m256i mask = _mm256_set1_epi64x((1ULL << 40) - 1);
+    int i;
+
+    deltas[0] = delta_uint32(start + 1, end + 1); /* timestamp */
+    deltas[1] = delta_uint32(start + 3, end + 3); /* clock */
+
+    for (i = 0; i < 32; i += 4) {
+        uint32_t h0, h1;
+        __m256i v0, v1;
+
+        memcpy(&h0, high_bytes0 + i, sizeof(h0));
+        memcpy(&h1, high_bytes1 + i, sizeof(h1));
+
+        v0 = _mm256_or_si256(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(start + 4 + i))),
+                             _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(h0)), 32));
+        v1 = _mm256_or_si256(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)(end + 4 + i))),
+                             _mm256_slli_epi64(_mm256_cvtepu8_epi64(_mm_cvtsi32_si128(h1)), 32));
+
+        _mm256_storeu_si256((__m256i *)(deltas + 2 + i),
+                            _mm256_and_si256(_mm256_sub_epi64(v1, v0), mask));
+    }
+
+    deltas_uint32_avx2(start + 36, end + 36, deltas + 34, 4);
+    deltas_uint32_avx2(start + 48, end + 48, deltas + 38, 16);
+}
+
+static void __attribute__((target("avx2")))
+a45_b8_c8_avx2(const uint32_t *start, const uint32_t *end,
+               uint64_t *deltas)
+{
+    deltas[0] = delta_uint32(start + 1, end + 1); /* timestamp */
+    deltas_uint32_avx2(start + 3, end + 3, deltas + 1, 61);
+}
+
+static const struct delta_kernels avx2_kernels = {
+    .name = "avx2",
+    .a32u40_a4u32_b8_c8 = a32u40_a4u32_b8_c8_avx2,
+    .a45_b8_c8 = a45_b8_c8_avx2,
+};
+
+#endif /* x86 */
+
+static const struct delta_kernels *delta_kernels;
+
+static bool
+delta_kernels_supported(const struct delta_kernels *kernels)
+{
+#ifdef HAVE_X86_DELTA_KERNELS
+    if (kernels == &avx2_kernels)
+        return __builtin_cpu_supports("avx2");
+    if (kernels == &sse41_kernels)
+        return __builtin_cpu_supports("sse4.1");
+#endif
+    return kernels == &scalar_kernels;
+}
+
+static const struct delta_kernels *
+get_delta_kernels(void)
+{
+    if (delta_kernels)
+        return delta_kernels;
+
+#ifdef HAVE_X86_DELTA_KERNELS
+    __builtin_cpu_init();
+    if (delta_kernels_supported(&avx2_kernels))
+        delta_kernels = &avx2_kernels;
+    else if (delta_kernels_supported(&sse41_kernels))
+        delta_kernels = &sse41_kernels;
+    else
+#endif
+        delta_kernels = &scalar_kernels;
+
+    return delta_kernels;
 }
 
 bool
-gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
-                                const uint8_t *report0,
-                                const uint8_t *report1)
+gputop_cc_oa_select_delta_kernels(const char *name)
+{
+    static const struct delta_kernels *all_kernels[] = {
+        &scalar_kernels,
+#ifdef HAVE_X86_DELTA_KERNELS
+        &sse41_kernels,
+        &avx2_kernels,
+#endif
+    };
+
+    for (int i = 0; i < ARRAY_SIZE(all_kernels); i++) {
+        if (strcmp(all_kernels[i]->name, name))
+            continue;
+        if (!delta_kernels_supported(all_kernels[i]))
+            return false;
+        delta_kernels = all_kernels[i];
+        return true;
+    }
+
+    return false;
+}
+
+const char *
+gputop_cc_oa_get_delta_kernels(void)
 {
-    const struct gputop_metric_set *metric_set = accumulator->metric_set;
-    uint64_t *deltas = accumulator->deltas;
+    return get_delta_kernels()->name;
+}
+
+bool
+gputop_cc_oa_decode_deltas(const struct gputop_metric_set *metric_set,
+                           const uint8_t *report0,
+                           const uint8_t *report1,
+                           struct gputop_cc_oa_deltas *deltas)
+{
+    const struct delta_kernels *kernels = get_delta_kernels();
     const uint32_t *start = (const uint32_t *)report0;
     const uint32_t *end = (const uint32_t *)report1;
-    int idx = 0;
-    int i;
 
     assert(report0 != report1);
 
@@ -136,47 +399,61 @@ gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
         return false;
     }
 
-    if (!accumulator->clock.devinfo)
-        gputop_u32_clock_init(&accumulator->clock, accumulator->devinfo,
-                              gputop_cc_oa_report_get_timestamp(report0));
-    //gputop_u32_clock_progress(&accumulator->clock, start[1]);
-    if (!accumulator->first_timestamp)
-        accumulator->first_timestamp =
-            gputop_u32_clock_get_time(&accumulator->clock);
+    deltas->start_timestamp = start[1];
+    deltas->end_timestamp = end[1];
 
     switch (metric_set->perf_oa_format) {
     case I915_OA_FORMAT_A32u40_A4u32_B8_C8:
-
-        accumulate_uint32(start + 1, end + 1, deltas + idx++); /* timestamp */
-        accumulate_uint32(start + 3, end + 3, deltas + idx++); /* clock */
-
-        /* 32x 40bit A counters... */
-        for (i = 0; i < 32; i++)
-            accumulate_uint40(i, start, end, deltas + idx++);
-
-        /* 4x 32bit A counters... */
-        for (i = 0; i < 4; i++)
-            accumulate_uint32(start + 36 + i, end + 36 + i, deltas + idx++);
-
-        /* 8x 32bit B counters + 8x 32bit C counters... */
-        for (i = 0; i < 16; i++)
-            accumulate_uint32(start + 48 + i, end + 48 + i, deltas + idx++);
+        kernels->a32u40_a4u32_b8_c8(start, end, deltas->deltas);
+        deltas->n_deltas = 54;
         break;
-
     case I915_OA_FORMAT_A45_B8_C8:
-
-        accumulate_uint32(start + 1, end + 1, deltas); /* timestamp */
-
-        for (i = 0; i < 61; i++)
-            accumulate_uint32(start + 3 + i, end + 3 + i, deltas + 1 + i);
+        kernels->a45_b8_c8(start, end, deltas->deltas);
+        deltas->n_deltas = 62;
         break;
     default:
         assert(0);
+        deltas->n_deltas = 0;
     }
 
-    gputop_u32_clock_progress(&accumulator->clock, start[1], end[1]);
+    return true;
+}
+
+void
+gputop_cc_oa_accumulate_deltas(struct gputop_cc_oa_accumulator *accumulator,
+                               const struct gputop_cc_oa_deltas *deltas)
+{
+    int i;
+
+    if (!accumulator->clock.devinfo)
+        gputop_u32_clock_init(&accumulator->clock, accumulator->devinfo,
+                              deltas->start_timestamp);
+    if (!accumulator->first_timestamp)
+        accumulator->first_timestamp =
+            gputop_u32_clock_get_time(&accumulator->clock);
+
+    for (i = 0; i < deltas->n_deltas; i++)
+        accumulator->deltas[i] += deltas->deltas[i];
+
+    gputop_u32_clock_progress(&accumulator->clock,
+                              deltas->start_timestamp,
+                              deltas->end_timestamp);
     accumulator->last_timestamp =
         gputop_u32_clock_get_time(&accumulator->clock);
+}
+
+bool
+gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
+                                const uint8_t *report0,
+                                const uint8_t *report1)
+{
+    struct gputop_cc_oa_deltas deltas;
+
+    if (!gputop_cc_oa_decode_deltas(accumulator->metric_set,
+                                    report0, report1, &deltas))
+        return false;
+
+    gputop_cc_oa_accumulate_deltas(accumulator, &deltas);
 
     return true;
 }
@@ -64,6 +64,18 @@ struct gputop_cc_oa_accumulator
     struct gputop_u32_clock clock;
 };
 
+/* Raw counter deltas between two OA reports. Decoding a pair of reports
+ * once and adding the result to several accumulators avoids walking the
+ * reports again for each of them.
+ */
+struct gputop_cc_oa_deltas
+{
+    uint32_t start_timestamp;
+    uint32_t end_timestamp;
+    int n_deltas;
+    uint64_t deltas[MAX_RAW_OA_COUNTERS];
+};
+
 void gputop_cc_oa_accumulator_init(struct gputop_cc_oa_accumulator *accumulator,
                                    const struct gputop_devinfo *devinfo,
                                    const struct gputop_metric_set *metric_set,
@@ -73,6 +85,18 @@ void gputop_cc_oa_accumulator_clear(struct gputop_cc_oa_accumulator *accumulator
 bool gputop_cc_oa_accumulate_reports(struct gputop_cc_oa_accumulator *accumulator,
                                      const uint8_t *report0,
                                      const uint8_t *report1);
+bool gputop_cc_oa_decode_deltas(const struct gputop_metric_set *metric_set,
+                                const uint8_t *report0,
+                                const uint8_t *report1,
+                                struct gputop_cc_oa_deltas *deltas);
+/* Selects the implementation used to decode reports ("scalar", "sse4.1"
+ * or "avx2"). Returns false if it isn't supported by the CPU. By default the
+ * fastest supported one is picked on first use.
+ */
+bool gputop_cc_oa_select_delta_kernels(const char *name);
+const char *gputop_cc_oa_get_delta_kernels(void);
+void gputop_cc_oa_accumulate_deltas(struct gputop_cc_oa_accumulator *accumulator,
+                                    const struct gputop_cc_oa_deltas *deltas);
 
 static inline uint64_t
 gputop_time_scale_timebase(const struct gputop_devinfo *devinfo, uint64_t ns_time)
@@ -0,0 +1,815 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-oa-expression.h"
+
+#include "util/macros.h"
+#include "util/ralloc.h"
+
+/* Deepest stack an expression may use and number of samples evaluated per
+ * instruction, the stack of a block takes 8KiB.
+ */
+#define MAX_STACK_DEPTH 16
+#define BLOCK_SIZE 64
+
+/* Bound on the nesting of infix sub-expressions, the parser recurses. */
+#define MAX_NESTING 64
+
+enum opcode {
+    OP_CONSTANT,
+    OP_DELTA,
+    OP_DEVINFO,
+    OP_COUNTER,
+
+    OP_FADD,
+    OP_FSUB,
+    OP_FMUL,
+    OP_FDIV,
+    OP_FMIN,
+    OP_FMAX,
+
+    OP_UADD,
+    OP_USUB,
+    OP_UMUL,
+    OP_UDIV,
+    OP_UMIN,
+    OP_UMAX,
+    OP_AND,
+    OP_SHL,
+    OP_SHR,
+};
+
+/* Values on the stack are either uint64_t or double, like the temporaries
+ * of the generated code. Their types are known at compile time.
+ */
+union value {
+    uint64_t u;
+    double f;
+};
+
+struct instruction {
+    enum opcode op;
+
+    /* Types of the operands & result, and whether the operation is done
+     * in floating point (see type_check()).
+     */
+    bool a_float;
+    bool b_float;
+    bool float_math;
+    bool result_float;
+
+    /* Arithmetic of the generated C code (RPN) or plain floating point
+     * arithmetic for +, -, * (infix).
+     */
+    bool c_arithmetic;
+
+    union {
+        union value constant;
+        int delta;       /* index in a delta vector */
+        int devinfo_var; /* index in devinfo_vars[] */
+        int counter;     /* index in metric_set->counters[] */
+    };
+};
+
+struct gputop_oa_expression {
+    struct instruction *instructions;
+    int n_instructions;
+};
+
+#define DEVINFO_VAR(name, field)                        \
+    { name, offsetof(struct gputop_devinfo, field),     \
+      sizeof(((struct gputop_devinfo *) 0)->field) }
+
+/* Same variables as hw_vars in gputop-oa-codegen.py */
+static const struct {
+    const char *name;
+    size_t offset;
+    size_t size;
+} devinfo_vars[] = {
+    DEVINFO_VAR("$EuCoresTotalCount", n_eus),
+    DEVINFO_VAR("$EuSlicesTotalCount", n_eu_slices),
+    DEVINFO_VAR("$EuSubslicesTotalCount", n_eu_sub_slices),
+    DEVINFO_VAR("$EuThreadsCount", eu_threads_count),
+    DEVINFO_VAR("$SliceMask", slice_mask),
+    DEVINFO_VAR("$SubsliceMask", subslice_mask),
+    DEVINFO_VAR("$GpuTimestampFrequency", timestamp_frequency),
+    DEVINFO_VAR("$GpuMinFrequency", gt_min_freq),
+    DEVINFO_VAR("$GpuMaxFrequency", gt_max_freq),
+    DEVINFO_VAR("$SkuRevisionId", revision),
+};
+
+static const struct {
+    const char *name;
+    enum opcode op;
+} rpn_operators[] = {
+    { "FADD", OP_FADD },
+    { "FSUB", OP_FSUB },
+    { "FMUL", OP_FMUL },
+    { "FDIV", OP_FDIV },
+    { "FMIN", OP_FMIN },
+    { "FMAX", OP_FMAX },
+    { "UADD", OP_UADD },
+    { "USUB", OP_USUB },
+    { "UMUL", OP_UMUL },
+    { "UDIV", OP_UDIV },
+    { "UMIN", OP_UMIN },
+    { "UMAX", OP_UMAX },
+    { "AND", OP_AND },
+    { "<<", OP_SHL },
+    { ">>", OP_SHR },
+};
+
+struct compiler {
+    void *mem_ctx;
+    const struct gputop_metric_set *metric_set;
+    const char *equation;
+    const char **error;
+
+    struct instruction *instructions;
+    int n_instructions;
+
+    bool c_arithmetic;
+
+    /* Infix parser state */
+    const char *pos;
+    int nesting;
+};
+
+static bool
+compile_error(struct compiler *comp, const char *format, ...)
+{
+    va_list args;
+
+    /* Only keep the first error */
+    if (*comp->error)
+        return false;
+
+    va_start(args, format);
+    *comp->error = ralloc_vasprintf(comp->mem_ctx, format, args);
+    va_end(args);
+
+    return false;
+}
+
+static void
+emit(struct compiler *comp, struct instruction instruction)
+{
+    if (instruction.op > OP_COUNTER)
+        instruction.c_arithmetic = comp->c_arithmetic;
+
+    comp->instructions = reralloc(comp->mem_ctx, comp->instructions,
+                                  struct instruction, comp->n_instructions + 1);
+    comp->instructions[comp->n_instructions++] = instruction;
+}
+
+static void
+emit_op(struct compiler *comp, enum opcode op)
+{
+    struct instruction instruction = { .op = op };
+    emit(comp, instruction);
+}
+
+static bool
+word_is(const char *word, int len, const char *str)
+{
+    return strlen(str) == len && !strncmp(word, str, len);
+}
+
+/* Integer literals are integers in the generated code too. */
+static bool
+parse_constant(const char *str, const char **end, union value *value)
+{
+    int int_len = strspn(str, "0123456789");
+    char *float_end;
+
+    if (int_len > 0 && str[int_len] != '.' && tolower(str[int_len]) != 'e') {
+        value->u = strtoull(str, NULL, 10);
+        *end = str + int_len;
+        return false;
+    }
+
+    value->f = strtod(str, &float_end);
+    *end = float_end;
+    return true;
+}
+
+static bool
+compile_constant(struct compiler *comp, const char *word, int len)
+{
+    char str[64];
+    const char *end;
+    struct instruction instruction = { .op = OP_CONSTANT };
+
+    if (len >= sizeof(str))
+        return compile_error(comp, "Invalid number '%.*s'", len, word);
+
+    memcpy(str, word, len);
+    str[len] = '\0';
+    instruction.result_float = parse_constant(str, &end, &instruction.constant);
+    if (end != &str[len])
+        return compile_error(comp, "Invalid number '%.*s'", len, word);
+
+    emit(comp, instruction);
+    return true;
+}
+
+/* Raw deltas, as read by "A 7 READ" or "A[7]" */
+static bool
+compile_delta(struct compiler *comp, const char *base, int base_len, int index)
+{
+    const struct gputop_metric_set *metric_set = comp->metric_set;
+    struct instruction instruction = { .op = OP_DELTA };
+    int offset = -1, count = 0;
+
+    if (word_is(base, base_len, "A")) {
+        offset = metric_set->a_offset;
+        count = metric_set->b_offset - metric_set->a_offset;
+    } else if (word_is(base, base_len, "B")) {
+        offset = metric_set->b_offset;
+        count = metric_set->c_offset - metric_set->b_offset;
+    } else if (word_is(base, base_len, "C")) {
+        offset = metric_set->c_offset;
+        count = 8;
+    } else if (word_is(base, base_len, "GPU_TIME")) {
+        offset = metric_set->gpu_time_offset;
+        count = 1;
+    } else if (word_is(base, base_len, "GPU_CLOCK")) {
+        offset = metric_set->gpu_clock_offset;
+        count = 1;
+    } else
+        return compile_error(comp, "Unknown counter '%.*s'", base_len, base);
+
+    if (index < 0 || index >= count)
+        return compile_error(comp, "No %.*s counter %i", base_len, base, index);
+
+    instruction.delta = offset + index;
+    emit(comp, instruction);
+    return true;
+}
+
+static bool
+compile_variable(struct compiler *comp, const char *name, int len)
+{
+    const struct gputop_metric_set *metric_set = comp->metric_set;
+
+    for (int i = 0; i < ARRAY_SIZE(devinfo_vars); i++) {
+        if (word_is(name, len, devinfo_vars[i].name)) {
+            struct instruction instruction = { .op = OP_DEVINFO };
+            instruction.devinfo_var = i;
+            emit(comp, instruction);
+            return true;
+        }
+    }
+
+    for (int c = 0; c < metric_set->n_counters; c++) {
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[c];
+
+        if (!word_is(name + 1, len - 1, counter->symbol_name))
+            continue;
+
+        /* Derived counters are inlined, they only ever reference counters
+         * defined before them so this can't recurse forever.
+         */
+        if (counter->expression) {
+            const struct gputop_oa_expression *expression = counter->expression;
+
+            comp->instructions = reralloc(comp->mem_ctx, comp->instructions,
+                                          struct instruction,
+                                          comp->n_instructions +
+                                          expression->n_instructions);
+            memcpy(&comp->instructions[comp->n_instructions],
+                   expression->instructions,
+                   expression->n_instructions * sizeof(struct instruction));
+            comp->n_instructions += expression->n_instructions;
+        } else {
+            struct instruction instruction = { .op = OP_COUNTER };
+            instruction.counter = c;
+            instruction.result_float =
+                counter->data_type == GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE ||
+                counter->data_type == GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT;
+            emit(comp, instruction);
+        }
+        return true;
+    }
+
+    return compile_error(comp, "Unknown variable '%.*s' in %s",
+                         len, name, metric_set->symbol_name);
+}
+
+static const char *
+next_word(const char *str, int *len)
+{
+    str += strspn(str, " \t\n");
+    *len = strcspn(str, " \t\n");
+    return str;
+}
+
+static int
+find_rpn_operator(const char *word, int len)
+{
+    for (int i = 0; i < ARRAY_SIZE(rpn_operators); i++) {
+        if (word_is(word, len, rpn_operators[i].name))
+            return i;
+    }
+    return -1;
+}
+
+static bool
+compile_rpn(struct compiler *comp)
+{
+    const char *word;
+    int len;
+
+    for (word = next_word(comp->equation, &len); len > 0;
+         word = next_word(word + len, &len)) {
+        int op = find_rpn_operator(word, len);
+
+        if (op >= 0) {
+            emit_op(comp, rpn_operators[op].op);
+        } else if (word[0] == '$') {
+            if (!compile_variable(comp, word, len))
+                return false;
+        } else if (isdigit((unsigned char) word[0]) || word[0] == '.') {
+            if (!compile_constant(comp, word, len))
+                return false;
+        } else {
+            /* "<base> <index> READ" */
+            const char *base = word;
+            int base_len = len;
+            const char *index = next_word(base + base_len, &len);
+            int index_len = len;
+            const char *read = next_word(index + index_len, &len);
+            char *end;
+            long i = strtol(index, &end, 10);
+
+            if (end != index + index_len || !word_is(read, len, "READ")) {
+                return compile_error(comp, "Expected '%.*s <index> READ'",
+                                     base_len, base);
+            }
+            if (!compile_delta(comp, base, base_len, i))
+                return false;
+            word = read;
+        }
+    }
+
+    return true;
+}
+
+/* Infix syntax */
+
+static void
+skip_spaces(struct compiler *comp)
+{
+    comp->pos += strspn(comp->pos, " \t\n");
+}
+
+static bool
+accept(struct compiler *comp, const char *token)
+{
+    skip_spaces(comp);
+    if (strncmp(comp->pos, token, strlen(token)))
+        return false;
+    comp->pos += strlen(token);
+    return true;
+}
+
+static bool
+expect(struct compiler *comp, const char *token)
+{
+    if (accept(comp, token))
+        return true;
+    return compile_error(comp, "Expected '%s' at '%s'", token, comp->pos);
+}
+
+static int
+identifier_length(const char *str)
+{
+    int len = 0;
+
+    while (isalnum((unsigned char) str[len]) || str[len] == '_')
+        len++;
+    return len;
+}
+
+static bool parse_infix(struct compiler *comp, int level);
+
+static bool parse_primary(struct compiler *comp);
+
+static bool
+parse_nested(struct compiler *comp)
+{
+    bool ret;
+
+    if (++comp->nesting > MAX_NESTING)
+        return compile_error(comp, "Equation nested too deeply");
+    ret = parse_primary(comp);
+    comp->nesting--;
+
+    return ret;
+}
+
+static bool
+parse_primary(struct compiler *comp)
+{
+    const char *start;
+    int len;
+
+    skip_spaces(comp);
+    start = comp->pos;
+
+    if (accept(comp, "(")) {
+        return parse_infix(comp, 0) && expect(comp, ")");
+    } else if (accept(comp, "-")) {
+        /* 0.0 - x */
+        struct instruction zero = { .op = OP_CONSTANT, .result_float = true };
+        emit(comp, zero);
+        if (!parse_nested(comp))
+            return false;
+        emit_op(comp, OP_FSUB);
+        return true;
+    } else if (*start == '$') {
+        len = 1 + identifier_length(start + 1);
+        comp->pos += len;
+        return compile_variable(comp, start, len);
+    } else if (isdigit((unsigned char) *start) || *start == '.') {
+        const char *end;
+        struct instruction instruction = { .op = OP_CONSTANT };
+
+        instruction.result_float = parse_constant(start, &end, &instruction.constant);
+        if (end == start)
+            return compile_error(comp, "Invalid number at '%s'", start);
+        comp->pos = end;
+        emit(comp, instruction);
+        return true;
+    }
+
+    len = identifier_length(start);
+    if (len == 0)
+        return compile_error(comp, "Unexpected '%s'", start);
+    comp->pos += len;
+
+    if (word_is(start, len, "min") || word_is(start, len, "max")) {
+        if (!expect(comp, "(") || !parse_infix(comp, 0) ||
+            !expect(comp, ",") || !parse_infix(comp, 0) || !expect(comp, ")"))
+            return false;
+        emit_op(comp, start[1] == 'i' ? OP_FMIN : OP_FMAX);
+        return true;
+    } else if (word_is(start, len, "GPU_TIME") || word_is(start, len, "GPU_CLOCK")) {
+        return compile_delta(comp, start, len, 0);
+    } else {
+        char *end;
+        long index;
+
+        if (!expect(comp, "["))
+            return false;
+        index = strtol(comp->pos, &end, 10);
+        if (end == comp->pos)
+            return compile_error(comp, "Expected an index at '%s'", comp->pos);
+        comp->pos = end;
+        if (!expect(comp, "]"))
+            return false;
+        return compile_delta(comp, start, len, index);
+    }
+}
+
+/* Binary operators by increasing precedence */
+static const struct {
+    const char *token;
+    enum opcode op;
+} infix_operators[][2] = {
+    { { "&", OP_AND }, },
+    { { "<<", OP_SHL }, { ">>", OP_SHR }, },
+    { { "+", OP_FADD }, { "-", OP_FSUB }, },
+    { { "*", OP_FMUL }, { "/", OP_FDIV }, },
+};
+
+static bool
+parse_infix(struct compiler *comp, int level)
+{
+    bool ret = true;
+
+    if (level == ARRAY_SIZE(infix_operators))
+        return parse_nested(comp);
+
+    if (!parse_infix(comp, level + 1))
+        return false;
+
+    while (ret) {
+        int i;
+
+        for (i = 0; i < ARRAY_SIZE(infix_operators[level]); i++) {
+            if (infix_operators[level][i].token &&
+                accept(comp, infix_operators[level][i].token))
+                break;
+        }
+        if (i == ARRAY_SIZE(infix_operators[level]))
+            break;
+
+        ret = parse_infix(comp, level + 1);
+        emit_op(comp, infix_operators[level][i].op);
+    }
+
+    return ret;
+}
+
+static bool
+compile_infix(struct compiler *comp)
+{
+    comp->pos = comp->equation;
+
+    if (!parse_infix(comp, 0))
+        return false;
+
+    skip_spaces(comp);
+    if (*comp->pos)
+        return compile_error(comp, "Unexpected '%s'", comp->pos);
+
+    return true;
+}
+
+/* Equations ending with an operator like "FDIV" or "READ" are RPN. */
+static bool
+is_rpn(const char *equation)
+{
+    const char *word = NULL, *next;
+    int len = 0, next_len;
+
+    for (next = next_word(equation, &next_len); next_len > 0;
+         next = next_word(next + next_len, &next_len)) {
+        word = next;
+        len = next_len;
+    }
+
+    return word && (find_rpn_operator(word, len) >= 0 || word_is(word, len, "READ"));
+}
+
+/* Checks the program leaves exactly one value and fits the stack, then
+ * works out the types like the C compiler does for the generated code :
+ * the U operators produce integers but compute in floating point when an
+ * operand is a double (except UDIV which truncates its operands first),
+ * the F operators produce doubles but compute on integers when both
+ * operands are integers (except FDIV, FMIN & FMAX which convert them
+ * first).
+ */
+static bool
+type_check(struct compiler *comp)
+{
+    bool types[MAX_STACK_DEPTH];
+    int depth = 0;
+
+    for (int i = 0; i < comp->n_instructions; i++) {
+        struct instruction *instruction = &comp->instructions[i];
+
+        if (instruction->op <= OP_COUNTER) {
+            if (depth == MAX_STACK_DEPTH)
+                return compile_error(comp, "Equation too complex '%s'", comp->equation);
+            types[depth++] = instruction->result_float;
+            continue;
+        }
+
+        if (depth < 2)
+            return compile_error(comp, "Missing operand in '%s'", comp->equation);
+
+        instruction->a_float = types[depth - 2];
+        instruction->b_float = types[depth - 1];
+
+        bool any_float = instruction->a_float || instruction->b_float;
+        switch (instruction->op) {
+        case OP_FADD:
+        case OP_FSUB:
+        case OP_FMUL:
+            instruction->float_math = any_float || !instruction->c_arithmetic;
+            instruction->result_float = true;
+            break;
+        case OP_FDIV:
+        case OP_FMIN:
+        case OP_FMAX:
+            instruction->float_math = true;
+            instruction->result_float = true;
+            break;
+        case OP_UADD:
+        case OP_USUB:
+        case OP_UMUL:
+        case OP_UMIN:
+        case OP_UMAX:
+            instruction->float_math = any_float;
+            instruction->result_float = false;
+            break;
+        default:
+            instruction->float_math = false;
+            instruction->result_float = false;
+            break;
+        }
+
+        types[--depth - 1] = instruction->result_float;
+    }
+
+    if (depth != 1)
+        return compile_error(comp, "Missing operator in '%s'", comp->equation);
+
+    return true;
+}
+
+struct gputop_oa_expression *
+gputop_oa_expression_compile(void *mem_ctx,
+                             const struct gputop_metric_set *metric_set,
+                             const char *equation,
+                             const char **error)
+{
+    struct gputop_oa_expression *expression =
+        rzalloc(mem_ctx, struct gputop_oa_expression);
+    struct compiler comp = {
+        .mem_ctx = expression,
+        .metric_set = metric_set,
+        .equation = equation,
+        .error = error,
+    };
+    bool compiled;
+
+    *error = NULL;
+
+    if (is_rpn(equation)) {
+        comp.c_arithmetic = true;
+        compiled = compile_rpn(&comp);
+    } else
+        compiled = compile_infix(&comp);
+
+    if (!compiled || !type_check(&comp)) {
+        *error = ralloc_strdup(mem_ctx, *error);
+        ralloc_free(expression);
+        return NULL;
+    }
+
+    expression->instructions = comp.instructions;
+    expression->n_instructions = comp.n_instructions;
+
+    return expression;
+}
+
+/* Same implicit conversions as the assignments of the generated code. */
+static void
+convert(union value *values, int n, bool from_float, bool to_float)
+{
+    if (from_float == to_float)
+        return;
+
+    if (to_float) {
+        for (int i = 0; i < n; i++)
+            values[i].f = values[i].u;
+    } else {
+        for (int i = 0; i < n; i++)
+            values[i].u = values[i].f;
+    }
+}
+
+static uint64_t
+read_devinfo_var(const struct gputop_devinfo *devinfo, int var)
+{
+    const uint8_t *field = (const uint8_t *) devinfo + devinfo_vars[var].offset;
+
+    if (devinfo_vars[var].size == sizeof(uint32_t))
+        return *(const uint32_t *) field;
+    return *(const uint64_t *) field;
+}
+
+#define BINARY_OP(field, expr)                          \
+    for (int i = 0; i < n; i++) {                       \
+        __typeof__(a[i].field) x = a[i].field;          \
+        __typeof__(b[i].field) y = b[i].field;          \
+        a[i].field = (expr);                            \
+    }                                                   \
+    break
+
+static void
+evaluate_float_op(enum opcode op, union value *a, const union value *b, int n)
+{
+    switch (op) {
+    case OP_FADD: case OP_UADD: BINARY_OP(f, x + y);
+    case OP_FSUB: case OP_USUB: BINARY_OP(f, x - y);
+    case OP_FMUL: case OP_UMUL: BINARY_OP(f, x * y);
+    case OP_FDIV:               BINARY_OP(f, y ? x / y : 0);
+    case OP_FMIN: case OP_UMIN: BINARY_OP(f, MIN2(x, y));
+    case OP_FMAX: case OP_UMAX: BINARY_OP(f, MAX2(x, y));
+    default:
+        unreachable("Not a floating point operator");
+    }
+}
+
+static void
+evaluate_uint_op(enum opcode op, union value *a, const union value *b, int n)
+{
+    switch (op) {
+    case OP_FADD: case OP_UADD: BINARY_OP(u, x + y);
+    case OP_FSUB: case OP_USUB: BINARY_OP(u, x - y);
+    case OP_FMUL: case OP_UMUL: BINARY_OP(u, x * y);
+    case OP_UDIV:               BINARY_OP(u, y ? x / y : 0);
+    case OP_UMIN:               BINARY_OP(u, MIN2(x, y));
+    case OP_UMAX:               BINARY_OP(u, MAX2(x, y));
+    case OP_AND:                BINARY_OP(u, x & y);
+    case OP_SHL:                BINARY_OP(u, y < 64 ? x << y : 0);
+    case OP_SHR:                BINARY_OP(u, y < 64 ? x >> y : 0);
+    default:
+        unreachable("Not an integer operator");
+    }
+}
+
+void
+gputop_oa_expression_evaluate(const struct gputop_oa_expression *expression,
+                              const struct gputop_devinfo *devinfo,
+                              const struct gputop_metric_set *metric_set,
+                              uint64_t *const *deltas,
+                              int n_deltas,
+                              double *values)
+{
+    union value stack[MAX_STACK_DEPTH][BLOCK_SIZE];
+    bool result_float =
+        expression->instructions[expression->n_instructions - 1].result_float;
+
+    for (int first = 0; first < n_deltas; first += BLOCK_SIZE) {
+        uint64_t *const *block = &deltas[first];
+        int n = MIN2(BLOCK_SIZE, n_deltas - first);
+        int sp = 0;
+
+        for (int pc = 0; pc < expression->n_instructions; pc++) {
+            const struct instruction *instruction = &expression->instructions[pc];
+            union value *top = stack[sp];
+
+            switch (instruction->op) {
+            case OP_CONSTANT:
+                for (int i = 0; i < n; i++)
+                    top[i] = instruction->constant;
+                sp++;
+                break;
+            case OP_DELTA:
+                for (int i = 0; i < n; i++)
+                    top[i].u = block[i][instruction->delta];
+                sp++;
+                break;
+            case OP_DEVINFO: {
+                uint64_t value = read_devinfo_var(devinfo, instruction->devinfo_var);
+                for (int i = 0; i < n; i++)
+                    top[i].u = value;
+                sp++;
+                break;
+            }
+            case OP_COUNTER: {
+                const struct gputop_metric_set_counter *counter =
+                    &metric_set->counters[instruction->counter];
+
+                if (instruction->result_float) {
+                    for (int i = 0; i < n; i++)
+                        top[i].f = counter->oa_counter_read_float(devinfo, metric_set, block[i]);
+                } else {
+                    for (int i = 0; i < n; i++)
+                        top[i].u = counter->oa_counter_read_uint64(devinfo, metric_set, block[i]);
+                }
+                sp++;
+                break;
+            }
+            default: {
+                union value *a = stack[sp - 2], *b = stack[sp - 1];
+
+                convert(a, n, instruction->a_float, instruction->float_math);
+                convert(b, n, instruction->b_float, instruction->float_math);
+                if (instruction->float_math)
+                    evaluate_float_op(instruction->op, a, b, n);
+                else
+                    evaluate_uint_op(instruction->op, a, b, n);
+                convert(a, n, instruction->float_math, instruction->result_float);
+                sp--;
+                break;
+            }
+            }
+        }
+
+        for (int i = 0; i < n; i++)
+            values[first + i] = result_float ? stack[0][i].f : stack[0][i].u;
+    }
+}
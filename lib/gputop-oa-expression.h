@@ -0,0 +1,85 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "gputop-oa-metrics.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Equations compiled at runtime, for counters defined by the user on top
+ * of the ones generated from the XML files.
+ *
+ * Equations use the RPN syntax & semantics of the XML files :
+ *
+ *   "A 7 READ $EuCoresTotalCount UDIV 100 UMUL $GpuCoreClocks FDIV"
+ *
+ * or an infix syntax where +, -, *, / and min()/max() are the floating
+ * point operators (FADD, FSUB, ...) and &, <<, >> the integer ones :
+ *
+ *   "$SamplerTexelMisses / max($EuActive, 1)"
+ *   "(A[7] + A[8]) / GPU_CLOCK"
+ *
+ * Both can read the raw deltas (A, B, C, GPU_TIME & GPU_CLOCK), the device
+ * variables ($EuCoresTotalCount, $GpuTimestampFrequency, ...) and the
+ * counters of the metric set ($GpuCoreClocks, ...) including the derived
+ * ones. Divisions by 0 give 0 like in the generated code.
+ *
+ * RPN equations keep the uint64_t/double temporaries of the generated code
+ * so they give the same values as the built-in counters, while infix
+ * +, -, * always compute in floating point.
+ *
+ * Equations are compiled into a small stack machine program evaluated one
+ * instruction at a time over blocks of samples, so the cost of dispatching
+ * instructions is shared by the samples of a block.
+ */
+struct gputop_oa_expression;
+
+/* Returns NULL and an error message (allocated from mem_ctx) if the
+ * equation can't be parsed or references something that doesn't exist in
+ * metric_set.
+ */
+struct gputop_oa_expression *
+gputop_oa_expression_compile(void *mem_ctx,
+                             const struct gputop_metric_set *metric_set,
+                             const char *equation,
+                             const char **error);
+
+/* Writes the value of the expression for each of the n_deltas delta
+ * vectors into values.
+ */
+void gputop_oa_expression_evaluate(const struct gputop_oa_expression *expression,
+                                   const struct gputop_devinfo *devinfo,
+                                   const struct gputop_metric_set *metric_set,
+                                   uint64_t *const *deltas,
+                                   int n_deltas,
+                                   double *values);
+
+#ifdef __cplusplus
+}
+#endif
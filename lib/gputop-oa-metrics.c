@@ -23,66 +23,241 @@
  */
 
 #include "gputop-oa-metrics.h"
-#include "gputop-gens-metrics.h"
-
+#include "gputop-oa-expression.h"
 
+#include <ctype.h>
+#include <stdio.h>
 #include <string.h>
 
-#include "util/hash_table.h"
+#ifdef GPUTOP_METRICS_PLUGINS
+#include <dlfcn.h>
+#include <limits.h>
+#include <stdlib.h>
+#else
+#include "gputop-gens-metrics.h"
+#endif
+
+#include "util/macros.h"
 #include "util/ralloc.h"
 
+static void
+gputop_gen_destroy(void *ptr)
+{
+    struct gputop_gen *gen = (struct gputop_gen *) ptr;
+
+    /* The metric sets outlive the gen when linked in. The saved counters
+     * aren't allocated under the gen as its children are already freed.
+     */
+    if (gen->builtin_counters) {
+        for (int s = 0; s < gen->n_metric_sets; s++) {
+            gen->metric_sets[s]->counters = gen->builtin_counters[s].counters;
+            gen->metric_sets[s]->n_counters = gen->builtin_counters[s].n_counters;
+        }
+        ralloc_free(gen->builtin_counters);
+    }
+
+#ifdef GPUTOP_METRICS_PLUGINS
+    if (gen->plugin)
+        dlclose(gen->plugin);
+#endif
+}
+
+#ifdef GPUTOP_METRICS_PLUGINS
+
+/* Plugins are looked up in $GPUTOP_METRICS_DIR first (to run from the
+ * build directory), then in the install directory.
+ */
+static const struct gputop_oa_platform *
+gputop_oa_load_platform(const char *devname, void **plugin)
+{
+    const char *dir = getenv("GPUTOP_METRICS_DIR");
+    char path[PATH_MAX], symbol[64];
+    const struct gputop_oa_platform *platform;
+
+    /* devname comes from the server, don't let it pick a path. */
+    for (const char *c = devname; *c; c++) {
+        if (!((*c >= 'a' && *c <= 'z') || (*c >= '0' && *c <= '9')))
+            return NULL;
+    }
+
+    snprintf(path, sizeof(path), "%s/gputop-metrics-%s.so",
+             dir ? dir : GPUTOP_METRICS_PLUGIN_DIR, devname);
+    *plugin = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+    if (!*plugin) {
+        fprintf(stderr, "Unable to load %s metrics: %s\n", devname, dlerror());
+        return NULL;
+    }
+
+    snprintf(symbol, sizeof(symbol), "gputop_oa_platform_%s", devname);
+    platform = (const struct gputop_oa_platform *) dlsym(*plugin, symbol);
+    if (!platform) {
+        fprintf(stderr, "Invalid %s metrics plugin: %s\n", devname, dlerror());
+        dlclose(*plugin);
+        *plugin = NULL;
+    }
+
+    return platform;
+}
+
+#else
+
+static const struct gputop_oa_platform *const builtin_platforms[] = {
+    &gputop_oa_platform_hsw,
+    &gputop_oa_platform_bdw,
+    &gputop_oa_platform_chv,
+    &gputop_oa_platform_sklgt2,
+    &gputop_oa_platform_sklgt3,
+    &gputop_oa_platform_sklgt4,
+    &gputop_oa_platform_kblgt2,
+    &gputop_oa_platform_kblgt3,
+    &gputop_oa_platform_cflgt2,
+    &gputop_oa_platform_cflgt3,
+    &gputop_oa_platform_bxt,
+    &gputop_oa_platform_glk,
+    &gputop_oa_platform_cnl,
+    &gputop_oa_platform_icl,
+};
+
+static const struct gputop_oa_platform *
+gputop_oa_load_platform(const char *devname, void **plugin)
+{
+    for (int i = 0; i < ARRAY_SIZE(builtin_platforms); i++) {
+        if (!strcmp(builtin_platforms[i]->devname, devname))
+            return builtin_platforms[i];
+    }
+
+    fprintf(stderr, "No metrics for %s\n", devname);
+    return NULL;
+}
+
+#endif
+
+struct gputop_gen *
+gputop_oa_get_metrics(const char *devname, const struct gputop_devinfo *devinfo)
+{
+    void *plugin = NULL;
+    const struct gputop_oa_platform *platform =
+        gputop_oa_load_platform(devname, &plugin);
+    struct gputop_gen *gen;
+
+    if (!platform)
+        return NULL;
+
+    gen = rzalloc(NULL, struct gputop_gen);
+    gen->name = platform->devname;
+    gen->metric_sets = platform->metric_sets;
+    gen->n_metric_sets = platform->n_metric_sets;
+    gen->guid_hash = platform->guid_hash;
+    gen->symbol_hash = platform->symbol_hash;
+
+    gen->plugin = plugin;
+    ralloc_set_destructor(gen, gputop_gen_destroy);
+
+    for (int i = 0; i < gen->n_metric_sets; i++)
+        gen->metric_sets[i]->perf_oa_metrics_set = 0;
+
+    platform->select_available(devinfo);
+
+    return gen;
+}
+
 struct gputop_gen *
 gputop_gen_for_devinfo(const struct gen_device_info *devinfo)
 {
     struct gputop_devinfo gputop_devinfo = {};
+    const char *devname = NULL;
 
     if (devinfo->is_haswell)
-        return gputop_oa_get_metrics_hsw(&gputop_devinfo);
-    if (devinfo->is_broadwell)
-	return gputop_oa_get_metrics_bdw(&gputop_devinfo);
-    if (devinfo->is_cherryview)
-	return gputop_oa_get_metrics_chv(&gputop_devinfo);
-    if (devinfo->is_skylake) {
-	switch (devinfo->gt) {
-	case 2:
-            return gputop_oa_get_metrics_sklgt2(&gputop_devinfo);
-	case 3:
-	    return gputop_oa_get_metrics_sklgt3(&gputop_devinfo);
-	case 4:
-	    return gputop_oa_get_metrics_sklgt4(&gputop_devinfo);
-	default:
-	    return NULL;
-	}
-    }
-    if (devinfo->is_broxton)
-	return gputop_oa_get_metrics_bxt(&gputop_devinfo);
-    if (devinfo->is_kabylake) {
-	switch (devinfo->gt) {
-	case 2:
-            return gputop_oa_get_metrics_kblgt2(&gputop_devinfo);
-	case 3:
-	    return gputop_oa_get_metrics_kblgt3(&gputop_devinfo);
-	default:
-            return NULL;
-	}
-    }
-    if (devinfo->is_geminilake)
-        return gputop_oa_get_metrics_glk(&gputop_devinfo);
-    if (devinfo->is_coffeelake) {
-	switch (devinfo->gt) {
-	case 2:
-	    return gputop_oa_get_metrics_cflgt2(&gputop_devinfo);
-	case 3:
-	    return gputop_oa_get_metrics_cflgt3(&gputop_devinfo);
-	default:
-	    return NULL;
-	}
-    }
-    if (devinfo->is_cannonlake)
-        return gputop_oa_get_metrics_cnl(&gputop_devinfo);
-    if (devinfo->gen == 11)
-        return gputop_oa_get_metrics_icl(&gputop_devinfo);
-    return NULL;
+        devname = "hsw";
+    else if (devinfo->is_broadwell)
+        devname = "bdw";
+    else if (devinfo->is_cherryview)
+        devname = "chv";
+    else if (devinfo->is_skylake && devinfo->gt >= 2 && devinfo->gt <= 4) {
+        static const char *names[] = { "sklgt2", "sklgt3", "sklgt4" };
+        devname = names[devinfo->gt - 2];
+    } else if (devinfo->is_broxton)
+        devname = "bxt";
+    else if (devinfo->is_kabylake && devinfo->gt >= 2 && devinfo->gt <= 3)
+        devname = devinfo->gt == 2 ? "kblgt2" : "kblgt3";
+    else if (devinfo->is_geminilake)
+        devname = "glk";
+    else if (devinfo->is_coffeelake && devinfo->gt >= 2 && devinfo->gt <= 3)
+        devname = devinfo->gt == 2 ? "cflgt2" : "cflgt3";
+    else if (devinfo->is_cannonlake)
+        devname = "cnl";
+    else if (devinfo->gen == 11)
+        devname = "icl";
+
+    if (!devname)
+        return NULL;
+
+    return gputop_oa_get_metrics(devname, &gputop_devinfo);
+}
+
+void
+gputop_devinfo_build_equations_variables(struct gputop_devinfo *devinfo)
+{
+    struct gputop_devtopology *topology = &devinfo->topology;
+    int subslice_stride = DIV_ROUND_UP(topology->max_eus_per_subslice, 8);
+    int slice_stride = subslice_stride * topology->max_subslices;
+    int subslice_slice_stride = DIV_ROUND_UP(topology->max_subslices, 8);
+
+    devinfo->n_eus = 0;
+    for (int s = 0; s < topology->max_slices; s++) {
+        for (int ss = 0; ss < topology->max_subslices; ss++) {
+            for (int eug = 0; eug < subslice_stride; eug++) {
+                devinfo->n_eus +=
+                    __builtin_popcount(topology->eus_mask[slice_stride * s +
+                                                          subslice_stride * ss +
+                                                          eug]);
+            }
+        }
+    }
+
+    devinfo->n_eu_slices = 0;
+    for (int s = 0; s < DIV_ROUND_UP(topology->max_slices, 8); s++) {
+        devinfo->n_eu_slices +=
+            __builtin_popcount(topology->slices_mask[s]);
+    }
+
+    devinfo->n_eu_sub_slices = 0;
+    for (int s = 0; s < topology->max_slices * subslice_slice_stride; s++) {
+        devinfo->n_eu_sub_slices +=
+            __builtin_popcount(topology->subslices_mask[s]);
+    }
+
+    devinfo->slice_mask = topology->slices_mask[0];
+
+    /* Unfortunately the equations expect at $SubsliceMask variable were the
+     * meaning of the bits varies from one platform to another. One could hope
+     * that we get special operations to query slice/subslice availability
+     * abstracting the storage of this information...
+     */
+    int subslice_bits_per_slice = 0;
+    if (devinfo->gen <= 10) {
+        /* Subslices are grouped by 3. */
+        subslice_bits_per_slice = 3;
+    } else if (devinfo->gen == 11) {
+        /* Subslices are grouped by 8 */
+        subslice_bits_per_slice = 8;
+    } else {
+        unreachable("Cannot build subslice mask for equations");
+    }
+
+    devinfo->subslice_mask = 0;
+    for (int s = 0; s < topology->max_slices; s++) {
+        for (int ss = 0; ss < MIN2(topology->max_subslices, 3); ss++) {
+            bool enabled =
+                (topology->subslices_mask[slice_stride * s + ss / 8] &
+                 (1UL << (ss % 8))) != 0;
+            if (enabled)
+                devinfo->subslice_mask |= 1ULL << (subslice_bits_per_slice * s + ss);
+        }
+    }
+
+
+    devinfo->eu_threads_count = devinfo->n_eus * topology->n_threads_per_eu;
 }
 
 static struct gputop_counter_group *
@@ -90,11 +265,10 @@ gputop_counter_group_new(struct gputop_gen *gen,
                          struct gputop_counter_group *parent,
                          const char *name)
 {
-    struct gputop_counter_group *group = ralloc(gen, struct gputop_counter_group);
+    struct gputop_counter_group *group = rzalloc(gen, struct gputop_counter_group);
 
     group->name = ralloc_strdup(group, name);
 
-    list_inithead(&group->counters);
     list_inithead(&group->groups);
 
     if (parent)
@@ -105,40 +279,67 @@ gputop_counter_group_new(struct gputop_gen *gen,
     return group;
 }
 
-struct gputop_gen *
-gputop_gen_new(void)
+/* FNV-1a, must match hash_string() in gputop-oa-codegen.py. */
+uint32_t
+gputop_metric_set_hash_string(uint32_t seed, const char *str)
 {
-    struct gputop_gen *gen = ralloc(NULL, struct gputop_gen);
+    uint32_t hash = 2166136261u ^ seed;
 
-    gen->root_group = gputop_counter_group_new(gen, NULL, "");
+    for (; *str; str++) {
+        hash ^= (uint8_t) *str;
+        hash *= 16777619u;
+    }
 
-    list_inithead(&gen->metric_sets);
-    gen->metric_sets_map = _mesa_hash_table_create(gen,
-                                                   _mesa_hash_string,
-                                                   _mesa_key_string_equal);
+    return hash;
+}
 
-    return gen;
+struct gputop_metric_set *
+gputop_gen_find_metric_set(const struct gputop_gen *gen,
+                           const char *hw_config_guid)
+{
+    const struct gputop_metric_set_hash *hash = &gen->guid_hash;
+    int idx = hash->slots[gputop_metric_set_hash_string(hash->seed,
+                                                        hw_config_guid) & hash->mask];
+
+    if (idx < 0 || strcmp(gen->metric_sets[idx]->hw_config_guid, hw_config_guid))
+        return NULL;
+
+    return gen->metric_sets[idx];
 }
 
-void
+struct gputop_metric_set *
+gputop_gen_find_metric_set_by_symbol(const struct gputop_gen *gen,
+                                     const char *symbol_name)
+{
+    const struct gputop_metric_set_hash *hash = &gen->symbol_hash;
+    int idx = hash->slots[gputop_metric_set_hash_string(hash->seed,
+                                                        symbol_name) & hash->mask];
+
+    if (idx < 0 || strcmp(gen->metric_sets[idx]->symbol_name, symbol_name))
+        return NULL;
+
+    return gen->metric_sets[idx];
+}
+
+static void
 gputop_gen_add_counter(struct gputop_gen *gen,
-                       struct gputop_metric_set_counter *counter,
-                       const char *group_path)
+                       const struct gputop_metric_set_counter *counter)
 {
+    const char *group_path = counter->group;
     const char *group_path_end = group_path + strlen(group_path);
-    struct gputop_counter_group *group = gen->root_group, *child_group = NULL;
+    struct gputop_counter_group *group = gen->root_group;
     const char *name = group_path;
 
     while (name < group_path_end) {
         const char *name_end = strstr(name, "/");
         char group_name[128] = { 0, };
+        struct gputop_counter_group *child_group = NULL;
 
         if (!name_end)
             name_end = group_path_end;
 
         memcpy(group_name, name, name_end - name);
 
-        child_group = NULL;
         list_for_each_entry(struct gputop_counter_group, iter_group,
                             &group->groups, link) {
             if (!strcmp(iter_group->name, group_name)) {
@@ -154,14 +355,165 @@ gputop_gen_add_counter(struct gputop_gen *gen,
         group = child_group;
     }
 
-    list_addtail(&counter->link, &child_group->counters);
+    group->counters = reralloc(group, group->counters,
+                               const struct gputop_metric_set_counter *,
+                               group->n_counters + 1);
+    group->counters[group->n_counters++] = counter;
+}
+
+struct gputop_counter_group *
+gputop_gen_get_root_group(struct gputop_gen *gen)
+{
+    if (gen->root_group)
+        return gen->root_group;
+
+    gen->root_group = gputop_counter_group_new(gen, NULL, "");
+
+    for (int s = 0; s < gen->n_metric_sets; s++) {
+        const struct gputop_metric_set *metric_set = gen->metric_sets[s];
+
+        for (int c = 0; c < metric_set->n_counters; c++)
+            gputop_gen_add_counter(gen, &metric_set->counters[c]);
+    }
+
+    return gen->root_group;
+}
+
+static bool
+gputop_metric_set_has_counter(const struct gputop_metric_set *metric_set,
+                              const char *symbol_name)
+{
+    for (int c = 0; c < metric_set->n_counters; c++) {
+        if (!strcmp(metric_set->counters[c].symbol_name, symbol_name))
+            return true;
+    }
+    return false;
+}
+
+static void
+gputop_gen_append_counter(struct gputop_gen *gen,
+                          struct gputop_metric_set *metric_set,
+                          const struct gputop_metric_set_counter *counter)
+{
+    struct gputop_metric_set_counter *counters =
+        ralloc_array(gen, struct gputop_metric_set_counter,
+                     metric_set->n_counters + 1);
+
+    memcpy(counters, metric_set->counters,
+           metric_set->n_counters * sizeof(counters[0]));
+    counters[metric_set->n_counters] = *counter;
+
+    /* Previous arrays are kept, callers may still point into them. */
+    metric_set->counters = counters;
+    metric_set->n_counters++;
+
+    if (gen->root_group)
+        gputop_gen_add_counter(gen, &counters[metric_set->n_counters - 1]);
+}
+
+int
+gputop_gen_add_derived_counter(struct gputop_gen *gen,
+                               const char *symbol_name,
+                               const char *equation,
+                               const char **error)
+{
+    struct gputop_metric_set_counter counter = {};
+    int n_added = 0;
+
+    *error = NULL;
+
+    /* Must be usable as a $variable and as a gputop-wrapper column */
+    for (const char *c = symbol_name; *c; c++) {
+        if (!isalnum((unsigned char) *c) && *c != '_') {
+            *error = ralloc_asprintf(gen, "Invalid counter name '%s'", symbol_name);
+            return 0;
+        }
+    }
+    if (!symbol_name[0]) {
+        *error = "Empty counter name";
+        return 0;
+    }
+
+    if (!gen->builtin_counters) {
+        gen->builtin_counters = ralloc_array(NULL, struct gputop_metric_set_counters,
+                                             gen->n_metric_sets);
+        for (int s = 0; s < gen->n_metric_sets; s++) {
+            gen->builtin_counters[s].counters = gen->metric_sets[s]->counters;
+            gen->builtin_counters[s].n_counters = gen->metric_sets[s]->n_counters;
+        }
+    }
+
+    counter.name = ralloc_strdup(gen, symbol_name);
+    counter.symbol_name = counter.name;
+    counter.desc = ralloc_strdup(gen, equation);
+    counter.group = "Derived";
+    counter.type = GPUTOP_PERFQUERY_COUNTER_RAW;
+    counter.data_type = GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE;
+    counter.units = GPUTOP_PERFQUERY_COUNTER_UNITS_NUMBER;
+
+    for (int s = 0; s < gen->n_metric_sets; s++) {
+        struct gputop_metric_set *metric_set = gen->metric_sets[s];
+
+        if (gputop_metric_set_has_counter(metric_set, symbol_name)) {
+            *error = ralloc_asprintf(gen, "%s already has a counter named %s",
+                                     metric_set->symbol_name, symbol_name);
+            continue;
+        }
+
+        counter.metric_set = metric_set;
+        counter.expression =
+            gputop_oa_expression_compile(gen, metric_set, equation, error);
+        if (!counter.expression)
+            continue;
+
+        gputop_gen_append_counter(gen, metric_set, &counter);
+        n_added++;
+    }
+
+    return n_added;
+}
+
+void
+gputop_metric_set_evaluate_all(const struct gputop_devinfo *devinfo,
+                               const struct gputop_metric_set *metric_set,
+                               uint64_t *const *deltas,
+                               int n_deltas,
+                               double *values)
+{
+    metric_set->evaluate_all(devinfo, metric_set, deltas, n_deltas, values);
+
+    /* Derived counters come after the generated ones. */
+    for (int c = 0; c < metric_set->n_counters; c++) {
+        const struct gputop_metric_set_counter *counter = &metric_set->counters[c];
+
+        if (counter->expression) {
+            gputop_oa_expression_evaluate(counter->expression, devinfo, metric_set,
+                                          deltas, n_deltas, &values[c * n_deltas]);
+        }
+    }
 }
 
 void
-gputop_gen_add_metric_set(struct gputop_gen *gen,
-                          struct gputop_metric_set *metric_set)
+gputop_metric_set_counter_read_batch(const struct gputop_devinfo *devinfo,
+                                     const struct gputop_metric_set *metric_set,
+                                     const struct gputop_metric_set_counter *counter,
+                                     uint64_t *const *deltas,
+                                     int n_deltas,
+                                     float *values)
 {
-    list_addtail(&metric_set->link, &gen->metric_sets);
-    _mesa_hash_table_insert(gen->metric_sets_map,
-                            metric_set->hw_config_guid, metric_set);
+    double block[64];
+
+    if (!counter->expression) {
+        counter->oa_counter_read_batch(devinfo, metric_set, deltas, n_deltas, values);
+        return;
+    }
+
+    for (int first = 0; first < n_deltas; first += ARRAY_SIZE(block)) {
+        int n = MIN2(ARRAY_SIZE(block), n_deltas - first);
+
+        gputop_oa_expression_evaluate(counter->expression, devinfo, metric_set,
+                                      &deltas[first], n, block);
+        for (int i = 0; i < n; i++)
+            values[first + i] = block[i];
+    }
 }
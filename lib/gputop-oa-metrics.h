@@ -132,11 +132,13 @@ typedef enum {
 #define OAREPORT_REASON_CTX_SWITCH     (1<<3)
 
 struct gputop_metric_set;
+struct gputop_oa_expression;
 struct gputop_metric_set_counter {
     const struct gputop_metric_set *metric_set;
     const char *name;
     const char *symbol_name;
     const char *desc;
+    const char *group; /* '/' separated path of gputop_counter_group names */
     gputop_counter_type_t type;
     gputop_counter_data_type_t data_type;
     gputop_counter_units_t units;
@@ -158,7 +160,19 @@ struct gputop_metric_set_counter {
                                         uint64_t *deltas);
     };
 
-    struct list_head link; /* list from gputop_counter_group.counters */
+    /* Reads the counter out of n_deltas delta vectors at once, values are
+     * converted to float regardless of the counter's data type.
+     */
+    void (*oa_counter_read_batch)(const struct gputop_devinfo *devinfo,
+                                  const struct gputop_metric_set *metric_set,
+                                  uint64_t *const *deltas,
+                                  int n_deltas,
+                                  float *values);
+
+    /* Only for derived counters (see gputop_gen_add_derived_counter()),
+     * which have no read functions.
+     */
+    const struct gputop_oa_expression *expression;
 };
 
 struct gputop_register_prog {
@@ -166,13 +180,29 @@ struct gputop_register_prog {
     uint32_t val;
 };
 
+/* Metric sets are static objects generated by gputop-oa-codegen.py, their
+ * counters and register programs live in read only tables. Only the sets
+ * with counters or registers depending on the device get their counters &
+ * registers fields updated when registering a platform (so a process only
+ * deals with one device at a time).
+ */
 struct gputop_metric_set {
     const char *name;
     const char *symbol_name;
     const char *hw_config_guid;
-    struct gputop_metric_set_counter *counters;
+    const struct gputop_metric_set_counter *counters;
     int n_counters;
 
+    /* Reads all the counters out of n_deltas delta vectors, sharing the
+     * terms common to several equations. values[c * n_deltas + i] receives
+     * counters[c] for deltas[i].
+     */
+    void (*evaluate_all)(const struct gputop_devinfo *devinfo,
+                         const struct gputop_metric_set *metric_set,
+                         uint64_t *const *deltas,
+                         int n_deltas,
+                         double *values);
+
     uint64_t perf_oa_metrics_set;
     int perf_oa_format;
     int perf_raw_size;
@@ -184,47 +214,146 @@ struct gputop_metric_set {
     int b_offset;
     int c_offset;
 
-    struct gputop_register_prog *b_counter_regs;
+    const struct gputop_register_prog *b_counter_regs;
     uint32_t n_b_counter_regs;
 
-    struct gputop_register_prog *mux_regs;
+    const struct gputop_register_prog *mux_regs;
     uint32_t n_mux_regs;
 
-    struct gputop_register_prog *flex_regs;
+    const struct gputop_register_prog *flex_regs;
     uint32_t n_flex_regs;
-
-    struct list_head link;
 };
 
 struct gputop_counter_group {
     const char *name;
 
-    struct list_head counters;
+    const struct gputop_metric_set_counter **counters;
+    int n_counters;
+
     struct list_head groups;
 
     struct list_head link;  /* list from gputop_counter_group.groups */
 };
 
+/* Perfect hash of the metric sets of a platform, computed at build time :
+ * slots[gputop_metric_set_hash_string(seed, key) & mask] is the index of
+ * the only metric set that can match key, or -1.
+ */
+struct gputop_metric_set_hash {
+    uint32_t seed;
+    uint32_t mask;
+    const int16_t *slots;
+};
+
+/* Metric sets of a platform, as generated by gputop-oa-codegen.py and
+ * exported as gputop_oa_platform_<devname>, either linked in or from a
+ * gputop-metrics-<devname>.so plugin.
+ */
+struct gputop_oa_platform {
+    const char *devname;
+
+    struct gputop_metric_set *const *metric_sets;
+    int n_metric_sets;
+
+    struct gputop_metric_set_hash guid_hash;
+    struct gputop_metric_set_hash symbol_hash;
+
+    /* Updates the counters & registers of the sets depending on the device. */
+    void (*select_available)(const struct gputop_devinfo *devinfo);
+};
+
+struct gputop_metric_set_counters {
+    const struct gputop_metric_set_counter *counters;
+    int n_counters;
+};
+
 struct gputop_gen {
     const char *name;
 
+    struct gputop_metric_set *const *metric_sets;
+    int n_metric_sets;
+
+    struct gputop_metric_set_hash guid_hash;
+    struct gputop_metric_set_hash symbol_hash;
+
+    /* Built on first use, see gputop_gen_get_root_group() */
     struct gputop_counter_group *root_group;
 
-    struct list_head metric_sets;
-    struct hash_table *metric_sets_map;
+    /* Counters of the metric sets before adding derived counters, put back
+     * when freeing the gen.
+     */
+    struct gputop_metric_set_counters *builtin_counters;
+
+    /* dlopen() handle of the metrics plugin, closed with the gen. */
+    void *plugin;
 };
 
+/* Evaluating a whole set costs about as much as reading half of its
+ * counters one at a time.
+ */
+static inline bool
+gputop_metric_set_use_evaluate_all(const struct gputop_metric_set *metric_set,
+                                   int n_counters)
+{
+    return metric_set->evaluate_all != NULL &&
+        2 * n_counters >= metric_set->n_counters;
+}
+
+/* Computes the variables used by the equations (n_eus, subslice_mask,
+ * ...) from the topology fields.
+ */
+void gputop_devinfo_build_equations_variables(struct gputop_devinfo *devinfo);
+
+/* Returns the metric sets of the platform named devname (as in
+ * gputop_devinfo.devname), loading its plugin when built with
+ * -Dmetrics_plugins=true, or NULL if unsupported. Free with ralloc_free()
+ */
+struct gputop_gen *gputop_oa_get_metrics(const char *devname,
+                                         const struct gputop_devinfo *devinfo);
+
 /* Free with ralloc_free() */
 struct gputop_gen *gputop_gen_for_devinfo(const struct gen_device_info *devinfo);
 
-struct gputop_gen *gputop_gen_new(void);
+uint32_t gputop_metric_set_hash_string(uint32_t seed, const char *str);
 
-void gputop_gen_add_counter(struct gputop_gen *gen,
-                            struct gputop_metric_set_counter *counter,
-                            const char *group);
+struct gputop_metric_set *
+gputop_gen_find_metric_set(const struct gputop_gen *gen,
+                           const char *hw_config_guid);
 
-void gputop_gen_add_metric_set(struct gputop_gen *gen,
-                               struct gputop_metric_set *metric_set);
+struct gputop_metric_set *
+gputop_gen_find_metric_set_by_symbol(const struct gputop_gen *gen,
+                                     const char *symbol_name);
+
+/* Returns the tree of counter groups of all the metric sets. */
+struct gputop_counter_group *gputop_gen_get_root_group(struct gputop_gen *gen);
+
+/* Adds a counter computed from equation (see gputop-oa-expression.h) to
+ * all the metric sets in which the equation resolves, after their other
+ * counters and in the "Derived" group. Returns the number of metric sets
+ * the counter was added to, if none error explains why.
+ *
+ * Adding counters reallocates metric_set->counters, previous counter
+ * pointers stay valid until the gen is freed.
+ */
+int gputop_gen_add_derived_counter(struct gputop_gen *gen,
+                                   const char *symbol_name,
+                                   const char *equation,
+                                   const char **error);
+
+/* Same as metric_set->evaluate_all(), also evaluating derived counters. */
+void gputop_metric_set_evaluate_all(const struct gputop_devinfo *devinfo,
+                                    const struct gputop_metric_set *metric_set,
+                                    uint64_t *const *deltas,
+                                    int n_deltas,
+                                    double *values);
+
+/* Same as counter->oa_counter_read_batch(), also for derived counters. */
+void gputop_metric_set_counter_read_batch(const struct gputop_devinfo *devinfo,
+                                          const struct gputop_metric_set *metric_set,
+                                          const struct gputop_metric_set_counter *counter,
+                                          uint64_t *const *deltas,
+                                          int n_deltas,
+                                          float *values);
 
 #ifdef __cplusplus
 }
@@ -0,0 +1,177 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-oa-prefix-index.h"
+
+#include "util/macros.h"
+
+static uint64_t *
+entry_sums(const struct gputop_oa_prefix_index *index, uint32_t idx)
+{
+    return &index->sums[gputop_oa_prefix_index_pos(index, idx) * index->n_deltas];
+}
+
+/* Sums of all the entries before idx */
+static const uint64_t *
+sums_before(const struct gputop_oa_prefix_index *index, uint32_t idx)
+{
+    return idx == 0 ? index->base : entry_sums(index, idx - 1);
+}
+
+static void
+index_resize(struct gputop_oa_prefix_index *index, uint32_t capacity)
+{
+    uint64_t *start_times = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+    uint64_t *end_times = (uint64_t *) malloc(capacity * sizeof(uint64_t));
+    uint64_t *sums = (uint64_t *) malloc(capacity * index->n_deltas * sizeof(uint64_t));
+
+    for (uint32_t i = 0; i < index->count; i++) {
+        uint32_t pos = gputop_oa_prefix_index_pos(index, i);
+
+        start_times[i] = index->start_times[pos];
+        end_times[i] = index->end_times[pos];
+        memcpy(&sums[i * index->n_deltas], &index->sums[pos * index->n_deltas],
+               index->n_deltas * sizeof(uint64_t));
+    }
+
+    free(index->start_times);
+    free(index->end_times);
+    free(index->sums);
+    index->start_times = start_times;
+    index->end_times = end_times;
+    index->sums = sums;
+    index->capacity = capacity;
+    index->first = 0;
+}
+
+void
+gputop_oa_prefix_index_fini(struct gputop_oa_prefix_index *index)
+{
+    free(index->start_times);
+    free(index->end_times);
+    free(index->sums);
+    memset(index, 0, sizeof(*index));
+}
+
+void
+gputop_oa_prefix_index_clear(struct gputop_oa_prefix_index *index)
+{
+    index->first = 0;
+    index->count = 0;
+    memset(index->base, 0, sizeof(index->base));
+}
+
+void
+gputop_oa_prefix_index_append(struct gputop_oa_prefix_index *index,
+                              uint64_t start_time, uint64_t end_time,
+                              const uint64_t *deltas, int n_deltas)
+{
+    /* The number of deltas only changes with the metric set, at which
+     * point the index is cleared. */
+    if (index->count == 0 && index->n_deltas != n_deltas) {
+        gputop_oa_prefix_index_fini(index);
+        index->n_deltas = n_deltas;
+    }
+    assert(index->n_deltas == n_deltas);
+
+    if (index->count == index->capacity)
+        index_resize(index, MAX2(256, index->capacity * 2));
+
+    const uint64_t *prev = sums_before(index, index->count);
+    uint32_t pos = gputop_oa_prefix_index_pos(index, index->count++);
+    uint64_t *sums = &index->sums[pos * n_deltas];
+
+    index->start_times[pos] = start_time;
+    index->end_times[pos] = end_time;
+    for (int i = 0; i < n_deltas; i++)
+        sums[i] = prev[i] + (deltas ? deltas[i] : 0);
+}
+
+void
+gputop_oa_prefix_index_drop_before(struct gputop_oa_prefix_index *index,
+                                   uint64_t time)
+{
+    uint32_t n = 0;
+
+    while (n < index->count &&
+           index->end_times[gputop_oa_prefix_index_pos(index, n)] < time)
+        n++;
+
+    if (!n)
+        return;
+
+    memcpy(index->base, entry_sums(index, n - 1), index->n_deltas * sizeof(uint64_t));
+    index->first = gputop_oa_prefix_index_pos(index, n);
+    index->count -= n;
+}
+
+bool
+gputop_oa_prefix_index_find_range(const struct gputop_oa_prefix_index *index,
+                                  uint64_t start_time, uint64_t end_time,
+                                  uint32_t *first, uint32_t *count)
+{
+    uint32_t lo = 0, hi = index->count;
+
+    /* First entry starting at or after start_time */
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (index->start_times[gputop_oa_prefix_index_pos(index, mid)] < start_time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *first = lo;
+
+    /* First entry ending after end_time */
+    hi = index->count;
+    while (lo < hi) {
+        uint32_t mid = (lo + hi) / 2;
+
+        if (index->end_times[gputop_oa_prefix_index_pos(index, mid)] <= end_time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    *count = lo - *first;
+
+    return *count > 0;
+}
+
+void
+gputop_oa_prefix_index_sum(const struct gputop_oa_prefix_index *index,
+                           uint32_t first, uint32_t count,
+                           uint64_t *deltas)
+{
+    const uint64_t *start = sums_before(index, first);
+    const uint64_t *end = sums_before(index, first + count);
+
+    for (int i = 0; i < index->n_deltas; i++)
+        deltas[i] = end[i] - start[i];
+}
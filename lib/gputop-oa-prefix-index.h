@@ -0,0 +1,100 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gputop-oa-counters.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Running sums of the raw counter deltas (including the timestamp and clock
+ * deltas) between consecutive OA reports, one entry per pair of reports.
+ *
+ * The deltas accumulated over any range of entries are then the difference
+ * of two sums, and since the times of the entries only ever increase the
+ * entries of a time range are found with a binary search, making arbitrary
+ * range queries O(log n) whatever the number of reports.
+ *
+ * Entries are kept in a ring so the oldest can be dropped as the timeline
+ * moves on. Unsigned arithmetic makes the sums wrapping harmless.
+ *
+ * A zeroed index is a valid empty index.
+ */
+struct gputop_oa_prefix_index {
+    int n_deltas; /* set by the first entry */
+
+    uint32_t capacity;
+    uint32_t first;
+    uint32_t count;
+
+    uint64_t *start_times; /* of the first report of each pair, in ns */
+    uint64_t *end_times;
+    uint64_t *sums; /* n_deltas per entry, including its own deltas */
+
+    /* Sums up to the oldest entry */
+    uint64_t base[MAX_RAW_OA_COUNTERS];
+};
+
+void gputop_oa_prefix_index_fini(struct gputop_oa_prefix_index *index);
+void gputop_oa_prefix_index_clear(struct gputop_oa_prefix_index *index);
+
+/* Adds the deltas of the next pair of reports, NULL deltas meaning the
+ * reports couldn't be decoded (the entry keeps the index aligned with the
+ * reports). */
+void gputop_oa_prefix_index_append(struct gputop_oa_prefix_index *index,
+                                   uint64_t start_time, uint64_t end_time,
+                                   const uint64_t *deltas, int n_deltas);
+
+/* Drops the entries ending before the given time. */
+void gputop_oa_prefix_index_drop_before(struct gputop_oa_prefix_index *index,
+                                        uint64_t time);
+
+/* Finds the entries within [start_time, end_time], returns false if
+ * there's none. */
+bool gputop_oa_prefix_index_find_range(const struct gputop_oa_prefix_index *index,
+                                       uint64_t start_time, uint64_t end_time,
+                                       uint32_t *first, uint32_t *count);
+
+/* Writes the sums of the deltas of count entries starting from first
+ * (relative to the oldest entry) into n_deltas values. */
+void gputop_oa_prefix_index_sum(const struct gputop_oa_prefix_index *index,
+                                uint32_t first, uint32_t count,
+                                uint64_t *deltas);
+
+static inline uint32_t
+gputop_oa_prefix_index_pos(const struct gputop_oa_prefix_index *index, uint32_t idx)
+{
+    uint32_t pos = index->first + idx;
+    return pos >= index->capacity ? (pos - index->capacity) : pos;
+}
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,655 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+/* Implementation of gputop-network.h replaying a capture recorded with
+ * gputop_client_context_start_capture(), the host being the path of the
+ * capture.
+ *
+ * The connection plays the part of the server : requests are answered from
+ * what the server replied when recording, and once a stream is opened the
+ * recorded data of the stream that was opened with the same parameters is
+ * sent back, renamed with the new stream id.
+ *
+ * By default captures are replayed as fast as possible, setting
+ * GPUTOP_REPLAY_REALTIME=1 replays them at the speed they were recorded and
+ * GPUTOP_REPLAY_START_MS skips the beginning of a capture.
+ */
+
+#include "gputop-network.h"
+
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include <uv.h>
+
+#include "gputop-capture.h"
+#include "gputop.pb-c.h"
+
+#include "util/list.h"
+#include "util/macros.h"
+
+/* Chunks replayed per main loop iteration when replaying at full speed */
+#define REPLAY_CHUNKS_PER_TICK 64
+
+struct replay_reply {
+    struct list_head link;
+    size_t len;
+    uint8_t data[];
+};
+
+struct replay_stream {
+    struct list_head link;
+    uint32_t recorded_id;
+    uint32_t id;
+};
+
+struct _gputop_connection_t {
+    bool open;
+    bool started;
+
+    struct gputop_capture_reader *reader;
+    bool realtime;
+    uint64_t start_offset;
+
+    /* What the session being replayed sent/received */
+    const struct gputop_capture_chunk *features;
+    Gputop__Request **requests;
+    int n_requests;
+    Gputop__Message **replies;
+    int n_replies;
+
+    struct list_head replies_queue;
+    struct list_head streams;
+
+    size_t cursor;
+    uint64_t capture_start;
+    uint64_t replay_start;
+
+    uint8_t *buffer;
+    size_t buffer_size;
+
+    uv_timer_t timer_handle;
+
+    gputop_on_ready_cb_t ready_cb;
+    gputop_on_data_cb_t data_cb;
+    gputop_on_close_cb_t close_cb;
+    void *user_data;
+
+    gputop_msg_alloc_cb_t msg_alloc_cb;
+    gputop_msg_release_cb_t msg_release_cb;
+    gputop_on_msg_cb_t msg_cb;
+};
+
+static void
+on_close_cb(uv_handle_t *handle)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) handle->data;
+
+    list_for_each_entry_safe(struct replay_reply, reply, &conn->replies_queue, link)
+        free(reply);
+    list_for_each_entry_safe(struct replay_stream, stream, &conn->streams, link)
+        free(stream);
+    for (int i = 0; i < conn->n_requests; i++)
+        gputop__request__free_unpacked(conn->requests[i], NULL);
+    for (int i = 0; i < conn->n_replies; i++)
+        gputop__message__free_unpacked(conn->replies[i], NULL);
+    free(conn->requests);
+    free(conn->replies);
+    if (conn->reader)
+        gputop_capture_reader_close(conn->reader);
+    free(conn->buffer);
+    free(conn);
+}
+
+static void
+replay_end(gputop_connection_t *conn, const char *error)
+{
+    conn->open = false;
+    conn->close_cb(conn, error, conn->user_data);
+    uv_timer_stop(&conn->timer_handle);
+    uv_close((uv_handle_t *) &conn->timer_handle, on_close_cb);
+}
+
+static uint8_t *
+replay_buffer(gputop_connection_t *conn, size_t len)
+{
+    if (len > conn->buffer_size) {
+        conn->buffer_size = MAX2(len, conn->buffer_size * 2);
+        conn->buffer = (uint8_t *) realloc(conn->buffer, conn->buffer_size);
+    }
+
+    return conn->buffer;
+}
+
+static void
+replay_deliver(gputop_connection_t *conn, const void *data, size_t len)
+{
+    if (conn->msg_cb) {
+        void *msg = conn->msg_alloc_cb(len, conn->user_data);
+
+        memcpy(msg, data, len);
+        conn->msg_cb(conn, msg, len, conn->user_data);
+    } else
+        conn->data_cb(conn, data, len, conn->user_data);
+}
+
+/* Packs a protobuf message with the 8 bytes header of protobuf messages */
+static size_t
+pack_pb_message(ProtobufCMessage *pb_message, uint8_t *(*alloc)(void *, size_t),
+                void *alloc_data)
+{
+    size_t len = protobuf_c_message_get_packed_size(pb_message);
+    uint8_t *data = alloc(alloc_data, 8 + len);
+
+    memset(data, 0, 8);
+    data[0] = 2;
+    protobuf_c_message_pack(pb_message, data + 8);
+
+    return 8 + len;
+}
+
+static uint8_t *
+alloc_reply(void *data, size_t len)
+{
+    struct replay_reply **reply = (struct replay_reply **) data;
+
+    *reply = (struct replay_reply *) malloc(sizeof(**reply) + len);
+    (*reply)->len = len;
+
+    return (*reply)->data;
+}
+
+static uint8_t *
+alloc_buffer(void *data, size_t len)
+{
+    return replay_buffer((gputop_connection_t *) data, len);
+}
+
+/* Replies are queued as requests may be sent while handling data, which
+ * mustn't recurse into the data callback.
+ */
+static void
+queue_reply(gputop_connection_t *conn, Gputop__Message *message)
+{
+    struct replay_reply *reply;
+
+    pack_pb_message(&message->base, alloc_reply, &reply);
+    list_addtail(&reply->link, &conn->replies_queue);
+}
+
+static void
+queue_raw_reply(gputop_connection_t *conn, const void *data, size_t len)
+{
+    struct replay_reply *reply =
+        (struct replay_reply *) malloc(sizeof(*reply) + len);
+
+    reply->len = len;
+    memcpy(reply->data, data, len);
+    list_addtail(&reply->link, &conn->replies_queue);
+}
+
+static void
+queue_error(gputop_connection_t *conn, const char *uuid, const char *error)
+{
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+
+    message.reply_uuid = (char *) uuid;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+    message.error = (char *) error;
+    queue_reply(conn, &message);
+}
+
+static void
+queue_ack(gputop_connection_t *conn, const char *uuid)
+{
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+
+    message.reply_uuid = (char *) uuid;
+    message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+    message.ack = true;
+    queue_reply(conn, &message);
+}
+
+/* Indexes the requests and the replies we might need to answer requests
+ * with.
+ */
+static void
+load_session(gputop_connection_t *conn)
+{
+    const struct gputop_capture_chunk *chunk;
+    size_t cursor = gputop_capture_reader_begin(conn->reader);
+
+    while ((chunk = gputop_capture_reader_next(conn->reader, &cursor))) {
+        const uint8_t *data = gputop_capture_chunk_data(chunk);
+
+        if (chunk->type == GPUTOP_CAPTURE_CHUNK_SEND) {
+            Gputop__Request *request =
+                gputop__request__unpack(NULL, chunk->len, data);
+
+            if (!request)
+                continue;
+
+            if (request->req_case != GPUTOP__REQUEST__REQ_OPEN_STREAM &&
+                request->req_case != GPUTOP__REQUEST__REQ_GET_TRACEPOINT_INFO) {
+                gputop__request__free_unpacked(request, NULL);
+                continue;
+            }
+
+            conn->requests = (Gputop__Request **)
+                realloc(conn->requests, (conn->n_requests + 1) * sizeof(request));
+            conn->requests[conn->n_requests++] = request;
+        } else if (chunk->type == GPUTOP_CAPTURE_CHUNK_RECV &&
+                   chunk->len > 8 && data[0] == 2) {
+            Gputop__Message *message =
+                gputop__message__unpack(NULL, chunk->len - 8, data + 8);
+
+            if (!message)
+                continue;
+
+            if (message->cmd_case == GPUTOP__MESSAGE__CMD_FEATURES && !conn->features)
+                conn->features = chunk;
+
+            if (message->cmd_case != GPUTOP__MESSAGE__CMD_TRACEPOINT_INFO) {
+                gputop__message__free_unpacked(message, NULL);
+                continue;
+            }
+
+            conn->replies = (Gputop__Message **)
+                realloc(conn->replies, (conn->n_replies + 1) * sizeof(message));
+            conn->replies[conn->n_replies++] = message;
+        }
+    }
+}
+
+static bool
+open_stream_matches(const Gputop__OpenStream *a, const Gputop__OpenStream *b)
+{
+    if (a->type_case != b->type_case)
+        return false;
+
+    switch (a->type_case) {
+    case GPUTOP__OPEN_STREAM__TYPE_OA_STREAM:
+        return !strcmp(a->oa_stream->uuid, b->oa_stream->uuid);
+    case GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT:
+        return a->tracepoint->id == b->tracepoint->id &&
+            a->tracepoint->cpu == b->tracepoint->cpu &&
+            a->tracepoint->pid == b->tracepoint->pid;
+    case GPUTOP__OPEN_STREAM__TYPE_GENERIC:
+        return a->generic->type == b->generic->type &&
+            a->generic->config == b->generic->config &&
+            a->generic->cpu == b->generic->cpu &&
+            a->generic->pid == b->generic->pid;
+    case GPUTOP__OPEN_STREAM__TYPE_CPU_STATS:
+        return true;
+    default:
+        return false;
+    }
+}
+
+static struct replay_stream *
+find_stream(gputop_connection_t *conn, uint32_t recorded_id)
+{
+    list_for_each_entry(struct replay_stream, stream, &conn->streams, link) {
+        if (stream->recorded_id == recorded_id)
+            return stream;
+    }
+
+    return NULL;
+}
+
+static void
+start_replay(gputop_connection_t *conn)
+{
+    const struct gputop_capture_chunk *chunk;
+    size_t cursor;
+
+    conn->started = true;
+    conn->cursor = cursor =
+        gputop_capture_reader_seek(conn->reader,
+                                   gputop_capture_reader_start_time(conn->reader) +
+                                   conn->start_offset);
+    chunk = gputop_capture_reader_next(conn->reader, &cursor);
+    conn->capture_start = chunk ? chunk->timestamp : 0;
+    conn->replay_start = uv_hrtime();
+}
+
+static void
+handle_open_stream(gputop_connection_t *conn, Gputop__Request *request)
+{
+    Gputop__OpenStream *open_stream = request->open_stream;
+    int n_matches = 0;
+
+    /* A stream might have been opened & closed several times with the same
+     * parameters while recording, replay all of them. */
+    for (int i = 0; i < conn->n_requests; i++) {
+        const Gputop__Request *recorded = conn->requests[i];
+        struct replay_stream *stream;
+
+        if (recorded->req_case != GPUTOP__REQUEST__REQ_OPEN_STREAM ||
+            !open_stream_matches(recorded->open_stream, open_stream) ||
+            find_stream(conn, recorded->open_stream->id))
+            continue;
+
+        stream = (struct replay_stream *) calloc(1, sizeof(*stream));
+        stream->recorded_id = recorded->open_stream->id;
+        stream->id = open_stream->id;
+        list_addtail(&stream->link, &conn->streams);
+        n_matches++;
+    }
+
+    if (!n_matches) {
+        queue_error(conn, request->uuid, "No such stream in the capture");
+        return;
+    }
+
+    queue_ack(conn, request->uuid);
+
+    if (!conn->started)
+        start_replay(conn);
+}
+
+static void
+handle_close_stream(gputop_connection_t *conn, Gputop__Request *request)
+{
+    list_for_each_entry_safe(struct replay_stream, stream, &conn->streams, link) {
+        if (stream->id == request->close_stream) {
+            list_del(&stream->link);
+            free(stream);
+        }
+    }
+
+    queue_ack(conn, request->uuid);
+}
+
+static void
+handle_get_tracepoint_info(gputop_connection_t *conn, Gputop__Request *request)
+{
+    for (int i = 0; i < conn->n_requests; i++) {
+        const Gputop__Request *recorded = conn->requests[i];
+
+        if (recorded->req_case != GPUTOP__REQUEST__REQ_GET_TRACEPOINT_INFO ||
+            strcmp(recorded->get_tracepoint_info, request->get_tracepoint_info))
+            continue;
+
+        for (int j = 0; j < conn->n_replies; j++) {
+            Gputop__Message *reply = conn->replies[j];
+            char *reply_uuid = reply->reply_uuid;
+
+            if (!reply_uuid || strcmp(reply_uuid, recorded->uuid))
+                continue;
+
+            reply->reply_uuid = request->uuid;
+            queue_reply(conn, reply);
+            reply->reply_uuid = reply_uuid;
+            return;
+        }
+    }
+
+    queue_error(conn, request->uuid, "No such tracepoint in the capture");
+}
+
+/* Forwards a recorded message if it belongs to one of the opened streams,
+ * renamed with the id of the stream.
+ */
+static void
+replay_message(gputop_connection_t *conn, const uint8_t *data, size_t len)
+{
+    struct replay_stream *stream;
+    Gputop__Message *message;
+    uint32_t *id = NULL;
+
+    if (len < 8)
+        return;
+
+    switch (data[0]) {
+    case 1:
+    case 3:
+    case 4: /* compressed i915 perf records */
+        stream = find_stream(conn, *(const uint32_t *) (data + 4));
+        if (stream) {
+            uint8_t *copy = replay_buffer(conn, len);
+
+            memcpy(copy, data, len);
+            *(uint32_t *) (copy + 4) = stream->id;
+            replay_deliver(conn, copy, len);
+        }
+        return;
+    case 2:
+        break;
+    default:
+        return;
+    }
+
+    message = gputop__message__unpack(NULL, len - 8, data + 8);
+    if (!message)
+        return;
+
+    switch (message->cmd_case) {
+    case GPUTOP__MESSAGE__CMD_LOG:
+    case GPUTOP__MESSAGE__CMD_PROCESS_INFO:
+        replay_deliver(conn, data, len);
+        break;
+    case GPUTOP__MESSAGE__CMD_CPU_STATS:
+        id = &message->cpu_stats->id;
+        break;
+    case GPUTOP__MESSAGE__CMD_FILL_NOTIFY:
+        id = &message->fill_notify->stream_id;
+        break;
+    case GPUTOP__MESSAGE__CMD_DROP_NOTIFY:
+        id = &message->drop_notify->stream_id;
+        break;
+    case GPUTOP__MESSAGE__CMD_STREAM_STATS:
+        id = &message->stream_stats->stream_id;
+        break;
+    case GPUTOP__MESSAGE__CMD_OA_AGGREGATE:
+        id = &message->oa_aggregate->stream_id;
+        break;
+    default:
+        /* Replies to the recorded requests, these are answered when the
+         * requests are made again. */
+        break;
+    }
+
+    if (id && (stream = find_stream(conn, *id))) {
+        *id = stream->id;
+        len = pack_pb_message(&message->base, alloc_buffer, conn);
+        replay_deliver(conn, conn->buffer, len);
+    }
+
+    gputop__message__free_unpacked(message, NULL);
+}
+
+static void
+on_timer_cb(uv_timer_t *handle)
+{
+    gputop_connection_t *conn = (gputop_connection_t *) handle->data;
+    const struct gputop_capture_chunk *chunk;
+    uint64_t delay_ms = 0;
+
+    if (!conn->reader) {
+        replay_end(conn, "Unable to open capture");
+        return;
+    }
+
+    if (!conn->open) {
+        conn->open = true;
+        conn->ready_cb(conn, conn->user_data);
+    } else if (!list_empty(&conn->replies_queue)) {
+        struct list_head replies;
+
+        /* New replies queued while handling these go to the next tick */
+        list_replace(&conn->replies_queue, &replies);
+        list_inithead(&conn->replies_queue);
+
+        list_for_each_entry_safe(struct replay_reply, reply, &replies, link) {
+            if (conn->open)
+                replay_deliver(conn, reply->data, reply->len);
+            free(reply);
+        }
+    } else if (conn->started) {
+        uint64_t now = conn->capture_start + (uv_hrtime() - conn->replay_start);
+        int n_chunks = 0;
+
+        while (conn->open) {
+            size_t cursor = conn->cursor;
+
+            if (!(chunk = gputop_capture_reader_next(conn->reader, &cursor))) {
+                replay_end(conn, NULL);
+                return;
+            }
+
+            if (conn->realtime ? chunk->timestamp > now :
+                n_chunks++ == REPLAY_CHUNKS_PER_TICK) {
+                if (conn->realtime)
+                    delay_ms = (chunk->timestamp - now) / 1000000;
+                break;
+            }
+
+            conn->cursor = cursor;
+            if (chunk->type == GPUTOP_CAPTURE_CHUNK_RECV)
+                replay_message(conn, gputop_capture_chunk_data(chunk), chunk->len);
+        }
+    } else
+        return; /* Nothing to do until a stream is opened */
+
+    if (conn->open)
+        uv_timer_start(&conn->timer_handle, on_timer_cb, delay_ms, 0);
+}
+
+static void
+schedule(gputop_connection_t *conn)
+{
+    uv_timer_start(&conn->timer_handle, on_timer_cb, 0, 0);
+}
+
+gputop_connection_t *
+gputop_connect(const char *host, int port,
+               gputop_on_ready_cb_t ready_cb,
+               gputop_on_data_cb_t data_cb,
+               gputop_on_close_cb_t close_cb,
+               void *user_data)
+{
+    gputop_connection_t *conn =
+        (gputop_connection_t *) calloc(1, sizeof(gputop_connection_t));
+    const char *env;
+
+    conn->ready_cb = ready_cb;
+    conn->data_cb = data_cb;
+    conn->close_cb = close_cb;
+    conn->user_data = user_data;
+
+    list_inithead(&conn->replies_queue);
+    list_inithead(&conn->streams);
+
+    conn->reader = gputop_capture_reader_open(host);
+    if (conn->reader)
+        load_session(conn);
+
+    env = getenv("GPUTOP_REPLAY_REALTIME");
+    conn->realtime = env && strcmp(env, "0") != 0;
+    env = getenv("GPUTOP_REPLAY_START_MS");
+    conn->start_offset = env ? strtoull(env, NULL, 10) * 1000000ULL : 0;
+
+    /* Like a network connection, become ready from the main loop */
+    uv_timer_init(uv_default_loop(), &conn->timer_handle);
+    conn->timer_handle.data = conn;
+    schedule(conn);
+
+    return conn;
+}
+
+void
+gputop_connection_set_msg_pool(gputop_connection_t *conn,
+                               gputop_msg_alloc_cb_t alloc_cb,
+                               gputop_msg_release_cb_t release_cb,
+                               gputop_on_msg_cb_t msg_cb)
+{
+    assert(conn != NULL);
+
+    conn->msg_alloc_cb = alloc_cb;
+    conn->msg_release_cb = release_cb;
+    conn->msg_cb = msg_cb;
+}
+
+void
+gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
+{
+    Gputop__Request *request;
+
+    assert(conn != NULL);
+    assert(gputop_connection_connected(conn));
+    assert(data != NULL && len > 0);
+
+    request = gputop__request__unpack(NULL, len, (const uint8_t *) data);
+    if (!request)
+        return;
+
+    switch (request->req_case) {
+    case GPUTOP__REQUEST__REQ_GET_FEATURES:
+        if (conn->features) {
+            queue_raw_reply(conn, gputop_capture_chunk_data(conn->features),
+                            conn->features->len);
+        } else
+            queue_error(conn, request->uuid, "No features in the capture");
+        break;
+    case GPUTOP__REQUEST__REQ_OPEN_STREAM:
+        handle_open_stream(conn, request);
+        break;
+    case GPUTOP__REQUEST__REQ_CLOSE_STREAM:
+        handle_close_stream(conn, request);
+        break;
+    case GPUTOP__REQUEST__REQ_GET_TRACEPOINT_INFO:
+        handle_get_tracepoint_info(conn, request);
+        break;
+    case GPUTOP__REQUEST__REQ_GET_PROCESS_INFO:
+        /* Process infos are replayed along with the streams */
+        break;
+    default:
+        queue_error(conn, request->uuid, "Not supported when replaying a capture");
+        break;
+    }
+
+    gputop__request__free_unpacked(request, NULL);
+
+    schedule(conn);
+}
+
+void
+gputop_connection_close(gputop_connection_t *conn)
+{
+    assert(conn != NULL);
+
+    if (conn->open)
+        replay_end(conn, NULL);
+}
+
+bool
+gputop_connection_connected(gputop_connection_t *conn)
+{
+    assert(conn != NULL);
+
+    return conn->open;
+}
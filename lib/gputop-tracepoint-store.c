@@ -0,0 +1,294 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-tracepoint-store.h"
+#include "gputop-util.h"
+
+#include "util/macros.h"
+
+#define INITIAL_PAYLOAD_SIZE (16 * 1024)
+
+static struct gputop_tracepoint_block *
+block_new(void)
+{
+    struct gputop_tracepoint_block *block =
+        (struct gputop_tracepoint_block *) xmalloc(sizeof(*block));
+
+    block->len = 0;
+    block->payload_size = INITIAL_PAYLOAD_SIZE;
+    block->payload_len = 0;
+    block->payload = (uint8_t *) xmalloc(block->payload_size);
+
+    return block;
+}
+
+static void
+block_free(struct gputop_tracepoint_block *block)
+{
+    free(block->payload);
+    free(block);
+}
+
+/* Makes room for a sample at idx, with the payload appended to the arena
+ * whatever the sample's position. */
+static void
+block_insert(struct gputop_tracepoint_block *block, int idx,
+             uint64_t time, int cpu, const void *payload, uint32_t size)
+{
+    int n_after = block->len - idx;
+
+    if (block->payload_len + size > block->payload_size) {
+        while (block->payload_len + size > block->payload_size)
+            block->payload_size *= 2;
+        block->payload = (uint8_t *) xrealloc(block->payload, block->payload_size);
+    }
+
+    if (n_after) {
+        memmove(&block->times[idx + 1], &block->times[idx], n_after * sizeof(block->times[0]));
+        memmove(&block->cpus[idx + 1], &block->cpus[idx], n_after * sizeof(block->cpus[0]));
+        memmove(&block->offsets[idx + 1], &block->offsets[idx], n_after * sizeof(block->offsets[0]));
+        memmove(&block->sizes[idx + 1], &block->sizes[idx], n_after * sizeof(block->sizes[0]));
+    }
+
+    block->times[idx] = time;
+    block->cpus[idx] = cpu;
+    block->offsets[idx] = block->payload_len;
+    block->sizes[idx] = size;
+    memcpy(block->payload + block->payload_len, payload, size);
+    block->payload_len += size;
+    block->len++;
+}
+
+static void
+insert_block(struct gputop_tracepoint_store *store, int b,
+             struct gputop_tracepoint_block *block)
+{
+    if (store->n_blocks == store->blocks_size) {
+        store->blocks_size = MAX2(store->blocks_size * 2, 16);
+        store->blocks = (struct gputop_tracepoint_block **)
+            xrealloc(store->blocks, store->blocks_size * sizeof(store->blocks[0]));
+    }
+
+    memmove(&store->blocks[b + 1], &store->blocks[b],
+            (store->n_blocks - b) * sizeof(store->blocks[0]));
+    store->blocks[b] = block;
+    store->n_blocks++;
+}
+
+/* Moves the samples of a full block from idx onwards into a new block
+ * following it. NB: the payloads of the moved samples are left behind in
+ * the original block's arena until it gets freed. */
+static void
+split_block(struct gputop_tracepoint_store *store, int b, int idx)
+{
+    struct gputop_tracepoint_block *block = store->blocks[b];
+    struct gputop_tracepoint_block *next = block_new();
+
+    for (int i = idx; i < block->len; i++) {
+        block_insert(next, next->len, block->times[i], block->cpus[i],
+                     block->payload + block->offsets[i], block->sizes[i]);
+    }
+    block->len = idx;
+
+    insert_block(store, b + 1, next);
+}
+
+/* First index of a block with a time greater than the given one */
+static int
+block_upper_bound(const struct gputop_tracepoint_block *block, uint64_t time)
+{
+    int lo = 0, hi = block->len;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (block->times[mid] <= time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+static int
+block_lower_bound(const struct gputop_tracepoint_block *block, uint64_t time)
+{
+    int lo = 0, hi = block->len;
+
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+
+        if (block->times[mid] < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+void
+gputop_tracepoint_store_init(struct gputop_tracepoint_store *store)
+{
+    memset(store, 0, sizeof(*store));
+}
+
+void
+gputop_tracepoint_store_clear(struct gputop_tracepoint_store *store)
+{
+    for (int b = 0; b < store->n_blocks; b++)
+        block_free(store->blocks[b]);
+    store->n_blocks = 0;
+    store->n_samples = 0;
+}
+
+void
+gputop_tracepoint_store_fini(struct gputop_tracepoint_store *store)
+{
+    gputop_tracepoint_store_clear(store);
+    free(store->blocks);
+    store->blocks = NULL;
+    store->blocks_size = 0;
+}
+
+void
+gputop_tracepoint_store_add(struct gputop_tracepoint_store *store,
+                            uint64_t time, int cpu,
+                            const void *payload, uint32_t size)
+{
+    struct gputop_tracepoint_block *block;
+    int b, idx;
+
+    if (!store->n_blocks)
+        insert_block(store, 0, block_new());
+
+    /* The last block starting at or before the sample, which is almost
+     * always the last block */
+    for (b = store->n_blocks - 1; b > 0; b--) {
+        if (store->blocks[b]->times[0] <= time)
+            break;
+    }
+    block = store->blocks[b];
+    idx = block_upper_bound(block, time);
+
+    /* NB: blocks are never left empty, evict() and lower_bound() rely on
+     * every block having a last sample */
+    if (block->len == GPUTOP_TRACEPOINT_BLOCK_LEN) {
+        if (idx == block->len) {
+            /* Goes between this block and the next, if any, which starts
+             * after the sample */
+            if (b + 1 < store->n_blocks &&
+                store->blocks[b + 1]->len < GPUTOP_TRACEPOINT_BLOCK_LEN)
+                b++;
+            else
+                insert_block(store, ++b, block_new());
+            idx = 0;
+        } else if (b + 1 < store->n_blocks &&
+                   store->blocks[b + 1]->len < GPUTOP_TRACEPOINT_BLOCK_LEN) {
+            struct gputop_tracepoint_block *next = store->blocks[b + 1];
+            int last = block->len - 1;
+
+            /* Spill the last sample over to the following block */
+            block_insert(next, 0, block->times[last], block->cpus[last],
+                         block->payload + block->offsets[last],
+                         block->sizes[last]);
+            block->len--;
+        } else if (idx > 0) {
+            /* Late samples usually belong near the end of the block, so
+             * splitting where they go keeps the blocks mostly full */
+            split_block(store, b, idx);
+        } else {
+            split_block(store, b, block->len / 2);
+        }
+        block = store->blocks[b];
+    }
+
+    block_insert(block, idx, time, cpu, payload, size);
+    store->n_samples++;
+}
+
+uint64_t
+gputop_tracepoint_store_evict(struct gputop_tracepoint_store *store,
+                              uint64_t before)
+{
+    uint64_t n_evicted = 0;
+    int n_blocks = 0;
+
+    while (n_blocks < store->n_blocks) {
+        struct gputop_tracepoint_block *block = store->blocks[n_blocks];
+
+        if (block->times[block->len - 1] >= before)
+            break;
+
+        n_evicted += block->len;
+        block_free(block);
+        n_blocks++;
+    }
+
+    if (n_blocks) {
+        store->n_blocks -= n_blocks;
+        memmove(&store->blocks[0], &store->blocks[n_blocks],
+                store->n_blocks * sizeof(store->blocks[0]));
+        store->n_samples -= n_evicted;
+    }
+
+    return n_evicted;
+}
+
+struct gputop_tracepoint_pos
+gputop_tracepoint_store_lower_bound(const struct gputop_tracepoint_store *store,
+                                    uint64_t time)
+{
+    struct gputop_tracepoint_pos pos = { 0, 0 };
+    int lo = 0, hi = store->n_blocks;
+
+    if (!store->n_blocks)
+        return pos;
+
+    /* First block whose last sample isn't before the given time */
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        const struct gputop_tracepoint_block *block = store->blocks[mid];
+
+        if (block->times[block->len - 1] < time)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    if (lo == store->n_blocks) {
+        pos.block = store->n_blocks - 1;
+        pos.idx = store->blocks[pos.block]->len;
+    } else {
+        pos.block = lo;
+        pos.idx = block_lower_bound(store->blocks[lo], time);
+    }
+
+    return pos;
+}
@@ -0,0 +1,177 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Time ordered store of the samples of one tracepoint.
+ *
+ * Samples are kept in blocks of up to GPUTOP_TRACEPOINT_BLOCK_LEN entries,
+ * with the times, CPUs and payload locations stored as columns and the raw
+ * payloads packed into a per-block arena. Expired samples are dropped a
+ * whole block at a time and the first/last times of the blocks act as an
+ * index for finding the start of a time range.
+ *
+ * Samples normally arrive in order so adding one is an append, but samples
+ * from per CPU streams can be a little late and are inserted in place,
+ * splitting a block if needed.
+ */
+
+#define GPUTOP_TRACEPOINT_BLOCK_LEN 1024
+
+struct gputop_tracepoint_block {
+    int len;
+
+    uint64_t times[GPUTOP_TRACEPOINT_BLOCK_LEN];
+    int32_t cpus[GPUTOP_TRACEPOINT_BLOCK_LEN];
+    uint32_t offsets[GPUTOP_TRACEPOINT_BLOCK_LEN]; /* into payload */
+    uint32_t sizes[GPUTOP_TRACEPOINT_BLOCK_LEN];
+
+    uint8_t *payload;
+    size_t payload_len;
+    size_t payload_size;
+};
+
+struct gputop_tracepoint_store {
+    struct gputop_tracepoint_block **blocks;
+    int n_blocks;
+    int blocks_size;
+
+    uint64_t n_samples;
+};
+
+/* Position of a sample, only valid until the store is next modified */
+struct gputop_tracepoint_pos {
+    int block;
+    int idx;
+};
+
+void gputop_tracepoint_store_init(struct gputop_tracepoint_store *store);
+void gputop_tracepoint_store_fini(struct gputop_tracepoint_store *store);
+void gputop_tracepoint_store_clear(struct gputop_tracepoint_store *store);
+
+void gputop_tracepoint_store_add(struct gputop_tracepoint_store *store,
+                                 uint64_t time, int cpu,
+                                 const void *payload, uint32_t size);
+
+/* Frees the blocks only holding samples older than the given time. Returns
+ * the number of samples dropped. */
+uint64_t gputop_tracepoint_store_evict(struct gputop_tracepoint_store *store,
+                                       uint64_t before);
+
+/* Position of the first sample at or after the given time, which is past
+ * the end if there's none. */
+struct gputop_tracepoint_pos
+gputop_tracepoint_store_lower_bound(const struct gputop_tracepoint_store *store,
+                                    uint64_t time);
+
+static inline bool
+gputop_tracepoint_store_empty(const struct gputop_tracepoint_store *store)
+{
+    return store->n_blocks == 0;
+}
+
+static inline bool
+gputop_tracepoint_pos_valid(const struct gputop_tracepoint_store *store,
+                            struct gputop_tracepoint_pos pos)
+{
+    return pos.block >= 0 && pos.block < store->n_blocks &&
+        pos.idx < store->blocks[pos.block]->len;
+}
+
+static inline struct gputop_tracepoint_pos
+gputop_tracepoint_pos_next(const struct gputop_tracepoint_store *store,
+                           struct gputop_tracepoint_pos pos)
+{
+    if (++pos.idx >= store->blocks[pos.block]->len &&
+        pos.block + 1 < store->n_blocks) {
+        pos.block++;
+        pos.idx = 0;
+    }
+    return pos;
+}
+
+static inline struct gputop_tracepoint_pos
+gputop_tracepoint_pos_prev(const struct gputop_tracepoint_store *store,
+                           struct gputop_tracepoint_pos pos)
+{
+    if (pos.idx > 0) {
+        pos.idx--;
+    } else if (pos.block > 0) {
+        pos.block--;
+        pos.idx = store->blocks[pos.block]->len - 1;
+    } else
+        pos.block = -1;
+    return pos;
+}
+
+static inline uint64_t
+gputop_tracepoint_store_time(const struct gputop_tracepoint_store *store,
+                             struct gputop_tracepoint_pos pos)
+{
+    return store->blocks[pos.block]->times[pos.idx];
+}
+
+static inline int
+gputop_tracepoint_store_cpu(const struct gputop_tracepoint_store *store,
+                            struct gputop_tracepoint_pos pos)
+{
+    return store->blocks[pos.block]->cpus[pos.idx];
+}
+
+static inline const uint8_t *
+gputop_tracepoint_store_payload(const struct gputop_tracepoint_store *store,
+                                struct gputop_tracepoint_pos pos,
+                                uint32_t *size)
+{
+    const struct gputop_tracepoint_block *block = store->blocks[pos.block];
+
+    if (size)
+        *size = block->sizes[pos.idx];
+    return block->payload + block->offsets[pos.idx];
+}
+
+/* Time of the most recent sample, 0 if the store is empty */
+static inline uint64_t
+gputop_tracepoint_store_last_time(const struct gputop_tracepoint_store *store)
+{
+    const struct gputop_tracepoint_block *block;
+
+    if (!store->n_blocks)
+        return 0;
+    block = store->blocks[store->n_blocks - 1];
+    return block->times[block->len - 1];
+}
+
+#ifdef __cplusplus
+}
+#endif
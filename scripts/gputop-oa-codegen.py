@@ -371,6 +371,10 @@ def output_counter_read(gen, set, counter):
         c.indent(4)
         c("%s" % hashed_funcs[counter.read_hash])
         c.outdent(4)
+        c("#define %s \\" % counter.read_batch_sym)
+        c.indent(4)
+        c("%s_batch" % hashed_funcs[counter.read_hash])
+        c.outdent(4)
     else:
         ret_type = counter.get('data_type')
         ret_ctype = data_type_to_ctype(ret_type)
@@ -391,6 +395,25 @@ def output_counter_read(gen, set, counter):
         c.outdent(4)
         c("}")
 
+        c("\n")
+        c("static void")
+        c(counter.read_batch_sym + "(const struct gputop_devinfo *devinfo,\n")
+        c.indent(len(counter.read_batch_sym) + 1)
+        c("const struct gputop_metric_set *metric_set,\n")
+        c("uint64_t *const *accumulators,\n")
+        c("int n_accumulators,\n")
+        c("float *values)\n")
+        c.outdent(len(counter.read_batch_sym) + 1)
+
+        c("{")
+        c.indent(4)
+        c("for (int i = 0; i < n_accumulators; i++)")
+        c.indent(4)
+        c("values[i] = " + counter.read_sym + "(devinfo, metric_set, accumulators[i]);")
+        c.outdent(4)
+        c.outdent(4)
+        c("}")
+
         hashed_funcs[counter.read_hash] = counter.read_sym
 
 
@@ -431,6 +454,151 @@ def output_counter_max(gen, set, counter):
         hashed_funcs[counter.max_hash] = counter.max_sym
 
 
+class EvalNode:
+    def __init__(self, key, op=None, args=[], text=None, const=True):
+        self.key = key
+        self.op = op
+        self.args = args
+        self.text = text
+        self.const = const
+
+
+# Builds the expression DAG of a counter's equation, sharing the nodes of
+# identical sub-expressions (and referenced counters) across the whole set.
+def build_eval_counter_node(set, counter, nodes, order):
+    key = "$" + counter.get('symbol_name')
+    if key in nodes:
+        return nodes[key]
+
+    equation = counter.get('equation')
+    stack = []
+
+    def operand_node(token):
+        if isinstance(token, EvalNode):
+            return token
+        if token[0] == "$":
+            if token in hw_vars:
+                if token not in nodes:
+                    node = EvalNode(token, op="HW", text=hw_vars[token]['c'])
+                    nodes[token] = node
+                    order.append(node)
+                return nodes[token]
+            elif token in set.counter_vars:
+                return build_eval_counter_node(set, set.counter_vars[token], nodes, order)
+            raise Exception("Failed to resolve variable " + token + " in equation " + equation + " for " + set.name + " :: " + counter.get('name'));
+        return EvalNode(token, text=token)
+
+    for token in equation.split():
+        stack.append(token)
+        while stack and not isinstance(stack[-1], EvalNode) and stack[-1] in ops:
+            op = stack.pop()
+            argc = ops[op][0]
+            args = []
+            for i in range(0, argc):
+                args.append(operand_node(stack.pop()))
+            op_key = op + "(" + ", ".join([a.key for a in args]) + ")"
+            if op_key not in nodes:
+                node = EvalNode(op_key, op=op, args=args,
+                                const=(op != "READ" and all([a.const for a in args])))
+                nodes[op_key] = node
+                order.append(node)
+            stack.append(nodes[op_key])
+
+    if len(stack) != 1:
+        raise Exception("Spurious empty rpn code for " + set.name + " :: " +
+                counter.get('name') + ".\nThis is probably due to some unhandled RPN function, in the equation \"" +
+                equation + "\"")
+
+    # Counters referenced by other equations are read back through their
+    # C type, keep the same conversion here.
+    root = operand_node(stack[-1])
+    node = EvalNode(key, op="COUNTER", args=[root], const=root.const)
+    node.ctype = data_type_to_ctype(counter.get('data_type'))
+    nodes[key] = node
+    order.append(node)
+
+    return node
+
+
+def output_eval_node(tmp_id, node):
+    if node.op == "HW":
+        c("uint64_t tmp{0} = {1};".format(tmp_id, node.text))
+        tmp_id += 1
+    elif node.op == "COUNTER":
+        c("{0} tmp{1} = {2};".format(node.ctype, tmp_id, node.args[0].text))
+        tmp_id += 1
+    else:
+        tmp_id = ops[node.op][1](tmp_id, [a.text for a in node.args])
+    node.text = "tmp{0}".format(tmp_id - 1)
+    return tmp_id
+
+
+# Evaluates all the counters of a set in one go : every sub-expression is
+# computed once per delta vector and terms only depending on devinfo are
+# hoisted out of the loop.
+def output_set_evaluate_all(gen, set):
+    nodes = {}
+    order = []
+
+    counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+    for counter in counters:
+        build_eval_counter_node(set, counter, nodes, order)
+
+    c("\n")
+    c("/* {0} :: all counters */".format(set.name))
+    c("static void")
+    c(set.evaluate_all_sym + "(const struct gputop_devinfo *devinfo,\n")
+    c.indent(len(set.evaluate_all_sym) + 1)
+    c("const struct gputop_metric_set *metric_set,\n")
+    c("uint64_t *const *deltas,\n")
+    c("int n_deltas,\n")
+    c("double *values)\n")
+    c.outdent(len(set.evaluate_all_sym) + 1)
+
+    c("{")
+    c.indent(4)
+
+    tmp_id = 0
+    for node in order:
+        if node.const:
+            tmp_id = output_eval_node(tmp_id, node)
+
+    availabilities = {}
+    for counter in counters:
+        availability = counter.get('availability')
+        if availability and availability not in availabilities:
+            availabilities[availability] = "avail{0}".format(len(availabilities))
+            c("bool {0} = {1};".format(availabilities[availability],
+                                       splice_rpn_expression(set, counter.get('name'), availability)))
+
+    c("\n")
+    c("for (int i = 0; i < n_deltas; i++) {")
+    c.indent(4)
+    c("uint64_t *accumulator = deltas[i];")
+    c("int n = 0;\n")
+
+    for node in order:
+        if not node.const:
+            tmp_id = output_eval_node(tmp_id, node)
+
+    c("\n")
+    for counter in counters:
+        value = nodes["$" + counter.get('symbol_name')].text
+        availability = counter.get('availability')
+        if availability:
+            c("if ({0})".format(availabilities[availability]))
+            c.indent(4)
+        c("values[n++ * n_deltas + i] = {0};".format(value))
+        if availability:
+            c.outdent(4)
+
+    c.outdent(4)
+    c("}")
+
+    c.outdent(4)
+    c("}")
+
+
 semantic_type_map = {
     "duration": "raw",
     "ratio": "event"
@@ -455,13 +623,9 @@ def output_units(unit):
     return unit.replace(' ', '_').upper()
 
 
-def output_counter_report(set, counter):
+def output_counter_entry(set, counter):
     data_type = counter.get('data_type')
     data_type_uc = data_type.upper()
-    c_type = data_type
-
-    if "uint" in c_type:
-        c_type = c_type + "_t"
 
     semantic_type = counter.get('semantic_type')
     if semantic_type in semantic_type_map:
@@ -469,72 +633,239 @@ def output_counter_report(set, counter):
 
     semantic_type_uc = semantic_type.upper()
 
-    c("\n")
+    c("{")
+    c.indent(4)
+    c(".metric_set = &{0},".format(set.sym))
+    c(".name = \"{0}\",".format(counter.get('name')))
+    c(".symbol_name = \"{0}\",".format(counter.get('symbol_name')))
+    c(".desc = \"{0}\",".format(counter.get('description')))
+    c(".group = \"{0}\",".format(counter.get('mdapi_group')))
+    c(".type = GPUTOP_PERFQUERY_COUNTER_{0},".format(semantic_type_uc))
+    c(".data_type = GPUTOP_PERFQUERY_COUNTER_DATA_{0},".format(data_type_uc))
+    c(".units = GPUTOP_PERFQUERY_COUNTER_UNITS_{0},".format(output_units(counter.get('units'))))
+    c(".max_{0} = {1},".format(data_type, set.max_funcs[counter.get('symbol_name')]))
+    c(".oa_counter_read_{0} = {1},".format(data_type, set.read_funcs[counter.get('symbol_name')]))
+    c(".oa_counter_read_batch = {0}_batch,".format(set.read_funcs[counter.get('symbol_name')]))
+    c.outdent(4)
+    c("},")
+
+
+register_types = {
+    'FLEX': 'flex_regs',
+    'NOA': 'mux_regs',
+    'OA': 'b_counter_regs',
+}
 
-    availability = counter.get('availability')
-    if availability:
-        output_availability(set, availability, counter.get('name'))
-        c.indent(4)
+# Returns the register configs of a set per type of registers, as lists of
+# (availability, registers) in programming order.
+def set_register_configs(set):
+    configs = {}
+    for register_config in set.findall('register_config'):
+        t = register_types[register_config.get('type')]
+        regs = [(r.get('address'), r.get('value')) for r in register_config.findall('register')]
+        configs.setdefault(t, []).append((register_config.get('availability'), regs))
+    return configs
 
-    c("counter = &metric_set->counters[metric_set->n_counters++];\n")
-    c("counter->metric_set = metric_set;\n")
-    c("counter->oa_counter_read_{0} = {1};\n".format(data_type, set.read_funcs[counter.get('symbol_name')]))
-    c("counter->name = \"{0}\";\n".format(counter.get('name')))
-    c("counter->symbol_name = \"{0}\";\n".format(counter.get('symbol_name')));
-    c("counter->desc = \"{0}\";\n".format(counter.get('description')))
-    c("counter->type = GPUTOP_PERFQUERY_COUNTER_{0};\n".format(semantic_type_uc))
-    c("counter->data_type = GPUTOP_PERFQUERY_COUNTER_DATA_{0};\n".format(data_type_uc))
-    c("counter->units = GPUTOP_PERFQUERY_COUNTER_UNITS_{0};\n".format(output_units(counter.get('units'))))
-    c("counter->max_{0} = {1};\n".format(data_type, set.max_funcs[counter.get('symbol_name')]))
-    c("gputop_gen_add_counter(gen, counter, \"{0}\");\n".format(counter.get('mdapi_group')))
-
-    if availability:
-        c.outdent(4)
-        c("}\n")
 
+def output_register_array(sym, regs):
+    c("static const struct gputop_register_prog {0}[] = {{".format(sym))
+    c.indent(4)
+    for address, value in regs:
+        c("{{ .reg = {0}, .val = {1} }},".format(address, value))
+    c.outdent(4)
+    c("};")
 
-def generate_register_configs(set):
-    register_types = {
-        'FLEX': 'flex_regs',
-        'NOA': 'mux_regs',
-        'OA': 'b_counter_regs',
-    }
 
-    # allocate memory
-    total_n_registers = {}
-    register_configs = set.findall('register_config')
-    for register_config in register_configs:
-        t = register_types[register_config.get('type')]
-        if t not in total_n_registers:
-            total_n_registers[t] = len(register_config.findall('register'))
+# Emits the read only tables of a set. The parts depending on the
+# availability of counters or registers are copied at registration into
+# static arrays by <set>__select_available().
+def output_set_tables(gen, set):
+    counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+    configs = set_register_configs(set)
+
+    c("\n")
+    c("/* {0} */".format(set.name))
+    c("static struct gputop_metric_set {0};".format(set.sym))
+    c("\n")
+
+    c("static const struct gputop_metric_set_counter {0}__counters[] = {{".format(set.sym))
+    c.indent(4)
+    for counter in counters:
+        output_counter_entry(set, counter)
+    c.outdent(4)
+    c("};")
+
+    if set.has_counter_availability:
+        c("static struct gputop_metric_set_counter {0}__available_counters[{1}];".format(set.sym, len(counters)))
+
+    for t in sorted(configs):
+        if set.has_register_availability(t):
+            for i, (availability, regs) in enumerate(configs[t]):
+                output_register_array("{0}__{1}_{2}".format(set.sym, t, i), regs)
+            n_regs = sum([len(regs) for availability, regs in configs[t]])
+            c("static struct gputop_register_prog {0}__available_{1}[{2}];".format(set.sym, t, n_regs))
         else:
-            total_n_registers[t] += len(register_config.findall('register'))
+            regs = []
+            for availability, config_regs in configs[t]:
+                regs += config_regs
+            output_register_array("{0}__{1}".format(set.sym, t), regs)
 
-    for reg in total_n_registers:
-        c("metric_set->%s = rzalloc_array(metric_set, struct gputop_register_prog, %i);" %
-          (reg, total_n_registers[reg]))
     c("\n")
+    c("static struct gputop_metric_set {0} = {{".format(set.sym))
+    c.indent(4)
+    c(".name = \"{0}\",".format(set.name))
+    c(".symbol_name = \"{0}\",".format(set.symbol_name))
+    c(".hw_config_guid = \"{0}\",".format(set.hw_config_guid))
+    if set.has_counter_availability:
+        c(".counters = {0}__available_counters,".format(set.sym))
+        c(".n_counters = 0, /* depends on the device */")
+    else:
+        c(".counters = {0}__counters,".format(set.sym))
+        c(".n_counters = {0},".format(len(counters)))
+    c(".evaluate_all = {0},".format(set.evaluate_all_sym))
+    c(".perf_oa_metrics_set = 0, /* determined at runtime */")
+
+    if gen.chipset == "hsw":
+        c(".perf_oa_format = I915_OA_FORMAT_A45_B8_C8,")
+        c(".perf_raw_size = 256,")
+        c(".gpu_time_offset = 0,")
+        c(".a_offset = 1,")
+        c(".b_offset = 1 + 45,")
+        c(".c_offset = 1 + 45 + 8,")
+    else:
+        c(".perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8,")
+        c(".perf_raw_size = 256,")
+        c(".gpu_time_offset = 0,")
+        c(".gpu_clock_offset = 1,")
+        c(".a_offset = 2,")
+        c(".b_offset = 2 + 36,")
+        c(".c_offset = 2 + 36 + 8,")
+
+    for t in sorted(configs):
+        if set.has_register_availability(t):
+            c(".{1} = {0}__available_{1},".format(set.sym, t))
+            c(".n_{0} = 0, /* depends on the device */".format(t))
+        else:
+            c(".{1} = {0}__{1},".format(set.sym, t))
+            c(".n_{0} = {1},".format(t, sum([len(regs) for availability, regs in configs[t]])))
 
-    # fill in register/values
-    register_configs = set.findall('register_config')
-    for register_config in register_configs:
-        t = register_types[register_config.get('type')]
+    c.outdent(4)
+    c("};")
 
-        availability = register_config.get('availability')
-        if availability:
-            output_availability(set, availability, register_config.get('type') + ' register config')
-            c.indent(4)
 
-        for register in register_config.findall('register'):
-            c("metric_set->%s[metric_set->n_%s++] = (struct gputop_register_prog) { .reg = %s, .val = %s };" %
-              (t, t, register.get('address'), register.get('value')))
+def output_set_select_available(gen, set):
+    counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
+    configs = set_register_configs(set)
 
-        if availability:
-            c.outdent(4)
-            c("}")
+    c("\n")
+    c("static void")
+    c(set.sym + "__select_available(const struct gputop_devinfo *devinfo)")
+    c("{")
+    c.indent(4)
+    c("struct gputop_metric_set *metric_set = &{0};".format(set.sym))
+
+    if set.has_counter_availability:
+        c("\n")
+        c("metric_set->n_counters = 0;")
+        # Copy the runs of counters always available at once.
+        i = 0
+        while i < len(counters):
+            availability = counters[i].get('availability')
+            if availability:
+                output_availability(set, availability, counters[i].get('name'))
+                c.indent(4)
+                c("{0}__available_counters[metric_set->n_counters++] = {0}__counters[{1}];".format(set.sym, i))
+                c.outdent(4)
+                c("}")
+                i += 1
+            else:
+                j = i
+                while j < len(counters) and not counters[j].get('availability'):
+                    j += 1
+                c("memcpy(&{0}__available_counters[metric_set->n_counters], &{0}__counters[{1}],".format(set.sym, i))
+                c("       {0} * sizeof({1}__counters[0]));".format(j - i, set.sym))
+                c("metric_set->n_counters += {0};".format(j - i))
+                i = j
+        c("assert(metric_set->n_counters <= {0});".format(len(counters)))
+
+    for t in sorted(configs):
+        if not set.has_register_availability(t):
+            continue
         c("\n")
+        c("metric_set->n_{0} = 0;".format(t))
+        for i, (availability, regs) in enumerate(configs[t]):
+            if availability:
+                output_availability(set, availability, t + ' register config')
+                c.indent(4)
+            c("memcpy(&{0}__available_{1}[metric_set->n_{1}], {0}__{1}_{2}, sizeof({0}__{1}_{2}));".format(set.sym, t, i))
+            c("metric_set->n_{0} += {1};".format(t, len(regs)))
+            if availability:
+                c.outdent(4)
+                c("}")
+
+    c.outdent(4)
+    c("}")
+
+
+# FNV-1a, gputop_metric_set_hash_string() must give the same values.
+def hash_string(seed, string):
+    h = (2166136261 ^ seed) & 0xffffffff
+    for char in string:
+        h ^= ord(char)
+        h = (h * 16777619) & 0xffffffff
+    return h
+
+
+# Finds a seed for which the keys land in distinct slots of a power of two
+# sized table, the table holding the index of each key (or -1).
+def perfect_hash(keys):
+    size = 1
+    while size < 4 * len(keys):
+        size *= 2
+
+    while True:
+        for seed in range(0, 4096):
+            slots = [-1] * size
+            for i, key in enumerate(keys):
+                slot = hash_string(seed, key) & (size - 1)
+                if slots[slot] != -1:
+                    break
+                slots[slot] = i
+            else:
+                return seed, size, slots
+        size *= 2
+
+
+# Prints the slots of the table and returns the initializer of its
+# gputop_metric_set_hash.
+def output_perfect_hash(sym, keys):
+    seed, size, slots = perfect_hash(keys)
+
+    c("static const int16_t {0}_slots[{1}] = {{".format(sym, size))
+    c.indent(4)
+    for i in range(0, size, 16):
+        c(", ".join([str(s) for s in slots[i:i + 16]]) + ",")
+    c.outdent(4)
+    c("};")
+
+    return "{{ .seed = {0}u, .mask = {1}, .slots = {2}_slots }}".format(seed, size - 1, sym)
+
+
+def output_gen_tables(gen):
+    c("\n")
+    c("static struct gputop_metric_set *const {0}_metric_sets[] = {{".format(gen.chipset))
+    c.indent(4)
+    for set in gen.sets:
+        c("&{0},".format(set.sym))
+    c.outdent(4)
+    c("};")
+    c("\n")
+
+    gen.guid_hash = output_perfect_hash(gen.chipset + "_guid_hash",
+                                        [set.hw_config_guid for set in gen.sets])
+    gen.symbol_hash = output_perfect_hash(gen.chipset + "_symbol_hash",
+                                          [set.symbol_name for set in gen.sets])
 
-#
 
 class Counter:
     def __init__(self, set, xml):
@@ -546,6 +877,7 @@ class Counter:
         self.read_sym = "{0}__{1}__{2}__read".format(self.set.gen.chipset,
                                                      self.set.underscore_name,
                                                      self.xml.get('underscore_name'))
+        self.read_batch_sym = self.read_sym + "_batch"
 
         max_eq = self.xml.get('max_equation')
         if not max_eq:
@@ -599,9 +931,27 @@ class Set:
             self.max_funcs[counter.get('symbol_name')] = counter.max_sym
             self.read_funcs[counter.get('symbol_name')] = counter.read_sym
 
+        self.sym = "{0}__{1}".format(self.gen.chipset, self.underscore_name)
+        self.evaluate_all_sym = self.sym + "__evaluate_all"
+
+        self.has_counter_availability = \
+            any([counter.get('availability') for counter in self.counters])
+
         for counter in self.counters:
             counter.compute_hashes()
 
+    def has_register_availability(self, register_type):
+        for register_config in self.findall('register_config'):
+            if register_types[register_config.get('type')] == register_type and \
+               register_config.get('availability'):
+                return True
+        return False
+
+    @property
+    def needs_select_available(self):
+        return self.has_counter_availability or \
+            any([self.has_register_availability(t) for t in register_types.values()])
+
     @property
     def hw_config_guid(self):
         return self.xml.get('hw_config_guid')
@@ -631,6 +981,8 @@ class Gen:
         self.xml = et.parse(self.filename)
         self.chipset = self.xml.find('.//set').get('chipset').lower()
         self.sets = []
+        self.guid_hash = None
+        self.symbol_hash = None
 
         for xml_set in self.xml.findall(".//set"):
             self.sets.append(Set(self, xml_set))
@@ -711,97 +1063,49 @@ def main():
 
         #include "gputop-oa-metrics.h"
 
-        #include "util/ralloc.h"
-
         #define MIN(x, y) (((x) < (y)) ? (x) : (y))
         #define MAX(a, b) (((a) > (b)) ? (a) : (b))
 
-        static double
-        percentage_max_callback_float(const struct gputop_devinfo *devinfo,
-                                      const struct gputop_metric_set *metric_set,
-                                      uint64_t *accumulator)
-        {
-           return 100;
-        }
-
-        static uint64_t
-        percentage_max_callback_uint64(const struct gputop_devinfo *devinfo,
-                                       const struct gputop_metric_set *metric_set,
-                                       uint64_t *accumulator)
-        {
-           return 100;
-        }
-
         """))
 
+    # Only output the percentage max callbacks some counter of the
+    # platforms uses, e.g. only HSW has uint64 percentages, so that the
+    # plugins build without -Wunused-function warnings.
+    max_syms = [counter.max_sym
+                for gen in gens for s in gen.sets for counter in s.counters]
+
+    for data_type, c_type in [("float", "double"), ("uint64", "uint64_t")]:
+        sym = "percentage_max_callback_" + data_type
+        if sym not in max_syms:
+            continue
+        c(textwrap.dedent("""\
+            static {0}
+            {1}(const struct gputop_devinfo *devinfo,
+            {2}const struct gputop_metric_set *metric_set,
+            {2}uint64_t *accumulator)
+            {{
+               return 100;
+            }}
+
+            """).format(c_type, sym, " " * (len(sym) + 1)))
+
     # Print out all equation functions.
     for gen in gens:
         for set in gen.sets:
             for counter in set.counters:
                 output_counter_read(gen, set, counter)
                 output_counter_max(gen, set, counter)
+            output_set_evaluate_all(gen, set)
 
-    # Print out all set registration functions for each set in each
-    # generation.
+    # Print out the read only tables of each set in each generation and
+    # the selection of the parts depending on the device.
     for gen in gens:
         for set in gen.sets:
-            c("\nstatic void\n")
-            c(gen.chipset + "_add_" + set.underscore_name + "_metric_set(struct gputop_gen *gen,")
-            c.indent(4)
-            c("const struct gputop_devinfo *devinfo)")
-            c.outdent(4)
-            c("{\n")
-            c.indent(4)
-
-            c("struct gputop_metric_set *metric_set;\n")
-            c("struct gputop_metric_set_counter *counter;\n\n")
-
-            counters = sorted(set.counters, key=lambda k: k.get('symbol_name'))
-
-            c("metric_set = rzalloc(gen, struct gputop_metric_set);\n")
-            c("metric_set->name = \"" + set.name + "\";\n")
-            c("metric_set->symbol_name = \"" + set.symbol_name + "\";\n")
-            c("metric_set->hw_config_guid = \"" + set.hw_config_guid + "\";\n")
-            c("metric_set->counters = rzalloc_array(metric_set, struct gputop_metric_set_counter,  {0});\n".format(str(len(counters))))
-            c("metric_set->n_counters = 0;\n")
-            c("metric_set->perf_oa_metrics_set = 0; // determined at runtime\n")
-
-            if gen.chipset == "hsw":
-                c(textwrap.dedent("""\
-                    metric_set->perf_oa_format = I915_OA_FORMAT_A45_B8_C8;
-
-                    metric_set->perf_raw_size = 256;
-                    metric_set->gpu_time_offset = 0;
-                    metric_set->a_offset = 1;
-                    metric_set->b_offset = metric_set->a_offset + 45;
-                    metric_set->c_offset = metric_set->b_offset + 8;
-
-                    """))
-            else:
-                c(textwrap.dedent("""\
-                    metric_set->perf_oa_format = I915_OA_FORMAT_A32u40_A4u32_B8_C8;
-
-                    metric_set->perf_raw_size = 256;
-                    metric_set->gpu_time_offset = 0;
-                    metric_set->gpu_clock_offset = 1;
-                    metric_set->a_offset = 2;
-                    metric_set->b_offset = metric_set->a_offset + 36;
-                    metric_set->c_offset = metric_set->b_offset + 8;
+            output_set_tables(gen, set)
+            if set.needs_select_available:
+                output_set_select_available(gen, set)
 
-                    """))
-
-            c("gputop_gen_add_metric_set(gen, metric_set);");
-            c("\n")
-
-            generate_register_configs(set)
-
-            for counter in counters:
-                output_counter_report(set, counter)
-
-            c("\nassert(metric_set->n_counters <= {0});\n".format(len(counters)));
-
-            c.outdent(4)
-            c("}\n")
+        output_gen_tables(gen)
 
     h(textwrap.dedent("""\
         #pragma once
@@ -814,27 +1118,32 @@ def main():
 
         """))
 
-    # Print out all set registration functions for each generation.
+    # Print out the platform descriptor of each generation, this is the only
+    # symbol exported when a generation is built as a metrics plugin.
     for gen in gens:
-        h("struct gputop_gen *gputop_oa_get_metrics_" + gen.chipset + "(const struct gputop_devinfo *devinfo);\n\n")
+        h("extern const struct gputop_oa_platform gputop_oa_platform_" + gen.chipset + ";\n\n")
 
-        c("\nstruct gputop_gen *")
-        c("gputop_oa_get_metrics_" + gen.chipset + "(const struct gputop_devinfo *devinfo)")
+        c("\nstatic void")
+        c(gen.chipset + "_select_available(const struct gputop_devinfo *devinfo)")
         c("{")
         c.indent(4)
-
-        c("struct gputop_gen *gen = gputop_gen_new();\n")
-        c("\n")
-
         for set in gen.sets:
-            c("{0}_add_{1}_metric_set(gen, devinfo);".format(gen.chipset, set.underscore_name))
-
-        c("\n")
-        c("return gen;")
-
+            if set.needs_select_available:
+                c("{0}__select_available(devinfo);".format(set.sym))
         c.outdent(4)
         c("}")
 
+        c("\nconst struct gputop_oa_platform gputop_oa_platform_" + gen.chipset + " = {")
+        c.indent(4)
+        c(".devname = \"{0}\",".format(gen.chipset))
+        c(".metric_sets = {0}_metric_sets,".format(gen.chipset))
+        c(".n_metric_sets = {0},".format(len(gen.sets)))
+        c(".guid_hash = {0},".format(gen.guid_hash))
+        c(".symbol_hash = {0},".format(gen.symbol_hash))
+        c(".select_available = {0}_select_available,".format(gen.chipset))
+        c.outdent(4)
+        c("};")
+
     h(textwrap.dedent("""\
         #ifdef __cplusplus
         } /* extern C */
@@ -3,6 +3,7 @@
 #include <i915_drm.h>
 
 #include "gputop-perf.h"
+#include "gputop-shm.h"
 
 int ioctl(int fd, unsigned long request, void *data)
 {
@@ -23,10 +24,18 @@ int ioctl(int fd, unsigned long request, void *data)
          * need the file descriptor and the ctx_id. */
         if (request == DRM_IOCTL_I915_GEM_CONTEXT_CREATE) {
             struct drm_i915_gem_context_create *ctx_create = data;
-            gputop_add_ctx_handle(fd, ctx_create->ctx_id);
+            if (gputop_shm_shim)
+                gputop_shm_publish_ctx(GPUTOP_SHM_EVENT_CTX_CREATE,
+                                       fd, ctx_create->ctx_id);
+            else
+                gputop_add_ctx_handle(fd, ctx_create->ctx_id);
         } else if (request == DRM_IOCTL_I915_GEM_CONTEXT_DESTROY) {
             struct drm_i915_gem_context_destroy *ctx_destroy = data;
-            gputop_remove_ctx_handle(ctx_destroy->ctx_id);
+            if (gputop_shm_shim)
+                gputop_shm_publish_ctx(GPUTOP_SHM_EVENT_CTX_DESTROY,
+                                       fd, ctx_destroy->ctx_id);
+            else
+                gputop_remove_ctx_handle(ctx_destroy->ctx_id);
         }
     }
 
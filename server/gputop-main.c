@@ -35,11 +35,16 @@
 #include <errno.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
 
 #include "util/macros.h"
 
+#include "gputop-shm.h"
+
 /* We resolve the location of various libraries and files at runtime adding them
  * here so we can list them for user feedback... */
 #define MAX_RESOURCES 10
@@ -64,7 +69,14 @@ usage(void)
            "     --disable-oaconfig            Disable loading of OA configs\n\n"
            "     --dry-run                     Print the environment variables\n"
            "                                   without executing the program\n\n"
-           "     --fake                        Run gputop using fake metrics\n\n");
+           "     --fake                        Run gputop using fake metrics\n\n"
+           "     --fake-scenario=<filename>    Run gputop using fake metrics\n"
+           "                                   generated following a scenario\n\n"
+           "     --reader-threads              Read each live stream from a dedicated\n"
+           "                                   thread instead of the server's mainloop\n\n"
+           "     --split                       Run the server in a separate gputop-system\n"
+           "                                   process, only intercepting context\n"
+           "                                   creation within the program\n\n");
 #ifdef SUPPORT_GL
     printf("     --libgl=<libgl_filename>      Explicitly specify the real libGL\n"
            "                                   library to intercept\n\n"
@@ -86,8 +98,14 @@ usage(void)
            "\n"
            "     GPUTOP_DISABLE_OACONFIG=1     Prevents gputop to load OA configs\n"
            "     GPUTOP_FAKE_MODE=1            Configure gputop to use fake mode\n"
+           "     GPUTOP_FAKE_SCENARIO=filename Scenario of the fake mode workload\n"
            "     GPUTOP_MODE=remote            Currently only one mode\n"
            "     GPUTOP_PORT=port              Port gputop should listen to\n"
+           "     GPUTOP_LOCAL_SOCKET=path      Unix socket local clients connect to\n"
+           "     GPUTOP_LOCAL_SOCKET_MODE=mode Permissions of the local socket\n"
+           "                                   (default 0600, server's user only)\n"
+           "     GPUTOP_READER_THREADS=1       Same as --reader-threads\n"
+           "     GPUTOP_SHM=fd                 Shared memory inherited from --split\n"
            "\n"
            "     GPUTOP_TOPOLOGY_OVERRIDE=slice_mask,subslice_mask,n_eus_total\n"
            "                                   Overrides slice mask, subslice mask and\n"
@@ -294,6 +312,8 @@ print_gputop_env_vars(void)
 {
     if (getenv("GPUTOP_FAKE_MODE"))
         fprintf(stderr, "GPUTOP_FAKE_MODE=%s \\\n", getenv("GPUTOP_FAKE_MODE"));
+    if (getenv("GPUTOP_FAKE_SCENARIO"))
+        fprintf(stderr, "GPUTOP_FAKE_SCENARIO=%s \\\n", getenv("GPUTOP_FAKE_SCENARIO"));
 
 #ifdef SUPPORT_GL
     if (getenv("GPUTOP_GL_LIBRARY"))
@@ -311,6 +331,12 @@ print_gputop_env_vars(void)
 
     if (getenv("GPUTOP_MODE"))
         fprintf(stderr, "GPUTOP_MODE=%s \\\n", getenv("GPUTOP_MODE"));
+    if (getenv("GPUTOP_LOCAL_SOCKET_MODE"))
+        fprintf(stderr, "GPUTOP_LOCAL_SOCKET_MODE=%s \\\n", getenv("GPUTOP_LOCAL_SOCKET_MODE"));
+    if (getenv("GPUTOP_READER_THREADS"))
+        fprintf(stderr, "GPUTOP_READER_THREADS=%s \\\n", getenv("GPUTOP_READER_THREADS"));
+    if (getenv(GPUTOP_SHM_ENV))
+        fprintf(stderr, GPUTOP_SHM_ENV "=%s \\\n", getenv(GPUTOP_SHM_ENV));
     if (getenv("GPUTOP_WEB_ROOT"))
         fprintf(stderr, "GPUTOP_WEB_ROOT=%s \\\n", getenv("GPUTOP_WEB_ROOT"));
 }
@@ -359,6 +385,59 @@ get_gputop_system_path(void)
     exit(1);
 }
 
+/* In split mode the server runs in a gputop-system daemon forked before
+ * we exec the program, sharing a segment that the program's preloaded
+ * shim publishes its contexts to.
+ */
+static void
+spawn_split_daemon(void)
+{
+    char *daemon_args[] = { get_gputop_system_path(), NULL };
+    struct gputop_shm_header *header;
+    char fd_str[16];
+    pid_t pid;
+    int fd;
+
+    /* NB: not close-on-exec; the daemon and the program inherit it */
+    fd = memfd_create("gputop-shm", 0);
+    if (fd < 0 || ftruncate(fd, sizeof(*header)) < 0) {
+        perror("Failed to create shared memory");
+        exit(1);
+    }
+
+    header = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        perror("Failed to map shared memory");
+        exit(1);
+    }
+    gputop_shm_init_header(header);
+
+    snprintf(fd_str, sizeof(fd_str), "%d", fd);
+    setenv(GPUTOP_SHM_ENV, fd_str, true);
+
+    pid = fork();
+    if (pid < 0) {
+        perror("Failed to fork gputop-system daemon");
+        exit(1);
+    }
+
+    if (pid == 0) {
+        /* Exit with the program, as the in-process server would */
+        prctl(PR_SET_PDEATHSIG, SIGTERM);
+
+        /* NB: the server is still started by libgputop's constructor,
+         * via LD_PRELOAD, like when running gputop-system directly */
+        setenv(GPUTOP_SHM_DAEMON_ENV, "1", true);
+
+        execv(daemon_args[0], daemon_args);
+        perror("Failed to run gputop-system daemon");
+        _exit(1);
+    }
+
+    atomic_store(&header->daemon_pid, pid);
+    munmap(header, sizeof(*header));
+}
+
 #ifdef ENABLE_WEBUI
 /* See if gputop is being run from a source/build directory and set
  * the GPUTOP_WEB_ROOT environment accordingly if so, to avoid
@@ -404,6 +483,7 @@ main (int argc, char **argv)
     int opt;
     bool dry_run = false;
     bool disable_ioctl = false;
+    bool split = false;
 
 #define LIB_GL_OPT              (CHAR_MAX + 1)
 #define LIB_EGL_OPT             (CHAR_MAX + 2)
@@ -414,6 +494,9 @@ main (int argc, char **argv)
 #define GPUTOP_SCISSOR_TEST     (CHAR_MAX + 7)
 #define PORT_OPT                (CHAR_MAX + 8)
 #define DISABLE_OACONFIG        (CHAR_MAX + 9)
+#define READER_THREADS_OPT      (CHAR_MAX + 10)
+#define SPLIT_OPT               (CHAR_MAX + 11)
+#define FAKE_SCENARIO_OPT       (CHAR_MAX + 12)
 
     /* The initial '+' means that getopt will stop looking for
      * options after the first non-option argument. */
@@ -422,6 +505,7 @@ main (int argc, char **argv)
         {"help",            no_argument,        0, 'h'},
         {"dry-run",         no_argument,        0, DRY_RUN_OPT},
         {"fake",            no_argument,        0, FAKE_OPT},
+        {"fake-scenario",   required_argument,  0, FAKE_SCENARIO_OPT},
         {"disable-ioctl-intercept", optional_argument,  0, DISABLE_IOCTL_OPT},
         {"disable-oaconfig", optional_argument,  0, DISABLE_OACONFIG},
 #ifdef SUPPORT_GL
@@ -431,6 +515,8 @@ main (int argc, char **argv)
         {"enable-gl-scissor-test",  optional_argument,  0, GPUTOP_SCISSOR_TEST},
 #endif
         {"port",            required_argument,  0, PORT_OPT},
+        {"reader-threads",  no_argument,        0, READER_THREADS_OPT},
+        {"split",           no_argument,        0, SPLIT_OPT},
         {0, 0, 0, 0}
     };
     char *ld_preload_path;
@@ -458,6 +544,10 @@ main (int argc, char **argv)
             case FAKE_OPT:
                 setenv("GPUTOP_FAKE_MODE", "1", true);
                 break;
+            case FAKE_SCENARIO_OPT:
+                setenv("GPUTOP_FAKE_MODE", "1", true);
+                setenv("GPUTOP_FAKE_SCENARIO", optarg, true);
+                break;
             case DISABLE_IOCTL_OPT:
                 disable_ioctl = true;
                 break;
@@ -481,6 +571,12 @@ main (int argc, char **argv)
             case PORT_OPT:
                 setenv("GPUTOP_PORT", optarg, true);
                 break;
+            case READER_THREADS_OPT:
+                setenv("GPUTOP_READER_THREADS", "1", true);
+                break;
+            case SPLIT_OPT:
+                split = true;
+                break;
             default:
                 fprintf(stderr, "Internal error: "
                         "unexpected getopt value: %d\n", opt);
@@ -495,6 +591,15 @@ main (int argc, char **argv)
         args = gputop_system_args;
         optind = 0;
         argc = 1;
+
+        /* gputop-system is already separate from any application */
+        split = false;
+    }
+
+    if (split && disable_ioctl) {
+        fprintf(stderr, "--split only serves to intercept context creation, "
+                "ignoring it with --disable-ioctl-intercept\n");
+        split = false;
     }
 
     if (!disable_ioctl)
@@ -574,6 +679,9 @@ main (int argc, char **argv)
 
     if (!dry_run)
     {
+        if (split)
+            spawn_split_daemon();
+
         execvp(args[optind], &args[optind]);
         err = errno;
 
@@ -43,6 +43,7 @@
 #include "gputop-sysutil.h"
 #include "gputop-server.h"
 #include "gputop-log.h"
+#include "gputop-shm.h"
 
 static uv_timer_t fake_timer;
 static pthread_t server_thread_id;
@@ -74,6 +75,10 @@ run(void *arg)
     if (!gputop_server_run())
 	_exit(EXIT_FAILURE);
 
+    if (getenv(GPUTOP_SHM_DAEMON_ENV) &&
+        !gputop_shm_daemon_start(atoi(getenv(GPUTOP_SHM_ENV))))
+        _exit(EXIT_FAILURE);
+
     if (gputop_fake_mode && gputop_get_bool_env("GPUTOP_TRAVIS_MODE")) {
         uv_timer_init(gputop_mainloop, &fake_timer);
         uv_timer_start(&fake_timer, exit_fake_mode_cb, 10000, 10000);
@@ -91,6 +96,14 @@ gputop_init(void)
 {
     pthread_attr_t attrs;
 
+    /* In split mode the application only needs our hooks, everything
+     * else happens in the gputop-system daemon. */
+    if (getenv(GPUTOP_SHM_ENV) && !getenv(GPUTOP_SHM_DAEMON_ENV)) {
+        if (!gputop_shm_shim_init(atoi(getenv(GPUTOP_SHM_ENV))))
+            fprintf(stderr, "gputop: Not tracking contexts for this process\n");
+        return;
+    }
+
     gputop_perf_initialize();
 
     pthread_attr_init(&attrs);
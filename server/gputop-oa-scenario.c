@@ -0,0 +1,740 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <errno.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <i915_drm.h>
+
+#include "util/macros.h"
+
+#include "gputop-util.h"
+#include "gputop-oa-scenario.h"
+
+#define MAX_CONTEXTS 64
+#define N_COUNTERS 52 /* A0-A35, B0-B7, C0-C7 */
+
+/* i915 uses a 16MB OA buffer */
+#define OA_BUFFER_N_REPORTS (16 * 1024 * 1024 / 256)
+
+#define REPORT_REASON_TIMER             (1 << 19)
+#define REPORT_REASON_CONTEXT_SWITCH    (1 << 22)
+
+enum rate_model {
+    RATE_MODEL_CONSTANT,
+    RATE_MODEL_NOISE,
+    RATE_MODEL_SINE,
+};
+
+struct counter_model {
+    bool has_rate;
+    double rate; /* events per GPU clock */
+    enum rate_model model;
+    double amplitude;
+    uint64_t period_ns;
+};
+
+struct scenario_context {
+    uint32_t hw_id;
+    double duty;
+    double load;
+};
+
+struct gputop_oa_scenario {
+    uint64_t rate; /* reports per second, 0 for the stream's period */
+    bool max_rate;
+    unsigned tick_ms;
+    uint64_t frequency;
+    uint64_t seed;
+    double switch_rate;
+    double report_loss;
+
+    struct scenario_context contexts[MAX_CONTEXTS];
+    int n_contexts;
+
+    struct counter_model counters[N_COUNTERS];
+};
+
+/* Body of an A32u40_A4u32_B8_C8 report */
+struct oa_report {
+    uint32_t rep_id;
+    uint32_t timestamp;
+    uint32_t context_id;
+    uint32_t clock_ticks;
+    uint32_t a40_lsb[32];
+    uint32_t a32[4];
+    uint8_t a40_msb[32];
+    uint32_t b[8];
+    uint32_t c[8];
+};
+
+struct gputop_oa_generator {
+    const struct gputop_oa_scenario *scenario;
+    const struct gputop_devinfo *devinfo;
+
+    uint64_t period_ns;
+    bool cpu_timestamps;
+    bool gpu_timestamps;
+    int record_size;
+
+    uint64_t rand_state;
+
+    /* All times are in nanoseconds since the stream was opened */
+    uint64_t start_time;
+    uint64_t next_report;
+    uint64_t horizon;
+    bool drained;
+
+    int context; /* index in scenario->contexts, -1 when idle */
+    uint64_t next_switch;
+
+    /* Counters are advanced up to this point */
+    uint64_t last_time;
+    double clocks_remainder;
+    uint64_t clocks;
+    double remainders[N_COUNTERS];
+    uint64_t counters[N_COUNTERS];
+};
+
+static bool
+parse_double(const char *str, double *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtod(str, &end);
+    return errno == 0 && end != str && *end == '\0';
+}
+
+static bool
+parse_uint64(const char *str, uint64_t *value)
+{
+    char *end;
+
+    errno = 0;
+    *value = strtoull(str, &end, 0);
+    return errno == 0 && end != str && *end == '\0';
+}
+
+/* Maps A0-A35, B0-B7 and C0-C7 to the index of the counter */
+static int
+parse_counter_name(const char *name)
+{
+    uint64_t n;
+
+    if (!parse_uint64(name + 1, &n))
+        return -1;
+
+    switch (name[0]) {
+    case 'A': return n < 36 ? n : -1;
+    case 'B': return n < 8 ? 36 + n : -1;
+    case 'C': return n < 8 ? 44 + n : -1;
+    default: return -1;
+    }
+}
+
+static bool
+parse_context(struct gputop_oa_scenario *scenario, char **args, int n_args,
+              const char **error)
+{
+    struct scenario_context *context;
+    uint64_t hw_id;
+
+    if (n_args < 1 || !parse_uint64(args[0], &hw_id) || hw_id > UINT32_MAX) {
+        *error = "expected a context hw_id";
+        return false;
+    }
+    if (scenario->n_contexts == MAX_CONTEXTS) {
+        *error = "too many contexts";
+        return false;
+    }
+
+    context = &scenario->contexts[scenario->n_contexts++];
+    context->hw_id = hw_id;
+    context->duty = -1; /* share what's left by the other contexts */
+    context->load = 1.0;
+
+    for (int i = 1; i < n_args; i++) {
+        char *value = strchr(args[i], '=');
+        double *field;
+
+        if (!value) {
+            *error = "expected a key=value context property";
+            return false;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(args[i], "duty"))
+            field = &context->duty;
+        else if (!strcmp(args[i], "load"))
+            field = &context->load;
+        else {
+            *error = "unknown context property";
+            return false;
+        }
+
+        if (!parse_double(value, field) || *field < 0 || *field > 1) {
+            *error = "context properties must be between 0 and 1";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static bool
+parse_counter(struct gputop_oa_scenario *scenario, char **args, int n_args,
+              const char **error)
+{
+    struct counter_model model = { .model = RATE_MODEL_CONSTANT };
+    char *last_name;
+    int first, last;
+
+    if (n_args < 1) {
+        *error = "expected a counter name or range";
+        return false;
+    }
+
+    last_name = strchr(args[0], '-');
+    if (last_name)
+        *last_name++ = '\0';
+    first = parse_counter_name(args[0]);
+    last = last_name ? parse_counter_name(last_name) : first;
+    if (first < 0 || last < first) {
+        *error = "invalid counter name or range";
+        return false;
+    }
+
+    for (int i = 1; i < n_args; i++) {
+        char *value = strchr(args[i], '=');
+        bool valid = true;
+
+        if (!value) {
+            *error = "expected a key=value counter property";
+            return false;
+        }
+        *value++ = '\0';
+
+        if (!strcmp(args[i], "rate")) {
+            valid = parse_double(value, &model.rate) && model.rate >= 0;
+            model.has_rate = true;
+        } else if (!strcmp(args[i], "model")) {
+            if (!strcmp(value, "constant"))
+                model.model = RATE_MODEL_CONSTANT;
+            else if (!strcmp(value, "noise"))
+                model.model = RATE_MODEL_NOISE;
+            else if (!strcmp(value, "sine"))
+                model.model = RATE_MODEL_SINE;
+            else
+                valid = false;
+        } else if (!strcmp(args[i], "amplitude")) {
+            valid = parse_double(value, &model.amplitude) &&
+                model.amplitude >= 0 && model.amplitude <= 1;
+        } else if (!strcmp(args[i], "period")) {
+            double period_ms;
+
+            valid = parse_double(value, &period_ms) && period_ms > 0;
+            model.period_ns = period_ms * 1000000;
+        } else {
+            *error = "unknown counter property";
+            return false;
+        }
+
+        if (!valid) {
+            *error = "invalid counter property value";
+            return false;
+        }
+    }
+
+    if (model.model == RATE_MODEL_SINE && !model.period_ns) {
+        *error = "sine rate models need a period";
+        return false;
+    }
+
+    for (int i = first; i <= last; i++)
+        scenario->counters[i] = model;
+
+    return true;
+}
+
+static bool
+parse_directive(struct gputop_oa_scenario *scenario, char **args, int n_args,
+                const char **error)
+{
+    const char *directive = args[0];
+    uint64_t uint_value;
+    double value;
+
+    args++;
+    n_args--;
+
+    if (!strcmp(directive, "context"))
+        return parse_context(scenario, args, n_args, error);
+    if (!strcmp(directive, "counter"))
+        return parse_counter(scenario, args, n_args, error);
+
+    if (n_args != 1) {
+        *error = "expected a single value";
+        return false;
+    }
+
+    if (!strcmp(directive, "rate")) {
+        if (!strcmp(args[0], "max"))
+            scenario->max_rate = true;
+        else if (!parse_uint64(args[0], &scenario->rate) || !scenario->rate) {
+            *error = "invalid report rate";
+            return false;
+        }
+    } else if (!strcmp(directive, "tick")) {
+        if (!parse_uint64(args[0], &uint_value) || !uint_value ||
+            uint_value > 1000) {
+            *error = "tick must be between 1 and 1000ms";
+            return false;
+        }
+        scenario->tick_ms = uint_value;
+    } else if (!strcmp(directive, "frequency")) {
+        if (!parse_uint64(args[0], &uint_value) || !uint_value) {
+            *error = "invalid frequency";
+            return false;
+        }
+        scenario->frequency = uint_value * 1000000;
+    } else if (!strcmp(directive, "seed")) {
+        if (!parse_uint64(args[0], &scenario->seed)) {
+            *error = "invalid seed";
+            return false;
+        }
+    } else if (!strcmp(directive, "switch_rate")) {
+        if (!parse_double(args[0], &value) || value < 0) {
+            *error = "invalid context switch rate";
+            return false;
+        }
+        scenario->switch_rate = value;
+    } else if (!strcmp(directive, "report_loss")) {
+        if (!parse_double(args[0], &value) || value < 0 || value > 1) {
+            *error = "report loss must be a probability between 0 and 1";
+            return false;
+        }
+        scenario->report_loss = value;
+    } else {
+        *error = "unknown directive";
+        return false;
+    }
+
+    return true;
+}
+
+struct gputop_oa_scenario *
+gputop_oa_scenario_load(const char *filename, char **error)
+{
+    struct gputop_oa_scenario *scenario;
+    FILE *file = fopen(filename, "r");
+    char *line = NULL;
+    size_t line_size = 0;
+    double total_duty = 0;
+    int n_shared = 0;
+    int line_no = 0;
+    int ret;
+
+    if (!file) {
+        ret = asprintf(error, "Failed to open scenario %s: %m", filename);
+        (void) ret;
+        return NULL;
+    }
+
+    scenario = xmalloc0(sizeof(*scenario));
+    scenario->tick_ms = 10;
+    scenario->frequency = 500000000;
+    scenario->seed = 1;
+
+    while (getline(&line, &line_size, file) >= 0) {
+        const char *parse_error = NULL;
+        char *args[16];
+        int n_args = 0;
+        char *comment, *save = NULL;
+
+        line_no++;
+
+        comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+
+        for (char *tok = strtok_r(line, " \t\r\n", &save);
+             tok && n_args < ARRAY_SIZE(args);
+             tok = strtok_r(NULL, " \t\r\n", &save))
+            args[n_args++] = tok;
+
+        if (n_args == 0)
+            continue;
+
+        if (!parse_directive(scenario, args, n_args, &parse_error)) {
+            ret = asprintf(error, "%s:%d: %s", filename, line_no, parse_error);
+            (void) ret;
+            goto err;
+        }
+    }
+
+    for (int i = 0; i < scenario->n_contexts; i++) {
+        if (scenario->contexts[i].duty < 0)
+            n_shared++;
+        else
+            total_duty += scenario->contexts[i].duty;
+    }
+    if (total_duty > 1.0 + 1e-9) {
+        ret = asprintf(error, "%s: context duty cycles add up to more than 1",
+                       filename);
+        (void) ret;
+        goto err;
+    }
+    for (int i = 0; i < scenario->n_contexts; i++) {
+        if (scenario->contexts[i].duty < 0)
+            scenario->contexts[i].duty = MAX2(1.0 - total_duty, 0) / n_shared;
+    }
+
+    free(line);
+    fclose(file);
+
+    return scenario;
+
+err:
+    free(line);
+    fclose(file);
+    free(scenario);
+
+    return NULL;
+}
+
+void
+gputop_oa_scenario_free(struct gputop_oa_scenario *scenario)
+{
+    free(scenario);
+}
+
+unsigned
+gputop_oa_scenario_tick_ms(const struct gputop_oa_scenario *scenario)
+{
+    return scenario->tick_ms;
+}
+
+/* xorshift64* */
+static double
+random_double(struct gputop_oa_generator *gen)
+{
+    uint64_t x = gen->rand_state;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    gen->rand_state = x;
+
+    return ((x * 0x2545F4914F6CDD1DULL) >> 11) * 0x1.0p-53;
+}
+
+static uint64_t
+timestamp_ticks(uint64_t ns, uint64_t frequency)
+{
+    return (ns / 1000000000) * frequency +
+        (ns % 1000000000) * frequency / 1000000000;
+}
+
+static double
+context_load(const struct gputop_oa_generator *gen)
+{
+    if (gen->context >= 0)
+        return gen->scenario->contexts[gen->context].load;
+
+    /* Without any context the GPU is always busy */
+    return gen->scenario->n_contexts ? 0 : 1;
+}
+
+static double
+counter_rate(struct gputop_oa_generator *gen, int counter, uint64_t time)
+{
+    const struct counter_model *model = &gen->scenario->counters[counter];
+    double rate;
+
+    if (model->has_rate)
+        rate = model->rate;
+    else
+        rate = counter < 36 ? gen->devinfo->n_eus : 1;
+
+    switch (model->model) {
+    case RATE_MODEL_CONSTANT:
+        break;
+    case RATE_MODEL_NOISE:
+        rate *= 1.0 + model->amplitude * (2.0 * random_double(gen) - 1.0);
+        break;
+    case RATE_MODEL_SINE:
+        rate *= 1.0 + model->amplitude *
+            sin(2.0 * M_PI * (time % model->period_ns) / model->period_ns);
+        break;
+    }
+
+    return rate;
+}
+
+/* Accumulates the events of the running context up to 'time' */
+static void
+advance_counters(struct gputop_oa_generator *gen, uint64_t time)
+{
+    double clocks, load;
+
+    if (time <= gen->last_time)
+        return;
+
+    clocks = (time - gen->last_time) * (gen->scenario->frequency / 1e9) +
+        gen->clocks_remainder;
+    gen->clocks += (uint64_t) clocks;
+    gen->clocks_remainder = clocks - (uint64_t) clocks;
+    gen->last_time = time;
+
+    load = context_load(gen);
+    if (load == 0)
+        return;
+
+    for (int i = 0; i < N_COUNTERS; i++) {
+        double events = counter_rate(gen, i, time) * load * clocks +
+            gen->remainders[i];
+
+        if (events <= 0)
+            continue;
+        gen->counters[i] += (uint64_t) events;
+        gen->remainders[i] = events - (uint64_t) events;
+    }
+}
+
+/* Picks the context running after 'time' according to the duty cycles and
+ * schedules the next switch. Returns whether the context changed.
+ */
+static bool
+switch_context(struct gputop_oa_generator *gen, uint64_t time)
+{
+    const struct gputop_oa_scenario *scenario = gen->scenario;
+    int previous = gen->context;
+    double pick = random_double(gen);
+
+    gen->context = -1;
+    for (int i = 0; i < scenario->n_contexts; i++) {
+        if (pick < scenario->contexts[i].duty) {
+            gen->context = i;
+            break;
+        }
+        pick -= scenario->contexts[i].duty;
+    }
+
+    if (scenario->n_contexts && scenario->switch_rate > 0) {
+        double slice = -log(1.0 - random_double(gen)) / scenario->switch_rate;
+
+        gen->next_switch = time + MAX2(slice * 1e9, 1);
+    } else
+        gen->next_switch = UINT64_MAX;
+
+    return gen->context != previous;
+}
+
+static uint8_t *
+write_header(uint8_t *p, uint32_t type, uint16_t size)
+{
+    struct drm_i915_perf_record_header header = {
+        .type = type,
+        .size = size,
+    };
+
+    memcpy(p, &header, sizeof(header));
+
+    return p + sizeof(header);
+}
+
+static void
+write_report(struct gputop_oa_generator *gen, uint8_t *p,
+             uint64_t time, uint32_t reason)
+{
+    const struct gputop_devinfo *devinfo = gen->devinfo;
+    struct oa_report report;
+    uint64_t ticks = timestamp_ticks(gen->start_time + time,
+                                     devinfo->timestamp_frequency);
+    int i;
+
+    p = write_header(p, DRM_I915_PERF_RECORD_SAMPLE, gen->record_size);
+
+    if (gen->gpu_timestamps) {
+        memcpy(p, &ticks, sizeof(ticks));
+        p += sizeof(ticks);
+    }
+    if (gen->cpu_timestamps) {
+        uint64_t cpu_time = gen->start_time + time;
+
+        memcpy(p, &cpu_time, sizeof(cpu_time));
+        p += sizeof(cpu_time);
+    }
+
+    report.rep_id = reason;
+    report.timestamp = ticks;
+    report.context_id = 0;
+    if (gen->context >= 0) {
+        report.rep_id |= devinfo->gen == 8 ? (1 << 25) : (1 << 16);
+        report.context_id = gen->scenario->contexts[gen->context].hw_id;
+    }
+    report.clock_ticks = gen->clocks;
+
+    for (i = 0; i < 32; i++) {
+        report.a40_lsb[i] = gen->counters[i];
+        report.a40_msb[i] = gen->counters[i] >> 32;
+    }
+    for (i = 0; i < 4; i++)
+        report.a32[i] = gen->counters[32 + i];
+    for (i = 0; i < 8; i++) {
+        report.b[i] = gen->counters[36 + i];
+        report.c[i] = gen->counters[44 + i];
+    }
+
+    memcpy(p, &report, sizeof(report));
+}
+
+struct gputop_oa_generator *
+gputop_oa_generator_new(const struct gputop_oa_scenario *scenario,
+                        const struct gputop_devinfo *devinfo,
+                        uint64_t period_ns,
+                        bool cpu_timestamps,
+                        bool gpu_timestamps,
+                        uint64_t now)
+{
+    struct gputop_oa_generator *gen = xmalloc0(sizeof(*gen));
+    /* The shortest period is 2 timestamp ticks, with an exponent of 0 */
+    uint64_t min_period_ns = DIV_ROUND_UP(2000000000ULL,
+                                          devinfo->timestamp_frequency);
+
+    if (scenario->max_rate)
+        period_ns = min_period_ns;
+    else if (scenario->rate)
+        period_ns = 1000000000ULL / scenario->rate;
+
+    gen->scenario = scenario;
+    gen->devinfo = devinfo;
+    gen->period_ns = MAX2(period_ns, min_period_ns);
+    gen->cpu_timestamps = cpu_timestamps;
+    gen->gpu_timestamps = gpu_timestamps;
+    gen->record_size = sizeof(struct drm_i915_perf_record_header) +
+        (gpu_timestamps ? 8 : 0) + (cpu_timestamps ? 8 : 0) +
+        sizeof(struct oa_report);
+    gen->rand_state = scenario->seed ? scenario->seed : 1;
+    gen->start_time = now;
+    gen->next_report = gen->period_ns;
+    gen->drained = true;
+
+    gen->context = -1;
+    switch_context(gen, 0);
+
+    return gen;
+}
+
+void
+gputop_oa_generator_free(struct gputop_oa_generator *gen)
+{
+    free(gen);
+}
+
+/* Emulates the OA buffer overflowing when the backlog of reports exceeds
+ * its size: the oldest reports are lost, though counters kept counting.
+ */
+static uint8_t *
+handle_overflow(struct gputop_oa_generator *gen, uint8_t *p)
+{
+    uint64_t backlog = (gen->horizon - gen->next_report) / gen->period_ns;
+    uint64_t target;
+
+    if (backlog <= OA_BUFFER_N_REPORTS)
+        return p;
+
+    target = gen->next_report +
+        (backlog - OA_BUFFER_N_REPORTS) * gen->period_ns;
+    while (gen->next_switch <= target) {
+        advance_counters(gen, gen->next_switch);
+        switch_context(gen, gen->next_switch);
+    }
+    advance_counters(gen, target);
+    gen->next_report = target;
+
+    return write_header(p, DRM_I915_PERF_RECORD_OA_BUFFER_LOST,
+                        sizeof(struct drm_i915_perf_record_header));
+}
+
+int
+gputop_oa_generator_read(struct gputop_oa_generator *gen, uint64_t now,
+                         uint8_t *buf, int buf_length)
+{
+    uint8_t *p = buf, *end = buf + buf_length;
+
+    if (gen->next_report >= gen->horizon) {
+        /* Like a real stream that keeps filling up while being read, only
+         * report what's due at the start of each round of reads, so
+         * callers looping until there's nothing left do stop even when
+         * generating reports is slower than their rate.
+         */
+        if (!gen->drained) {
+            gen->drained = true;
+            return 0;
+        }
+        gen->horizon = now > gen->start_time ? now - gen->start_time : 0;
+        if (gen->next_report >= gen->horizon)
+            return 0;
+        gen->drained = false;
+
+        p = handle_overflow(gen, p);
+    }
+
+    while (gen->next_report < gen->horizon && end - p >= gen->record_size) {
+        uint32_t reason;
+        uint64_t time;
+
+        if (gen->next_switch <= gen->next_report) {
+            time = gen->next_switch;
+            advance_counters(gen, time);
+            if (!switch_context(gen, time))
+                continue;
+            reason = REPORT_REASON_CONTEXT_SWITCH;
+        } else {
+            time = gen->next_report;
+            advance_counters(gen, time);
+            gen->next_report += gen->period_ns;
+
+            if (gen->scenario->report_loss > 0 &&
+                random_double(gen) < gen->scenario->report_loss) {
+                p = write_header(p, DRM_I915_PERF_RECORD_OA_REPORT_LOST,
+                                 sizeof(struct drm_i915_perf_record_header));
+                continue;
+            }
+            reason = REPORT_REASON_TIMER;
+        }
+
+        write_report(gen, p, time, reason);
+        p += gen->record_size;
+    }
+
+    return p - buf;
+}
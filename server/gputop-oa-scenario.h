@@ -0,0 +1,89 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "gputop-oa-metrics.h"
+
+/* By default fake mode generates identical counters for every report, with
+ * no context and no loss. A scenario file, given with
+ * GPUTOP_FAKE_SCENARIO=<filename>, describes a more realistic workload
+ * instead. One directive per line, '#' starts a comment:
+ *
+ *   rate <reports per second>|max   overrides the stream's OA exponent,
+ *                                   max being the hardware's maximum
+ *   tick <ms>                       how often streams are read (10)
+ *   frequency <MHz>                 GPU clock frequency (500)
+ *   seed <n>                        random seed, for reproducible runs
+ *   switch_rate <per second>        mean rate of context switches (0)
+ *   report_loss <probability>       chance for any report to be lost
+ *   context <hw_id> [duty=<0-1>] [load=<0-1>]
+ *                                   a context running a fraction 'duty' of
+ *                                   the time, scaling all counter rates by
+ *                                   'load' (1). Contexts without a duty
+ *                                   cycle share the time left by the others
+ *                                   and the GPU idles for whatever remains.
+ *                                   Without any context the GPU is always
+ *                                   busy, with no valid context ID.
+ *   counter <first>[-<last>] [rate=<events per clock>]
+ *           [model=constant|noise|sine] [amplitude=<0-1>] [period=<ms>]
+ *                                   rate model of counters named A0-A35,
+ *                                   B0-B7 and C0-C7. A counters default to
+ *                                   one event per EU per clock, B and C to
+ *                                   one per clock.
+ *
+ * Reports accumulating faster than a stream is read overflow an emulated
+ * OA buffer the size of i915's, reported with an OA_BUFFER_LOST record.
+ */
+struct gputop_oa_scenario;
+struct gputop_oa_generator;
+
+struct gputop_oa_scenario *gputop_oa_scenario_load(const char *filename,
+                                                   char **error);
+void gputop_oa_scenario_free(struct gputop_oa_scenario *scenario);
+
+unsigned gputop_oa_scenario_tick_ms(const struct gputop_oa_scenario *scenario);
+
+/* period_ns is the period requested when opening the stream, now the
+ * current gputop_get_time().
+ */
+struct gputop_oa_generator *
+gputop_oa_generator_new(const struct gputop_oa_scenario *scenario,
+                        const struct gputop_devinfo *devinfo,
+                        uint64_t period_ns,
+                        bool cpu_timestamps,
+                        bool gpu_timestamps,
+                        uint64_t now);
+void gputop_oa_generator_free(struct gputop_oa_generator *gen);
+
+/* Writes the records due by 'now' into buf, following read(2) on a real
+ * stream: it returns 0 once everything due at the start of a round of
+ * reads has been returned.
+ */
+int gputop_oa_generator_read(struct gputop_oa_generator *gen, uint64_t now,
+                             uint8_t *buf, int buf_length);
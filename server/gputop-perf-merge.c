@@ -0,0 +1,197 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-perf-merge.h"
+#include "gputop-util.h"
+
+static uint64_t
+record_time(const struct gputop_perf_merge_cpu *cpu,
+            const struct perf_event_header *header)
+{
+    if (header->type != PERF_RECORD_SAMPLE ||
+        header->size < sizeof(*header) + sizeof(uint64_t))
+        return cpu->last_time;
+
+    return *(const uint64_t *) (header + 1);
+}
+
+static bool
+heap_less(const struct gputop_perf_merge *merge, int a, int b)
+{
+    return merge->cpus[merge->heap[a]].head_time <
+        merge->cpus[merge->heap[b]].head_time;
+}
+
+static void
+heap_swap(struct gputop_perf_merge *merge, int a, int b)
+{
+    int tmp = merge->heap[a];
+
+    merge->heap[a] = merge->heap[b];
+    merge->heap[b] = tmp;
+}
+
+static void
+heap_sift_up(struct gputop_perf_merge *merge, int i)
+{
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!heap_less(merge, i, parent))
+            break;
+        heap_swap(merge, i, parent);
+        i = parent;
+    }
+}
+
+static void
+heap_sift_down(struct gputop_perf_merge *merge, int i)
+{
+    while (true) {
+        int left = 2 * i + 1, right = left + 1, min = i;
+
+        if (left < merge->heap_len && heap_less(merge, left, min))
+            min = left;
+        if (right < merge->heap_len && heap_less(merge, right, min))
+            min = right;
+        if (min == i)
+            break;
+        heap_swap(merge, i, min);
+        i = min;
+    }
+}
+
+void
+gputop_perf_merge_init(struct gputop_perf_merge *merge,
+                       int n_cpus, size_t cpu_buffer_size)
+{
+    memset(merge, 0, sizeof(*merge));
+
+    merge->n_cpus = n_cpus;
+    merge->cpu_buffer_size = cpu_buffer_size;
+    merge->cpus = xmalloc0(sizeof(merge->cpus[0]) * n_cpus);
+    for (int c = 0; c < n_cpus; c++)
+        merge->cpus[c].buf = xmalloc(cpu_buffer_size);
+    merge->heap = xmalloc(sizeof(merge->heap[0]) * n_cpus);
+}
+
+void
+gputop_perf_merge_fini(struct gputop_perf_merge *merge)
+{
+    for (int c = 0; c < merge->n_cpus; c++)
+        free(merge->cpus[c].buf);
+    free(merge->cpus);
+    free(merge->heap);
+}
+
+size_t
+gputop_perf_merge_space(const struct gputop_perf_merge *merge, int cpu)
+{
+    const struct gputop_perf_merge_cpu *c = &merge->cpus[cpu];
+
+    return merge->cpu_buffer_size - (c->end - c->start);
+}
+
+uint64_t
+gputop_perf_merge_next_time(const struct gputop_perf_merge *merge)
+{
+    return merge->heap_len ? merge->cpus[merge->heap[0]].head_time : UINT64_MAX;
+}
+
+bool
+gputop_perf_merge_push(struct gputop_perf_merge *merge, int cpu,
+                       const struct perf_event_header *header)
+{
+    struct gputop_perf_merge_cpu *c = &merge->cpus[cpu];
+    bool was_empty = c->start == c->end;
+
+    if (header->size > gputop_perf_merge_space(merge, cpu))
+        return false;
+
+    /* Records are only ever appended, so compact when reaching the end */
+    if (c->end + header->size > merge->cpu_buffer_size) {
+        memmove(c->buf, c->buf + c->start, c->end - c->start);
+        c->end -= c->start;
+        c->start = 0;
+    }
+
+    memcpy(c->buf + c->end, header, header->size);
+    c->end += header->size;
+    c->last_time = record_time(c, header);
+
+    if (was_empty) {
+        c->head_time = c->last_time;
+        merge->heap[merge->heap_len] = cpu;
+        heap_sift_up(merge, merge->heap_len++);
+    }
+
+    return true;
+}
+
+size_t
+gputop_perf_merge_pop(struct gputop_perf_merge *merge,
+                      uint64_t until, size_t max_len,
+                      gputop_perf_merge_cb cb, void *user_data)
+{
+    size_t len = 0;
+
+    while (merge->heap_len) {
+        struct gputop_perf_merge_cpu *c = &merge->cpus[merge->heap[0]];
+        const struct perf_event_header *header =
+            (const struct perf_event_header *) (c->buf + c->start);
+
+        if (c->head_time > until || len + header->size > max_len)
+            break;
+
+        if (c->head_time < merge->last_emitted_time)
+            merge->n_late_records++;
+        else
+            merge->last_emitted_time = c->head_time;
+
+        cb(header, user_data);
+        len += header->size;
+        c->start += header->size;
+
+        if (c->start == c->end) {
+            c->start = c->end = 0;
+            merge->heap[0] = merge->heap[--merge->heap_len];
+        } else {
+            const struct perf_event_header *next =
+                (const struct perf_event_header *) (c->buf + c->start);
+
+            /* Non sample records inherit the time of the record before */
+            if (next->type == PERF_RECORD_SAMPLE &&
+                next->size >= sizeof(*next) + sizeof(uint64_t))
+                c->head_time = *(const uint64_t *) (next + 1);
+        }
+        heap_sift_down(merge, 0);
+    }
+
+    return len;
+}
@@ -0,0 +1,98 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/perf_event.h>
+
+/* K-way merge of the records read from the per CPU rings of a perf event
+ * into a single stream ordered by PERF_SAMPLE_TIME.
+ *
+ * Each CPU's ring is already in time order, so records are queued per CPU
+ * and a binary min-heap of the CPUs, keyed on the time of their oldest
+ * queued record, gives the next record to emit in O(log n_cpus).
+ *
+ * Samples must have PERF_SAMPLE_TIME as their first field. Other records
+ * (e.g. PERF_RECORD_LOST) take the time of the last sample queued for the
+ * same CPU so they keep their place.
+ */
+struct gputop_perf_merge_cpu {
+    uint8_t *buf;
+    size_t start; /* oldest queued record */
+    size_t end;
+
+    uint64_t head_time; /* time of the record at start */
+    uint64_t last_time; /* time of the last record queued */
+};
+
+struct gputop_perf_merge {
+    struct gputop_perf_merge_cpu *cpus;
+    int n_cpus;
+    size_t cpu_buffer_size;
+
+    int *heap; /* indices of the CPUs with queued records */
+    int heap_len;
+
+    uint64_t last_emitted_time;
+    uint64_t n_late_records; /* emitted after a more recent record */
+};
+
+typedef void (*gputop_perf_merge_cb)(const struct perf_event_header *header,
+                                     void *user_data);
+
+void gputop_perf_merge_init(struct gputop_perf_merge *merge,
+                            int n_cpus, size_t cpu_buffer_size);
+void gputop_perf_merge_fini(struct gputop_perf_merge *merge);
+
+/* Bytes that can still be queued for a CPU */
+size_t gputop_perf_merge_space(const struct gputop_perf_merge *merge, int cpu);
+
+/* Time of the oldest queued record, UINT64_MAX if there's none */
+uint64_t gputop_perf_merge_next_time(const struct gputop_perf_merge *merge);
+
+/* Time of the most recent record queued for a CPU */
+static inline uint64_t
+gputop_perf_merge_last_time(const struct gputop_perf_merge *merge, int cpu)
+{
+    return merge->cpus[cpu].last_time;
+}
+
+/* Queues a copy of a record read from a CPU's ring, returns false if there
+ * isn't enough space (see gputop_perf_merge_space()).
+ */
+bool gputop_perf_merge_push(struct gputop_perf_merge *merge, int cpu,
+                            const struct perf_event_header *header);
+
+/* Passes the queued records up to a given time to cb, in time order, as
+ * long as they fit within max_len bytes. Returns the number of bytes
+ * emitted.
+ */
+size_t gputop_perf_merge_pop(struct gputop_perf_merge *merge,
+                             uint64_t until, size_t max_len,
+                             gputop_perf_merge_cb cb, void *user_data);
@@ -47,6 +47,9 @@
 #include <assert.h>
 #include <inttypes.h>
 #include <poll.h>
+#include <sched.h>
+#include <signal.h>
+#include <sys/eventfd.h>
 
 #include <uv.h>
 #include <dirent.h>
@@ -58,15 +61,22 @@
 #include "gputop-mainloop.h"
 #include "gputop-log.h"
 #include "gputop-perf.h"
+#include "gputop-perf-merge.h"
+#include "gputop-oa-scenario.h"
 #include "gputop-oa-metrics.h"
 #include "gputop-cpu.h"
 
-#include "gputop-gens-metrics.h"
-
 #include "util/bitscan.h"
 #include "util/macros.h"
 #include "util/ralloc.h"
 
+/* perf_event_header::size is 16 bits */
+#define PERF_MAX_RECORD_SIZE (1 << 16)
+
+/* How long records of merged per-CPU streams are held back, waiting for
+ * older records from other CPUs that haven't been read yet */
+#define MERGE_REORDER_WINDOW_NS 10000000
+
 /* Samples read() from i915 perf */
 struct oa_sample {
     struct drm_i915_perf_record_header header;
@@ -110,6 +120,7 @@ struct intel_device {
 };
 
 bool gputop_fake_mode = false;
+bool gputop_perf_reader_threads = false;
 static bool gputop_disable_oaconfig = false;
 
 static struct intel_device intel_dev;
@@ -121,6 +132,9 @@ struct array *gputop_perf_oa_supported_metric_set_uuids;
 static struct perf_oa_user *gputop_perf_current_user;
 static struct gputop_devinfo gputop_devinfo;
 
+/* Loaded from $GPUTOP_FAKE_SCENARIO, see gputop-oa-scenario.h */
+static struct gputop_oa_scenario *fake_scenario;
+
 static int drm_fd = -1;
 static int drm_card = -1;
 
@@ -156,8 +170,8 @@ kernel_has_dynamic_config_support(int fd)
     if (gputop_disable_oaconfig)
 	return false;
 
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &gen_metrics->metric_sets, link) {
+    for (int i = 0; i < gen_metrics->n_metric_sets; i++) {
+	const struct gputop_metric_set *metric_set = gen_metrics->metric_sets[i];
 	struct drm_i915_perf_oa_config config;
 	char config_path[256];
 	uint32_t mux_regs[] = { 0x9888 /* NOA_WRITE */, 0x0 };
@@ -187,13 +201,7 @@ kernel_has_dynamic_config_support(int fd)
 static const struct gputop_metric_set *
 get_test_metric_set(void)
 {
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &gen_metrics->metric_sets, link) {
-        if (!strcmp(metric_set->symbol_name, "TestOa"))
-            return metric_set;
-    }
-
-    return NULL;
+    return gputop_gen_find_metric_set_by_symbol(gen_metrics, "TestOa");
 }
 
 static bool
@@ -244,6 +252,10 @@ kernel_supports_open_property(uint64_t prop, uint64_t value)
 bool
 gputop_perf_kernel_has_i915_oa_cpu_timestamps(void)
 {
+    /* Scenarios generate timestamps along with the fake reports */
+    if (gputop_fake_mode)
+        return fake_scenario != NULL;
+
     return kernel_supports_open_property(DRM_I915_PERF_PROP_SAMPLE_SYSTEM_TS,
                                          true);
 }
@@ -251,6 +263,9 @@ gputop_perf_kernel_has_i915_oa_cpu_timestamps(void)
 bool
 gputop_perf_kernel_has_i915_oa_gpu_timestamps(void)
 {
+    if (gputop_fake_mode)
+        return fake_scenario != NULL;
+
     return kernel_supports_open_property(DRM_I915_PERF_PROP_SAMPLE_GPU_TS,
                                          true);
 }
@@ -281,16 +296,61 @@ bool gputop_remove_ctx_handle(uint32_t ctx_id)
     return false;
 }
 
+bool gputop_add_remote_ctx_handle(int ctx_fd, uint32_t ctx_id,
+                                  pid_t pid, int remote_fd)
+{
+    if (!gputop_add_ctx_handle(ctx_fd, ctx_id))
+	return false;
+
+    struct ctx_handle *handle =
+	list_last_entry(&ctx_handles_list, struct ctx_handle, link);
+    handle->pid = pid;
+    handle->remote_fd = remote_fd;
+
+    return true;
+}
+
+static void
+free_remote_ctx_handle(struct ctx_handle *ctx)
+{
+    list_del(&ctx->link);
+    close(ctx->fd);
+    free(ctx);
+}
+
+bool gputop_remove_remote_ctx_handle(pid_t pid, int remote_fd, uint32_t ctx_id)
+{
+    list_for_each_entry(struct ctx_handle, ctx, &ctx_handles_list, link) {
+	if (ctx->pid == pid && ctx->remote_fd == remote_fd && ctx->id == ctx_id) {
+	    free_remote_ctx_handle(ctx);
+	    return true;
+	}
+    }
+    return false;
+}
+
+/* Our duplicate fds keep the DRM files of exited processes alive, so
+ * drop their contexts if they didn't destroy them before exiting. */
+void gputop_prune_remote_ctx_handles(void)
+{
+    list_for_each_entry_safe(struct ctx_handle, ctx, &ctx_handles_list, link) {
+	if (ctx->pid && kill(ctx->pid, 0) < 0 && errno == ESRCH)
+	    free_remote_ctx_handle(ctx);
+    }
+}
+
 struct ctx_handle *get_first_available_ctx(char **error)
 {
     struct ctx_handle *ctx = NULL;
 
-    ctx = list_first_entry(&ctx_handles_list, struct ctx_handle, link);
-    if (!ctx) {
+    if (list_empty(&ctx_handles_list)) {
 	int ret = asprintf(error, "Error unable to find a context\n");
 	(void) ret;
+	return NULL;
     }
 
+    ctx = list_first_entry(&ctx_handles_list, struct ctx_handle, link);
+
     return ctx;
 }
 
@@ -313,6 +373,146 @@ perf_event_open (struct perf_event_attr *hw_event,
     return syscall(__NR_perf_event_open, hw_event, pid, cpu, group_fd, flags);
 }
 
+#define MAX_RECORDER_MARKS 4096
+#define RECORDER_MARK_INTERVAL_NS 10000000ULL
+
+static void
+recorder_copy_out(struct gputop_oa_recorder *rec, uint64_t offset,
+                  uint8_t *data, size_t len)
+{
+    size_t pos = offset & (rec->size - 1);
+    size_t before = MIN(len, rec->size - pos);
+
+    memcpy(data, rec->buf + pos, before);
+    memcpy(data + before, rec->buf, len - before);
+}
+
+static void
+recorder_copy_in(struct gputop_oa_recorder *rec, const uint8_t *data, size_t len)
+{
+    size_t pos = rec->head & (rec->size - 1);
+    size_t before = MIN(len, rec->size - pos);
+
+    memcpy(rec->buf + pos, data, before);
+    memcpy(rec->buf, data + before, len - before);
+    rec->head += len;
+}
+
+/* Discard the oldest records until there's room for len more bytes */
+static void
+recorder_make_room(struct gputop_oa_recorder *rec, size_t len)
+{
+    while (rec->head - rec->tail + len > rec->size) {
+        struct drm_i915_perf_record_header header;
+
+        recorder_copy_out(rec, rec->tail, (uint8_t *)&header, sizeof(header));
+        assert(header.size);
+        rec->tail += header.size;
+    }
+
+    while (rec->n_marks && rec->marks[rec->first_mark].offset < rec->tail) {
+        rec->first_mark = (rec->first_mark + 1) % MAX_RECORDER_MARKS;
+        rec->n_marks--;
+    }
+}
+
+static void
+recorder_add_mark(struct gputop_oa_recorder *rec, uint64_t time, uint64_t offset)
+{
+    int last = (rec->first_mark + rec->n_marks - 1) % MAX_RECORDER_MARKS;
+
+    if (rec->n_marks &&
+        time - rec->marks[last].time < RECORDER_MARK_INTERVAL_NS)
+        return;
+
+    if (rec->n_marks == MAX_RECORDER_MARKS) {
+        rec->first_mark = (rec->first_mark + 1) % MAX_RECORDER_MARKS;
+        rec->n_marks--;
+    }
+
+    last = (rec->first_mark + rec->n_marks) % MAX_RECORDER_MARKS;
+    rec->marks[last].time = time;
+    rec->marks[last].offset = offset;
+    rec->n_marks++;
+}
+
+/* NB: read() only ever returns whole records */
+void
+gputop_i915_perf_recorder_drain(struct gputop_perf_stream *stream)
+{
+    struct gputop_oa_recorder *rec = &stream->oa.recorder;
+    uint8_t *buf = stream->oa.bufs[0];
+    uint64_t start = rec->head;
+    int len;
+
+    while (true) {
+        if (gputop_fake_mode)
+            len = gputop_perf_fake_read(stream, buf, stream->oa.buf_sizes);
+        else {
+            while ((len = read(stream->fd, buf, stream->oa.buf_sizes)) < 0 &&
+                   errno == EINTR)
+                ;
+        }
+        if (len <= 0)
+            break;
+
+        recorder_make_room(rec, len);
+        recorder_copy_in(rec, buf, len);
+    }
+
+    if (!gputop_fake_mode && len < 0 && errno != EAGAIN)
+        dbg("Error reading i915 perf stream %m\n");
+
+    if (rec->head != start)
+        recorder_add_mark(rec, gputop_get_time(), start);
+}
+
+/* Returns the position of the first record read within the last
+ * duration_ns (or of the oldest record for a duration of 0) along with
+ * the length of data from there up to the most recent record.
+ */
+uint64_t
+gputop_i915_perf_recorder_window(struct gputop_perf_stream *stream,
+                                 uint64_t duration_ns,
+                                 size_t *len)
+{
+    struct gputop_oa_recorder *rec = &stream->oa.recorder;
+    uint64_t now = gputop_get_time();
+    uint64_t start = rec->tail;
+
+    if (duration_ns && duration_ns < now) {
+        start = rec->head;
+
+        /* NB: if the oldest mark is already within the window we don't know
+         * when the records before it were read so err on the side of
+         * including them. */
+        for (int i = 0; i < rec->n_marks; i++) {
+            const struct gputop_oa_recorder_mark *mark =
+                &rec->marks[(rec->first_mark + i) % MAX_RECORDER_MARKS];
+
+            if (mark->time >= now - duration_ns) {
+                start = i == 0 ? rec->tail : mark->offset;
+                break;
+            }
+        }
+    }
+
+    *len = rec->head - start;
+
+    return start;
+}
+
+void
+gputop_i915_perf_recorder_read(struct gputop_perf_stream *stream,
+                               uint64_t offset, uint8_t *data, size_t len)
+{
+    struct gputop_oa_recorder *rec = &stream->oa.recorder;
+
+    assert(offset >= rec->tail && offset + len <= rec->head);
+
+    recorder_copy_out(rec, offset, data, len);
+}
+
 static void
 perf_ready_cb(uv_poll_t *poll, int status, int events)
 {
@@ -331,6 +531,287 @@ perf_fake_ready_cb(uv_timer_t *poll)
 	stream->ready_cb(stream);
 }
 
+static unsigned
+fake_tick_ms(void)
+{
+    return fake_scenario ? gputop_oa_scenario_tick_ms(fake_scenario) : 1000;
+}
+
+/* Size of the ring between a reader thread and the mainloop */
+#define READER_RING_SIZE (16 * 1024 * 1024)
+
+/* Perf only wakes us up after a number of samples, so also drain
+ * periodically. This is also the period of the fake mode reports. */
+#define READER_POLL_TIMEOUT_MS 100
+
+/* How long a reader waits for the mainloop to make room in a full ring */
+#define READER_STALL_SLEEP_US 1000
+
+static int next_reader_cpu;
+
+static void read_perf_records(struct gputop_perf_stream *stream,
+                              struct gputop_perf_stream_stats *stats,
+                              gputop_perf_record_cb cb,
+                              void *user_data);
+
+static void
+reader_push(struct gputop_perf_reader *reader, const uint8_t *data, size_t len)
+{
+    if (gputop_spsc_ring_push(&reader->ring, data, len))
+        return;
+
+    /* NB: we only stop reading while the mainloop catches up, so the
+     * kernel's own buffer still gives us some slack */
+    atomic_fetch_add(&reader->n_stalls, 1);
+    do {
+        usleep(READER_STALL_SLEEP_US);
+    } while (!atomic_load(&reader->quit) &&
+             !gputop_spsc_ring_push(&reader->ring, data, len));
+}
+
+static bool
+reader_drain_i915_perf(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_reader *reader = stream->reader;
+    bool pushed = false;
+    int len;
+
+    while (true) {
+        if (gputop_fake_mode)
+            len = gputop_perf_fake_read(stream, reader->buf, reader->buf_size);
+        else {
+            while ((len = read(stream->fd, reader->buf, reader->buf_size)) < 0 &&
+                   errno == EINTR)
+                ;
+        }
+        if (len <= 0)
+            break;
+
+        reader_push(reader, reader->buf, len);
+        pushed = true;
+    }
+
+    if (!gputop_fake_mode && len < 0 && errno != EAGAIN)
+        dbg("Error reading i915 perf stream %m\n");
+
+    return pushed;
+}
+
+static void
+reader_append_record_cb(struct gputop_perf_stream *stream,
+                        const struct perf_event_header *header,
+                        void *user_data)
+{
+    size_t *len = user_data;
+
+    memcpy(stream->reader->buf + *len, header, header->size);
+    *len += header->size;
+}
+
+/* NB: the records pending in perf's ring can never exceed the size of our
+ * buffer, which is the same size.
+ *
+ * The mainloop reads stream->stats concurrently so the records are counted
+ * in the reader's own stats, then published atomically.
+ */
+static bool
+reader_drain_perf(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_reader *reader = stream->reader;
+    struct gputop_perf_stream_stats *stats = &reader->stats;
+    size_t len = 0;
+
+    read_perf_records(stream, stats, reader_append_record_cb, &len);
+
+    atomic_store(&reader->n_records, stats->n_records);
+    atomic_store(&reader->n_samples, stats->n_samples);
+    atomic_store(&reader->n_lost_samples, stats->n_lost_samples);
+    atomic_store(&reader->n_wrapped_records, stats->n_wrapped_records);
+    atomic_store(&reader->n_spurious_records, stats->n_spurious_records);
+
+    if (!len)
+        return false;
+
+    reader_push(reader, reader->buf, len);
+
+    return true;
+}
+
+static void *
+reader_thread(void *data)
+{
+    struct gputop_perf_stream *stream = data;
+    struct gputop_perf_reader *reader = stream->reader;
+    struct pollfd pollfds[2] = {
+        /* NB: poll() ignores the negative fd of fake streams */
+        { .fd = stream->fd, .events = POLLIN },
+        { .fd = reader->wakeup_fd, .events = POLLIN },
+    };
+
+    while (!atomic_load(&reader->quit)) {
+        bool pushed = false;
+
+        if (poll(pollfds, ARRAY_SIZE(pollfds), READER_POLL_TIMEOUT_MS) < 0 &&
+            errno != EINTR) {
+            dbg("Error polling perf stream %m\n");
+            break;
+        }
+
+        switch (stream->type) {
+        case GPUTOP_STREAM_I915_PERF:
+            pushed = reader_drain_i915_perf(stream);
+            break;
+        case GPUTOP_STREAM_PERF:
+            pushed = reader_drain_perf(stream);
+            break;
+        case GPUTOP_STREAM_CPU:
+            assert(0);
+            break;
+        }
+
+        if (pushed)
+            uv_async_send(&reader->async);
+    }
+
+    return NULL;
+}
+
+static void
+reader_async_cb(uv_async_t *async)
+{
+    struct gputop_perf_stream *stream = async->data;
+
+    if (stream->ready_cb)
+        stream->ready_cb(stream);
+}
+
+static void
+reader_failed_close_cb(uv_handle_t *handle)
+{
+    struct gputop_perf_reader *reader = handle->data;
+
+    free(reader->ring.buf);
+    free(reader->buf);
+    free(reader);
+}
+
+/* Moves the reading of a live stream out of the mainloop, into a dedicated
+ * thread (see struct gputop_perf_reader). Must be called before any data is
+ * read from the stream.
+ */
+bool
+gputop_perf_stream_start_reader(struct gputop_perf_stream *stream)
+{
+    struct gputop_perf_reader *reader;
+    bool fake_timer = gputop_fake_mode && stream->type == GPUTOP_STREAM_I915_PERF;
+    size_t buf_size;
+    cpu_set_t cpu_set;
+
+    /* In overwrite mode streams are either read in place or already
+     * drained into a flight recorder */
+    if (stream->overwrite)
+        return false;
+
+    switch (stream->type) {
+    case GPUTOP_STREAM_I915_PERF:
+        buf_size = stream->oa.buf_sizes;
+        break;
+    case GPUTOP_STREAM_PERF:
+        /* Merged streams are read via the rings of their per-CPU streams */
+        if (stream->perf.merge)
+            return false;
+        buf_size = stream->perf.buffer_size;
+        break;
+    default:
+        return false;
+    }
+
+    reader = xmalloc0(sizeof(*reader));
+    reader->wakeup_fd = eventfd(0, EFD_CLOEXEC);
+    if (reader->wakeup_fd < 0) {
+        dbg("Failed to create reader thread eventfd %m\n");
+        free(reader);
+        return false;
+    }
+    reader->buf = xmalloc(buf_size);
+    reader->buf_size = buf_size;
+    gputop_spsc_ring_init(&reader->ring, xmalloc(READER_RING_SIZE), READER_RING_SIZE);
+    atomic_init(&reader->quit, false);
+    atomic_init(&reader->n_stalls, 0);
+    atomic_init(&reader->n_records, 0);
+    atomic_init(&reader->n_samples, 0);
+    atomic_init(&reader->n_lost_samples, 0);
+    atomic_init(&reader->n_wrapped_records, 0);
+    atomic_init(&reader->n_spurious_records, 0);
+
+    /* The thread takes over from the mainloop's polling */
+    if (fake_timer)
+        uv_timer_stop(&stream->fd_timer);
+    else
+        uv_poll_stop(&stream->fd_poll);
+
+    uv_async_init(gputop_mainloop, &reader->async, reader_async_cb);
+    reader->async.data = stream;
+    stream->reader = reader;
+
+    if (pthread_create(&reader->thread, NULL, reader_thread, stream) != 0) {
+        dbg("Failed to create reader thread\n");
+        stream->reader = NULL;
+        close(reader->wakeup_fd);
+        reader->async.data = reader;
+        uv_close((uv_handle_t *)&reader->async, reader_failed_close_cb);
+        if (fake_timer)
+            uv_timer_start(&stream->fd_timer, perf_fake_ready_cb,
+                           fake_tick_ms(), fake_tick_ms());
+        else
+            uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+        return false;
+    }
+
+    /* Keep the threads of different streams from competing for a CPU */
+    CPU_ZERO(&cpu_set);
+    CPU_SET(next_reader_cpu++ % gputop_cpu_count(), &cpu_set);
+    pthread_setaffinity_np(reader->thread, sizeof(cpu_set), &cpu_set);
+
+    return true;
+}
+
+static void
+stop_reader(struct gputop_perf_reader *reader)
+{
+    uint64_t wakeup = 1;
+
+    atomic_store(&reader->quit, true);
+    if (write(reader->wakeup_fd, &wakeup, sizeof(wakeup)) != sizeof(wakeup))
+        dbg("Failed to wake up reader thread %m\n");
+    pthread_join(reader->thread, NULL);
+    close(reader->wakeup_fd);
+}
+
+/* Called by the mainloop to consume what a reader thread has read */
+size_t
+gputop_perf_stream_reader_pop(struct gputop_perf_stream *stream,
+                              uint8_t *data, size_t max_len)
+{
+    struct gputop_perf_reader *reader = stream->reader;
+    struct gputop_perf_stream_stats *stats = &stream->stats;
+
+    stats->reader_occupancy = gputop_spsc_ring_occupancy(&reader->ring);
+    stats->reader_max_occupancy = MAX2(stats->reader_max_occupancy,
+                                       stats->reader_occupancy);
+    stats->n_reader_stalls = atomic_load(&reader->n_stalls);
+
+    if (stream->type == GPUTOP_STREAM_PERF) {
+        stats->n_records = atomic_load(&reader->n_records);
+        stats->n_samples = atomic_load(&reader->n_samples);
+        stats->n_lost_samples = atomic_load(&reader->n_lost_samples);
+        stats->n_wrapped_records = atomic_load(&reader->n_wrapped_records);
+        stats->n_spurious_records = atomic_load(&reader->n_spurious_records);
+    }
+
+    return gputop_spsc_ring_pop(&reader->ring, data, max_len);
+}
+
 void
 gputop_perf_stream_ref(struct gputop_perf_stream *stream)
 {
@@ -343,8 +824,27 @@ gputop_perf_stream_ref(struct gputop_perf_stream *stream)
 static void
 finish_stream_close(struct gputop_perf_stream *stream)
 {
+    if (stream->reader) {
+        free(stream->reader->ring.buf);
+        free(stream->reader->buf);
+        free(stream->reader);
+        stream->reader = NULL;
+    }
+
     switch(stream->type) {
     case GPUTOP_STREAM_PERF:
+	if (stream->perf.cpu_streams) {
+	    if (stream->perf.merge) {
+		gputop_perf_merge_fini(stream->perf.merge);
+		free(stream->perf.merge);
+		stream->perf.merge = NULL;
+	    }
+	    free(stream->perf.cpu_streams);
+	    stream->perf.cpu_streams = NULL;
+
+	    server_dbg("closed merged perf stream\n");
+	}
+
 	if (stream->fd > 0) {
 
 	    if (stream->perf.mmap_page) {
@@ -359,6 +859,9 @@ finish_stream_close(struct gputop_perf_stream *stream)
 		stream->perf.header_buf.offsets = NULL;
 	    }
 
+	    free(stream->perf.record_scratch);
+	    stream->perf.record_scratch = NULL;
+
 	    close(stream->fd);
 	    stream->fd = -1;
 
@@ -373,6 +876,14 @@ finish_stream_close(struct gputop_perf_stream *stream)
 		stream->oa.bufs[i] = NULL;
 	    }
 	}
+	free(stream->oa.recorder.buf);
+	stream->oa.recorder.buf = NULL;
+	free(stream->oa.recorder.marks);
+	stream->oa.recorder.marks = NULL;
+	if (stream->fake_generator) {
+	    gputop_oa_generator_free(stream->fake_generator);
+	    stream->fake_generator = NULL;
+	}
 	if (stream->fd == -1)
 	    server_dbg("closed i915 fake perf stream\n");
 	else if (stream->fd > 0) {
@@ -402,18 +913,39 @@ stream_handle_closed_cb(uv_handle_t *handle)
 	finish_stream_close(stream);
 }
 
+/* The per-CPU streams of a merged stream aren't polled, the merged stream
+ * reads them, so they are closed immediately */
+static void
+cpu_stream_closed_cb(struct gputop_perf_stream *stream)
+{
+}
+
 void
 gputop_perf_stream_close(struct gputop_perf_stream *stream,
 			 void (*on_close_cb)(struct gputop_perf_stream *stream))
 {
     stream->on_close_cb = on_close_cb;
 
+    /* The reader thread mustn't touch the stream once we start closing it */
+    if (stream->reader) {
+        stop_reader(stream->reader);
+        uv_close((uv_handle_t *)&stream->reader->async, stream_handle_closed_cb);
+        stream->n_closing_uv_handles++;
+    }
+
     /* First we close any libuv handles before closing anything else in
      * stream_handle_closed_cb()...
      */
     switch(stream->type) {
     case GPUTOP_STREAM_PERF:
-	if (stream->fd >= 0) {
+	for (int i = 0; i < stream->perf.n_cpu_streams; i++) {
+	    gputop_perf_stream_close(stream->perf.cpu_streams[i],
+				     cpu_stream_closed_cb);
+	    gputop_perf_stream_unref(stream->perf.cpu_streams[i]);
+	}
+	stream->perf.n_cpu_streams = 0;
+
+	if (stream->fd >= 0 && !stream->no_poll) {
 	    uv_close((uv_handle_t *)&stream->fd_poll, stream_handle_closed_cb);
 	    stream->n_closing_uv_handles++;
 	}
@@ -466,6 +998,7 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
                                 bool gpu_timestamps,
                                 void (*ready_cb)(struct gputop_perf_stream *),
 				bool overwrite,
+				size_t recorder_size,
 				char **error)
 {
     struct gputop_perf_stream *stream;
@@ -546,6 +1079,13 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
 	stream->prev_clocks = gputop_get_time();
 	stream->period = 80 * (2 << period_exponent);
 	stream->prev_timestamp = gputop_get_time();
+
+        if (fake_scenario)
+            stream->fake_generator =
+                gputop_oa_generator_new(fake_scenario, &gputop_devinfo,
+                                        stream->period,
+                                        cpu_timestamps, gpu_timestamps,
+                                        stream->start_time);
     }
 
     /* We double buffer the samples we read from the kernel so
@@ -559,8 +1099,16 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
 
     stream->overwrite = overwrite;
     if (overwrite) {
-#warning "TODO: support flight-recorder mode"
-	assert(0);
+        struct gputop_oa_recorder *rec = &stream->oa.recorder;
+
+        assert(recorder_size >= stream->oa.buf_sizes &&
+               (recorder_size & (recorder_size - 1)) == 0);
+        rec->size = recorder_size;
+        rec->buf = xmalloc(recorder_size);
+        rec->marks = xmalloc(sizeof(rec->marks[0]) * MAX_RECORDER_MARKS);
+
+        /* Nothing else reads from the stream in overwrite mode */
+        stream->ready_cb = gputop_i915_perf_recorder_drain;
     }
 
     stream->fd_poll.data = stream;
@@ -569,7 +1117,8 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
     if (gputop_fake_mode)
     {
 	uv_timer_init(gputop_mainloop, &stream->fd_timer);
-	uv_timer_start(&stream->fd_timer, perf_fake_ready_cb, 1000, 1000);
+	uv_timer_start(&stream->fd_timer, perf_fake_ready_cb,
+                       fake_tick_ms(), fake_tick_ms());
     }
     else
     {
@@ -581,15 +1130,17 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
     return stream;
 }
 
-struct gputop_perf_stream *
-gputop_perf_open_tracepoint(int pid,
-			    int cpu,
-			    uint64_t id,
-			    size_t trace_struct_size,
-			    size_t perf_buffer_size,
-			    void (*ready_cb)(struct gputop_perf_stream *),
-			    bool overwrite,
-			    char **error)
+/* Opens the perf event and ring of a tracepoint stream, without polling for
+ * data... */
+static struct gputop_perf_stream *
+open_tracepoint_ring(int pid,
+		     int cpu,
+		     uint64_t id,
+		     size_t trace_struct_size,
+		     size_t perf_buffer_size,
+		     uint64_t sample_type,
+		     bool overwrite,
+		     char **error)
 {
     struct gputop_perf_stream *stream;
     struct perf_event_attr attr;
@@ -603,7 +1154,7 @@ gputop_perf_open_tracepoint(int pid,
     attr.type = PERF_TYPE_TRACEPOINT;
     attr.config = id;
 
-    attr.sample_type = PERF_SAMPLE_RAW | PERF_SAMPLE_TIME;
+    attr.sample_type = sample_type;
     attr.sample_period = 1;
     //attr.wakeup_events = 1;
     attr.watermark = true;
@@ -641,11 +1192,12 @@ gputop_perf_open_tracepoint(int pid,
     stream->perf.buffer = mmap_base + page_size;
     stream->perf.buffer_size = perf_buffer_size;
     stream->perf.mmap_page = (void *)mmap_base;
-    stream->ready_cb = ready_cb;
+    stream->perf.record_scratch = xmalloc(PERF_MAX_RECORD_SIZE);
 
     sample_size =
 	sizeof(struct perf_event_header) +
 	8 /* _TIME */ +
+	((sample_type & PERF_SAMPLE_CPU) ? 8 : 0) +
 	trace_struct_size; /* _RAW */
 
     expected_max_samples = (stream->perf.buffer_size / sample_size) * 1.2;
@@ -659,6 +1211,93 @@ gputop_perf_open_tracepoint(int pid,
 	    xmalloc(sizeof(uint32_t) * expected_max_samples);
     }
 
+    return stream;
+}
+
+/* perf can't trace all processes on all CPUs with a single event, so for
+ * pid == -1, cpu == -1 we open a ring per CPU and merge their records into
+ * one time ordered stream as they are read. Each record then also includes
+ * PERF_SAMPLE_CPU.
+ */
+static struct gputop_perf_stream *
+open_merged_tracepoint(int pid,
+		       uint64_t id,
+		       size_t trace_struct_size,
+		       size_t perf_buffer_size,
+		       void (*ready_cb)(struct gputop_perf_stream *),
+		       char **error)
+{
+    struct gputop_perf_stream *stream;
+    int n_cpus = gputop_cpu_count();
+
+    stream = xmalloc0(sizeof(*stream));
+    stream->type = GPUTOP_STREAM_PERF;
+    stream->ref_count = 1;
+    stream->fd = -1;
+    stream->ready_cb = ready_cb;
+
+    /* NB: the frames we forward are sized according to a single ring */
+    stream->perf.buffer_size = perf_buffer_size;
+
+    stream->perf.cpu_streams = xmalloc0(sizeof(stream->perf.cpu_streams[0]) * n_cpus);
+    for (int cpu = 0; cpu < n_cpus; cpu++) {
+	struct gputop_perf_stream *cpu_stream =
+	    open_tracepoint_ring(pid, cpu, id, trace_struct_size,
+				 perf_buffer_size,
+				 PERF_SAMPLE_RAW | PERF_SAMPLE_TIME | PERF_SAMPLE_CPU,
+				 false, error);
+	if (!cpu_stream) {
+	    gputop_perf_stream_close(stream, cpu_stream_closed_cb);
+	    gputop_perf_stream_unref(stream);
+	    return NULL;
+	}
+	cpu_stream->no_poll = true;
+
+	stream->perf.cpu_streams[stream->perf.n_cpu_streams++] = cpu_stream;
+    }
+
+    /* Enough to always be able to drain a whole ring while still holding
+     * back records within the reorder window */
+    stream->perf.merge = xmalloc(sizeof(*stream->perf.merge));
+    gputop_perf_merge_init(stream->perf.merge, n_cpus, perf_buffer_size * 2);
+
+    stream->fd_poll.data = stream;
+    stream->fd_timer.data = stream;
+
+    return stream;
+}
+
+struct gputop_perf_stream *
+gputop_perf_open_tracepoint(int pid,
+			    int cpu,
+			    uint64_t id,
+			    size_t trace_struct_size,
+			    size_t perf_buffer_size,
+			    void (*ready_cb)(struct gputop_perf_stream *),
+			    bool overwrite,
+			    char **error)
+{
+    struct gputop_perf_stream *stream;
+
+    if (cpu == -1 && pid == -1) {
+	if (overwrite) {
+	    int ret = asprintf(error, "Merged per-CPU tracepoints can't be opened in overwrite mode\n");
+	    (void) ret;
+	    return NULL;
+	}
+	return open_merged_tracepoint(pid, id, trace_struct_size,
+				      perf_buffer_size, ready_cb, error);
+    }
+
+    stream = open_tracepoint_ring(pid, cpu, id, trace_struct_size,
+				  perf_buffer_size,
+				  PERF_SAMPLE_RAW | PERF_SAMPLE_TIME,
+				  overwrite, error);
+    if (!stream)
+	return NULL;
+
+    stream->ready_cb = ready_cb;
+
     stream->fd_poll.data = stream;
     uv_poll_init(gputop_mainloop, &stream->fd_poll, stream->fd);
     uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
@@ -724,6 +1363,7 @@ gputop_perf_open_generic_counter(int pid,
     stream->perf.buffer = mmap_base + page_size;
     stream->perf.buffer_size = perf_buffer_size;
     stream->perf.mmap_page = (void *)mmap_base;
+    stream->perf.record_scratch = xmalloc(PERF_MAX_RECORD_SIZE);
 
     sample_size =
 	sizeof(struct perf_event_header) +
@@ -1077,26 +1717,20 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 
     if (devinfo->is_haswell) {
 	SET_NAMES(gputop_devinfo, "hsw", "Haswell");
-	gen_metrics = gputop_oa_get_metrics_hsw(&gputop_devinfo);
     } else if (devinfo->is_broadwell) {
 	SET_NAMES(gputop_devinfo, "bdw", "Broadwell");
-	gen_metrics = gputop_oa_get_metrics_bdw(&gputop_devinfo);
     } else if (devinfo->is_cherryview) {
 	SET_NAMES(gputop_devinfo, "chv", "Cherryview");
-	gen_metrics = gputop_oa_get_metrics_chv(&gputop_devinfo);
     } else if (devinfo->is_skylake) {
 	switch (devinfo->gt) {
 	case 2:
 	    SET_NAMES(gputop_devinfo, "sklgt2", "Skylake GT2");
-	    gen_metrics = gputop_oa_get_metrics_sklgt2(&gputop_devinfo);
 	    break;
 	case 3:
 	    SET_NAMES(gputop_devinfo, "sklgt3", "Skylake GT3");
-	    gen_metrics = gputop_oa_get_metrics_sklgt3(&gputop_devinfo);
 	    break;
 	case 4:
 	    SET_NAMES(gputop_devinfo, "sklgt4", "Skylake GT4");
-	    gen_metrics = gputop_oa_get_metrics_sklgt4(&gputop_devinfo);
 	    break;
 	default:
 	    fprintf(stderr, "Unsupported GT%u Skylake System\n", devinfo->gt);
@@ -1104,16 +1738,13 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 	}
     } else if (devinfo->is_broxton) {
 	SET_NAMES(gputop_devinfo, "bxt", "Broxton");
-	gen_metrics = gputop_oa_get_metrics_bxt(&gputop_devinfo);
     } else if (devinfo->is_kabylake) {
 	switch (devinfo->gt) {
 	case 2:
 	    SET_NAMES(gputop_devinfo, "kblgt2", "Kabylake GT2");
-	    gen_metrics = gputop_oa_get_metrics_kblgt2(&gputop_devinfo);
 	    break;
 	case 3:
 	    SET_NAMES(gputop_devinfo, "kblgt3", "Kabylake GT3");
-	    gen_metrics = gputop_oa_get_metrics_kblgt3(&gputop_devinfo);
 	    break;
 	default:
 	    fprintf(stderr, "Unsupported GT%u Kabylake System\n", devinfo->gt);
@@ -1121,16 +1752,13 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 	}
     } else if (devinfo->is_geminilake) {
 	SET_NAMES(gputop_devinfo, "glk", "Geminilake");
-	gen_metrics = gputop_oa_get_metrics_glk(&gputop_devinfo);
     } else if (devinfo->is_coffeelake) {
 	switch (devinfo->gt) {
 	case 2:
 	    SET_NAMES(gputop_devinfo, "cflgt2", "Coffeelake GT2");
-	    gen_metrics = gputop_oa_get_metrics_cflgt2(&gputop_devinfo);
 	    break;
 	case 3:
 	    SET_NAMES(gputop_devinfo, "cflgt3", "Coffeelake GT3");
-	    gen_metrics = gputop_oa_get_metrics_cflgt3(&gputop_devinfo);
 	    break;
 	default:
 	    fprintf(stderr, "Unsupported GT%u Coffeelake System\n", devinfo->gt);
@@ -1138,15 +1766,20 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 	}
     } else if (devinfo->is_cannonlake) {
         SET_NAMES(gputop_devinfo, "cnl", "Cannonlake");
-	gen_metrics = gputop_oa_get_metrics_cnl(&gputop_devinfo);
     } else if (devinfo->gen == 11) {
         SET_NAMES(gputop_devinfo, "icl", "Icelake");
-	gen_metrics = gputop_oa_get_metrics_icl(&gputop_devinfo);
     } else {
 	fprintf(stderr, "Unknown System\n");
 	return false;
     }
 
+    /* Needed to read counters for clients asking the server to aggregate */
+    gputop_devinfo_build_equations_variables(&gputop_devinfo);
+
+    gen_metrics = gputop_oa_get_metrics(gputop_devinfo.devname, &gputop_devinfo);
+    if (!gen_metrics)
+	return false;
+
     if (gputop_fake_mode)
 	SET_NAMES(gputop_devinfo, "bdw", "Fake Broadwell Intel device");
     else {
@@ -1159,10 +1792,10 @@ init_dev_info(int fd, uint32_t devid, const struct gen_device_info *devinfo)
 #undef SET_NAMES
 }
 
-static unsigned int
+static uint64_t
 read_perf_head(struct perf_event_mmap_page *mmap_page)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
+    uint64_t head = (*(volatile uint64_t *)&mmap_page->data_head);
     rmb();
 
     return head;
@@ -1170,7 +1803,7 @@ read_perf_head(struct perf_event_mmap_page *mmap_page)
 
 static void
 write_perf_tail(struct perf_event_mmap_page *mmap_page,
-		unsigned int tail)
+		uint64_t tail)
 {
     /* Make sure we've finished reading all the sample data we
      * we're consuming before updating the tail... */
@@ -1178,11 +1811,31 @@ write_perf_tail(struct perf_event_mmap_page *mmap_page,
     mmap_page->data_tail = tail;
 }
 
+static uint64_t
+merge_reorder_deadline(void)
+{
+    uint64_t now = gputop_get_time();
+
+    return now > MERGE_REORDER_WINDOW_NS ? now - MERGE_REORDER_WINDOW_NS : 0;
+}
+
 static bool
 perf_stream_data_pending(struct gputop_perf_stream *stream)
 {
-    uint64_t head = read_perf_head(stream->perf.mmap_page);
-    uint64_t tail = stream->perf.mmap_page->data_tail;
+    uint64_t head;
+    uint64_t tail;
+
+    if (stream->perf.merge) {
+	for (int i = 0; i < stream->perf.n_cpu_streams; i++) {
+	    if (perf_stream_data_pending(stream->perf.cpu_streams[i]))
+		return true;
+	}
+	return gputop_perf_merge_next_time(stream->perf.merge) <=
+	    merge_reorder_deadline();
+    }
+
+    head = read_perf_head(stream->perf.mmap_page);
+    tail = stream->perf.mmap_page->data_tail;
 
     return !!TAKEN(head, tail, stream->perf.buffer_size);
 }
@@ -1209,9 +1862,34 @@ i915_perf_stream_data_pending(struct gputop_perf_stream *stream)
     }
 }
 
+/* The fds are polled level triggered, so a consumer that leaves the data
+ * with the kernel while it can't take any more has to stop polling or the
+ * ready_cb keeps getting called. Streams read by a thread or a fake timer
+ * only wake us up when there's new data and are left alone.
+ */
+void
+gputop_perf_stream_set_polling(struct gputop_perf_stream *stream, bool enabled)
+{
+    if (stream->reader || stream->fd < 0 || !stream->ready_cb ||
+        (gputop_fake_mode && stream->type == GPUTOP_STREAM_I915_PERF))
+        return;
+
+    if (stream->poll_stopped != enabled)
+        return;
+
+    if (enabled)
+        uv_poll_start(&stream->fd_poll, UV_READABLE, perf_ready_cb);
+    else
+        uv_poll_stop(&stream->fd_poll);
+    stream->poll_stopped = !enabled;
+}
+
 bool
 gputop_stream_data_pending(struct gputop_perf_stream *stream)
 {
+    if (stream->reader)
+        return gputop_spsc_ring_occupancy(&stream->reader->ring) != 0;
+
     switch (stream->type) {
     case GPUTOP_STREAM_PERF:
 	return perf_stream_data_pending(stream);
@@ -1297,69 +1975,40 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
     uint64_t perf_tail;
     uint32_t buf_head;
     uint32_t buf_tail;
-    uint32_t n_new = 0;
 
     perf_head = read_perf_head(stream->perf.mmap_page);
-
-    //if (hdr_buf->head == hdr_buf->tail)
-    //perf_tail = hdr_buf->last_perf_head;
-    //else
     perf_tail = stream->perf.mmap_page->data_tail;
 
-#if 0
-    if (perf_tail > perf_head) {
-	dbg("Unexpected perf tail > head condition\n");
-	return;
-    }
-#endif
-
     if (perf_head == perf_tail)
 	return;
 
-    //hdr_buf->last_perf_head = perf_head;
+    stream->stats.n_header_updates++;
 
     buf_head = hdr_buf->head;
     buf_tail = hdr_buf->tail;
 
-#if 1
-    printf("perf records:\n");
-    printf("> fd = %d\n", stream->fd);
-    printf("> size = %lu\n", stream->perf.buffer_size);
-    printf("> tail_ptr = %p\n", &stream->perf.mmap_page->data_tail);
-    printf("> head=%"PRIu64"\n", perf_head);
-    printf("> tail=%"PRIu64"\n", (uint64_t)stream->perf.mmap_page->data_tail);
-    printf("> TAKEN=%"PRIu64"\n", (uint64_t)TAKEN(perf_head, stream->perf.mmap_page->data_tail, stream->perf.buffer_size));
-    printf("> records:\n");
-#endif
-
     while (TAKEN(perf_head, perf_tail, stream->perf.buffer_size)) {
 	uint64_t perf_offset = perf_tail & mask;
 	const struct perf_event_header *header =
 	    (const struct perf_event_header *)(data + perf_offset);
 
-	n_new++;
-
-	if (header->size == 0) {
-	    dbg("Spurious header size == 0\n");
-	    /* XXX: How should we handle this instead of exiting() */
+	if (header->size == 0 || header->size > (perf_head - perf_tail)) {
+	    /* Skip to the head rather than risk parsing garbage */
+	    stream->stats.n_spurious_records++;
 	    break;
-	    //exit(1);
 	}
 
-	if (header->size > (perf_head - perf_tail)) {
-	    dbg("Spurious header size would overshoot head\n");
-	    /* XXX: How should we handle this instead of exiting() */
-	    break;
-	    //exit(1);
-	}
+	stream->stats.n_records++;
 
 	/* Once perf wraps, the buffer is full of data and perf starts
 	 * to eat its tail, overwriting old data. */
 	if ((const uint8_t *)header + header->size > data + stream->perf.buffer_size)
 	    hdr_buf->full = true;
 
-	if ((buf_head - buf_tail) == hdr_buf->len)
+	if ((buf_head - buf_tail) == hdr_buf->len) {
 	    buf_tail++;
+	    stream->stats.n_overwritten_records++;
+	}
 
 	/* Checking what tail records have been being overwritten by this
 	 * new record...
@@ -1369,7 +2018,7 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
 	 * NB: it's possible no records have been trampled
 	 */
 	if (hdr_buf->full) {
-	    while (1) {
+	    while (buf_tail != buf_head) {
 		uint32_t buf_tail_offset = hdr_buf->offsets[buf_tail % hdr_buf->len];
 
 		/* To simplify checking for an overlap, invariably ensure the
@@ -1382,6 +2031,7 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
 		    break;
 
 		buf_tail++;
+		stream->stats.n_overwritten_records++;
 	    }
 	}
 
@@ -1396,24 +2046,6 @@ gputop_perf_update_header_offsets(struct gputop_perf_stream *stream)
 
     hdr_buf->head = buf_head;
     hdr_buf->tail = buf_tail;
-
-#if 1
-    printf("headers update:\n");
-    printf("n new records = %d\n", n_new);
-    printf("buf len = %d\n", hdr_buf->len);
-    printf("perf head = %"PRIu64"\n", perf_head);
-    printf("perf tail = %"PRIu64"\n", perf_tail);
-    printf("buf head = %"PRIu32"\n", hdr_buf->head);
-    printf("buf tail = %"PRIu32"\n", hdr_buf->tail);
-
-    if (!hdr_buf->full) {
-	float percentage = (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] / (float)stream->perf.buffer_size) * 100.0f;
-	printf("> %d%% full\n", (int)percentage);
-    } else
-	printf("> 100%% full\n");
-
-    printf("> n records = %u\n", (hdr_buf->head - hdr_buf->tail));
-#endif
 }
 
 void
@@ -1455,10 +2087,167 @@ gputop_i915_perf_print_records(struct gputop_perf_stream *stream,
 }
 
 
+/* PERF_RECORD_LOST */
+struct perf_lost_record {
+    struct perf_event_header header;
+    uint64_t id;
+    uint64_t lost;
+};
+
+struct merge_push_state {
+    struct gputop_perf_merge *merge;
+    int cpu;
+};
+
+static void
+merge_push_record_cb(struct gputop_perf_stream *stream,
+		     const struct perf_event_header *header,
+		     void *user_data)
+{
+    struct merge_push_state *state = user_data;
+    bool pushed = gputop_perf_merge_push(state->merge, state->cpu, header);
+
+    /* We only drain a ring once there's room for all of it */
+    assert(pushed);
+    (void) pushed;
+}
+
+struct merge_pop_state {
+    struct gputop_perf_stream *stream;
+    gputop_perf_record_cb cb;
+    void *user_data;
+};
+
+static void
+merge_pop_record_cb(const struct perf_event_header *header, void *user_data)
+{
+    struct merge_pop_state *state = user_data;
+
+    if (state->cb)
+	state->cb(state->stream, header, state->user_data);
+}
+
+/* Drains the rings of a merged stream's per-CPU streams and forwards, in time
+ * order, up to a ring's worth of the records that are older than the reorder
+ * window. */
+static void
+read_merged_records(struct gputop_perf_stream *stream,
+		    gputop_perf_record_cb cb,
+		    void *user_data)
+{
+    struct gputop_perf_merge *merge = stream->perf.merge;
+    struct gputop_perf_stream_stats *stats = &stream->stats;
+    struct merge_pop_state pop_state = { stream, cb, user_data };
+    uint64_t until = merge_reorder_deadline();
+
+    for (int i = 0; i < stream->perf.n_cpu_streams; i++) {
+	struct gputop_perf_stream *cpu_stream = stream->perf.cpu_streams[i];
+	struct merge_push_state push_state = { merge, i };
+
+	if (gputop_perf_merge_space(merge, i) >= cpu_stream->perf.buffer_size)
+	    gputop_perf_read_records(cpu_stream, merge_push_record_cb, &push_state);
+
+	/* Rather than letting the kernel drop records for a busy CPU we
+	 * forward everything it has queued, even if that means some
+	 * records of other CPUs will arrive late... */
+	if (gputop_perf_merge_space(merge, i) < cpu_stream->perf.buffer_size)
+	    until = MAX2(until, gputop_perf_merge_last_time(merge, i));
+    }
+
+    gputop_perf_merge_pop(merge, until, stream->perf.buffer_size,
+			  merge_pop_record_cb, &pop_state);
+
+    memset(stats, 0, sizeof(*stats));
+    for (int i = 0; i < stream->perf.n_cpu_streams; i++) {
+	const struct gputop_perf_stream_stats *cpu_stats =
+	    &stream->perf.cpu_streams[i]->stats;
+
+	stats->n_records += cpu_stats->n_records;
+	stats->n_samples += cpu_stats->n_samples;
+	stats->n_lost_samples += cpu_stats->n_lost_samples;
+	stats->n_wrapped_records += cpu_stats->n_wrapped_records;
+	stats->n_spurious_records += cpu_stats->n_spurious_records;
+    }
+    stats->n_late_records = merge->n_late_records;
+}
+
+static void
+read_perf_records(struct gputop_perf_stream *stream,
+		  struct gputop_perf_stream_stats *stats,
+		  gputop_perf_record_cb cb,
+		  void *user_data)
+{
+    uint8_t *data = stream->perf.buffer;
+    const uint64_t size = stream->perf.buffer_size;
+    const uint64_t mask = size - 1;
+    uint64_t head, tail;
+
+    if (stream->perf.merge) {
+	read_merged_records(stream, cb, user_data);
+	return;
+    }
+
+    head = read_perf_head(stream->perf.mmap_page);
+    tail = stream->perf.mmap_page->data_tail;
+
+    while (head - tail >= sizeof(struct perf_event_header)) {
+	uint64_t offset = tail & mask;
+	const struct perf_event_header *header =
+	    (const struct perf_event_header *)(data + offset);
+
+	/* NB: records are 8 byte aligned so a header itself never wraps */
+	if (header->size < sizeof(*header) || header->size > head - tail) {
+	    /* Skip to the head rather than risk parsing garbage */
+	    stats->n_spurious_records++;
+	    tail = head;
+	    break;
+	}
+
+	if (offset + header->size > size) {
+	    uint64_t before = size - offset;
+
+	    memcpy(stream->perf.record_scratch, data + offset, before);
+	    memcpy(stream->perf.record_scratch + before, data,
+		   header->size - before);
+	    header = (const struct perf_event_header *)stream->perf.record_scratch;
+	    stats->n_wrapped_records++;
+	}
+
+	switch (header->type) {
+	case PERF_RECORD_SAMPLE:
+	    stats->n_samples++;
+	    break;
+	case PERF_RECORD_LOST:
+	    stats->n_lost_samples += ((const struct perf_lost_record *)header)->lost;
+	    break;
+	}
+	stats->n_records++;
+
+	if (cb)
+	    cb(stream, header, user_data);
+
+	tail += header->size;
+    }
+
+    write_perf_tail(stream->perf.mmap_page, tail);
+}
+
+/* Parses all the records currently available in a perf stream's ring
+ * without allocating, passing each one to cb (if not NULL) before handing
+ * the space back to perf.
+ */
+void
+gputop_perf_read_records(struct gputop_perf_stream *stream,
+			 gputop_perf_record_cb cb,
+			 void *user_data)
+{
+    read_perf_records(stream, &stream->stats, cb, user_data);
+}
+
 static void
 read_perf_samples(struct gputop_perf_stream *stream)
 {
-    dbg("FIXME: read core perf samples");
+    gputop_perf_read_records(stream, stream->user.record_cb, stream->user.data);
 }
 
 
@@ -1488,6 +2277,10 @@ gputop_perf_fake_read(struct gputop_perf_stream *stream,
     uint64_t elapsed_time = gputop_get_time() - stream->start_time;
     uint32_t records_to_gen;
 
+    if (stream->fake_generator)
+        return gputop_oa_generator_read(stream->fake_generator,
+                                        gputop_get_time(), buf, buf_length);
+
     header.type = DRM_I915_PERF_RECORD_SAMPLE;
     header.pad = 0;
     header.size = sizeof(struct report_layout);
@@ -1737,8 +2530,8 @@ gputop_reload_userspace_metrics(int fd)
     if (!gputop_devinfo.has_dynamic_configs)
 	return;
 
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &gen_metrics->metric_sets, link) {
+    for (int i = 0; i < gen_metrics->n_metric_sets; i++) {
+	const struct gputop_metric_set *metric_set = gen_metrics->metric_sets[i];
 	struct drm_i915_perf_oa_config config;
 	char config_path[256];
 	uint64_t config_id;
@@ -1802,19 +2595,14 @@ gputop_enumerate_metrics_via_sysfs(void)
 
     while ((entry = readdir(metrics_dir))) {
 	struct gputop_metric_set *metric_set;
-	struct hash_entry *metrics_entry;
 
 	if (entry->d_type != DT_DIR || entry->d_name[0] == '.')
 	    continue;
 
-	metrics_entry =
-	    _mesa_hash_table_search(gen_metrics->metric_sets_map, entry->d_name);
-
-	if (metrics_entry == NULL)
+	metric_set = gputop_gen_find_metric_set(gen_metrics, entry->d_name);
+	if (metric_set == NULL)
 	    continue;
 
-	metric_set = (struct gputop_metric_set*)metrics_entry->data;
-
 	snprintf(buffer, sizeof(buffer), "metrics/%s/id",
 		 metric_set->hw_config_guid);
 
@@ -1858,14 +2646,11 @@ gputop_enumerate_metrics_fake(void)
     };
 
     struct gputop_metric_set *metric_set;
-    struct hash_entry *metrics_entry;
 
     int i;
 
     for (i = 0; i < ARRAY_SIZE(fake_bdw_guids); i++){
-	metrics_entry = _mesa_hash_table_search(gen_metrics->metric_sets_map,
-                                                fake_bdw_guids[i]);
-	metric_set = (struct gputop_metric_set*)metrics_entry->data;
+	metric_set = gputop_gen_find_metric_set(gen_metrics, fake_bdw_guids[i]);
 	metric_set->perf_oa_metrics_set = i;
 	array_append(gputop_perf_oa_supported_metric_set_uuids, &metric_set->hw_config_guid);
     }
@@ -1886,6 +2671,18 @@ gputop_perf_initialize(void)
     if (getenv("GPUTOP_FAKE_MODE") && strcmp(getenv("GPUTOP_FAKE_MODE"), "1") == 0) {
 	gputop_fake_mode = true;
 	intel_dev.device = 5654; // broadwell specific id
+
+	if (getenv("GPUTOP_FAKE_SCENARIO")) {
+	    char *error = NULL;
+
+	    fake_scenario = gputop_oa_scenario_load(getenv("GPUTOP_FAKE_SCENARIO"),
+                                                    &error);
+	    if (!fake_scenario) {
+		gputop_log(GPUTOP_LOG_LEVEL_HIGH, error, -1);
+		free(error);
+		return false;
+	    }
+	}
     } else {
 	drm_fd = open_render_node(&intel_dev);
 	if (drm_fd < 0) {
@@ -1898,6 +2695,9 @@ gputop_perf_initialize(void)
     if (getenv("GPUTOP_DISABLE_OACONFIG") && strcmp(getenv("GPUTOP_DISABLE_OACONFIG"), "1") == 0)
 	gputop_disable_oaconfig = true;
 
+    if (getenv("GPUTOP_READER_THREADS") && strcmp(getenv("GPUTOP_READER_THREADS"), "1") == 0)
+	gputop_perf_reader_threads = true;
+
     /* NB: eu_count needs to be initialized before declaring counters */
     page_size = sysconf(_SC_PAGE_SIZE);
 
@@ -1926,6 +2726,10 @@ gputop_perf_free(void)
     ralloc_free(gen_metrics);
     gen_metrics = NULL;
     array_free(gputop_perf_oa_supported_metric_set_uuids);
+    if (fake_scenario) {
+        gputop_oa_scenario_free(fake_scenario);
+        fake_scenario = NULL;
+    }
 }
 
 const struct gputop_devinfo *
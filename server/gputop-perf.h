@@ -25,6 +25,9 @@
 #pragma once
 
 #include <stdbool.h>
+#include <pthread.h>
+
+#include <linux/perf_event.h>
 
 #include <uv.h>
 #include <time.h>
@@ -32,6 +35,7 @@
 #include "util/list.h"
 
 #include "gputop-oa-metrics.h"
+#include "gputop-spsc-ring.h"
 
 uint64_t get_time(void);
 
@@ -40,6 +44,11 @@ struct ctx_handle {
 
     uint32_t id;
     int fd;
+
+    /* For contexts published by a split mode shim, fd is our own
+     * duplicate of remote_fd in process pid. pid is 0 otherwise. */
+    pid_t pid;
+    int remote_fd;
 };
 
 /*
@@ -132,12 +141,90 @@ struct gputop_perf_header_buf
     bool full; /* Set when we first wrap. */
 };
 
+/* Counters maintained while parsing a stream's records */
+struct gputop_perf_stream_stats {
+    uint64_t n_records;
+    uint64_t n_samples;
+    uint64_t n_lost_samples; /* as reported by PERF_RECORD_LOST */
+    uint64_t n_wrapped_records; /* split across the end of the ring */
+    uint64_t n_spurious_records; /* corrupt headers we had to skip */
+    uint64_t n_header_updates; /* overwrite mode header tracking */
+    uint64_t n_overwritten_records; /* overwrite mode records trampled */
+    uint64_t n_late_records; /* merged streams: forwarded out of time order */
+
+    /* Reader thread ring, sampled by the mainloop whenever it's flushed */
+    uint64_t reader_occupancy;
+    uint64_t reader_max_occupancy;
+    uint64_t n_reader_stalls; /* times the ring was found full */
+};
+
 enum gputop_perf_stream_type {
     GPUTOP_STREAM_PERF,
     GPUTOP_STREAM_I915_PERF,
     GPUTOP_STREAM_CPU,
 };
 
+/* i915 perf doesn't support overwriting old samples itself so instead, in
+ * overwrite mode, we continuously drain OA streams into an in-memory ring of
+ * whole records, discarding the oldest once full.
+ *
+ * Positions are byte offsets that only ever increase, and marks record when
+ * data was read so we can find the start of the last N seconds...
+ */
+struct gputop_oa_recorder_mark {
+    uint64_t time;
+    uint64_t offset;
+};
+
+struct gputop_oa_recorder {
+    uint8_t *buf;
+    size_t size; /* power of two */
+    uint64_t head;
+    uint64_t tail; /* start of the oldest whole record */
+
+    struct gputop_oa_recorder_mark *marks;
+    int first_mark;
+    int n_marks;
+};
+
+struct gputop_perf_stream;
+
+/* With GPUTOP_READER_THREADS=1 each live stream gets its own thread
+ * draining the kernel's buffers into a ring, so a stalled mainloop doesn't
+ * make the kernel drop samples. The mainloop then only ever consumes from the
+ * ring, see gputop_perf_stream_reader_pop().
+ */
+struct gputop_perf_reader {
+    pthread_t thread;
+    int wakeup_fd; /* eventfd to interrupt the thread's poll() */
+    atomic_bool quit;
+
+    /* Wakes up the mainloop to call the stream's ready_cb */
+    uv_async_t async;
+
+    struct gputop_spsc_ring ring;
+
+    /* Only touched by the reader thread */
+    uint8_t *buf;
+    size_t buf_size;
+    struct gputop_perf_stream_stats stats; /* perf records parsed so far */
+
+    /* Published by the reader thread, see gputop_perf_stream_reader_pop() */
+    atomic_uint_fast64_t n_stalls;
+    atomic_uint_fast64_t n_records;
+    atomic_uint_fast64_t n_samples;
+    atomic_uint_fast64_t n_lost_samples;
+    atomic_uint_fast64_t n_wrapped_records;
+    atomic_uint_fast64_t n_spurious_records;
+};
+
+/* Called for each record parsed from a perf stream. NB: a record that wrapped
+ * around the end of the ring is passed as a copy that's only valid for the
+ * duration of the call. */
+typedef void (*gputop_perf_record_cb)(struct gputop_perf_stream *stream,
+                                      const struct perf_event_header *header,
+                                      void *user_data);
+
 struct gputop_perf_stream
 {
     int ref_count;
@@ -155,8 +242,7 @@ struct gputop_perf_stream
             uint8_t *last;
             int last_buf_idx;
 
-            bool header_written;
-            uint32_t total_len;
+            struct gputop_oa_recorder recorder;
         } oa;
         /* linux perf event */
         struct {
@@ -167,10 +253,14 @@ struct gputop_perf_stream
 
             struct gputop_perf_header_buf header_buf;
 
-            bool header_written;
-            uint32_t total_len;
-            uint64_t head;
-            uint64_t tail;
+            /* For records split across the end of the ring */
+            uint8_t *record_scratch;
+
+            /* A tracepoint opened for all CPUs (cpu == -1) has no ring of
+             * its own and instead merges those of a stream per CPU */
+            struct gputop_perf_stream **cpu_streams;
+            int n_cpu_streams;
+            struct gputop_perf_merge *merge;
         } perf;
         /* /proc/stat */
         struct {
@@ -187,21 +277,27 @@ struct gputop_perf_stream
     uv_poll_t fd_poll;
     uv_timer_t fd_timer;
     void (*ready_cb)(struct gputop_perf_stream *);
+    bool poll_stopped; /* see gputop_perf_stream_set_polling() */
+    bool no_poll; /* fd_poll never initialized, e.g. per-CPU streams */
+
+    struct gputop_perf_reader *reader;
 
     bool live_updates;
 
     int n_closing_uv_handles;
     void (*on_close_cb)(struct gputop_perf_stream *stream);
-    bool pending_close;
     bool closed;
     bool per_ctx_mode;
 
+    struct gputop_perf_stream_stats stats;
+
 // fields used for fake data:
     uint64_t start_time;  // stream opening time
     uint32_t gen_so_far; // amount of reports generated since stream opening
     uint32_t prev_clocks; // the previous value of clock ticks
     uint32_t period; // the period in nanoseconds calculated from exponent
     uint32_t prev_timestamp; // the previous timestamp value
+    struct gputop_oa_generator *fake_generator; // when following a scenario
 
     /* XXX: reserved for whoever opens the stream */
     struct {
@@ -209,7 +305,7 @@ struct gputop_perf_stream
         struct list_head link;
         void *data;
         void (*destroy_cb)(struct gputop_perf_stream *stream);
-        bool flushing;
+        gputop_perf_record_cb record_cb; /* for gputop_perf_read_samples() */
     } user;
 };
 
@@ -221,6 +317,10 @@ struct perf_oa_user {
 
 bool gputop_add_ctx_handle(int ctx_fd, uint32_t ctx_id);
 bool gputop_remove_ctx_handle(uint32_t ctx_id);
+bool gputop_add_remote_ctx_handle(int ctx_fd, uint32_t ctx_id,
+                                  pid_t pid, int remote_fd);
+bool gputop_remove_remote_ctx_handle(pid_t pid, int remote_fd, uint32_t ctx_id);
+void gputop_prune_remote_ctx_handles(void);
 struct ctx_handle *get_first_available_ctx(char **error);
 
 bool gputop_perf_initialize(void);
@@ -235,6 +335,7 @@ extern bool gputop_perf_trace_full;
 extern uint8_t *gputop_perf_trace_head;
 extern int gputop_perf_n_samples;
 extern bool gputop_fake_mode;
+extern bool gputop_perf_reader_threads;
 
 struct gputop_perf_stream *
 gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
@@ -244,6 +345,7 @@ gputop_open_i915_perf_oa_stream(struct gputop_metric_set *metric_set,
                                 bool gpu_timestamps,
                                 void (*ready_cb)(struct gputop_perf_stream *),
                                 bool overwrite,
+                                size_t recorder_size,
                                 char **error);
 struct gputop_perf_stream *
 gputop_perf_open_tracepoint(int pid,
@@ -269,6 +371,19 @@ struct gputop_perf_stream *
 gputop_perf_open_cpu_stats(bool overwrite, uint64_t sample_period_ms);
 
 bool gputop_stream_data_pending(struct gputop_perf_stream *stream);
+void gputop_perf_stream_set_polling(struct gputop_perf_stream *stream,
+                                    bool enabled);
+
+bool gputop_perf_stream_start_reader(struct gputop_perf_stream *stream);
+size_t gputop_perf_stream_reader_pop(struct gputop_perf_stream *stream,
+                                     uint8_t *data, size_t max_len);
+
+void gputop_i915_perf_recorder_drain(struct gputop_perf_stream *stream);
+uint64_t gputop_i915_perf_recorder_window(struct gputop_perf_stream *stream,
+                                          uint64_t duration_ns,
+                                          size_t *len);
+void gputop_i915_perf_recorder_read(struct gputop_perf_stream *stream,
+                                    uint64_t offset, uint8_t *data, size_t len);
 
 void gputop_perf_update_header_offsets(struct gputop_perf_stream *stream);
 
@@ -276,6 +391,9 @@ int gputop_perf_fake_read(struct gputop_perf_stream *stream,
                           uint8_t *buf, int buf_length);
 
 void gputop_perf_read_samples(struct gputop_perf_stream *stream);
+void gputop_perf_read_records(struct gputop_perf_stream *stream,
+                              gputop_perf_record_cb cb,
+                              void *user_data);
 
 void gputop_i915_perf_print_records(struct gputop_perf_stream *stream,
                                     uint8_t *buf,
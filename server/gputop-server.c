@@ -35,6 +35,8 @@
 #include <getopt.h>
 #include <string.h>
 #include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
 #include <ifaddrs.h>
 
 #include <uv.h>
@@ -52,6 +54,10 @@
 #include "gputop-log.h"
 #include "gputop.pb-c.h"
 #include "gputop-debugfs.h"
+#include "gputop-shm.h"
+#include "gputop-local.h"
+#include "gputop-i915-perf-compression.h"
+#include "gputop-oa-aggregator.h"
 
 #include "dev/gen_device_info.h"
 
@@ -62,11 +68,11 @@
 #include "gputop-gl.h"
 #endif
 
-static h2o_websocket_conn_t *h2o_conn;
 static h2o_globalconf_t config;
 static h2o_context_t ctx;
 static SSL_CTX *ssl_ctx;
 static uv_tcp_t listener;
+static uv_pipe_t local_listener;
 
 static uv_timer_t timer;
 
@@ -77,18 +83,251 @@ enum {
     WS_MESSAGE_PERF = 1,
     WS_MESSAGE_PROTOBUF,
     WS_MESSAGE_I915_PERF,
+    WS_MESSAGE_I915_PERF_COMPRESSED,
 };
 
-static struct list_head streams;
-static struct list_head closing_streams;
+/* Samples are read from a stream once into reference counted frames which
+ * are then shared between all the clients subscribed to that stream...
+ */
+#define FRAME_SIZE (64 * 1024)
+
+/* How many frames we'll queue for a client, by default, before applying
+ * its flow control policy to stop a slow client from losing whole OA
+ * buffers or holding up any others.
+ */
+#define DEFAULT_QUEUED_FRAMES 64
+#define MAX_QUEUED_FRAMES 1024
+#define DEFAULT_DECIMATION 4
+
+/* Parser statistics are pushed at most this often, and only on change */
+#define STATS_NOTIFY_INTERVAL_NS 1000000000ULL
+
+struct frame {
+    int ref_count;
+    int n_reports;
+    size_t len;
+    uint8_t data[];
+};
+
+struct client {
+    struct list_head link;
+
+    /* NULL once the websocket has been closed */
+    h2o_websocket_conn_t *conn;
+
+    /* Same-host clients connected to the local socket instead, NULL once
+     * closed */
+    struct local_conn *local;
+
+    struct list_head subscriptions;
+};
+
+/* See gputop-local.h */
+struct local_conn {
+    uv_pipe_t pipe;
+    struct client *client;
+
+    /* NB: the client can write anywhere in the mapping, so only trust
+     * what's in the producer and map_size */
+    struct gputop_local_ring *ring;
+    struct gputop_local_producer producer;
+    size_t map_size;
+    int event_fd;
+
+    /* Protobuf messages that didn't fit in the ring, sent before anything
+     * else once there's room */
+    struct list_head pending;
+
+    /* Partially received requests */
+    uint8_t *requests;
+    size_t requests_len;
+    size_t requests_size;
+};
+
+struct local_pending {
+    struct list_head link;
+    uint32_t len;
+    uint8_t data[];
+};
+
+/* Every stream opened by a client is represented by a stream_source which
+ * may be shared by multiple clients if they each request a stream with an
+ * identical configuration.
+ */
+struct stream_source {
+    struct list_head link;
+
+    struct gputop_perf_stream *stream;
+    uint8_t message_type;
+    uint32_t sample_type; /* record type counted as a report */
+
+    /* The packed OpenStream request (with a zero id) used to match
+     * identical requests from different clients */
+    uint8_t *key;
+    size_t key_len;
+
+    struct list_head subscriptions;
+
+    /* Last perf parser statistics sent to subscribers */
+    struct gputop_perf_stream_stats notified_stats;
+    uint64_t stats_notify_time;
+
+    /* When set, OA reports are accumulated here and only the resulting
+     * counter values are sent to subscribers */
+    struct gputop_oa_aggregator *aggregator;
+};
+
+struct subscription {
+    struct list_head link; /* client->subscriptions */
+    struct list_head source_link; /* source->subscriptions */
+
+    struct client *client;
+    struct stream_source *source;
+
+    /* The id the client chose for the stream */
+    uint32_t id;
+
+    Gputop__FlowControlPolicy policy;
+    int decimation;
+    int n_skipped_reports;
+
+    /* Frames are queued compressed for this client */
+    bool compressed;
+
+    struct frame **frames;
+    int max_frames;
+    int first_frame;
+    int n_frames;
+
+    /* While sending, the first n_sending_frames queued frames belong to
+     * the websocket message currently being written */
+    bool sending;
+    bool header_written;
+    int n_sending_frames;
+    size_t frame_offset;
+
+    uint64_t n_dropped_reports;
+    uint64_t n_decimated_reports;
+    uint64_t n_notified_dropped_reports;
+    uint64_t n_notified_decimated_reports;
+
+    bool closing;
+    char *close_uuid;
+};
+
+static struct list_head clients;
+static struct list_head sources;
+
+static void queue_update(void);
+
+static bool
+client_connected(struct client *client)
+{
+    return client->conn || client->local;
+}
+
+static void
+local_signal(struct local_conn *local)
+{
+    uint64_t one = 1;
+
+    if (write(local->event_fd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+        dbg("Failed to signal local client: %m\n");
+}
+
+static void local_conn_close(struct local_conn *local);
+
+/* A client that corrupted its ring is dropped */
+static uint8_t *
+local_reserve(struct local_conn *local,
+              uint32_t min_len, uint32_t max_len, uint32_t *len)
+{
+    uint8_t *data = gputop_local_ring_reserve(&local->producer,
+                                              min_len, max_len, len);
+
+    if (!data && local->producer.broken) {
+        dbg("Closing local client with a corrupt ring\n");
+        local_conn_close(local);
+    }
+
+    return data;
+}
+
+/* Packs messages straight into the ring if there's room */
+static bool
+local_write_pb_message(struct local_conn *local, ProtobufCMessage *pb_message)
+{
+    uint32_t len = 8 + protobuf_c_message_get_packed_size(pb_message);
+    uint32_t avail;
+    uint8_t *data;
+
+    if (!list_empty(&local->pending) ||
+        !(data = local_reserve(local, len, len, &avail)))
+        return false;
+
+    memset(data, 0, 8);
+    data[0] = WS_MESSAGE_PROTOBUF;
+    protobuf_c_message_pack(pb_message, &data[8]);
+    gputop_local_ring_commit(&local->producer, len);
+
+    return true;
+}
+
+static void
+local_send_pb_message(struct local_conn *local, ProtobufCMessage *pb_message)
+{
+    struct local_pending *pending;
+    uint32_t len;
+
+    if (local_write_pb_message(local, pb_message)) {
+        local_signal(local);
+        return;
+    }
+
+    len = 8 + protobuf_c_message_get_packed_size(pb_message);
+    pending = xmalloc(sizeof(*pending) + len);
+    pending->len = len;
+    memset(pending->data, 0, 8);
+    pending->data[0] = WS_MESSAGE_PROTOBUF;
+    protobuf_c_message_pack(pb_message, &pending->data[8]);
+    list_addtail(&pending->link, &local->pending);
+}
 
 static void
-send_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
+local_flush_pending(struct local_conn *local)
+{
+    bool written = false;
+
+    list_for_each_entry_safe(struct local_pending, pending, &local->pending, link) {
+        uint32_t avail;
+        uint8_t *data = local_reserve(local, pending->len, pending->len, &avail);
+        if (!data)
+            break;
+
+        memcpy(data, pending->data, pending->len);
+        gputop_local_ring_commit(&local->producer, pending->len);
+        written = true;
+
+        list_del(&pending->link);
+        free(pending);
+    }
+
+    if (written)
+        local_signal(local);
+}
+
+static void
+send_pb_message(struct client *client, ProtobufCMessage *pb_message)
 {
     struct wslay_event_msg msg;
     uint8_t *data;
 
-    if (!conn)
+    if (client->local) {
+        local_send_pb_message(client->local, pb_message);
+        return;
+    }
+
+    if (!client->conn)
         return;
 
     msg.opcode = WSLAY_BINARY_FRAME;
@@ -98,299 +337,712 @@ send_pb_message(h2o_websocket_conn_t *conn, ProtobufCMessage *pb_message)
     protobuf_c_message_pack(pb_message, &data[8]);
     msg.msg = data;
 
-    wslay_event_queue_msg(conn->ws_ctx, &msg);
-    wslay_event_send(conn->ws_ctx);
+    wslay_event_queue_msg(client->conn->ws_ctx, &msg);
+    wslay_event_send(client->conn->ws_ctx);
 
     free(data);
 }
 
 static void
-stream_closed_cb(struct gputop_perf_stream *stream)
+broadcast_pb_message(ProtobufCMessage *pb_message)
+{
+    list_for_each_entry_safe(struct client, client, &clients, link)
+        send_pb_message(client, pb_message);
+}
+
+static struct frame *
+frame_new(size_t size)
+{
+    struct frame *frame = xmalloc(sizeof(*frame) + size);
+
+    frame->ref_count = 1;
+    frame->n_reports = 0;
+    frame->len = 0;
+
+    return frame;
+}
+
+static void
+frame_unref(struct frame *frame)
 {
-    list_del(&stream->user.link);
+    if (--frame->ref_count == 0)
+        free(frame);
+}
 
+static void
+stream_closed_cb(struct gputop_perf_stream *stream)
+{
     gputop_perf_stream_unref(stream);
 }
 
+static uint8_t *
+pack_stream_key(Gputop__OpenStream *open_stream, size_t *len)
+{
+    uint32_t id = open_stream->id;
+    Gputop__FlowControl *flow_control = open_stream->flow_control;
+    protobuf_c_boolean has_compressed_frames = open_stream->has_compressed_frames;
+    uint8_t *key;
+
+    /* The id, flow control and compression are chosen per client so they
+     * mustn't affect matching */
+    open_stream->id = 0;
+    open_stream->flow_control = NULL;
+    open_stream->has_compressed_frames = false;
+    *len = protobuf_c_message_get_packed_size(&open_stream->base);
+    key = xmalloc(*len);
+    protobuf_c_message_pack(&open_stream->base, key);
+    open_stream->id = id;
+    open_stream->flow_control = flow_control;
+    open_stream->has_compressed_frames = has_compressed_frames;
+
+    return key;
+}
+
+static struct stream_source *
+find_stream_source(Gputop__OpenStream *open_stream)
+{
+    struct stream_source *ret = NULL;
+    size_t key_len;
+    uint8_t *key = pack_stream_key(open_stream, &key_len);
+
+    list_for_each_entry(struct stream_source, source, &sources, link) {
+        if (source->key_len == key_len &&
+            memcmp(source->key, key, key_len) == 0) {
+            ret = source;
+            break;
+        }
+    }
+
+    free(key);
+
+    return ret;
+}
+
 static void
-stream_closed_notify_cb(struct gputop_perf_stream *stream)
+add_subscription(struct client *client,
+                 struct stream_source *source,
+                 Gputop__OpenStream *open_stream)
 {
-    Gputop__Message message_ack = GPUTOP__MESSAGE__INIT;
-    Gputop__Message message = GPUTOP__MESSAGE__INIT;
-    Gputop__CloseNotify notify = GPUTOP__CLOSE_NOTIFY__INIT;
+    struct subscription *sub = xmalloc0(sizeof(*sub));
+    Gputop__FlowControl *flow_control = open_stream->flow_control;
+
+    sub->client = client;
+    sub->source = source;
+    sub->id = open_stream->id;
+
+    sub->policy = GPUTOP__FLOW_CONTROL_POLICY__DROP_OLDEST;
+    sub->max_frames = DEFAULT_QUEUED_FRAMES;
+    sub->decimation = DEFAULT_DECIMATION;
+    if (flow_control) {
+        sub->policy = flow_control->policy;
+        if (flow_control->max_queued_frames)
+            sub->max_frames = MIN(flow_control->max_queued_frames,
+                                  MAX_QUEUED_FRAMES);
+        if (flow_control->decimation)
+            sub->decimation = flow_control->decimation;
+    }
+    sub->frames = xmalloc(sizeof(sub->frames[0]) * sub->max_frames);
 
-    /* stream->user.data will = a UUID if it was closed
-     * in response to a remote request which we need to
-     * ACK... */
-    if (stream->user.data) {
+    /* Local clients get frames copied straight into their ring, where
+     * compressing them would only cost time */
+    sub->compressed = open_stream->compressed_frames && !client->local &&
+        source->message_type == WS_MESSAGE_I915_PERF;
 
-        message_ack.reply_uuid = stream->user.data;
-        message_ack.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
-        message_ack.ack = true;
+    list_addtail(&sub->link, &client->subscriptions);
+    list_addtail(&sub->source_link, &source->subscriptions);
+}
 
-        dbg("CMD_ACK: %s\n", (char *)stream->user.data);
+static struct stream_source *
+add_stream_source(struct client *client,
+                  struct gputop_perf_stream *stream,
+                  Gputop__OpenStream *open_stream)
+{
+    struct stream_source *source = xmalloc0(sizeof(*source));
 
-        send_pb_message(h2o_conn, &message_ack.base);
+    source->stream = stream;
+    switch (stream->type) {
+    case GPUTOP_STREAM_PERF:
+        source->message_type = WS_MESSAGE_PERF;
+        source->sample_type = PERF_RECORD_SAMPLE;
+        break;
+    case GPUTOP_STREAM_I915_PERF:
+        source->message_type = WS_MESSAGE_I915_PERF;
+        source->sample_type = DRM_I915_PERF_RECORD_SAMPLE;
+        break;
+    case GPUTOP_STREAM_CPU:
+        source->message_type = WS_MESSAGE_PROTOBUF;
+        break;
+    }
+    source->key = pack_stream_key(open_stream, &source->key_len);
+    list_inithead(&source->subscriptions);
+    list_addtail(&source->link, &sources);
 
-        free(stream->user.data);
-        stream->user.data = NULL;
+    if (gputop_perf_reader_threads && stream->live_updates)
+        gputop_perf_stream_start_reader(stream);
+
+    add_subscription(client, source, open_stream);
+
+    return source;
+}
+
+static void
+close_stream_source(struct stream_source *source)
+{
+    list_del(&source->link);
+
+    gputop_perf_stream_close(source->stream, stream_closed_cb);
+
+    if (source->aggregator) {
+        gputop_oa_aggregator_fini(source->aggregator);
+        free(source->aggregator);
     }
 
-    notify.id = stream->user.id;
+    free(source->key);
+    free(source);
+}
 
-    message.cmd_case = GPUTOP__MESSAGE__CMD_CLOSE_NOTIFY;
-    message.close_notify = &notify;
+static void
+subscription_pop_frame(struct subscription *sub)
+{
+    frame_unref(sub->frames[sub->first_frame]);
+    sub->first_frame = (sub->first_frame + 1) % sub->max_frames;
+    sub->n_frames--;
+    sub->frame_offset = 0;
+}
 
-    send_pb_message(h2o_conn, &message.base);
+/* NB: i915 perf and perf records both start with a 32bit type followed by
+ * a 16bit size at the same offset.
+ */
+static int
+count_frame_reports(const struct frame *frame, uint32_t sample_type)
+{
+    const uint8_t *p = frame->data;
+    const uint8_t *end = frame->data + frame->len;
+    int n = 0;
+
+    while (p + sizeof(struct perf_event_header) <= end) {
+        const struct perf_event_header *header = (const void *)p;
+
+        if (header->size == 0)
+            break;
+        if (header->type == sample_type)
+            n++;
+        p += header->size;
+    }
 
-    stream_closed_cb(stream);
+    return n;
 }
 
-/*
- * FIXME: don't duplicate these...
+/* Copy a frame keeping all of its non-sample records (such as reports of
+ * lost data) but only every Nth report. Returns NULL if nothing is left.
  */
+static struct frame *
+decimate_frame(struct subscription *sub, const struct frame *frame)
+{
+    uint32_t sample_type = sub->source->sample_type;
+    const uint8_t *p = frame->data;
+    const uint8_t *end = frame->data + frame->len;
+    struct frame *decimated = frame_new(frame->len);
+
+    while (p + sizeof(struct perf_event_header) <= end) {
+        const struct perf_event_header *header = (const void *)p;
+
+        if (header->size == 0)
+            break;
+
+        if (header->type != sample_type ||
+            sub->n_skipped_reports == sub->decimation - 1) {
+            memcpy(decimated->data + decimated->len, p, header->size);
+            decimated->len += header->size;
+            if (header->type == sample_type) {
+                decimated->n_reports++;
+                sub->n_skipped_reports = 0;
+            }
+        } else {
+            sub->n_skipped_reports++;
+            sub->n_decimated_reports++;
+        }
 
-#define TAKEN(HEAD, TAIL, POT_SIZE)	(((HEAD) - (TAIL)) & (POT_SIZE - 1))
+        p += header->size;
+    }
 
-/* Note: this will equate to 0 when the buffer is exactly full... */
-#define REMAINING(HEAD, TAIL, POT_SIZE) (POT_SIZE - TAKEN (HEAD, TAIL, POT_SIZE))
+    if (!decimated->len) {
+        free(decimated);
+        return NULL;
+    }
 
-#if defined(__i386__)
-#define rmb()           __asm__ volatile("lock; addl $0,0(%%esp)" ::: "memory")
-#define mb()            __asm__ volatile("lock; addl $0,0(%%esp)" ::: "memory")
-#endif
+    return decimated;
+}
 
-#if defined(__x86_64__)
-#define rmb()           __asm__ volatile("lfence" ::: "memory")
-#define mb()            __asm__ volatile("mfence" ::: "memory")
-#endif
+static struct frame *
+compress_frame(const struct frame *frame)
+{
+    struct frame *compressed =
+        frame_new(gputop_i915_perf_compress_bound(frame->len));
 
+    compressed->len = gputop_i915_perf_compress(frame->data, frame->len,
+                                                compressed->data);
+    compressed->n_reports = frame->n_reports;
 
-struct perf_flush_closure {
-    bool header_written;
-    int id;
-    int total_len;
-    struct gputop_perf_stream *stream;
-    uint64_t head;
-    uint64_t tail;
-};
+    return compressed;
+}
+
+static bool
+subscription_full(struct subscription *sub)
+{
+    return sub->n_frames == sub->max_frames;
+}
 
-static unsigned int
-read_perf_head(struct perf_event_mmap_page *mmap_page)
+/* Make room for another frame by dropping the oldest frame that isn't part
+ * of a message already being sent. Returns false if there's no such frame.
+ */
+static bool
+subscription_drop_oldest(struct subscription *sub)
 {
-    unsigned int head = (*(volatile uint64_t *)&mmap_page->data_head);
-    rmb();
+    /* Local clients may have been sent part of the first frame */
+    int n_busy = MAX2(sub->n_sending_frames, sub->frame_offset ? 1 : 0);
+    int drop;
+
+    if (n_busy == sub->n_frames)
+        return false;
+
+    drop = (sub->first_frame + n_busy) % sub->max_frames;
+    sub->n_dropped_reports += sub->frames[drop]->n_reports;
+    frame_unref(sub->frames[drop]);
 
-    return head;
+    /* Close the gap by shifting the frames being sent along by one */
+    for (int i = n_busy; i > 0; i--) {
+        int idx = (sub->first_frame + i) % sub->max_frames;
+        int prev = (sub->first_frame + i - 1) % sub->max_frames;
+        sub->frames[idx] = sub->frames[prev];
+    }
+    sub->first_frame = (sub->first_frame + 1) % sub->max_frames;
+    sub->n_frames--;
+
+    return true;
 }
 
+/* The compressed copy of a frame is made once, on first use, for all the
+ * subscriptions wanting it.
+ */
 static void
-write_perf_tail(struct perf_event_mmap_page *mmap_page,
-                unsigned int tail)
+subscription_push_frame(struct subscription *sub, struct frame *frame,
+                        struct frame **compressed)
 {
-    /* Make sure we've finished reading all the sample data we
-     * were consuming before updating the tail... */
-    mb();
-    mmap_page->data_tail = tail;
+    int next;
+
+    if (sub->policy == GPUTOP__FLOW_CONTROL_POLICY__DECIMATE &&
+        sub->n_frames >= sub->max_frames / 2) {
+        frame = decimate_frame(sub, frame);
+        if (!frame)
+            return;
+        if (sub->compressed) {
+            struct frame *decimated = frame;
+            frame = compress_frame(decimated);
+            frame_unref(decimated);
+        }
+    } else if (sub->compressed) {
+        if (!*compressed)
+            *compressed = compress_frame(frame);
+        frame = *compressed;
+        frame->ref_count++;
+    } else {
+        frame->ref_count++;
+    }
+
+    /* NB: with the BLOCK policy we stop reading before the queue fills */
+    if (subscription_full(sub) && !subscription_drop_oldest(sub)) {
+        sub->n_dropped_reports += frame->n_reports;
+        frame_unref(frame);
+        return;
+    }
+
+    next = (sub->first_frame + sub->n_frames) % sub->max_frames;
+    sub->frames[next] = frame;
+    sub->n_frames++;
 }
 
-static ssize_t
-fragmented_perf_read_cb(wslay_event_context_ptr ctx,
-                        uint8_t *data, size_t len,
-                        const union wslay_event_msg_source *_source,
-                        int *eof,
-                        void *user_data)
-{
-    union wslay_event_msg_source *source =
-        (union wslay_event_msg_source *) _source;
-    struct gputop_perf_stream *stream = source->data;
-    uint64_t mask;
-    int read_len;
-    int total = 0;
-    uint64_t head;
-    uint64_t tail;
-    uint64_t remainder;
-    uint8_t *buffer;
-    uint8_t *p;
-
-    if (!stream) {
-        *eof = 1;
-        return 0;
+static void
+subscription_notify_drops(struct subscription *sub)
+{
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__DropNotify notify = GPUTOP__DROP_NOTIFY__INIT;
+
+    if (sub->n_dropped_reports == sub->n_notified_dropped_reports &&
+        sub->n_decimated_reports == sub->n_notified_decimated_reports)
+        return;
+
+    notify.stream_id = sub->id;
+    notify.policy = sub->policy;
+    notify.n_dropped_reports = sub->n_dropped_reports;
+    notify.n_decimated_reports = sub->n_decimated_reports;
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_DROP_NOTIFY;
+    message.drop_notify = &notify;
+
+    send_pb_message(sub->client, &message.base);
+
+    sub->n_notified_dropped_reports = sub->n_dropped_reports;
+    sub->n_notified_decimated_reports = sub->n_decimated_reports;
+}
+
+static void
+stream_source_notify_stats(struct stream_source *source)
+{
+    struct gputop_perf_stream *stream = source->stream;
+    struct gputop_perf_stream_stats *stats = &stream->stats;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__StreamStats pb_stats = GPUTOP__STREAM_STATS__INIT;
+    uint64_t now;
+
+    if ((stream->type != GPUTOP_STREAM_PERF && !stream->reader) ||
+        memcmp(stats, &source->notified_stats, sizeof(*stats)) == 0)
+        return;
+
+    now = gputop_get_time();
+    if (now - source->stats_notify_time < STATS_NOTIFY_INTERVAL_NS)
+        return;
+
+    pb_stats.n_records = stats->n_records;
+    pb_stats.n_samples = stats->n_samples;
+    pb_stats.n_lost_samples = stats->n_lost_samples;
+    pb_stats.n_wrapped_records = stats->n_wrapped_records;
+    pb_stats.n_spurious_records = stats->n_spurious_records;
+    if (stream->reader) {
+        pb_stats.has_reader_occupancy = true;
+        pb_stats.reader_occupancy = stats->reader_occupancy;
+        pb_stats.has_reader_max_occupancy = true;
+        pb_stats.reader_max_occupancy = stats->reader_max_occupancy;
+        pb_stats.has_n_reader_stalls = true;
+        pb_stats.n_reader_stalls = stats->n_reader_stalls;
+    }
+    if (stream->type == GPUTOP_STREAM_PERF && stream->perf.merge) {
+        pb_stats.has_n_late_records = true;
+        pb_stats.n_late_records = stats->n_late_records;
+    }
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_STREAM_STATS;
+    message.stream_stats = &pb_stats;
+
+    list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+        if (sub->closing)
+            continue;
+        pb_stats.stream_id = sub->id;
+        send_pb_message(sub->client, &message.base);
     }
 
-    mask = stream->perf.buffer_size - 1;
+    source->notified_stats = *stats;
+    source->stats_notify_time = now;
+}
+
+static void
+remove_subscription(struct subscription *sub)
+{
+    struct stream_source *source = sub->source;
+
+    while (sub->n_frames)
+        subscription_pop_frame(sub);
+
+    list_del(&sub->link);
+    list_del(&sub->source_link);
+    free(sub->frames);
+    free(sub->close_uuid);
+    free(sub);
+
+    /* Only close the underlying stream once nobody is left reading it */
+    if (list_empty(&source->subscriptions))
+        close_stream_source(source);
+}
 
-    if (!stream->perf.header_written) {
+static void
+finish_close_subscription(struct subscription *sub)
+{
+    struct client *client = sub->client;
+    Gputop__Message message_ack = GPUTOP__MESSAGE__INIT;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__CloseNotify notify = GPUTOP__CLOSE_NOTIFY__INIT;
+
+    /* sub->close_uuid will = a UUID if it was closed in response to a
+     * remote request which we need to ACK... */
+    if (sub->close_uuid) {
+        message_ack.reply_uuid = sub->close_uuid;
+        message_ack.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+        message_ack.ack = true;
+
+        dbg("CMD_ACK: %s\n", sub->close_uuid);
+
+        send_pb_message(client, &message_ack.base);
+    }
+
+    notify.id = sub->id;
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_CLOSE_NOTIFY;
+    message.close_notify = &notify;
+
+    send_pb_message(client, &message.base);
+
+    remove_subscription(sub);
+}
+
+static ssize_t
+fragmented_frames_read_cb(wslay_event_context_ptr ctx,
+                          uint8_t *data, size_t len,
+                          const union wslay_event_msg_source *source,
+                          int *eof,
+                          void *user_data)
+{
+    struct subscription *sub = source->data;
+    size_t total = 0;
+
+    if (!sub->header_written) {
         assert(len > 8);
 
         memset(data, 0, 8);
-        data[0] = WS_MESSAGE_PERF;
-        *(uint32_t *)(data + 4) = stream->user.id;
+        data[0] = sub->compressed ? WS_MESSAGE_I915_PERF_COMPRESSED :
+            sub->source->message_type;
+        *(uint32_t *)(data + 4) = sub->id;
 
         total = 8;
         data += 8;
         len -= 8;
-        stream->perf.header_written = true;
+        sub->header_written = true;
     }
 
-    head = stream->perf.head;
-    tail = stream->perf.tail;
-
-    buffer = stream->perf.buffer;
+    while (len && sub->n_sending_frames) {
+        struct frame *frame = sub->frames[sub->first_frame];
+        size_t read_len = MIN(len, frame->len - sub->frame_offset);
 
-    if ((head & mask) < (tail & mask)) {
-        int before;
+        memcpy(data, frame->data + sub->frame_offset, read_len);
 
-        p = buffer + (tail & mask);
-        before = stream->perf.buffer_size - (tail & mask);
-        read_len = MIN(before, len);
-        memcpy(data, p, read_len);
-
-        len -= read_len;
-        tail += read_len;
         data += read_len;
+        len -= read_len;
         total += read_len;
+        sub->frame_offset += read_len;
 
-        stream->perf.tail = tail;
+        if (sub->frame_offset == frame->len) {
+            subscription_pop_frame(sub);
+            sub->n_sending_frames--;
+        }
     }
 
-    p = buffer + (tail & mask);
-    remainder = TAKEN(head, tail, stream->perf.buffer_size);
-    read_len = MIN(remainder, len);
-    memcpy(data, p, read_len);
+    if (!sub->n_sending_frames) {
+        *eof = 1;
+        sub->sending = false;
 
-    len -= read_len;
-    tail += read_len;
-    total += read_len;
-    stream->perf.tail = tail;
+        /* NB: we can't respond to a close request while in the middle of
+         * writing to the websocket so that's deferred to the next update,
+         * which will also resume reading any stream blocked on us */
+        queue_update();
+    }
 
-    stream->perf.total_len += total;
+    return total;
+}
 
-    if (TAKEN(head, tail, stream->perf.buffer_size) == 0) {
-        *eof = 1;
-        write_perf_tail(stream->perf.mmap_page, tail);
+/* How much of a frame, from offset, is made of whole records fitting in
+ * len bytes */
+static size_t
+frame_records_len(const struct frame *frame, size_t offset, size_t len)
+{
+    size_t records_len = 0;
 
-        stream->user.flushing = false;
-        if (stream->pending_close)
-            gputop_perf_stream_close(stream, stream_closed_notify_cb);
+    while (offset + records_len + sizeof(struct perf_event_header) <= frame->len) {
+        const struct perf_event_header *header =
+            (const void *)(frame->data + offset + records_len);
 
-        source->data = NULL;
+        if (header->size == 0 || records_len + header->size > len)
+            break;
+        records_len += header->size;
     }
 
-    return total;
+    return records_len;
 }
 
+/* Copies the queued frames straight into the client's ring, as many whole
+ * frames per message as fit, or else as many whole records.
+ */
 static void
-flush_perf_stream_samples(struct gputop_perf_stream *stream)
+local_subscription_send(struct subscription *sub)
 {
-    uint64_t head = read_perf_head(stream->perf.mmap_page);
-    uint64_t tail = stream->perf.mmap_page->data_tail;
-    struct wslay_event_fragmented_msg msg;
+    struct local_conn *local = sub->client->local;
+    bool written = false;
 
-    if (stream->user.flushing)
+    if (!list_empty(&local->pending))
         return;
 
-    stream->user.flushing = true;
+    while (sub->n_frames) {
+        struct frame *frame = sub->frames[sub->first_frame];
+        const struct perf_event_header *first =
+            (const void *)(frame->data + sub->frame_offset);
+        uint32_t avail, len = 8;
+        uint8_t *data;
 
-    //gputop_perf_print_records(stream, head, tail, false);
+        /* Never spin on a malformed frame */
+        if (first->size == 0 || sub->frame_offset + first->size > frame->len) {
+            subscription_pop_frame(sub);
+            continue;
+        }
 
-    stream->perf.header_written = false;
-    stream->perf.total_len = 0;
-    stream->perf.head = head;
-    stream->perf.tail = tail;
+        data = local_reserve(local, len + first->size,
+                             local->producer.size / 4, &avail);
+        if (!data)
+            break;
 
-    memset(&msg, 0, sizeof(msg));
-    msg.opcode = WSLAY_BINARY_FRAME;
-    msg.source.data = stream;
-    msg.read_callback = fragmented_perf_read_cb;
+        memset(data, 0, 8);
+        data[0] = sub->source->message_type;
+        *(uint32_t *)(data + 4) = sub->id;
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+        while (sub->n_frames) {
+            size_t copy_len;
 
-    wslay_event_send(h2o_conn->ws_ctx);
-}
+            frame = sub->frames[sub->first_frame];
+            copy_len = frame->len - sub->frame_offset;
+            if (len + copy_len > avail)
+                copy_len = frame_records_len(frame, sub->frame_offset, avail - len);
 
-static ssize_t
-fragmented_i915_perf_read_cb(wslay_event_context_ptr ctx,
-                             uint8_t *data, size_t len,
-                             const union wslay_event_msg_source *_source,
-                             int *eof,
-                             void *user_data)
-{
-    union wslay_event_msg_source *source =
-        (union wslay_event_msg_source *) _source;
-    struct gputop_perf_stream *stream = source->data;
-    int total = 0;
-    int read_len;
+            memcpy(data + len, frame->data + sub->frame_offset, copy_len);
+            len += copy_len;
+            sub->frame_offset += copy_len;
 
-    if (!stream) {
-        *eof = 1;
-        return 0;
+            if (sub->frame_offset < frame->len)
+                break;
+            subscription_pop_frame(sub);
+        }
+
+        gputop_local_ring_commit(&local->producer, len);
+        written = true;
     }
 
-    if (!stream->oa.header_written) {
-        assert(len > 8);
+    if (written)
+        local_signal(local);
+}
 
-        memset(data, 0, 8);
-        data[0] = WS_MESSAGE_I915_PERF;
-        *(uint32_t *)(data + 4) = stream->user.id;
+static void
+subscription_send(struct subscription *sub)
+{
+    h2o_websocket_conn_t *conn = sub->client->conn;
+    struct wslay_event_fragmented_msg msg;
 
-        total = 8;
-        data += 8;
-        len -= 8;
-        stream->oa.header_written = true;
+    if (sub->client->local && !sub->closing) {
+        local_subscription_send(sub);
+        return;
     }
 
-    if (gputop_fake_mode)
-        read_len = gputop_perf_fake_read(stream, data, len);
-    else
-        while ((read_len = read(stream->fd, data, len)) < 0 && errno == EINTR)
-            ;
-    if (read_len > 0) {
-        total += read_len;
-        stream->oa.total_len += total;
-    } else {
-        *eof = 1;
-        if (!gputop_fake_mode && errno != EAGAIN)
-            dbg("Error reading i915 perf stream %m\n");
+    if (!conn || sub->sending || sub->closing || !sub->n_frames)
+        return;
+
+    /* Each message only carries the frames queued so far so that a client
+     * will see a complete message even while we're still reading more */
+    sub->sending = true;
+    sub->header_written = false;
+    sub->n_sending_frames = sub->n_frames;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.opcode = WSLAY_BINARY_FRAME;
+    msg.source.data = sub;
+    msg.read_callback = fragmented_frames_read_cb;
+
+    wslay_event_queue_fragmented_msg(conn->ws_ctx, &msg);
+
+    wslay_event_send(conn->ws_ctx);
+}
+
+static void
+broadcast_frame(struct stream_source *source, struct frame *frame)
+{
+    struct frame *compressed = NULL;
+
+    frame->n_reports = count_frame_reports(frame, source->sample_type);
+
+    list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+        if (!sub->closing && client_connected(sub->client))
+            subscription_push_frame(sub, frame, &compressed);
+    }
 
-        stream->user.flushing = false;
-        if (stream->pending_close)
-            gputop_perf_stream_close(stream, stream_closed_notify_cb);
+    if (compressed)
+        frame_unref(compressed);
+    frame_unref(frame);
+}
 
-        source->data = NULL;
+/* Any client using the BLOCK policy stops us reading from a stream while
+ * its queue is full, leaving the data with the kernel.
+ */
+static bool
+stream_source_blocked(struct stream_source *source)
+{
+    list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+        if (sub->policy == GPUTOP__FLOW_CONTROL_POLICY__BLOCK &&
+            !sub->closing && client_connected(sub->client) &&
+            subscription_full(sub))
+            return true;
     }
 
-    return total;
+    return false;
 }
 
 static void
-flush_i915_perf_stream_samples(struct gputop_perf_stream *stream)
+append_perf_record_cb(struct gputop_perf_stream *stream,
+                      const struct perf_event_header *header,
+                      void *user_data)
 {
-    struct wslay_event_fragmented_msg msg;
+    struct frame *frame = user_data;
 
-    if (stream->user.flushing)
-        return;
+    memcpy(frame->data + frame->len, header, header->size);
+    frame->len += header->size;
+}
 
-    //gputop_perf_print_records(stream, head, tail, false);
+static struct frame *
+read_perf_frame(struct gputop_perf_stream *stream)
+{
+    /* The records pending in the ring can't exceed its size, and copying
+     * them out lets us hand the space straight back to perf instead of
+     * waiting for the slowest client... */
+    struct frame *frame = frame_new(stream->perf.buffer_size);
+
+    if (stream->reader) {
+        frame->len = gputop_perf_stream_reader_pop(stream, frame->data,
+                                                   stream->perf.buffer_size);
+    } else
+        gputop_perf_read_records(stream, append_perf_record_cb, frame);
+
+    if (!frame->len) {
+        free(frame);
+        return NULL;
+    }
 
-    stream->user.flushing = true;
+    return frame;
+}
 
-    stream->oa.header_written = false;
-    stream->oa.total_len = 0;
+static struct frame *
+read_i915_perf_frame(struct gputop_perf_stream *stream)
+{
+    struct frame *frame = frame_new(FRAME_SIZE);
+    int read_len;
 
-    memset(&msg, 0, sizeof(msg));
-    msg.opcode = WSLAY_BINARY_FRAME;
-    msg.source.data = stream;
-    msg.read_callback = fragmented_i915_perf_read_cb;
+    if (stream->reader)
+        read_len = gputop_perf_stream_reader_pop(stream, frame->data, FRAME_SIZE);
+    else if (gputop_fake_mode)
+        read_len = gputop_perf_fake_read(stream, frame->data, FRAME_SIZE);
+    else
+        while ((read_len = read(stream->fd, frame->data, FRAME_SIZE)) < 0 &&
+               errno == EINTR)
+            ;
+
+    if (read_len <= 0) {
+        if (!gputop_fake_mode && read_len < 0 && errno != EAGAIN)
+            dbg("Error reading i915 perf stream %m\n");
+        free(frame);
+        return NULL;
+    }
 
-    wslay_event_queue_fragmented_msg(h2o_conn->ws_ctx, &msg);
+    frame->len = read_len;
 
-    wslay_event_send(h2o_conn->ws_ctx);
+    return frame;
 }
 
 static void
-flush_cpu_stats(struct gputop_perf_stream *stream)
+flush_cpu_stats(struct stream_source *source)
 {
+    struct gputop_perf_stream *stream = source->stream;
     int n_cpus = gputop_cpu_count();
     int n;
     int pos;
@@ -420,7 +1072,6 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
 
         message.cpu_stats = &set;
 
-        set.id = stream->user.id;
         set.n_cpus = n_cpus;
         set.cpus = stats_vec;
 
@@ -440,7 +1091,12 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
             stats[i].guest_nice = stat[i].guest_nice;
         }
 
-        send_pb_message(h2o_conn, &message.base);
+        list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+            if (sub->closing)
+                continue;
+            set.id = sub->id;
+            send_pb_message(sub->client, &message.base);
+        }
 
         pos += n_cpus;
         if (pos >= stream->cpu.stats_buf_len)
@@ -452,14 +1108,65 @@ flush_cpu_stats(struct gputop_perf_stream *stream)
 }
 
 static void
-flush_stream_samples(struct gputop_perf_stream *stream)
+send_oa_aggregate_cb(struct gputop_oa_aggregator *aggregator, void *user_data)
 {
-    if (stream->user.flushing) {
-        fprintf(stderr, "Throttling websocket forwarding\n");
-        return;
+    struct stream_source *source = user_data;
+    int n_counters = aggregator->n_counters;
+    int n_contexts = list_length(&aggregator->contexts);
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    Gputop__OAAggregate aggregate = GPUTOP__OAAGGREGATE__INIT;
+    Gputop__OAAggregateValues global = GPUTOP__OAAGGREGATE_VALUES__INIT;
+    Gputop__OAAggregateValues **contexts_vec;
+    Gputop__OAAggregateValues *contexts;
+    double *values;
+    int i = 0;
+
+    values = alloca(sizeof(double) * n_counters * (n_contexts + 1));
+    contexts_vec = alloca(sizeof(void *) * n_contexts);
+    contexts = alloca(sizeof(Gputop__OAAggregateValues) * n_contexts);
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_OA_AGGREGATE;
+    message.oa_aggregate = &aggregate;
+
+    aggregate.start_timestamp = aggregator->accumulator.first_timestamp;
+    aggregate.end_timestamp = aggregator->accumulator.last_timestamp;
+
+    global.hw_id = GPUTOP_OA_INVALID_CTX_ID;
+    global.n_values = n_counters;
+    global.values = values;
+    gputop_oa_aggregator_read(aggregator, &aggregator->accumulator, values);
+    aggregate.global = &global;
+
+    list_for_each_entry(struct gputop_oa_aggregator_context, context,
+                        &aggregator->contexts, link) {
+        double *context_values = values + n_counters * (i + 1);
+
+        gputop__oaaggregate_values__init(&contexts[i]);
+        contexts[i].hw_id = context->hw_id;
+        contexts[i].n_values = n_counters;
+        contexts[i].values = context_values;
+        gputop_oa_aggregator_read(aggregator, &context->accumulator,
+                                  context_values);
+        contexts_vec[i] = &contexts[i];
+        i++;
+    }
+    aggregate.n_contexts = n_contexts;
+    aggregate.contexts = contexts_vec;
+
+    list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+        if (sub->closing)
+            continue;
+        aggregate.stream_id = sub->id;
+        send_pb_message(sub->client, &message.base);
     }
+}
+
+static void
+flush_stream_samples(struct stream_source *source)
+{
+    struct gputop_perf_stream *stream = source->stream;
+    struct frame *frame;
 
-    assert(!stream->pending_close);
     assert(!stream->closed);
 
     if (!gputop_stream_data_pending(stream))
@@ -467,20 +1174,36 @@ flush_stream_samples(struct gputop_perf_stream *stream)
 
     switch (stream->type) {
     case GPUTOP_STREAM_PERF:
-        flush_perf_stream_samples(stream);
+        if (stream_source_blocked(source))
+            break;
+        while (!stream_source_blocked(source) &&
+               (frame = read_perf_frame(stream)))
+            broadcast_frame(source, frame);
         break;
     case GPUTOP_STREAM_I915_PERF:
-        flush_i915_perf_stream_samples(stream);
+        if (source->aggregator) {
+            while ((frame = read_i915_perf_frame(stream))) {
+                gputop_oa_aggregator_process(source->aggregator,
+                                             frame->data, frame->len,
+                                             send_oa_aggregate_cb, source);
+                frame_unref(frame);
+            }
+            break;
+        }
+        while (!stream_source_blocked(source) &&
+               (frame = read_i915_perf_frame(stream)))
+            broadcast_frame(source, frame);
         break;
     case GPUTOP_STREAM_CPU:
-        flush_cpu_stats(stream);
+        flush_cpu_stats(source);
         break;
     }
 }
 
 static void
-update_perf_head_pointers(struct gputop_perf_stream *stream)
+update_perf_head_pointers(struct stream_source *source)
 {
+    struct gputop_perf_stream *stream = source->stream;
     struct gputop_perf_header_buf *hdr_buf = &stream->perf.header_buf;
 
     gputop_perf_update_header_offsets(stream);
@@ -489,25 +1212,66 @@ update_perf_head_pointers(struct gputop_perf_stream *stream)
         Gputop__Message message = GPUTOP__MESSAGE__INIT;
         Gputop__BufferFillNotify notify = GPUTOP__BUFFER_FILL_NOTIFY__INIT;
 
-        notify.stream_id = stream->user.id;
         notify.fill_percentage =
             (hdr_buf->offsets[(hdr_buf->head - 1) % hdr_buf->len] /
              (float)stream->perf.buffer_size) * 100.0f;
         message.cmd_case = GPUTOP__MESSAGE__CMD_FILL_NOTIFY;
         message.fill_notify = &notify;
 
-        send_pb_message(h2o_conn, &message.base);
+        list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+            notify.stream_id = sub->id;
+            send_pb_message(sub->client, &message.base);
+        }
     }
 }
 
 static void
 update_streams(void)
 {
-    list_for_each_entry_safe(struct gputop_perf_stream, stream, &streams, user.link) {
+    list_for_each_entry(struct stream_source, source, &sources, link) {
+        struct gputop_perf_stream *stream = source->stream;
+
         if (stream->live_updates)
-            flush_stream_samples(stream);
+            flush_stream_samples(source);
         else if (stream->type == GPUTOP_STREAM_PERF)
-            update_perf_head_pointers(stream);
+            update_perf_head_pointers(source);
+
+        list_for_each_entry(struct subscription, sub, &source->subscriptions, source_link) {
+            subscription_send(sub);
+            subscription_notify_drops(sub);
+        }
+
+        /* Polling restarts once the blocking subscriptions have drained,
+         * or gone */
+        if (stream->live_updates)
+            gputop_perf_stream_set_polling(stream, !stream_source_blocked(source));
+
+        stream_source_notify_stats(source);
+    }
+}
+
+/* Clients and subscriptions are only ever freed from here, outside of any
+ * websocket callbacks that might still refer to them...
+ */
+static void
+cleanup_clients(void)
+{
+    list_for_each_entry_safe(struct client, client, &clients, link) {
+        if (!client_connected(client)) {
+            list_for_each_entry_safe(struct subscription, sub,
+                                     &client->subscriptions, link) {
+                remove_subscription(sub);
+            }
+            list_del(&client->link);
+            free(client);
+            continue;
+        }
+
+        list_for_each_entry_safe(struct subscription, sub,
+                                 &client->subscriptions, link) {
+            if (sub->closing && !sub->sending)
+                finish_close_subscription(sub);
+        }
     }
 }
 
@@ -524,18 +1288,31 @@ forward_logs(void)
         msg.cmd_case = GPUTOP__MESSAGE__CMD_LOG;
         msg.log = log;
 
-        send_pb_message(h2o_conn, &msg.base);
+        broadcast_pb_message(&msg.base);
 
         gputop_pb_log_free(log);
     }
 }
 
+static void
+flush_local_clients(void)
+{
+    list_for_each_entry(struct client, client, &clients, link) {
+        if (client->local)
+            local_flush_pending(client->local);
+    }
+}
+
 static void
 update_cb(uv_idle_t *idle)
 {
     uv_idle_stop(&update_idle);
     update_queued = false;
 
+    cleanup_clients();
+
+    flush_local_clients();
+
     update_streams();
 
     forward_logs();
@@ -567,15 +1344,50 @@ i915_perf_ready_cb(struct gputop_perf_stream *stream)
     queue_update();
 }
 
+#define DEFAULT_RECORDER_SIZE (16 * 1024 * 1024)
+#define MIN_RECORDER_SIZE (1024 * 1024)
+#define MAX_RECORDER_SIZE (1024 * 1024 * 1024)
+
+/* The flight recorder for overwrite mode may be sized in seconds of
+ * reports at the requested sampling period instead of in megabytes */
+static size_t
+oa_recorder_size(Gputop__OAStreamInfo *oa_stream_info)
+{
+    uint64_t size = DEFAULT_RECORDER_SIZE;
+
+    if (oa_stream_info->has_recorder_seconds &&
+        oa_stream_info->recorder_seconds) {
+        const struct gputop_devinfo *devinfo = gputop_perf_get_devinfo();
+        uint64_t period_ns = ((2ULL << oa_stream_info->period_exponent) *
+                              1000000000ULL / devinfo->timestamp_frequency);
+        uint64_t record_size = (sizeof(struct drm_i915_perf_record_header) +
+                                256 + /* OA report */
+                                (oa_stream_info->cpu_timestamps ? 8 : 0) +
+                                (oa_stream_info->gpu_timestamps ? 8 : 0));
+
+        size = (oa_stream_info->recorder_seconds * record_size *
+                (1000000000ULL / MAX2(period_ns, 1)));
+    } else if (oa_stream_info->has_recorder_size_mb &&
+               oa_stream_info->recorder_size_mb) {
+        size = oa_stream_info->recorder_size_mb * 1024ULL * 1024ULL;
+    }
+
+    size = CLAMP(size, MIN_RECORDER_SIZE, MAX_RECORDER_SIZE);
+
+    /* Round up to a power of two */
+    return 1ULL << (64 - __builtin_clzll(size - 1));
+}
+
 static void
-handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
+handle_open_i915_perf_oa_stream(struct client *client,
                                 Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
     uint32_t id = open_stream->id;
     Gputop__OAStreamInfo *oa_stream_info = open_stream->oa_stream;
+    Gputop__OAAggregationInfo *aggregation = oa_stream_info->aggregation;
     struct gputop_metric_set *metric_set = NULL;
-    struct hash_entry *entry = NULL;
+    struct gputop_oa_aggregator *aggregator = NULL;
     struct gputop_perf_stream *stream;
     char *error = NULL;
     struct ctx_handle *ctx = NULL;
@@ -590,21 +1402,53 @@ handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
     }
     dbg("handle_open_i915_perf_oa_stream: id = %d\n", id);
 
-    entry = _mesa_hash_table_search(gen_metrics->metric_sets_map, oa_stream_info->uuid);
-    if (entry != NULL) {
-        metric_set = entry->data;
-    } else {
+    metric_set = gputop_gen_find_metric_set(gen_metrics, oa_stream_info->uuid);
+    if (metric_set == NULL) {
         int ret = asprintf(&error, "uuid is not available\n");
         (void) ret;
         goto err;
     }
 
+    if (aggregation) {
+        struct gputop_i915_perf_configuration config = {
+            .oa_reports = true,
+            .cpu_timestamps = oa_stream_info->cpu_timestamps,
+            .gpu_timestamps = oa_stream_info->gpu_timestamps,
+        };
+
+        if (!open_stream->live_updates || open_stream->overwrite) {
+            int ret = asprintf(&error, "Server side aggregation requires live updates\n");
+            (void) ret;
+            goto err;
+        }
+
+        /* Otherwise every report would be sent as an aggregate */
+        if (aggregation->period_ns == 0) {
+            int ret = asprintf(&error, "Server side aggregation requires a period\n");
+            (void) ret;
+            goto err;
+        }
+
+        aggregator = xmalloc(sizeof(*aggregator));
+        gputop_oa_aggregator_init(aggregator, gputop_perf_get_devinfo(),
+                                  metric_set, &config, aggregation->period_ns,
+                                  aggregation->per_hw_context);
+        if (!gputop_oa_aggregator_select_counters(aggregator,
+                                                  aggregation->counters,
+                                                  aggregation->n_counters)) {
+            int ret = asprintf(&error, "Unknown counter in aggregation request\n");
+            (void) ret;
+            goto err;
+        }
+    }
+
     // TODO: (matt-auld)
     // Currently we don't support selectable contexts, so we just use the
     // first one which is available to us. Though this would only really
     // make sense if we could make the list of contexts visible to the user.
     // Maybe later the per_ctx_mode could become the context handle...
     if (oa_stream_info->per_ctx_mode) {
+        gputop_shm_daemon_poll();
         ctx = get_first_available_ctx(&error);
         if (!ctx)
             goto err;
@@ -618,12 +1462,15 @@ handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
                                              (open_stream->live_updates ?
                                               i915_perf_ready_cb : NULL),
                                              open_stream->overwrite,
+                                             (open_stream->overwrite ?
+                                              oa_recorder_size(oa_stream_info) : 0),
                                              &error);
     if (stream) {
-        stream->user.id = id;
-        list_addtail(&stream->user.link, &streams);
-
-        stream->live_updates = open_stream->live_updates;
+        /* In overwrite mode samples are only sent when dumped */
+        stream->live_updates = open_stream->live_updates && !open_stream->overwrite;
+        struct stream_source *source =
+            add_stream_source(client, stream, open_stream);
+        source->aggregator = aggregator;
     } else {
         dbg("Failed to open perf stream set=%s period=%d: %s\n",
             oa_stream_info->uuid, oa_stream_info->period_exponent,
@@ -634,25 +1481,29 @@ handle_open_i915_perf_oa_stream(h2o_websocket_conn_t *conn,
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 
     return;
 
 err:
+    if (aggregator) {
+        gputop_oa_aggregator_fini(aggregator);
+        free(aggregator);
+    }
+
     message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
     message.error = error;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
     free(error);
 
     return;
 }
 
 static void
-handle_open_tracepoint(h2o_websocket_conn_t *conn,
+handle_open_tracepoint(struct client *client,
                        Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
-    uint32_t id = open_stream->id;
     Gputop__TracepointConfig *config = open_stream->tracepoint;
     struct gputop_perf_stream *stream;
     char *error = NULL;
@@ -663,7 +1514,7 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client, &message.base);
         return;
     }
 
@@ -685,10 +1536,8 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
                                          open_stream->overwrite,
                                          &error);
     if (stream) {
-        stream->user.id = id;
-        list_addtail(&stream->user.link, &streams);
-
         stream->live_updates = open_stream->live_updates;
+        add_stream_source(client, stream, open_stream);
     } else {
         dbg("Failed to open trace %"PRIu32": %s\n", config->id, error);
         free(error);
@@ -697,15 +1546,14 @@ handle_open_tracepoint(h2o_websocket_conn_t *conn,
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 }
 
 static void
-handle_open_generic_stream(h2o_websocket_conn_t *conn,
+handle_open_generic_stream(struct client *client,
                           Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
-    uint32_t id = open_stream->id;
     Gputop__GenericEventInfo *generic_info = open_stream->generic;
     struct gputop_perf_stream *stream;
     char *error = NULL;
@@ -716,7 +1564,7 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client, &message.base);
         return;
     }
 
@@ -736,11 +1584,8 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
                                               open_stream->overwrite,
                                               &error);
     if (stream) {
-        stream->user.id = id;
-        list_inithead(&stream->user.link);
-        list_addtail(&stream->user.link, &streams);
-
         stream->live_updates = open_stream->live_updates;
+        add_stream_source(client, stream, open_stream);
     } else {
         dbg("Failed to open perf event: %s\n", error);
         free(error);
@@ -749,15 +1594,14 @@ handle_open_generic_stream(h2o_websocket_conn_t *conn,
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 }
 
 static void
-handle_open_cpu_stats(h2o_websocket_conn_t *conn,
+handle_open_cpu_stats(struct client *client,
                       Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
-    uint32_t id = open_stream->id;
     Gputop__CpuStatsInfo *stats_info = open_stream->cpu_stats;
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
     struct gputop_perf_stream *stream;
@@ -766,103 +1610,151 @@ handle_open_cpu_stats(h2o_websocket_conn_t *conn,
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &message.base);
+        send_pb_message(client, &message.base);
         return;
     }
 
     stream = gputop_perf_open_cpu_stats(open_stream->overwrite,
                                         stats_info->sample_period_ms);
     if (stream) {
-        stream->user.id = id;
-        list_inithead(&stream->user.link);
-        list_addtail(&stream->user.link, &streams);
-
         stream->live_updates = open_stream->live_updates;
+        add_stream_source(client, stream, open_stream);
     }
 
     message.reply_uuid = request->uuid;
     message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
     message.ack = true;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 }
 
 static void
-handle_open_stream(h2o_websocket_conn_t *conn, Gputop__Request *request)
+handle_open_stream(struct client *client, Gputop__Request *request)
 {
     Gputop__OpenStream *open_stream = request->open_stream;
+    struct stream_source *source = find_stream_source(open_stream);
     Gputop__Message message = GPUTOP__MESSAGE__INIT;
 
+    /* NB: i915 perf only supports one OA stream at a time, so any other
+     * client wanting OA metrics can only share an identically configured
+     * stream. */
+    if (source) {
+        dbg("handle_open_stream: id = %d sharing existing stream\n",
+            open_stream->id);
+
+        add_subscription(client, source, open_stream);
+
+        message.reply_uuid = request->uuid;
+        message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+        message.ack = true;
+        send_pb_message(client, &message.base);
+        return;
+    }
 
     switch (open_stream->type_case) {
     case GPUTOP__OPEN_STREAM__TYPE_OA_STREAM:
-        handle_open_i915_perf_oa_stream(conn, request);
+        handle_open_i915_perf_oa_stream(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_TRACEPOINT:
-        handle_open_tracepoint(conn, request);
+        handle_open_tracepoint(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_GENERIC:
-        handle_open_generic_stream(conn, request);
+        handle_open_generic_stream(client, request);
         break;
     case GPUTOP__OPEN_STREAM__TYPE_CPU_STATS:
-        handle_open_cpu_stats(conn, request);
+        handle_open_cpu_stats(client, request);
         break;
     default:
         message.reply_uuid = request->uuid;
         message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         message.error = "FIXME: implement support for opening GL queries\n";
 
-        send_pb_message(conn, &message.base);
+        send_pb_message(client, &message.base);
         fprintf(stderr, "TODO: support opening GL queries");
     }
 }
 
 static void
-close_stream(struct gputop_perf_stream *stream)
+handle_close_stream(struct client *client,
+                   Gputop__Request *request)
 {
-    /* By moving the stream into the closing_streams list we ensure we
-     * won't forward anymore for the stream in case we can't close the
-     * stream immediately.
-     */
-    list_del(&stream->user.link);
-    list_addtail(&stream->user.link, &closing_streams);
-    stream->pending_close = true;
+    uint32_t id = request->close_stream;
 
-    /* NB: we can't synchronously close the perf event if we're in the
-     * middle of writing samples to the websocket...
-     */
-    if (!stream->user.flushing)
-        gputop_perf_stream_close(stream, stream_closed_notify_cb);
-}
+    dbg("handle_close_stream: id=%d, request_uuid=%s\n", id, request->uuid);
 
-static void
-terminate_all_streams(void)
-{
-    list_for_each_entry_safe(struct gputop_perf_stream, stream,
-                             &streams, user.link) {
-        gputop_perf_stream_close(stream, stream_closed_cb);
-    }
-    list_for_each_entry_safe(struct gputop_perf_stream, stream,
-                             &closing_streams, user.link) {
-        gputop_perf_stream_close(stream, stream_closed_cb);
+    list_for_each_entry(struct subscription, sub, &client->subscriptions, link) {
+        if (sub->id == id && !sub->closing) {
+            assert(sub->close_uuid == NULL);
+            sub->close_uuid = strdup(request->uuid);
+            sub->closing = true;
+
+            /* NB: we can't synchronously close the subscription if we're
+             * in the middle of writing samples to the websocket...
+             */
+            if (!sub->sending)
+                finish_close_subscription(sub);
+            return;
+        }
     }
 }
 
 static void
-handle_close_stream(h2o_websocket_conn_t *conn,
+handle_dump_stream(struct client *client,
                    Gputop__Request *request)
 {
-    uint32_t id = request->close_stream;
+    Gputop__DumpStream *dump_stream = request->dump_stream;
+    Gputop__Message message = GPUTOP__MESSAGE__INIT;
+    struct subscription *sub = NULL;
+    struct gputop_perf_stream *stream;
+    struct frame *frame;
+    uint64_t offset;
+    size_t len;
 
-    dbg("handle_close_stream: id=%d, request_uuid=%s\n", id, request->uuid);
+    message.reply_uuid = request->uuid;
 
-    list_for_each_entry_safe(struct gputop_perf_stream, stream, &streams, user.link) {
-        if (stream->user.id == id) {
-            assert(stream->user.data == NULL);
-            stream->user.data = strdup(request->uuid);
-            close_stream(stream);
-            return;
+    list_for_each_entry(struct subscription, s, &client->subscriptions, link) {
+        if (s->id == dump_stream->id && !s->closing) {
+            sub = s;
+            break;
         }
     }
+
+    if (!sub ||
+        sub->source->stream->type != GPUTOP_STREAM_I915_PERF ||
+        !sub->source->stream->overwrite) {
+        message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
+        message.error = "Stream has no flight recorder to dump\n";
+        send_pb_message(client, &message.base);
+        return;
+    }
+
+    stream = sub->source->stream;
+
+    gputop_i915_perf_recorder_drain(stream);
+    offset = gputop_i915_perf_recorder_window(stream,
+                                              dump_stream->duration_ms * 1000000ULL,
+                                              &len);
+    dbg("handle_dump_stream: id=%d, len=%zu\n", dump_stream->id, len);
+
+    /* The dump is forwarded like any live samples, as one frame */
+    if (len) {
+        struct frame *compressed = NULL;
+
+        frame = frame_new(len);
+        gputop_i915_perf_recorder_read(stream, offset, frame->data, len);
+        frame->len = len;
+        frame->n_reports = count_frame_reports(frame, sub->source->sample_type);
+
+        subscription_push_frame(sub, frame, &compressed);
+        if (compressed)
+            frame_unref(compressed);
+        frame_unref(frame);
+
+        subscription_send(sub);
+    }
+
+    message.cmd_case = GPUTOP__MESSAGE__CMD_ACK;
+    message.ack = true;
+    send_pb_message(client, &message.base);
 }
 
 static bool
@@ -902,7 +1794,7 @@ gputop_get_pid_prop(uint32_t pid, const char *prop, char *buf, int len)
 }
 
 static void
-handle_get_process_info(h2o_websocket_conn_t *conn,
+handle_get_process_info(struct client *client,
                     Gputop__Request *request)
 {
 
@@ -927,19 +1819,19 @@ handle_get_process_info(h2o_websocket_conn_t *conn,
         process_info.cmd_line = cmdline;
         process_info.comm = comm;
         message.process_info = &process_info;
-        send_pb_message(conn, &message.base);
+        send_pb_message(client, &message.base);
         return;
     }
 
     snprintf(error, sizeof(error), "Failed to find process %d", pid);
     message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
     message.error = error;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
     dbg("Failed to find process %d\n", pid);
 }
 
 static void
-handle_get_tracepoint_info(h2o_websocket_conn_t *conn,
+handle_get_tracepoint_info(struct client *client,
                            Gputop__Request *request)
 {
 
@@ -962,7 +1854,7 @@ handle_get_tracepoint_info(h2o_websocket_conn_t *conn,
 
     message.cmd_case = GPUTOP__MESSAGE__CMD_TRACEPOINT_INFO;
     message.tracepoint_info = &tracepoint_info;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 
     free(tracepoint_info.sample_format);
 
@@ -970,7 +1862,7 @@ handle_get_tracepoint_info(h2o_websocket_conn_t *conn,
 
 error:
     message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
-    send_pb_message(conn, &message.base);
+    send_pb_message(client, &message.base);
 }
 
 #ifdef SUPPORT_GL
@@ -1096,7 +1988,7 @@ free_gl_query_info(Gputop__GLQueryInfo **queries, int n_queries)
 #endif
 
 static void
-handle_get_features(h2o_websocket_conn_t *conn,
+handle_get_features(struct client *client,
                     Gputop__Request *request)
 {
     char kernel_release[128];
@@ -1114,7 +2006,7 @@ handle_get_features(h2o_websocket_conn_t *conn,
         pb_message.reply_uuid = request->uuid;
         pb_message.cmd_case = GPUTOP__MESSAGE__CMD_ERROR;
         pb_message.error = "Failed to initialize perf\n";
-        send_pb_message(conn, &pb_message.base);
+        send_pb_message(client, &pb_message.base);
         return;
     }
 
@@ -1148,6 +2040,10 @@ handle_get_features(h2o_websocket_conn_t *conn,
     pb_features.fake_mode = gputop_fake_mode;
     pb_features.has_i915_oa_cpu_timestamps = gputop_perf_kernel_has_i915_oa_cpu_timestamps();
     pb_features.has_i915_oa_gpu_timestamps = gputop_perf_kernel_has_i915_oa_gpu_timestamps();
+    pb_features.has_has_i915_perf_compression = true;
+    pb_features.has_i915_perf_compression = true;
+    pb_features.has_has_merged_tracepoints = true;
+    pb_features.has_merged_tracepoints = true;
 
     pb_features.devinfo = &pb_devinfo;
 
@@ -1228,7 +2124,7 @@ handle_get_features(h2o_websocket_conn_t *conn,
         dbg("  %s\n", notice);
     }
 
-    send_pb_message(conn, &pb_message.base);
+    send_pb_message(client, &pb_message.base);
 
     gputop_debugfs_free_tracepoint_names(pb_features.tracepoints);
     gputop_free_events_names(pb_features.events);
@@ -1239,29 +2135,15 @@ handle_get_features(h2o_websocket_conn_t *conn,
 #endif
 }
 
-static void on_ws_message(h2o_websocket_conn_t *conn,
-                          const struct wslay_event_on_msg_recv_arg *arg)
+static void
+handle_request(struct client *client, const uint8_t *data, size_t len)
 {
     Gputop__Request *request;
-    //fprintf(stderr, "on_ws_message\n");
-    //dbg("on_ws_message\n");
-
-    if (arg == NULL) {
-        //dbg("socket closed\n");
-        h2o_conn = NULL;
-        terminate_all_streams();
-        h2o_websocket_close(conn);
-        return;
-    }
-
-    if (wslay_is_ctrl_frame(arg->opcode))
-        return;
 
     request =
         (void *)protobuf_c_message_unpack(&gputop__request__descriptor,
                                           NULL, /* default allocator */
-                                          arg->msg_length,
-                                          arg->msg);
+                                          len, data);
 
     if (!request) {
         fprintf(stderr, "Failed to unpack message\n");
@@ -1272,23 +2154,27 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
     switch (request->req_case) {
     case GPUTOP__REQUEST__REQ_GET_TRACEPOINT_INFO:
         server_dbg("GetTracepointInfo request received\n");
-        handle_get_tracepoint_info(conn, request);
+        handle_get_tracepoint_info(client, request);
         break;
     case GPUTOP__REQUEST__REQ_GET_PROCESS_INFO:
         server_dbg("GetProcessInfo request received\n");
-        handle_get_process_info(conn, request);
+        handle_get_process_info(client, request);
         break;
     case GPUTOP__REQUEST__REQ_GET_FEATURES:
         server_dbg("GetFeatures request received\n");
-        handle_get_features(conn, request);
+        handle_get_features(client, request);
         break;
     case GPUTOP__REQUEST__REQ_OPEN_STREAM:
         server_dbg("OpenStream request received\n");
-        handle_open_stream(conn, request);
+        handle_open_stream(client, request);
         break;
     case GPUTOP__REQUEST__REQ_CLOSE_STREAM:
         server_dbg("CloseStream request received\n");
-        handle_close_stream(conn, request);
+        handle_close_stream(client, request);
+        break;
+    case GPUTOP__REQUEST__REQ_DUMP_STREAM:
+        server_dbg("DumpStream request received\n");
+        handle_dump_stream(client, request);
         break;
     case GPUTOP__REQUEST__REQ_TEST_LOG:
         server_dbg("TEST LOG: %s\n", request->test_log);
@@ -1303,9 +2189,34 @@ static void on_ws_message(h2o_websocket_conn_t *conn,
     free(request);
 }
 
+static void on_ws_message(h2o_websocket_conn_t *conn,
+                          const struct wslay_event_on_msg_recv_arg *arg)
+{
+    struct client *client = conn->data;
+    //fprintf(stderr, "on_ws_message\n");
+    //dbg("on_ws_message\n");
+
+    if (arg == NULL) {
+        //dbg("socket closed\n");
+        h2o_websocket_close(conn);
+
+        /* The client's streams are closed by the next update, in case
+         * we're currently iterating its subscriptions... */
+        client->conn = NULL;
+        queue_update();
+        return;
+    }
+
+    if (wslay_is_ctrl_frame(arg->opcode))
+        return;
+
+    handle_request(client, arg->msg, arg->msg_length);
+}
+
 static int on_req(h2o_handler_t *self, h2o_req_t *req)
 {
     const char *client_key;
+    struct client *client;
     ssize_t proto_header_index;
 
     //dbg("on_req\n");
@@ -1326,7 +2237,11 @@ static int on_req(h2o_handler_t *self, h2o_req_t *req)
                               0, NULL, "binary", strlen("binary"));
     }
 
-    h2o_conn = h2o_upgrade_to_websocket(req, client_key, NULL, on_ws_message);
+    client = xmalloc0(sizeof(*client));
+    list_inithead(&client->subscriptions);
+    list_addtail(&client->link, &clients);
+
+    client->conn = h2o_upgrade_to_websocket(req, client_key, client, on_ws_message);
 
     return 0;
 }
@@ -1361,6 +2276,237 @@ static void on_connect(uv_stream_t *server, int status)
     uv_timer_start(&timer, periodic_update_cb, 200, 200);
 }
 
+static void
+on_local_close_cb(uv_handle_t *handle)
+{
+    struct local_conn *local = handle->data;
+
+    list_for_each_entry_safe(struct local_pending, pending, &local->pending, link)
+        free(pending);
+    munmap(local->ring, local->map_size);
+    close(local->event_fd);
+    free(local->requests);
+    free(local);
+}
+
+static void
+local_conn_close(struct local_conn *local)
+{
+    if (uv_is_closing((uv_handle_t *)&local->pipe))
+        return;
+
+    /* As for websockets the client itself is freed by the next update */
+    if (local->client) {
+        local->client->local = NULL;
+        queue_update();
+    }
+
+    uv_read_stop((uv_stream_t *)&local->pipe);
+    uv_close((uv_handle_t *)&local->pipe, on_local_close_cb);
+}
+
+static void
+on_local_alloc_cb(uv_handle_t *handle, size_t suggested_size, uv_buf_t *buf)
+{
+    struct local_conn *local = handle->data;
+
+    if (local->requests_size - local->requests_len < suggested_size) {
+        local->requests_size = local->requests_len + suggested_size;
+        local->requests = xrealloc(local->requests, local->requests_size);
+    }
+
+    *buf = uv_buf_init((char *)local->requests + local->requests_len,
+                       local->requests_size - local->requests_len);
+}
+
+static void
+on_local_read_cb(uv_stream_t *stream, ssize_t nread, const uv_buf_t *buf)
+{
+    struct local_conn *local = stream->data;
+    size_t offset = 0;
+
+    if (nread < 0) {
+        local_conn_close(local);
+        return;
+    }
+
+    local->requests_len += nread;
+
+    while (local->requests_len - offset >= sizeof(uint32_t)) {
+        uint32_t len = *(uint32_t *)(local->requests + offset);
+
+        if (local->requests_len - offset - sizeof(uint32_t) < len)
+            break;
+
+        offset += sizeof(uint32_t);
+
+        /* An empty request means the client made room in its ring */
+        if (len)
+            handle_request(local->client, local->requests + offset, len);
+        else
+            queue_update();
+
+        offset += len;
+    }
+
+    memmove(local->requests, local->requests + offset, local->requests_len - offset);
+    local->requests_len -= offset;
+}
+
+static bool
+local_conn_init(struct local_conn *local)
+{
+    struct gputop_local_hello hello;
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(2 * sizeof(int))];
+    } control;
+    struct iovec iov = { &hello, sizeof(hello) };
+    struct msghdr msg = {
+        .msg_iov = &iov,
+        .msg_iovlen = 1,
+        .msg_control = control.buf,
+        .msg_controllen = sizeof(control.buf),
+    };
+    struct cmsghdr *cmsg;
+    size_t map_size = GPUTOP_LOCAL_DATA_OFFSET + GPUTOP_LOCAL_RING_SIZE;
+    uv_os_fd_t socket_fd;
+    int ring_fd;
+    int ret;
+
+    ring_fd = memfd_create("gputop-local", MFD_CLOEXEC);
+    if (ring_fd < 0)
+        return false;
+
+    if (ftruncate(ring_fd, map_size) < 0)
+        goto err;
+
+    local->ring = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring_fd, 0);
+    if (local->ring == MAP_FAILED) {
+        local->ring = NULL;
+        goto err;
+    }
+
+    local->map_size = map_size;
+    gputop_local_producer_init(&local->producer, local->ring, GPUTOP_LOCAL_RING_SIZE);
+
+    local->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (local->event_fd < 0)
+        goto err;
+
+    memset(&hello, 0, sizeof(hello));
+    memcpy(hello.magic, GPUTOP_LOCAL_MAGIC, sizeof(hello.magic));
+    hello.version = GPUTOP_LOCAL_VERSION;
+    hello.ring_size = GPUTOP_LOCAL_RING_SIZE;
+
+    memset(&control, 0, sizeof(control));
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(2 * sizeof(int));
+    ((int *)CMSG_DATA(cmsg))[0] = ring_fd;
+    ((int *)CMSG_DATA(cmsg))[1] = local->event_fd;
+
+    /* NB: the socket is new so there's always room for this */
+    uv_fileno((uv_handle_t *)&local->pipe, &socket_fd);
+    while ((ret = sendmsg(socket_fd, &msg, 0)) < 0 && errno == EINTR)
+        ;
+    if (ret != sizeof(hello))
+        goto err;
+
+    close(ring_fd);
+
+    return true;
+
+err:
+    fprintf(stderr, "Failed to set up local client: %m\n");
+    if (local->ring)
+        munmap(local->ring, map_size);
+    if (local->event_fd >= 0)
+        close(local->event_fd);
+    close(ring_fd);
+    return false;
+}
+
+static void on_local_connect(uv_stream_t *server, int status)
+{
+    struct local_conn *local;
+    struct client *client;
+
+    if (status != 0)
+        return;
+
+    local = xmalloc0(sizeof(*local));
+    local->event_fd = -1;
+    list_inithead(&local->pending);
+    uv_pipe_init(server->loop, &local->pipe, 0);
+    local->pipe.data = local;
+
+    if (uv_accept(server, (uv_stream_t *)&local->pipe) != 0 ||
+        !local_conn_init(local)) {
+        uv_close((uv_handle_t *)&local->pipe, (uv_close_cb)free);
+        return;
+    }
+
+    client = xmalloc0(sizeof(*client));
+    list_inithead(&client->subscriptions);
+    list_addtail(&client->link, &clients);
+    client->local = local;
+    local->client = client;
+
+    uv_read_start((uv_stream_t *)&local->pipe, on_local_alloc_cb, on_local_read_cb);
+
+    uv_timer_start(&timer, periodic_update_cb, 200, 200);
+}
+
+static mode_t
+local_socket_mode(void)
+{
+    const char *mode_env = getenv("GPUTOP_LOCAL_SOCKET_MODE");
+    char *end;
+    long mode;
+
+    if (!mode_env)
+        return 0600;
+
+    mode = strtol(mode_env, &end, 8);
+    if (*end || mode < 0 || mode > 0777) {
+        fprintf(stderr, "Ignoring invalid GPUTOP_LOCAL_SOCKET_MODE=%s\n", mode_env);
+        return 0600;
+    }
+
+    return mode;
+}
+
+/* Failing to listen locally isn't fatal, clients can still use the
+ * websocket */
+static void
+local_listen(uv_loop_t *loop, unsigned long port)
+{
+    char path[sizeof(((struct sockaddr_un *)0)->sun_path)];
+    int r;
+
+    gputop_local_socket_path(port, path, sizeof(path));
+
+    /* Remove any socket left behind by a previous server */
+    unlink(path);
+
+    uv_pipe_init(loop, &local_listener, 0);
+    if ((r = uv_pipe_bind(&local_listener, path)) != 0 ||
+        (r = uv_listen((uv_stream_t *)&local_listener, 128, on_local_connect)) != 0) {
+        fprintf(stderr, "Not listening for local clients on %s: %s\n",
+                path, uv_strerror(r));
+        uv_close((uv_handle_t *)&local_listener, NULL);
+        return;
+    }
+
+    /* Clients get to write into memory the server reads, so by default only
+     * the server's user may connect */
+    chmod(path, local_socket_mode());
+
+    printf("Listening for local clients on %s\n", path);
+}
+
 MAYBE_UNUSED static h2o_iovec_t cache_control;
 MAYBE_UNUSED static h2o_headers_command_t uncache_cmd[2];
 
@@ -1419,8 +2565,8 @@ bool gputop_server_run(void)
     char *port_env;
     unsigned long port;
 
-    list_inithead(&streams);
-    list_inithead(&closing_streams);
+    list_inithead(&clients);
+    list_inithead(&sources);
 
     loop = gputop_mainloop;
 
@@ -1447,6 +2593,8 @@ bool gputop_server_run(void)
     }
     gputop_server_print_addresses(port);
 
+    local_listen(loop, port);
+
     h2o_config_init(&config);
     hostconf = h2o_config_register_host(&config, h2o_iovec_init(H2O_STRLIT("default")), 7890);
     pathconf = h2o_config_register_path(hostconf, "/gputop", 0);
@@ -0,0 +1,253 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+
+#include <uv.h>
+
+#include "gputop-shm.h"
+#include "gputop-mainloop.h"
+#include "gputop-perf.h"
+#include "gputop-log.h"
+
+#ifndef SYS_pidfd_open
+#define SYS_pidfd_open 434
+#endif
+#ifndef SYS_pidfd_getfd
+#define SYS_pidfd_getfd 438
+#endif
+
+#define DAEMON_POLL_INTERVAL_MS 100
+
+bool gputop_shm_shim;
+
+static struct gputop_shm_header *shm;
+
+static uv_timer_t daemon_poll_timer;
+static uint64_t daemon_n_dropped;
+
+static struct gputop_shm_header *
+attach_shm(int fd)
+{
+    struct stat sb;
+    struct gputop_shm_header *header;
+
+    if (fstat(fd, &sb) < 0 || sb.st_size < (off_t) sizeof(*header)) {
+        fprintf(stderr, "gputop: $GPUTOP_SHM fd %d isn't a gputop segment\n", fd);
+        return NULL;
+    }
+
+    header = mmap(NULL, sizeof(*header), PROT_READ | PROT_WRITE,
+                  MAP_SHARED, fd, 0);
+    if (header == MAP_FAILED) {
+        fprintf(stderr, "gputop: Failed to map shared memory fd %d: %m\n", fd);
+        return NULL;
+    }
+
+    if (memcmp(header->magic, GPUTOP_SHM_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != GPUTOP_SHM_VERSION) {
+        fprintf(stderr, "gputop: $GPUTOP_SHM fd %d isn't a compatible gputop segment\n", fd);
+        munmap(header, sizeof(*header));
+        return NULL;
+    }
+
+    return header;
+}
+
+bool
+gputop_shm_shim_init(int fd)
+{
+    pid_t daemon_pid;
+
+    /* NB: the fd is left open so that any processes we spawn that
+     * inherit the preload can publish their contexts too. */
+    shm = attach_shm(fd);
+    if (!shm)
+        return false;
+
+    /* The daemon isn't our ancestor so with Yama's default ptrace
+     * scope it may only borrow our file descriptors if we say so. */
+    daemon_pid = atomic_load_explicit(&shm->daemon_pid, memory_order_acquire);
+    if (daemon_pid)
+        prctl(PR_SET_PTRACER, daemon_pid, 0, 0, 0);
+
+    gputop_shm_shim = true;
+
+    return true;
+}
+
+void
+gputop_shm_publish_ctx(enum gputop_shm_event_type type, int fd, uint32_t ctx_id)
+{
+    uint64_t pos = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    struct gputop_shm_event *event;
+
+    for (;;) {
+        uint64_t seq;
+
+        event = &shm->events[pos & (GPUTOP_SHM_N_EVENTS - 1)];
+        seq = atomic_load_explicit(&event->seq, memory_order_acquire);
+
+        if (seq == pos) {
+            if (atomic_compare_exchange_weak_explicit(&shm->head, &pos, pos + 1,
+                                                      memory_order_relaxed,
+                                                      memory_order_relaxed))
+                break;
+        } else if (seq < pos) {
+            /* Full, never stall the application on the daemon */
+            atomic_fetch_add_explicit(&shm->n_dropped, 1, memory_order_relaxed);
+            return;
+        } else
+            pos = atomic_load_explicit(&shm->head, memory_order_relaxed);
+    }
+
+    event->type = type;
+    event->pid = getpid();
+    event->fd = fd;
+    event->ctx_id = ctx_id;
+    event->timestamp = get_time();
+
+    atomic_store_explicit(&event->seq, pos + 1, memory_order_release);
+}
+
+static int
+borrow_fd(pid_t pid, int remote_fd)
+{
+    int pidfd = syscall(SYS_pidfd_open, pid, 0);
+    int fd;
+
+    if (pidfd < 0)
+        return -1;
+
+    fd = syscall(SYS_pidfd_getfd, pidfd, remote_fd, 0);
+    close(pidfd);
+
+    return fd;
+}
+
+static void
+handle_event(struct gputop_shm_event *event)
+{
+    switch (event->type) {
+    case GPUTOP_SHM_EVENT_CTX_CREATE: {
+        int fd = borrow_fd(event->pid, event->fd);
+
+        if (fd < 0) {
+            char *msg = NULL;
+            int ret = asprintf(&msg, "Failed to access DRM fd %d of pid %d for context %u: %m\n",
+                               event->fd, event->pid, event->ctx_id);
+            (void) ret;
+            gputop_log(GPUTOP_LOG_LEVEL_HIGH, msg, -1);
+            free(msg);
+            return;
+        }
+
+        if (!gputop_add_remote_ctx_handle(fd, event->ctx_id,
+                                          event->pid, event->fd))
+            close(fd);
+        break;
+    }
+    case GPUTOP_SHM_EVENT_CTX_DESTROY:
+        gputop_remove_remote_ctx_handle(event->pid, event->fd, event->ctx_id);
+        break;
+    }
+}
+
+void
+gputop_shm_daemon_poll(void)
+{
+    uint64_t tail, n_dropped;
+
+    if (!shm)
+        return;
+
+    tail = atomic_load_explicit(&shm->tail, memory_order_relaxed);
+
+    for (;;) {
+        struct gputop_shm_event *event =
+            &shm->events[tail & (GPUTOP_SHM_N_EVENTS - 1)];
+        struct gputop_shm_event copy;
+
+        if (atomic_load_explicit(&event->seq, memory_order_acquire) != tail + 1)
+            break;
+
+        copy = *event;
+        atomic_store_explicit(&event->seq, tail + GPUTOP_SHM_N_EVENTS,
+                              memory_order_release);
+        tail++;
+
+        handle_event(&copy);
+    }
+
+    atomic_store_explicit(&shm->tail, tail, memory_order_relaxed);
+
+    n_dropped = atomic_load_explicit(&shm->n_dropped, memory_order_relaxed);
+    if (n_dropped != daemon_n_dropped) {
+        char *msg = NULL;
+        int ret = asprintf(&msg, "Lost %" PRIu64 " context events from the application\n",
+                           n_dropped - daemon_n_dropped);
+        (void) ret;
+        gputop_log(GPUTOP_LOG_LEVEL_MEDIUM, msg, -1);
+        free(msg);
+        daemon_n_dropped = n_dropped;
+    }
+
+    gputop_prune_remote_ctx_handles();
+}
+
+static void
+daemon_poll_cb(uv_timer_t *timer)
+{
+    gputop_shm_daemon_poll();
+}
+
+bool
+gputop_shm_daemon_start(int fd)
+{
+    shm = attach_shm(fd);
+    if (!shm)
+        return false;
+    close(fd);
+
+    /* There's no fd to poll for shared memory, but context creation is
+     * rare and we also poll before picking a context for a new stream. */
+    uv_timer_init(gputop_mainloop, &daemon_poll_timer);
+    uv_timer_start(&daemon_poll_timer, daemon_poll_cb,
+                   DAEMON_POLL_INTERVAL_MS, DAEMON_POLL_INTERVAL_MS);
+
+    return true;
+}
@@ -0,0 +1,119 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/types.h>
+
+/* NB: We use a portable stdatomic.h, so we don't depend on a recent compiler...
+ */
+#include "stdatomic.h"
+
+/* In split mode the library preloaded into the profiled application is
+ * only a thin shim: it keeps its syscall hooks but rather than running
+ * the server itself it publishes what it sees through a shared memory
+ * segment that's drained by the gputop-system daemon, which owns all
+ * stream reading and networking.
+ *
+ * The segment is an anonymous memfd created by the gputop wrapper and
+ * inherited by both the daemon and the application, with its number
+ * passed via $GPUTOP_SHM, so there's no name to race on or leave behind.
+ *
+ * The segment is a bounded queue of fixed size events. The application
+ * may have several threads, or child processes inheriting the preload,
+ * so each slot carries a sequence number letting any number of producers
+ * reserve slots without locks, while the daemon is the only consumer.
+ * Producers never block: if the daemon falls behind events are dropped
+ * and counted.
+ */
+
+#define GPUTOP_SHM_ENV          "GPUTOP_SHM"
+#define GPUTOP_SHM_DAEMON_ENV   "GPUTOP_SHM_DAEMON"
+
+#define GPUTOP_SHM_MAGIC        "GPUTOPSH"
+#define GPUTOP_SHM_VERSION      1
+#define GPUTOP_SHM_N_EVENTS     1024 /* power of two */
+
+enum gputop_shm_event_type {
+    GPUTOP_SHM_EVENT_CTX_CREATE = 1,
+    GPUTOP_SHM_EVENT_CTX_DESTROY,
+};
+
+struct gputop_shm_event {
+    atomic_uint_fast64_t seq;
+
+    uint32_t type;
+    int32_t pid;
+    int32_t fd;     /* DRM fd, only meaningful within the publishing process */
+    uint32_t ctx_id;
+    uint64_t timestamp;
+};
+
+struct gputop_shm_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t n_events;
+
+    /* Set by the wrapper once the daemon has been forked so the shim can
+     * allow it to borrow the application's DRM file descriptors. */
+    atomic_int daemon_pid;
+
+    atomic_uint_fast64_t head; /* next slot to reserve, shared by producers */
+    atomic_uint_fast64_t tail; /* only written by the daemon */
+    atomic_uint_fast64_t n_dropped;
+
+    struct gputop_shm_event events[GPUTOP_SHM_N_EVENTS];
+};
+
+/* Wrapper side. This is inline since the wrapper mustn't load libgputop,
+ * whose constructor would start a server.
+ */
+static inline void
+gputop_shm_init_header(struct gputop_shm_header *header)
+{
+    memcpy(header->magic, GPUTOP_SHM_MAGIC, sizeof(header->magic));
+    header->version = GPUTOP_SHM_VERSION;
+    header->n_events = GPUTOP_SHM_N_EVENTS;
+    atomic_init(&header->daemon_pid, 0);
+    atomic_init(&header->head, 0);
+    atomic_init(&header->tail, 0);
+    atomic_init(&header->n_dropped, 0);
+    for (int i = 0; i < GPUTOP_SHM_N_EVENTS; i++)
+        atomic_init(&header->events[i].seq, i);
+}
+
+/* Application side */
+extern bool gputop_shm_shim;
+
+bool gputop_shm_shim_init(int fd);
+void gputop_shm_publish_ctx(enum gputop_shm_event_type type,
+                            int fd, uint32_t ctx_id);
+
+/* Daemon side, must be called from the mainloop thread */
+bool gputop_shm_daemon_start(int fd);
+void gputop_shm_daemon_poll(void);
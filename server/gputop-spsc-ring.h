@@ -0,0 +1,147 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+
+#pragma once
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+/* NB: We use a portable stdatomic.h, so we don't depend on a recent compiler...
+ */
+#include "stdatomic.h"
+
+#include "util/macros.h"
+
+/* Lock-free ring of variable sized messages handed from exactly one
+ * producer thread to exactly one consumer thread.
+ *
+ * Each message is prefixed by its length and padded to 8 bytes so that
+ * headers are never split across the end of the ring and the consumer only
+ * ever sees whole messages.
+ */
+struct gputop_spsc_ring {
+    uint8_t *buf;
+    uint64_t size; /* power of two */
+
+    atomic_uint_fast64_t head; /* only written by the producer */
+    atomic_uint_fast64_t tail; /* only written by the consumer */
+};
+
+#define GPUTOP_SPSC_RING_HEADER_SIZE 8
+#define GPUTOP_SPSC_RING_ALIGN(len) (((len) + 7) & ~(uint64_t) 7)
+
+static inline void
+gputop_spsc_ring_init(struct gputop_spsc_ring *ring, uint8_t *buf, uint64_t size)
+{
+    assert((size & (size - 1)) == 0 && size >= GPUTOP_SPSC_RING_HEADER_SIZE);
+
+    ring->buf = buf;
+    ring->size = size;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+}
+
+static inline uint64_t
+gputop_spsc_ring_occupancy(struct gputop_spsc_ring *ring)
+{
+    return atomic_load_explicit(&ring->head, memory_order_acquire) -
+        atomic_load_explicit(&ring->tail, memory_order_acquire);
+}
+
+static inline void
+gputop_spsc_ring_copy_in(struct gputop_spsc_ring *ring, uint64_t pos,
+                         const void *data, uint64_t len)
+{
+    uint64_t offset = pos & (ring->size - 1);
+    uint64_t before = MIN2(len, ring->size - offset);
+
+    memcpy(ring->buf + offset, data, before);
+    memcpy(ring->buf, (const uint8_t *) data + before, len - before);
+}
+
+static inline void
+gputop_spsc_ring_copy_out(struct gputop_spsc_ring *ring, uint64_t pos,
+                          void *data, uint64_t len)
+{
+    uint64_t offset = pos & (ring->size - 1);
+    uint64_t before = MIN2(len, ring->size - offset);
+
+    memcpy(data, ring->buf + offset, before);
+    memcpy((uint8_t *) data + before, ring->buf, len - before);
+}
+
+/* Producer side, returns false if there isn't room for the message. */
+static inline bool
+gputop_spsc_ring_push(struct gputop_spsc_ring *ring,
+                      const void *data, uint32_t len)
+{
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    uint64_t total = GPUTOP_SPSC_RING_HEADER_SIZE + GPUTOP_SPSC_RING_ALIGN(len);
+
+    if (total > ring->size - (head - tail))
+        return false;
+
+    *(uint32_t *) (ring->buf + (head & (ring->size - 1))) = len;
+    gputop_spsc_ring_copy_in(ring, head + GPUTOP_SPSC_RING_HEADER_SIZE, data, len);
+
+    /* Publish the message only once it's been fully written */
+    atomic_store_explicit(&ring->head, head + total, memory_order_release);
+
+    return true;
+}
+
+/* Consumer side, pops as many whole messages as fit in max_len bytes,
+ * concatenated into data. Returns the number of bytes popped.
+ */
+static inline uint64_t
+gputop_spsc_ring_pop(struct gputop_spsc_ring *ring,
+                     void *data, uint64_t max_len)
+{
+    uint64_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    uint64_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    uint64_t len = 0;
+
+    while (tail != head) {
+        uint32_t msg_len = *(uint32_t *) (ring->buf + (tail & (ring->size - 1)));
+
+        if (len + msg_len > max_len) {
+            assert(len > 0); /* a single message must always fit */
+            break;
+        }
+
+        gputop_spsc_ring_copy_out(ring, tail + GPUTOP_SPSC_RING_HEADER_SIZE,
+                                  (uint8_t *) data + len, msg_len);
+        len += msg_len;
+        tail += GPUTOP_SPSC_RING_HEADER_SIZE + GPUTOP_SPSC_RING_ALIGN(msg_len);
+    }
+
+    /* Hand the space back only once we're done copying out of it */
+    atomic_store_explicit(&ring->tail, tail, memory_order_release);
+
+    return len;
+}
@@ -5,8 +5,13 @@
  * nothing interesting itself that can be used while investigating
  * system-wide metrics.
  *
- * Note that gputop-system is linked against libgputop.so and the ui
- * will be initialized/run via a library constructor (gputop_ui_init)
+ * It's also the daemon for gputop --split, where the program being
+ * profiled only gets a thin shim that publishes its contexts via
+ * $GPUTOP_SHM and it's gputop-system that reads all the streams and
+ * serves the clients.
+ *
+ * Either way the server is started via libgputop.so's constructor
+ * (gputop_init) and runs on its own thread, so there's nothing to do here.
  */
 
 int
@@ -0,0 +1,154 @@
+/*
+ * GPU Top
+ *
+ * Copyright (C) 2018 Intel Corporation
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+/* Checks the tracepoint store keeps its samples in time order, in blocks
+ * that are never empty nor over full, whatever order they're added in.
+ */
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "gputop-tracepoint-store.h"
+
+static int n_failures;
+
+#define check(cond, ...)                                \
+    do {                                                \
+        if (!(cond)) {                                  \
+            fprintf(stderr, "%s:%d: ", __FILE__, __LINE__); \
+            fprintf(stderr, __VA_ARGS__);               \
+            fprintf(stderr, "\n");                      \
+            n_failures++;                               \
+        }                                               \
+    } while (0)
+
+/* Every sample's payload is its time */
+static void
+add(struct gputop_tracepoint_store *store, uint64_t time)
+{
+    gputop_tracepoint_store_add(store, time, time % 4, &time, sizeof(time));
+}
+
+static void
+check_store(const struct gputop_tracepoint_store *store, const char *name)
+{
+    uint64_t n_samples = 0, prev = 0;
+
+    for (int b = 0; b < store->n_blocks; b++) {
+        const struct gputop_tracepoint_block *block = store->blocks[b];
+
+        check(block->len > 0, "%s: block %d is empty", name, b);
+        check(block->len <= GPUTOP_TRACEPOINT_BLOCK_LEN,
+              "%s: block %d has %d samples", name, b, block->len);
+
+        for (int i = 0; i < block->len; i++) {
+            uint64_t payload;
+
+            memcpy(&payload, block->payload + block->offsets[i], sizeof(payload));
+            check(block->times[i] >= prev, "%s: sample %" PRIu64 " out of order",
+                  name, n_samples);
+            check(payload == block->times[i] && block->cpus[i] == payload % 4,
+                  "%s: sample %" PRIu64 " has the wrong data", name, n_samples);
+            prev = block->times[i];
+            n_samples++;
+        }
+    }
+
+    check(n_samples == store->n_samples, "%s: %" PRIu64 " samples, expected %" PRIu64,
+          name, n_samples, store->n_samples);
+}
+
+/* A late sample between two full blocks needs a block of its own */
+static void
+test_between_full_blocks(void)
+{
+    struct gputop_tracepoint_store store;
+    struct gputop_tracepoint_pos pos;
+
+    gputop_tracepoint_store_init(&store);
+
+    for (int i = 0; i < 3 * GPUTOP_TRACEPOINT_BLOCK_LEN; i++)
+        add(&store, i * 10);
+    add(&store, 10235);
+    check_store(&store, "between full blocks");
+
+    pos = gputop_tracepoint_store_lower_bound(&store, 10231);
+    check(gputop_tracepoint_pos_valid(&store, pos) &&
+          gputop_tracepoint_store_time(&store, pos) == 10235,
+          "between full blocks: lower bound didn't find the late sample");
+
+    check(gputop_tracepoint_store_evict(&store, 10240) == GPUTOP_TRACEPOINT_BLOCK_LEN + 1,
+          "between full blocks: evicted the wrong number of samples");
+    check_store(&store, "between full blocks, evicted");
+
+    gputop_tracepoint_store_fini(&store);
+}
+
+/* Mostly in order with some late samples, as merged from several CPUs */
+static void
+test_late_samples(void)
+{
+    struct gputop_tracepoint_store store;
+    uint64_t time = 1000;
+
+    gputop_tracepoint_store_init(&store);
+    srand(1);
+
+    for (int i = 0; i < 100000; i++) {
+        time += rand() % 8;
+        add(&store, rand() % 16 ? time : time - rand() % 20000);
+
+        if (i % 10000 == 9999) {
+            uint64_t before = time - 30000;
+            struct gputop_tracepoint_pos pos;
+
+            gputop_tracepoint_store_evict(&store, before);
+            pos = gputop_tracepoint_store_lower_bound(&store, before);
+            check(!gputop_tracepoint_pos_valid(&store, pos) ||
+                  gputop_tracepoint_store_time(&store, pos) >= before,
+                  "late samples: bad lower bound");
+            pos = gputop_tracepoint_pos_prev(&store, pos);
+            check(!gputop_tracepoint_pos_valid(&store, pos) ||
+                  gputop_tracepoint_store_time(&store, pos) < before,
+                  "late samples: bad lower bound");
+        }
+    }
+    check_store(&store, "late samples");
+
+    gputop_tracepoint_store_fini(&store);
+}
+
+int
+main(int argc, char **argv)
+{
+    test_between_full_blocks();
+    test_late_samples();
+
+    if (n_failures)
+        fprintf(stderr, "%d failures\n", n_failures);
+
+    return n_failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -116,6 +116,15 @@ gputop_connect(const char *host, int port,
     return conn;
 }
 
+void
+gputop_connection_set_msg_pool(gputop_connection_t *conn,
+                               gputop_msg_alloc_cb_t alloc_cb,
+                               gputop_msg_release_cb_t release_cb,
+                               gputop_on_msg_cb_t msg_cb)
+{
+    /* Messages are assembled by libsoup, keep using the data callback. */
+}
+
 void
 gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
 {
@@ -90,6 +90,12 @@ struct i915_perf_window {
     struct list_head counters;
 };
 
+enum {
+    TIMELINE_COUNTERS_SELECTED_SAMPLE,
+    TIMELINE_COUNTERS_VISIBLE_CONTEXT,
+    TIMELINE_COUNTERS_VISIBLE_GPU,
+};
+
 struct timeline_window {
     struct window base;
 
@@ -104,6 +110,8 @@ struct timeline_window {
     int32_t hovered_report;
     float *accumulated_values;
 
+    int counters_range; /* What the counters window accumulates */
+
     struct gputop_perf_tracepoint tracepoint;
     uint64_t tracepoint_selected_ts;
 
@@ -157,6 +165,16 @@ static struct {
     struct i915_perf_window contexts_i915_perf_window;
     struct window live_i915_perf_counters_window;
     struct window live_i915_perf_usage_window;
+    struct window derived_counters_window;
+
+    /* Added to each new gen_metrics */
+    struct {
+        char name[64];
+        char equation[256];
+        int n_metric_sets;
+    } derived_counters[32];
+    int n_derived_counters;
+    char derived_counter_error[256];
 
     ImVec4 clear_color;
 
@@ -273,20 +291,46 @@ update_cpu_colors(int n_cpus)
 }
 
 static void
-on_connection_data(gputop_connection_t *conn,
-                   const void *payload, size_t payload_len,
-                   void *user_data)
+on_connection_data_handled(void)
 {
     struct gputop_client_context *ctx = &context.ctx;
 
-    gputop_client_context_handle_data(ctx, payload, payload_len);
-
     if (ctx->features && context.n_cpu_colors != ctx->features->features->n_cpus)
         update_cpu_colors(ctx->features->features->n_cpus);
 
     ImGui_ScheduleFrame();
 }
 
+static void
+on_connection_data(gputop_connection_t *conn,
+                   const void *payload, size_t payload_len,
+                   void *user_data)
+{
+    gputop_client_context_handle_data(&context.ctx, payload, payload_len);
+    on_connection_data_handled();
+}
+
+static void *
+on_connection_msg_alloc(size_t len, void *user_data)
+{
+    return gputop_client_context_alloc_message(&context.ctx, len);
+}
+
+static void
+on_connection_msg_release(void *msg, void *user_data)
+{
+    gputop_client_context_release_message(&context.ctx, msg);
+}
+
+static void
+on_connection_msg(gputop_connection_t *conn,
+                  void *msg, size_t len,
+                  void *user_data)
+{
+    gputop_client_context_handle_message(&context.ctx, msg, len);
+    on_connection_data_handled();
+}
+
 static void
 on_connection_closed(gputop_connection_t *conn,
                      const char *error,
@@ -322,6 +366,10 @@ reconnect(void)
                                      on_connection_ready,
                                      on_connection_data,
                                      on_connection_closed, NULL);
+    gputop_connection_set_msg_pool(ctx->connection,
+                                   on_connection_msg_alloc,
+                                   on_connection_msg_release,
+                                   on_connection_msg);
 }
 
 /**/
@@ -335,7 +383,7 @@ pretty_print_counter_value(const struct gputop_metric_set_counter *counter,
 
 static double
 read_counter_max(struct gputop_client_context *ctx,
-                 struct gputop_accumulated_samples *sample,
+                 uint64_t *deltas,
                  const struct gputop_metric_set_counter *counter,
                  float max_value)
 {
@@ -346,14 +394,14 @@ read_counter_max(struct gputop_client_context *ctx,
         if (counter->max_uint64)
             return counter->max_uint64(&ctx->devinfo,
                                        ctx->metric_set,
-                                       sample->accumulator.deltas);
+                                       deltas);
         break;
     case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
     case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
         if (counter->max_float)
             return counter->max_float(&ctx->devinfo,
                                       ctx->metric_set,
-                                      sample->accumulator.deltas);
+                                      deltas);
         break;
     }
 
@@ -374,7 +422,7 @@ add_counter_i915_perf_window(struct i915_perf_window *window,
 static void
 display_i915_perf_counters(struct gputop_client_context *ctx,
                            ImGuiTextFilter *filter,
-                           struct gputop_accumulated_samples *samples,
+                           uint64_t *deltas,
                            bool add_buttons)
 {
     if (!ctx->metric_set) {
@@ -382,6 +430,20 @@ display_i915_perf_counters(struct gputop_client_context *ctx,
         return;
     }
 
+    double *values = NULL;
+    if (deltas) {
+        int n_visible = 0;
+        for (int c = 0; c < ctx->metric_set->n_counters; c++)
+            n_visible += filter->PassFilter(ctx->metric_set->counters[c].name);
+
+        if (gputop_metric_set_use_evaluate_all(ctx->metric_set, n_visible)) {
+            values = (double *)
+                ensure_temporary_buffer(ctx->metric_set->n_counters * sizeof(double));
+            gputop_metric_set_evaluate_all(&ctx->devinfo, ctx->metric_set,
+                                           &deltas, 1, values);
+        }
+    }
+
     for (int c = 0; c < ctx->metric_set->n_counters; c++) {
         const struct gputop_metric_set_counter *counter = &ctx->metric_set->counters[c];
 
@@ -399,8 +461,9 @@ display_i915_perf_counters(struct gputop_client_context *ctx,
             if (ImGui::IsItemHovered()) ImGui::SetTooltip("Add counter to timeline windows");
         }
 
-        double value = samples ? gputop_client_context_read_counter_value(ctx, samples, counter) : 0.0f;
-        double max = samples ? read_counter_max(ctx, samples, counter, MAX2(1.0f, value)) : 1.0f;
+        double value = values ? values[c] :
+            deltas ? gputop_client_context_read_counter_value(ctx, deltas, counter) : 0.0f;
+        double max = deltas ? read_counter_max(ctx, deltas, counter, MAX2(1.0f, value)) : 1.0f;
         ImGui::ProgressBar(value / max, ImVec2(100, 0)); ImGui::SameLine();
 
         char text[100];
@@ -432,12 +495,11 @@ display_live_i915_perf_counters_window(struct window *win)
     if (!ctx->metric_set)
         return;
 
-    struct gputop_accumulated_samples *last_sample =
-        list_empty(&ctx->graphs) ? NULL :
-        list_last_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+    uint64_t *last_deltas = ctx->graphs.count == 0 ? NULL :
+        gputop_samples_ring_deltas(&ctx->graphs, ctx->graphs.count - 1);
 
     ImGui::BeginChild("##counters");
-    display_i915_perf_counters(ctx, &filter, last_sample, true);
+    display_i915_perf_counters(ctx, &filter, last_deltas, true);
     ImGui::EndChild();
 }
 
@@ -503,24 +565,32 @@ show_live_i915_perf_usage_window(void)
 static float *
 get_counter_samples(struct gputop_client_context *ctx,
                     int max_graphs,
-                    struct gputop_accumulated_samples *first_samples,
+                    const struct gputop_samples_ring *graphs,
                     struct i915_perf_window_counter *counter,
                     float *max_value)
 {
-    float *values = ensure_plot_accumulator(max_graphs);
+    uint8_t *buffer = (uint8_t *)
+        ensure_temporary_buffer(max_graphs * (sizeof(uint64_t *) + sizeof(float)));
+    uint64_t **deltas = (uint64_t **) buffer;
+    float *values = (float *) (buffer + max_graphs * sizeof(uint64_t *));
+    int first = MAX2(0, max_graphs - (int) graphs->count);
+    int skipped = MAX2(0, (int) graphs->count - max_graphs);
     int i;
 
-    for (i = 0; i < (max_graphs - ctx->n_graphs); i++)
+    for (i = 0; i < first; i++)
         values[i] = 0.0f;
 
+    for (i = 0; i < (max_graphs - first); i++)
+        deltas[i] = gputop_samples_ring_deltas(graphs, skipped + i);
+
+    gputop_metric_set_counter_read_batch(&ctx->devinfo, ctx->metric_set,
+                                         counter->counter,
+                                         deltas, max_graphs - first,
+                                         &values[first]);
+
     *max_value = 0.0f;
-    struct gputop_accumulated_samples *sample = first_samples;
-    for (; i < max_graphs; i++) {
-        values[i] = gputop_client_context_read_counter_value(ctx, sample, counter->counter);
+    for (i = first; i < max_graphs; i++)
         *max_value = MAX2(*max_value, values[i]);
-        sample = list_first_entry(&sample->link,
-                                  struct gputop_accumulated_samples, link);
-    }
 
     return values;
 }
@@ -542,8 +612,8 @@ select_i915_perf_counter(struct gputop_client_context *ctx,
 
     if (!ctx->metric_set) return false;
 
-    struct gputop_accumulated_samples *last_sample =
-        list_last_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+    uint64_t *last_deltas = ctx->graphs.count == 0 ? NULL :
+        gputop_samples_ring_deltas(&ctx->graphs, ctx->graphs.count - 1);
 
     ImGui::BeginChild("##block", ImVec2(0, 300));
     for (int c = 0; c < ctx->metric_set->n_counters; c++) {
@@ -556,9 +626,11 @@ select_i915_perf_counter(struct gputop_client_context *ctx,
             selected = true;
         }
         hovered = ImGui::IsItemHovered();
-        double value = gputop_client_context_read_counter_value(ctx, last_sample, counter);
-        ImGui::ProgressBar(value / read_counter_max(ctx, last_sample, counter, MAX2(1.0f, value)),
-                           ImVec2(100, 0)); ImGui::SameLine();
+        double value = last_deltas ?
+            gputop_client_context_read_counter_value(ctx, last_deltas, counter) : 0.0f;
+        double max = last_deltas ?
+            read_counter_max(ctx, last_deltas, counter, MAX2(1.0f, value)) : 1.0f;
+        ImGui::ProgressBar(value / max, ImVec2(100, 0)); ImGui::SameLine();
         char svalue[100];
         pretty_print_counter_value(counter, value, svalue, sizeof(svalue));
         if (ImGui::Selectable(svalue, hovered)) {
@@ -602,9 +674,9 @@ display_global_i915_perf_window(struct window *win)
         cleanup_counters_i915_perf_window(window);
     } ImGui::SameLine();
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); }
-    if (ctx->n_graphs < max_graphs) {
+    if (ctx->graphs.count < max_graphs) {
         ImGui::SameLine(); ImGui::Text("Loading:"); ImGui::SameLine();
-        ImGui::ProgressBar((float) ctx->n_graphs / max_graphs);
+        ImGui::ProgressBar((float) ctx->graphs.count / max_graphs);
     }
 
 
@@ -625,16 +697,17 @@ display_global_i915_perf_window(struct window *win)
         ImGui::PopID();
         if (ImGui::IsItemHovered()) { ImGui::SetTooltip("Change max behavior"); } ImGui::SameLine();
 
-        struct gputop_accumulated_samples *first_samples =
-          list_first_entry(&ctx->graphs, struct gputop_accumulated_samples, link);
+        uint64_t *first_deltas = ctx->graphs.count == 0 ? NULL :
+            gputop_samples_ring_deltas(&ctx->graphs, 0);
         float max_value = 0.0f;
         const float *values =
-            get_counter_samples(ctx, max_graphs, first_samples, c, &max_value);
+            get_counter_samples(ctx, max_graphs, &ctx->graphs, c, &max_value);
         int hovered =
             Gputop::PlotLines("", values, max_graphs, 0, -1,
                               c->counter->name,
-                              0, c->use_samples_max ? max_value : read_counter_max(ctx, first_samples,
-                                                                                   c->counter, max_value),
+                              0, (c->use_samples_max || !first_deltas) ?
+                              max_value : read_counter_max(ctx, first_deltas,
+                                                           c->counter, max_value),
                               ImVec2(ImGui::GetContentRegionAvailWidth() - 10, 50.0f));
         if (hovered >= 0) {
             char tooltip_tex[100];
@@ -709,9 +782,9 @@ display_contexts_i915_perf_window(struct window *win)
         cleanup_counters_i915_perf_window(window);
     } ImGui::SameLine();
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); }
-    if (ctx->n_graphs < max_graphs) {
+    if (ctx->graphs.count < max_graphs) {
         ImGui::SameLine(); ImGui::Text("Loading:"); ImGui::SameLine();
-        ImGui::ProgressBar((float) ctx->n_graphs / max_graphs);
+        ImGui::ProgressBar((float) ctx->graphs.count / max_graphs);
     }
 
     ImGui::BeginChild("##block");
@@ -737,16 +810,17 @@ display_contexts_i915_perf_window(struct window *win)
                 continue;
 
             ImGui::Text("%s", context->name);
-            struct gputop_accumulated_samples *first_samples =
-              list_first_entry(&context->graphs, struct gputop_accumulated_samples, link);
+            uint64_t *first_deltas = context->graphs.count == 0 ? NULL :
+                gputop_samples_ring_deltas(&context->graphs, 0);
             float max_value = 0.0f;
             const float *values =
-                get_counter_samples(ctx, max_graphs, first_samples, c, &max_value);
+                get_counter_samples(ctx, max_graphs, &context->graphs, c, &max_value);
             int hovered =
                 Gputop::PlotLines("", values, max_graphs, 0, -1,
                                   "",
-                                  0, c->use_samples_max ? max_value : read_counter_max(ctx, first_samples,
-                                                                                       c->counter, max_value),
+                                  0, (c->use_samples_max || !first_deltas) ?
+                                  max_value : read_counter_max(ctx, first_deltas,
+                                                               c->counter, max_value),
                                   ImVec2(ImGui::GetContentRegionAvailWidth() - 10, 50.0f));
             if (hovered >= 0 ) {
                 char tooltip_tex[100];
@@ -1037,17 +1111,16 @@ static uint64_t
 get_end_timeline_ts(struct gputop_client_context *ctx,
                     bool for_i915_perf)
 {
-    struct gputop_accumulated_samples *oa_end = list_empty(&ctx->timelines) ?
-        NULL : list_last_entry(&ctx->timelines, struct gputop_accumulated_samples, link);
-    struct gputop_perf_tracepoint_data *tp_end = list_empty(&ctx->perf_tracepoints_data) ?
-        NULL : list_last_entry(&ctx->perf_tracepoints_data,
-                               struct gputop_perf_tracepoint_data, link);
+    const struct gputop_samples_ring *timelines = &ctx->timelines;
+    uint64_t tp_end = gputop_client_context_tracepoints_end_time(ctx);
 
     if (for_i915_perf && !ctx->i915_perf_config.cpu_timestamps)
-        tp_end = NULL;
+        tp_end = 0;
 
-    return MAX2(oa_end ? oa_end->timestamp_end : 0,
-                tp_end ? tp_end->data.time : 0);
+    return MAX2(timelines->count > 0 ?
+                timelines->timestamp_end[gputop_samples_ring_index(timelines,
+                                                                   timelines->count - 1)] : 0,
+                tp_end);
 }
 
 static void
@@ -1074,14 +1147,14 @@ tracepoint_print_prev_next(struct gputop_client_context *ctx,
                            struct gputop_perf_tracepoint_data *data)
 {
     struct gputop_perf_tracepoint *tp = data->tp;
-    struct gputop_perf_tracepoint_data *other;
+    struct gputop_perf_tracepoint_data other;
     char pretty_value[100];
 
-    other = (data->tp_link.prev == &tp->data) ? NULL :
-        LIST_ENTRY(struct gputop_perf_tracepoint_data, data->tp_link.prev, tp_link);
-    if (other) {
+    if (gputop_client_context_tracepoint_data(tp,
+                                              gputop_tracepoint_pos_prev(&tp->samples, data->pos),
+                                              &other)) {
         gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
-                                         data->data.time - other->data.time,
+                                         data->time - other.time,
                                          pretty_value, sizeof(pretty_value));
 
         int l = snprintf(buf, len, "\nprev @ %s", pretty_value);
@@ -1089,11 +1162,11 @@ tracepoint_print_prev_next(struct gputop_client_context *ctx,
         len -= l;
     }
 
-    other = (data->tp_link.next == &tp->data) ? NULL :
-        LIST_ENTRY(struct gputop_perf_tracepoint_data, data->tp_link.next, tp_link);
-    if (other) {
+    if (gputop_client_context_tracepoint_data(tp,
+                                              gputop_tracepoint_pos_next(&tp->samples, data->pos),
+                                              &other)) {
         gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
-                                         other->data.time - data->data.time,
+                                         other.time - data->time,
                                          pretty_value, sizeof(pretty_value));
 
         int l = snprintf(buf, len, "\nnext @ %s", pretty_value);
@@ -1131,21 +1204,24 @@ timeline_focus_on_first_sample(struct timeline_window *window,
     get_timeline_bounds(window, ctx, true, &start_ts, &end_ts,
                         window->zoom_start, window->zoom_length);
 
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        if (samples->timestamp_end < start_ts)
+    const struct gputop_samples_ring *timelines = &ctx->timelines;
+    for (uint32_t i = 0; i < timelines->count; i++) {
+        uint32_t idx = gputop_samples_ring_index(timelines, i);
+
+        if (timelines->timestamp_end[idx] < start_ts)
             continue;
-        if (samples->timestamp_start > end_ts)
+        if (timelines->timestamp_start[idx] > end_ts)
             break;
-        if (samples->context != context)
+        if (timelines->contexts[idx] != context)
             continue;
 
         const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
         uint64_t total_end_ts = get_end_timeline_ts(ctx, true);
 
-        uint64_t ts_length = samples->timestamp_end - samples->timestamp_start;
+        uint64_t ts_length = timelines->timestamp_end[idx] - timelines->timestamp_start[idx];
         ts_length *= 2;
 
-        window->zoom_start = (samples->timestamp_start - ts_length / 4) - (total_end_ts - max_length);
+        window->zoom_start = (timelines->timestamp_start[idx] - ts_length / 4) - (total_end_ts - max_length);
         window->zoom_length = ts_length;
 
         break;
@@ -1179,21 +1255,24 @@ timeline_focus_on_gt_timestamp(struct timeline_window *window,
                                struct gputop_client_context *ctx,
                                uint64_t gt_timestamp)
 {
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
+    const struct gputop_samples_ring *timelines = &ctx->timelines;
+    for (uint32_t i = 0; i < timelines->count; i++) {
+        uint32_t idx = gputop_samples_ring_index(timelines, i);
+
         if (gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->end_report.header) < gt_timestamp)
+                                              timelines->end_reports[idx].header) < gt_timestamp)
             continue;
         if (gputop_i915_perf_record_timestamp(&ctx->i915_perf_config,
-                                              samples->start_report.header) > gt_timestamp)
+                                              timelines->start_reports[idx].header) > gt_timestamp)
             break;
 
         const uint64_t max_length = ctx->oa_visible_timeline_s * 1000000000ULL;
         uint64_t total_end_ts = get_end_timeline_ts(ctx, true);
 
-        uint64_t ts_length = samples->timestamp_end - samples->timestamp_start;
+        uint64_t ts_length = timelines->timestamp_end[idx] - timelines->timestamp_start[idx];
         ts_length *= 2;
 
-        window->zoom_start = (samples->timestamp_start - ts_length / 4) - (total_end_ts - max_length);
+        window->zoom_start = (timelines->timestamp_start[idx] - ts_length / 4) - (total_end_ts - max_length);
         window->zoom_length = ts_length;
 
         break;
@@ -1296,80 +1375,76 @@ search_timeline_reports_for_timestamp(struct timeline_window *window,
 static void
 update_timeline_selected_reports(struct timeline_window *window,
                                  struct gputop_client_context *ctx,
-                                 struct gputop_accumulated_samples *sample)
+                                 uint32_t sample_idx)
 {
-    if (window->selected_sample.start_report.header == sample->start_report.header)
-        return;
+    const struct gputop_samples_ring *timelines = &ctx->timelines;
+    uint32_t idx = gputop_samples_ring_index(timelines, sample_idx);
 
-    memcpy(&window->selected_sample, sample, sizeof(window->selected_sample));
-    memcpy(&window->selected_context, sample->context, sizeof(window->selected_context));
+    if (window->selected_sample.start_report.header == timelines->start_reports[idx].header)
+        return;
 
-    struct gputop_record_iterator iter;
-    int n_reports = 0;
-    gputop_record_iterator_init(&iter, sample);
-    while (gputop_record_iterator_next(&iter)) {
-        if (iter.header->type == DRM_I915_PERF_RECORD_SAMPLE)
-            n_reports++;
-    }
+    gputop_samples_ring_get(timelines, sample_idx, &window->selected_sample);
+    memcpy(&window->selected_context, timelines->contexts[idx],
+           sizeof(window->selected_context));
 
-    assert(n_reports > 1);
-    int n_accumulated_reports = n_reports - 1;
+    /* The running sums of the context give the deltas of each report
+     * without walking & decoding the reports again. */
+    const struct gputop_accumulated_samples *sample = &window->selected_sample;
+    const struct gputop_oa_prefix_index *index = &timelines->contexts[idx]->oa_index;
+    uint32_t first = 0, n_accumulated_reports = 0;
+    gputop_oa_prefix_index_find_range(index,
+                                      sample->timestamp_start, sample->timestamp_end,
+                                      &first, &n_accumulated_reports);
 
     int n_counters = ctx->metric_set->n_counters;
 
     free(window->accumulated_values);
     window->accumulated_values = (float *)
-        calloc(n_accumulated_reports * n_counters, sizeof(float));
+        calloc(MAX2(n_accumulated_reports, 1) * n_counters, sizeof(float));
     window->n_accumulated_reports = n_accumulated_reports;
     window->hovered_report = -1;
 
-    const uint8_t *last_report = NULL;
-    int i = 0;
-    gputop_record_iterator_init(&iter, sample);
-    while (gputop_record_iterator_next(&iter)) {
-        if (iter.header->type != DRM_I915_PERF_RECORD_SAMPLE)
-            continue;
+    if (!n_accumulated_reports) {
+        search_timeline_reports_for_timestamp(window, ctx);
+        return;
+    }
 
-        const uint8_t *report = (const uint8_t *)
-            gputop_i915_perf_record_field(&ctx->i915_perf_config, iter.header,
-                                          GPUTOP_I915_PERF_FIELD_OA_REPORT);
-        if (!last_report) {
-            last_report = report;
-            continue;
-        }
+    /* Then read all the counters over all the deltas in one go. */
+    struct gputop_cc_oa_deltas *deltas = (struct gputop_cc_oa_deltas *)
+        calloc(n_accumulated_reports, sizeof(*deltas));
+    uint64_t **deltas_ptrs = (uint64_t **)
+        calloc(n_accumulated_reports, sizeof(*deltas_ptrs));
+    for (uint32_t i = 0; i < n_accumulated_reports; i++) {
+        gputop_oa_prefix_index_sum(index, first + i, 1, deltas[i].deltas);
+        deltas_ptrs[i] = deltas[i].deltas;
+    }
 
-        struct gputop_cc_oa_accumulator accumulator;
-        gputop_cc_oa_accumulator_init(&accumulator, &ctx->devinfo,
-                                      ctx->metric_set, 0, NULL);
-        gputop_cc_oa_accumulate_reports(&accumulator, last_report, report);
+    if (gputop_metric_set_use_evaluate_all(ctx->metric_set, n_counters)) {
+        uint32_t n_values = n_accumulated_reports * n_counters;
+        double *values = (double *) calloc(n_values, sizeof(*values));
 
+        gputop_metric_set_evaluate_all(&ctx->devinfo, ctx->metric_set,
+                                       deltas_ptrs, n_accumulated_reports,
+                                       values);
+        for (uint32_t v = 0; v < n_values; v++)
+            window->accumulated_values[v] = values[v];
+
+        free(values);
+    } else {
         for (int c = 0; c < n_counters; c++) {
-            struct gputop_metric_set_counter *counter =
+            const struct gputop_metric_set_counter *counter =
                 &ctx->metric_set->counters[c];
 
-            float *value = &window->accumulated_values[c * n_accumulated_reports + i];
-
-            switch (counter->data_type) {
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT64:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_UINT32:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_BOOL32:
-                *value = counter->oa_counter_read_uint64(&ctx->devinfo,
-                                                         ctx->metric_set,
-                                                         accumulator.deltas);
-                break;
-            case GPUTOP_PERFQUERY_COUNTER_DATA_DOUBLE:
-            case GPUTOP_PERFQUERY_COUNTER_DATA_FLOAT:
-                *value = counter->oa_counter_read_float(&ctx->devinfo,
-                                                        ctx->metric_set,
-                                                        accumulator.deltas);
-                break;
-            }
+            gputop_metric_set_counter_read_batch(&ctx->devinfo, ctx->metric_set,
+                                                 counter, deltas_ptrs,
+                                                 n_accumulated_reports,
+                                                 &window->accumulated_values[c * n_accumulated_reports]);
         }
-
-        i++;
-        last_report = report;
     }
 
+    free(deltas_ptrs);
+    free(deltas);
+
     search_timeline_reports_for_timestamp(window, ctx);
 }
 
@@ -1442,32 +1517,38 @@ display_timeline_window(struct window *win)
     }
 
     uint32_t n_entries = 0;
-    list_for_each_entry(struct gputop_accumulated_samples, samples, &ctx->timelines, link) {
-        if (samples->timestamp_end < start_ts)
+    const struct gputop_samples_ring *timelines = &ctx->timelines;
+    for (uint32_t i = 0; i < timelines->count; i++) {
+        uint32_t idx = gputop_samples_ring_index(timelines, i);
+        uint64_t timestamp_start = timelines->timestamp_start[idx];
+        uint64_t timestamp_end = timelines->timestamp_end[idx];
+        struct gputop_hw_context *hw_context = timelines->contexts[idx];
+
+        if (timestamp_end < start_ts)
             continue;
-        if (samples->timestamp_start > end_ts)
+        if (timestamp_start > end_ts)
             break;
 
-        if (samples->context) {
-            samples->context->visible_time_spent +=
-                MIN2(samples->timestamp_end, end_ts) -
-                MAX2(samples->timestamp_start, start_ts);
+        if (hw_context) {
+            hw_context->visible_time_spent +=
+                MIN2(timestamp_end, end_ts) -
+                MAX2(timestamp_start, start_ts);
         }
 
         n_entries++;
-        assert(samples->context->timeline_row < n_rows);
+        assert(hw_context->timeline_row < n_rows);
 
-        if (Gputop::TimelineItem(samples->context->timeline_row,
-                                 MAX2(samples->timestamp_start, start_ts) - start_ts,
-                                 samples->timestamp_end - start_ts, false)) {
-            update_timeline_selected_reports(window, ctx, samples);
+        if (Gputop::TimelineItem(hw_context->timeline_row,
+                                 MAX2(timestamp_start, start_ts) - start_ts,
+                                 timestamp_end - start_ts, false)) {
+            update_timeline_selected_reports(window, ctx, i);
 
             char pretty_time[20];
             gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
-                                             samples->timestamp_end - samples->timestamp_start,
+                                             timestamp_end - timestamp_start,
                                              pretty_time, sizeof(pretty_time));
             ImGui::SetTooltip("%s : %s",
-                              samples->context->name, pretty_time);
+                              hw_context->name, pretty_time);
         }
     }
 
@@ -1527,16 +1608,14 @@ display_timeline_window(struct window *win)
                               ImVec2(ImGui::GetContentRegionAvailWidth(), 300.0f));
     }
 
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
-        if (data->data.time < start_ts)
-            continue;
-        if (data->data.time > end_ts)
-            break;
+    struct gputop_perf_tracepoint_iterator tp_iter;
+    gputop_client_context_tracepoint_iterator_init(ctx, &tp_iter, start_ts, end_ts);
+    while (gputop_client_context_tracepoint_iterator_next(&tp_iter)) {
+        struct gputop_perf_tracepoint_data *data = &tp_iter.data;
 
         if (Gputop::TimelineEvent(data->tp->idx,
-                                  MAX2(data->data.time, start_ts) - start_ts,
-                                  data->data.time == window->tracepoint_selected_ts)) {
+                                  MAX2(data->time, start_ts) - start_ts,
+                                  data->time == window->tracepoint_selected_ts)) {
             struct gputop_perf_tracepoint *tp = data->tp;
 
             char point_desc[200];
@@ -1553,6 +1632,7 @@ display_timeline_window(struct window *win)
             memcpy(&window->tracepoint, data->tp, sizeof(window->tracepoint));
         }
     }
+    gputop_client_context_tracepoint_iterator_fini(&tp_iter);
 
     int64_t zoom_start;
     uint64_t zoom_end;
@@ -1585,8 +1665,45 @@ display_timeline_counters(struct window *win)
     static ImGuiTextFilter filter;
     filter.Draw();
 
+    ImGui::RadioButton("Selected sample", &window->counters_range,
+                       TIMELINE_COUNTERS_SELECTED_SAMPLE); ImGui::SameLine();
+    ImGui::RadioButton("Visible range, context", &window->counters_range,
+                       TIMELINE_COUNTERS_VISIBLE_CONTEXT); ImGui::SameLine();
+    ImGui::RadioButton("Visible range, GPU", &window->counters_range,
+                       TIMELINE_COUNTERS_VISIBLE_GPU);
+
+    /* Accumulating over the visible range comes down to a couple of binary
+     * searches in the running sums of the reports, so we can afford
+     * doing it every frame while zooming. */
+    uint64_t *deltas = window->selected_sample.accumulator.deltas;
+    struct gputop_cc_oa_accumulator range_accumulator;
+    if (window->counters_range != TIMELINE_COUNTERS_SELECTED_SAMPLE &&
+        ctx->metric_set) {
+        const struct gputop_hw_context *hw_context = NULL;
+        uint64_t start_ts, end_ts;
+
+        get_timeline_bounds(window, ctx, true, &start_ts, &end_ts,
+                            window->zoom_start, window->zoom_length);
+
+        if (window->counters_range == TIMELINE_COUNTERS_VISIBLE_CONTEXT) {
+            list_for_each_entry(struct gputop_hw_context, c, &ctx->hw_contexts, link) {
+                if (c->hw_id == window->selected_context.hw_id)
+                    hw_context = c;
+            }
+        }
+
+        if ((hw_context ||
+             window->counters_range == TIMELINE_COUNTERS_VISIBLE_GPU) &&
+            gputop_client_context_accumulate_range(ctx, hw_context, start_ts, end_ts,
+                                                   &range_accumulator))
+            deltas = range_accumulator.deltas;
+        else
+            deltas = NULL;
+    }
+
     ImGui::BeginChild("##counters");
-    display_i915_perf_counters(ctx, &filter, &window->selected_sample, false);
+    if (deltas)
+        display_i915_perf_counters(ctx, &filter, deltas, false);
     ImGui::EndChild();
 }
 
@@ -1608,25 +1725,24 @@ display_timeline_events(struct window *win)
 
     int n_items = 0, n_tps = list_length(&ctx->perf_tracepoints);
     window->tracepoint_selected_ts = 0ULL;
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
-        if (data->data.time < start_ts)
-            continue;
-        if (data->data.time > end_ts || n_items > 100)
-            break;
+    struct gputop_perf_tracepoint_iterator tp_iter;
+    gputop_client_context_tracepoint_iterator_init(ctx, &tp_iter, start_ts, end_ts);
+    while (n_items <= 100 && gputop_client_context_tracepoint_iterator_next(&tp_iter)) {
+        struct gputop_perf_tracepoint_data *data = &tp_iter.data;
 
-        char desc[20];
-        snprintf(desc, sizeof(desc), "##%p", data);
+        char desc[40];
+        snprintf(desc, sizeof(desc), "##%p-%i-%i", data->tp, data->pos.block, data->pos.idx);
         ImGui::ColorButton(desc,
                            Gputop::GetHueColor(data->tp->idx, n_tps),
                            ImGuiColorEditFlags_NoInputs | ImGuiColorEditFlags_NoTooltip); ImGui::SameLine();
         char point_desc[200];
         gputop_client_context_print_tracepoint_data(ctx, point_desc, sizeof(point_desc), data, true);
         ImGui::Selectable(point_desc);
-        if (ImGui::IsItemHovered()) window->tracepoint_selected_ts = data->data.time;
+        if (ImGui::IsItemHovered()) window->tracepoint_selected_ts = data->time;
 
         n_items++;
     }
+    gputop_client_context_tracepoint_iterator_fini(&tp_iter);
 }
 
 static void
@@ -1694,7 +1810,7 @@ display_timeline_reports(struct window *win)
 
     int32_t new_hovered_column = -1;
     for (int c = 0; c < ctx->metric_set->n_counters; c++) {
-        struct gputop_metric_set_counter *counter =
+        const struct gputop_metric_set_counter *counter =
             &ctx->metric_set->counters[c];
 
         if (!filter.PassFilter(counter->name))
@@ -2102,19 +2218,38 @@ display_streams_window(struct window *win)
     list_for_each_entry(struct gputop_stream, stream, &ctx->streams, link) {
         ImGui::Text("id=%i", stream->id); ImGui::SameLine();
         ImGui::ProgressBar(stream->fill / 100.0);
+        if (stream->n_dropped_reports || stream->n_decimated_reports) {
+            ImGui::Text("  dropped=%" PRIu64 " decimated=%" PRIu64,
+                        stream->n_dropped_reports, stream->n_decimated_reports);
+        }
+        if (stream->n_records) {
+            ImGui::Text("  records=%" PRIu64 " samples=%" PRIu64 " lost=%" PRIu64
+                        " wrapped=%" PRIu64 " spurious=%" PRIu64,
+                        stream->n_records, stream->n_samples, stream->n_lost_samples,
+                        stream->n_wrapped_records, stream->n_spurious_records);
+        }
+        if (stream->reader_max_occupancy) {
+            ImGui::Text("  reader ring=%" PRIu64 "KB max=%" PRIu64 "KB stalls=%" PRIu64,
+                        stream->reader_occupancy / 1024,
+                        stream->reader_max_occupancy / 1024,
+                        stream->n_reader_stalls);
+        }
+        if (stream->n_late_records)
+            ImGui::Text("  late records=%" PRIu64, stream->n_late_records);
     }
     ImGui::NextColumn();
     list_for_each_entry(struct gputop_perf_tracepoint, tp, &ctx->perf_tracepoints, link) {
         ImGui::Text("tp=%s id=%i", tp->name, tp->event_id);
     }
-    ImGui::Text("n_timelines=%i", ctx->n_timelines);
-    ImGui::Text("n_graphs=%i", ctx->n_graphs);
+    ImGui::Text("n_timelines=%u", ctx->timelines.count);
+    ImGui::Text("n_graphs=%u", ctx->graphs.count);
     ImGui::Text("n_cpu_stats=%i", ctx->n_cpu_stats);
 
-    list_for_each_entry(struct gputop_perf_tracepoint_data, data,
-                        &ctx->perf_tracepoints_data, link) {
-        ImGui::Text("%s time=%" PRIx64, data->tp->name, data->data.time);
-    }
+    struct gputop_perf_tracepoint_iterator tp_iter;
+    gputop_client_context_tracepoint_iterator_init(ctx, &tp_iter, 0, UINT64_MAX);
+    while (gputop_client_context_tracepoint_iterator_next(&tp_iter))
+        ImGui::Text("%s time=%" PRIx64, tp_iter.data.tp->name, tp_iter.data.time);
+    gputop_client_context_tracepoint_iterator_fini(&tp_iter);
 }
 
 static void
@@ -2138,6 +2273,95 @@ show_streams_window(void)
 
 /**/
 
+static bool
+add_derived_counter(struct gputop_client_context *ctx, int idx)
+{
+    const char *error;
+
+    context.derived_counters[idx].n_metric_sets =
+        gputop_gen_add_derived_counter(ctx->gen_metrics,
+                                       context.derived_counters[idx].name,
+                                       context.derived_counters[idx].equation,
+                                       &error);
+    if (context.derived_counters[idx].n_metric_sets > 0)
+        error = NULL;
+    snprintf(context.derived_counter_error, sizeof(context.derived_counter_error),
+             "%s", error ? error : "");
+
+    return context.derived_counters[idx].n_metric_sets > 0;
+}
+
+static void
+update_derived_counters(struct gputop_client_context *ctx)
+{
+    /* A new connection brings new metric sets. */
+    if (!ctx->gen_metrics || ctx->gen_metrics->builtin_counters ||
+        context.n_derived_counters == 0)
+        return;
+
+    for (int i = 0; i < context.n_derived_counters; i++)
+        add_derived_counter(ctx, i);
+}
+
+static void
+display_derived_counters_window(struct window *win)
+{
+    struct gputop_client_context *ctx = &context.ctx;
+    static char name[64], equation[256];
+
+    ImGui::InputText("Name", name, sizeof(name));
+    ImGui::InputText("Equation", equation, sizeof(equation));
+    if (ImGui::IsItemHovered()) {
+        ImGui::SetTooltip("RPN as in the XML files (A 7 READ $GpuCoreClocks FDIV)\n"
+                          "or infix ($SamplerTexelMisses / max($EuActive, 1))");
+    }
+    if (ImGui::Button("Add") && ctx->gen_metrics &&
+        context.n_derived_counters < ARRAY_SIZE(context.derived_counters)) {
+        int idx = context.n_derived_counters;
+
+        snprintf(context.derived_counters[idx].name,
+                 sizeof(context.derived_counters[idx].name), "%s", name);
+        snprintf(context.derived_counters[idx].equation,
+                 sizeof(context.derived_counters[idx].equation), "%s", equation);
+        if (add_derived_counter(ctx, idx))
+            context.n_derived_counters++;
+    }
+    if (!ctx->gen_metrics) {
+        ImGui::SameLine(); ImGui::Text("Not connected");
+    }
+    if (context.derived_counter_error[0])
+        ImGui::TextColored(ImColor(0.9f, 0.0f, 0.0f), "%s", context.derived_counter_error);
+
+    ImGui::Separator();
+    for (int i = 0; i < context.n_derived_counters; i++) {
+        ImGui::Text("%s = %s (%i metric sets)",
+                    context.derived_counters[i].name,
+                    context.derived_counters[i].equation,
+                    context.derived_counters[i].n_metric_sets);
+    }
+}
+
+static void
+show_derived_counters_window(void)
+{
+    struct window *window = &context.derived_counters_window;
+
+    if (window->opened) {
+        window->opened = false;
+        return;
+    }
+
+    snprintf(window->name, sizeof(window->name), "Derived counters");
+    window->size = ImVec2(500, 200);
+    window->display = display_derived_counters_window;
+    window->opened = true;
+    window->destroy = hide_window;
+
+    list_add(&window->link, &context.windows);
+}
+
+/**/
+
 static float *
 get_cpus_stats(struct gputop_client_context *ctx, int max_cpu_stats)
 {
@@ -2264,8 +2488,9 @@ select_metric_set_from_group_counter(struct gputop_counter_group *group,
         }
     }
 
-    list_for_each_entry(struct gputop_metric_set_counter, counter,
-                        &group->counters, link) {
+    for (int c = 0; c < group->n_counters; c++) {
+        const struct gputop_metric_set_counter *counter = group->counters[c];
+
         if (!filter->PassFilter(counter->name))
             continue;
 
@@ -2293,7 +2518,7 @@ select_metric_set_from_counter(struct gputop_client_context *ctx,
 
     ImGui::BeginChild("##block");
     bool selected =
-        select_metric_set_from_group_counter(ctx->gen_metrics->root_group,
+        select_metric_set_from_group_counter(gputop_gen_get_root_group(ctx->gen_metrics),
                                              &filter,
                                              out_metric_set);
     ImGui::EndChild();
@@ -2346,6 +2571,8 @@ display_main_window(struct window *win)
     struct gputop_client_context *ctx = &context.ctx;
     char buf[80];
 
+    update_derived_counters(ctx);
+
     if (ImGui::Button("Style editor")) { show_style_editor_window(); } ImGui::SameLine();
     int n_messages = context.n_messages + ctx->n_messages;
     if (n_messages > 0)
@@ -2354,7 +2581,8 @@ display_main_window(struct window *win)
         snprintf(buf, sizeof(buf), "Logs");
     if (ImGui::Button(buf)) { show_log_window(); } ImGui::SameLine();
     if (ImGui::Button("Report")) { show_report_window(); } ImGui::SameLine();
-    if (ImGui::Button("Streams")) { show_streams_window(); }
+    if (ImGui::Button("Streams")) { show_streams_window(); } ImGui::SameLine();
+    if (ImGui::Button("Derived counters")) { show_derived_counters_window(); }
 
     if (ImGui::InputText("Address", context.host_address,
                          sizeof(context.host_address),
@@ -2468,6 +2696,23 @@ display_main_window(struct window *win)
                 pretty_sampling, pretty_bandwidth);
     ImGui::SliderFloat("OA visible sampling (s)",
                        &ctx->oa_visible_timeline_s, 0.1f, 15.0f);
+    int flow_control = ctx->oa_flow_control.policy;
+    if (ImGui::Combo("OA flow control", &flow_control,
+                     "Server default\0Block\0Drop oldest\0Decimate\0\0")) {
+        ctx->oa_flow_control.policy = (Gputop__FlowControlPolicy) flow_control;
+        maybe_restart_sampling(ctx);
+    }
+    int oa_recorder_seconds = ctx->oa_recorder_seconds;
+    if (ImGui::InputInt("OA flight recorder (s, 0 = live)", &oa_recorder_seconds)) {
+        ctx->oa_recorder_seconds = CLAMP(oa_recorder_seconds, 0, 3600);
+        maybe_restart_sampling(ctx);
+    }
+    if (ctx->oa_recorder_seconds) {
+        static int dump_seconds = 5;
+        ImGui::InputInt("Dump last (s)", &dump_seconds); ImGui::SameLine();
+        if (ImGui::Button("Dump flight recorder"))
+            gputop_client_context_dump_recorder(ctx, MAX2(dump_seconds, 0) * 1000);
+    }
     if (StartStopSamplingButton(ctx)) { toggle_start_stop_sampling(ctx); } ImGui::SameLine();
     if (ImGui::Button("Live counters")) { show_live_i915_perf_counters_window(); } ImGui::SameLine();
     if (ImGui::Button("Live usage")) { show_live_i915_perf_usage_window(); }
@@ -52,6 +52,16 @@ struct _gputop_connection_t {
     gputop_on_close_cb_t close_cb;
     void *user_data;
 
+    /* Zero copy receive path */
+    gputop_msg_alloc_cb_t msg_alloc_cb;
+    gputop_msg_release_cb_t msg_release_cb;
+    gputop_on_msg_cb_t msg_cb;
+
+    uint8_t *msg;
+    size_t msg_len, msg_capacity;
+    bool msg_frame; /* Whether the current frame goes into msg */
+    bool msg_fin;
+
     char http_client_header[1024];
     char http_server_header[64 * 1024];
 };
@@ -103,6 +113,10 @@ on_close_cb(uv_handle_t *handle)
 static void
 gputop_connection_end(gputop_connection_t *conn, const char *error)
 {
+    if (conn->msg) {
+        conn->msg_release_cb(conn->msg, conn->user_data);
+        conn->msg = NULL;
+    }
     conn->close_cb(conn, error, conn->user_data);
     uv_read_stop((uv_stream_t *) &conn->tcp_handle);
     uv_check_stop(&conn->check_handle);
@@ -131,9 +145,79 @@ on_wslay_msg_recv_cb(wslay_event_context_ptr ctx,
         return;
     }
 
+    /* Data messages were already delivered by on_wslay_frame_recv_end_cb() */
+    if (conn->msg_cb)
+        return;
+
     conn->data_cb(conn, arg->msg, arg->msg_length, conn->user_data);
 }
 
+static void
+on_wslay_frame_recv_start_cb(wslay_event_context_ptr ctx,
+                             const struct wslay_event_on_frame_recv_start_arg *arg,
+                             void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+
+    /* Control frames are interleaved within fragmented messages and
+     * buffered by wslay. */
+    conn->msg_frame = conn->msg_cb && !(arg->opcode & 0x8);
+    if (!conn->msg_frame)
+        return;
+
+    conn->msg_fin = arg->fin;
+
+    if (arg->opcode != WSLAY_CONTINUATION_FRAME) {
+        assert(conn->msg == NULL);
+        conn->msg = conn->msg_alloc_cb(arg->payload_length, conn->user_data);
+        conn->msg_capacity = arg->payload_length;
+        conn->msg_len = 0;
+        return;
+    }
+
+    /* The server streams samples as a long run of continuation frames so
+     * grow geometrically to avoid copying the message for every frame. */
+    if (conn->msg_len + arg->payload_length > conn->msg_capacity) {
+        size_t capacity = MAX2(conn->msg_len + arg->payload_length,
+                               conn->msg_capacity * 2);
+        uint8_t *msg = conn->msg_alloc_cb(capacity, conn->user_data);
+
+        memcpy(msg, conn->msg, conn->msg_len);
+        conn->msg_release_cb(conn->msg, conn->user_data);
+        conn->msg = msg;
+        conn->msg_capacity = capacity;
+    }
+}
+
+static void
+on_wslay_frame_recv_chunk_cb(wslay_event_context_ptr ctx,
+                             const struct wslay_event_on_frame_recv_chunk_arg *arg,
+                             void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+
+    if (!conn->msg_frame)
+        return;
+
+    assert(conn->msg_len + arg->data_length <= conn->msg_capacity);
+    memcpy(&conn->msg[conn->msg_len], arg->data, arg->data_length);
+    conn->msg_len += arg->data_length;
+}
+
+static void
+on_wslay_frame_recv_end_cb(wslay_event_context_ptr ctx, void *user_data)
+{
+    gputop_connection_t *conn = user_data;
+    uint8_t *msg = conn->msg;
+
+    if (!conn->msg_frame || !conn->msg_fin)
+        return;
+
+    /* The callback takes ownership of the message. */
+    conn->msg = NULL;
+    conn->msg_cb(conn, msg, conn->msg_len, conn->user_data);
+}
+
 static ssize_t
 on_wslay_recv_cb(wslay_event_context_ptr ctx,
                  uint8_t *buf, size_t len,
@@ -251,9 +335,9 @@ gputop_connect(const char *host, int port,
         on_wslay_recv_cb,
         on_wslay_send_cb,
         on_wslay_genmask_cb,
-        NULL,
-        NULL,
-        NULL,
+        on_wslay_frame_recv_start_cb,
+        on_wslay_frame_recv_chunk_cb,
+        on_wslay_frame_recv_end_cb,
         on_wslay_msg_recv_cb,
     };
     uv_getaddrinfo_t req;
@@ -262,6 +346,7 @@ gputop_connect(const char *host, int port,
     conn->ready_cb = ready_cb;
     conn->data_cb = data_cb;
     conn->close_cb = close_cb;
+    conn->user_data = user_data;
 
     wslay_event_context_client_init(&conn->wslay_ctx, &callbacks, conn);
 
@@ -318,6 +403,24 @@ gputop_connect(const char *host, int port,
     return conn;
 }
 
+void
+gputop_connection_set_msg_pool(gputop_connection_t *conn,
+                               gputop_msg_alloc_cb_t alloc_cb,
+                               gputop_msg_release_cb_t release_cb,
+                               gputop_on_msg_cb_t msg_cb)
+{
+    assert(conn != NULL);
+    assert(conn->msg == NULL);
+
+    conn->msg_alloc_cb = alloc_cb;
+    conn->msg_release_cb = release_cb;
+    conn->msg_cb = msg_cb;
+
+    /* Data frames are assembled into the pool's buffers, no need for wslay
+     * to keep its own copy. */
+    wslay_event_config_set_no_buffering(conn->wslay_ctx, msg_cb != NULL);
+}
+
 void
 gputop_connection_send(gputop_connection_t *conn, const void *data, size_t len)
 {
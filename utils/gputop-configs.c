@@ -162,14 +162,12 @@ perf_ioctl(int fd, unsigned long request, void *arg)
 static const char *
 metric_name(struct gputop_gen *gen, const char *hw_config_guid)
 {
-    struct hash_entry *entry = _mesa_hash_table_search(gen->metric_sets_map,
-                                                       hw_config_guid);
+    struct gputop_metric_set *metric_set =
+        gputop_gen_find_metric_set(gen, hw_config_guid);
 
-    if (!entry)
+    if (!metric_set)
         return "Unknown";
 
-    struct gputop_metric_set *metric_set = entry->data;
-
     return metric_set->symbol_name;
 }
 
@@ -56,15 +56,21 @@ static struct {
         char *symbol_name;
         const struct gputop_metric_set_counter *counter;
         int width;
+        int server_idx; /* index in the server aggregated values */
     } *metric_columns;
     int n_metric_columns;
+    const char **derived_counters; /* <name>=<equation> */
+    int n_derived_counters;
+    double *metric_values; /* all the counters, when evaluated at once */
+    bool server_aggregation;
     bool human_units;
     bool print_headers;
     bool print_maximums;
     FILE *wrapper_output;
 
     int n_accumulations;
-    struct gputop_accumulated_samples *last_samples;
+    bool printed_history;
+    uint64_t n_reported_drops;
 
     int child_process_pid;
     char **child_process_args;
@@ -278,14 +284,14 @@ static void print_system_info(void)
 
 static void print_metrics(void)
 {
+    const struct gputop_gen *gen = context.ctx.gen_metrics;
     int max_name_length = 0;
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &context.ctx.gen_metrics->metric_sets, link)
-        max_name_length = MAX2(max_name_length, strlen(metric_set->symbol_name));
+    for (int i = 0; i < gen->n_metric_sets; i++)
+        max_name_length = MAX2(max_name_length, strlen(gen->metric_sets[i]->symbol_name));
 
     comment("List of metric sets selectable with -m/--metrics=...\n");
-    list_for_each_entry(struct gputop_metric_set, metric_set,
-                        &context.ctx.gen_metrics->metric_sets, link) {
+    for (int i = 0; i < gen->n_metric_sets; i++) {
+        const struct gputop_metric_set *metric_set = gen->metric_sets[i];
         comment("\t%s:%*s %s hw-config-guid=%s\n",
                 metric_set->symbol_name,
                 max_name_length - strlen(metric_set->symbol_name), "",
@@ -406,29 +412,23 @@ static bool pid_is_child_of(uint32_t parent, uint32_t child)
     return is_child;
 }
 
-static bool match_process(struct gputop_hw_context *hw_context)
+static bool match_process_info(struct gputop_process_info *process)
 {
-    if (hw_context == NULL) {
-        if (context.child_process_pid == 0)
-            return true;
-        return false;
-    }
-
-    if (!hw_context->process)
+    if (!process)
         return false;
 
-    if (hw_context->process->pid == context.child_process_pid)
+    if (process->pid == context.child_process_pid)
         return true;
 
     struct hash_entry *entry =
         _mesa_hash_table_search(context.process_ids,
-                                (void *) (uintptr_t) hw_context->process->pid);
+                                (void *) (uintptr_t) process->pid);
     if (!entry) {
         bool is_child = pid_is_child_of(context.child_process_pid,
-                                        hw_context->process->pid);
+                                        process->pid);
 
         _mesa_hash_table_insert(context.process_ids,
-                                (void *) (uintptr_t) hw_context->process->pid,
+                                (void *) (uintptr_t) process->pid,
                                 (void *) (uintptr_t) is_child);
 
         return is_child;
@@ -437,10 +437,29 @@ static bool match_process(struct gputop_hw_context *hw_context)
     return (bool) entry->data;
 }
 
+static bool match_process(struct gputop_hw_context *hw_context)
+{
+    if (hw_context == NULL) {
+        if (context.child_process_pid == 0)
+            return true;
+        return false;
+    }
+
+    return match_process_info(hw_context->process);
+}
+
 static void print_accumulated_columns(struct gputop_client_context *ctx,
-                                      struct gputop_accumulated_samples *samples)
+                                      const struct gputop_samples_ring *ring,
+                                      uint32_t sample_idx)
 {
+    uint64_t *deltas = gputop_samples_ring_deltas(ring, sample_idx);
     int i;
+
+    if (context.metric_values) {
+        gputop_metric_set_evaluate_all(&ctx->devinfo, ctx->metric_set,
+                                       &deltas, 1, context.metric_values);
+    }
+
     for (i = 0; i < context.n_metric_columns; i++) {
         const struct gputop_metric_set_counter *counter =
             context.metric_columns[i].counter;
@@ -448,9 +467,11 @@ static void print_accumulated_columns(struct gputop_client_context *ctx,
 
         if (counter == &timestamp_counter) {
             snprintf(svalue, sizeof(svalue), "%" PRIu64,
-                     samples->accumulator.first_timestamp);
+                     ring->oa_timestamp[gputop_samples_ring_index(ring, sample_idx)]);
         } else {
-            double value = gputop_client_context_read_counter_value(ctx, samples, counter);
+            double value = context.metric_values ?
+                context.metric_values[counter - ctx->metric_set->counters] :
+                gputop_client_context_read_counter_value(ctx, deltas, counter);
             if (context.human_units)
                 gputop_client_pretty_print_value(counter->units, value, svalue, sizeof(svalue));
             else
@@ -462,37 +483,139 @@ static void print_accumulated_columns(struct gputop_client_context *ctx,
     output("\n");
 }
 
+static void print_flow_control(struct gputop_client_context *ctx)
+{
+    if (ctx->oa_stream.n_dropped_reports + ctx->oa_stream.n_decimated_reports !=
+        context.n_reported_drops) {
+        comment("Server flow control: %" PRIu64 " reports dropped, %" PRIu64 " decimated\n",
+                ctx->oa_stream.n_dropped_reports, ctx->oa_stream.n_decimated_reports);
+        context.n_reported_drops =
+            ctx->oa_stream.n_dropped_reports + ctx->oa_stream.n_decimated_reports;
+    }
+}
+
 static void print_columns(struct gputop_client_context *ctx,
                           struct gputop_hw_context *hw_context)
 {
-    struct list_head *list;
+    const struct gputop_samples_ring *ring;
 
     if (!match_process(hw_context))
         return;
 
     context.n_accumulations++;
-    list = hw_context == NULL ? &ctx->graphs : &hw_context->graphs;
+    ring = hw_context == NULL ? &ctx->graphs : &hw_context->graphs;
 
-    if (context.last_samples == NULL) {
-        list_for_each_entry(struct gputop_accumulated_samples, samples, list, link) {
-            print_accumulated_columns(ctx, samples);
-        }
-        context.last_samples = list_last_entry(list, struct gputop_accumulated_samples, link);
+    if (!context.printed_history) {
+        for (uint32_t i = 0; i < ring->count; i++)
+            print_accumulated_columns(ctx, ring, i);
+        context.printed_history = true;
     } else {
-        context.last_samples = list_last_entry(list, struct gputop_accumulated_samples, link);
-        print_accumulated_columns(ctx, context.last_samples);
+        print_accumulated_columns(ctx, ring, ring->count - 1);
     }
 
+    print_flow_control(ctx);
+
+    if (context.child_exited)
+        quit();
+}
+
+static void print_aggregated_columns(struct gputop_client_context *ctx,
+                                     uint32_t hw_id,
+                                     uint64_t timestamp_start,
+                                     uint64_t timestamp_end,
+                                     const double *values)
+{
+    int i;
+
+    if (hw_id == GPUTOP_OA_INVALID_CTX_ID ? !match_process(NULL) :
+        !match_process_info(gputop_client_context_hw_id_to_process(ctx, hw_id)))
+        return;
+
+    context.n_accumulations++;
+
+    for (i = 0; i < context.n_metric_columns; i++) {
+        const struct gputop_metric_set_counter *counter =
+            context.metric_columns[i].counter;
+        char svalue[20];
+
+        if (counter == &timestamp_counter) {
+            snprintf(svalue, sizeof(svalue), "%" PRIu64, timestamp_start);
+        } else {
+            double value = values[context.metric_columns[i].server_idx];
+            if (context.human_units)
+                gputop_client_pretty_print_value(counter->units, value, svalue, sizeof(svalue));
+            else
+                snprintf(svalue, sizeof(svalue), "%.2f", value);
+        }
+        output("%*s%s%s", context.metric_columns[i].width - strlen(svalue), "",
+               svalue, i == (context.n_metric_columns - 1) ? "" : ",");
+    }
+    output("\n");
+
+    print_flow_control(ctx);
+
     if (context.child_exited)
         quit();
 }
 
+static void setup_server_aggregation(struct gputop_client_context *ctx)
+{
+    const struct gputop_metric_set_counter **counters =
+        calloc(context.n_metric_columns, sizeof(counters[0]));
+    int i, n_counters = 0;
+
+    for (i = 0; i < context.n_metric_columns; i++) {
+        if (context.metric_columns[i].counter == &timestamp_counter)
+            continue;
+        context.metric_columns[i].server_idx = n_counters;
+        counters[n_counters++] = context.metric_columns[i].counter;
+    }
+
+    ctx->oa_server_counters = counters;
+    ctx->n_oa_server_counters = n_counters;
+    /* Only a monitored child process needs the values per context */
+    ctx->oa_server_per_hw_context = context.child_process_pid != 0;
+    ctx->aggregate_cb = print_aggregated_columns;
+}
+
+static bool add_derived_counters(struct gputop_client_context *ctx)
+{
+    for (int i = 0; i < context.n_derived_counters; i++) {
+        const char *definition = context.derived_counters[i];
+        const char *equal = strchr(definition, '=');
+        const char *error;
+        char *name;
+        bool added;
+
+        if (!equal) {
+            comment("Invalid derived counter '%s', expected <name>=<equation>\n",
+                    definition);
+            return false;
+        }
+
+        name = strndup(definition, equal - definition);
+        added = gputop_gen_add_derived_counter(ctx->gen_metrics, name,
+                                               equal + 1, &error) > 0;
+        if (!added)
+            comment("Unable to add derived counter '%s': %s\n", name, error);
+        free(name);
+
+        if (!added)
+            return false;
+    }
+
+    return true;
+}
+
 static bool handle_features()
 {
     static bool info_printed = false;
     struct gputop_client_context *ctx = &context.ctx;
     int i;
 
+    if (ctx->gen_metrics && !add_derived_counters(ctx))
+        return true;
+
     if (!context.metric_name ||
         (ctx->metric_set = gputop_client_context_symbol_to_metric_set(ctx, context.metric_name)) == NULL) {
         print_metrics();
@@ -521,6 +644,12 @@ static bool handle_features()
                     comment("Unknown counter '%s'\n", context.metric_columns[i]);
                     return true;
                 }
+                if (context.server_aggregation &&
+                    context.metric_columns[i].counter->expression) {
+                    comment("Derived counter '%s' can't be aggregated by the server\n",
+                            context.metric_columns[i].symbol_name);
+                    return true;
+                }
             }
 
             context.metric_columns[i].width =
@@ -528,6 +657,14 @@ static bool handle_features()
                      strlen(unit_to_string(context.metric_columns[i].counter->units)) +
                      unit_to_width(context.metric_columns[i].counter->units) + 1) + 1;
         }
+
+        if (context.server_aggregation) {
+            setup_server_aggregation(ctx);
+        } else if (gputop_metric_set_use_evaluate_all(ctx->metric_set,
+                                                      context.n_metric_columns)) {
+            context.metric_values =
+                calloc(ctx->metric_set->n_counters, sizeof(context.metric_values[0]));
+        }
     }
     if (!info_printed && ctx->features) {
         info_printed = true;
@@ -544,13 +681,10 @@ static void on_ready(gputop_connection_t *conn, void *user_data)
     gputop_client_context_reset(&context.ctx, conn);
 }
 
-static void on_data(gputop_connection_t *conn,
-                    const void *data, size_t len,
-                    void *user_data)
+static void on_data_handled(void)
 {
     static bool features_handled = false;
 
-    gputop_client_context_handle_data(&context.ctx, data, len);
     if (!features_handled && context.ctx.features) {
         features_handled = true;
         if (handle_features()) {
@@ -578,6 +712,32 @@ static void on_data(gputop_connection_t *conn,
     }
 }
 
+static void on_data(gputop_connection_t *conn,
+                    const void *data, size_t len,
+                    void *user_data)
+{
+    gputop_client_context_handle_data(&context.ctx, data, len);
+    on_data_handled();
+}
+
+static void *on_msg_alloc(size_t len, void *user_data)
+{
+    return gputop_client_context_alloc_message(&context.ctx, len);
+}
+
+static void on_msg_release(void *msg, void *user_data)
+{
+    gputop_client_context_release_message(&context.ctx, msg);
+}
+
+static void on_msg(gputop_connection_t *conn,
+                   void *msg, size_t len,
+                   void *user_data)
+{
+    gputop_client_context_handle_message(&context.ctx, msg, len);
+    on_data_handled();
+}
+
 static void on_close(gputop_connection_t *conn, const char *error,
                      void *user_data)
 {
@@ -600,6 +760,25 @@ static const char *next_column(const char *string)
     return NULL;
 }
 
+static bool parse_flow_control(const char *arg, struct gputop_flow_control *flow_control)
+{
+    if (!strcmp(arg, "block")) {
+        flow_control->policy = GPUTOP__FLOW_CONTROL_POLICY__BLOCK;
+    } else if (!strcmp(arg, "drop")) {
+        flow_control->policy = GPUTOP__FLOW_CONTROL_POLICY__DROP_OLDEST;
+    } else if (!strncmp(arg, "decimate", strlen("decimate"))) {
+        arg += strlen("decimate");
+        flow_control->policy = GPUTOP__FLOW_CONTROL_POLICY__DECIMATE;
+        if (*arg == ':')
+            flow_control->decimation = atoi(arg + 1);
+        else if (*arg != '\0')
+            return false;
+    } else
+        return false;
+
+    return true;
+}
+
 static void usage(void)
 {
     output("Usage: gputop-wrapper [options] <program> [program args...]\n"
@@ -614,6 +793,9 @@ static void usage(void)
            "                                     (first line after units)\n"
            "\t -c, --columns <col0,col1,..>      Columns to print out\n"
            "                                     (prints out a lists of counters if missing)\n"
+           "\t -d, --derived <name>=<equation>   Adds a counter computed from other counters,\n"
+           "                                     equations are RPN as in the XML files or infix\n"
+           "                                     (e.g. 'Ratio=$SamplerTexelMisses / $EuActive')\n"
            "\t -n, --no-human-units              Disable human readable units (for machine readable output)\n"
            "\t -N, --no-headers                  Disable headers (for machine readable output)\n"
            "\t -O, --child-output <filename>     Outputs the child's standard output to filename\n"
@@ -621,6 +803,13 @@ static void usage(void)
            "                                     (disables human readable units)\n"
            "\t -w, --max-inactive-time <time>    Maximum time of inactivity before killing\n"
            "                                     the child process (in seconds, floating point)\n"
+           "\t -f, --flow-control <policy>       What the server does when we can't keep up:\n"
+           "                                     block, drop or decimate[:N]\n"
+           "\t -r, --record <filename>           Records the session to filename, to be replayed\n"
+           "                                     with gputop-wrapper-replay -H <filename>\n"
+           "\t -a, --server-aggregation          Have the server accumulate the reports and only\n"
+           "                                     send the values of the columns (for slow links)\n"
+           "\t -z, --compress                    Have the server compress the reports it sends\n"
            "\n"
         );
 }
@@ -647,11 +836,16 @@ int main (int argc, char **argv)
         { "metric",            required_argument,  0, 'm' },
         { "max",               no_argument,        0, 'M' },
         { "columns",           required_argument,  0, 'c' },
+        { "derived",           required_argument,  0, 'd' },
         { "no-human-units",    no_argument,        0, 'n' },
         { "no-headers",        no_argument,        0, 'N' },
         { "child-output",      required_argument,  0, 'O' },
         { "output",            required_argument,  0, 'o' },
         { "max-inactive-time", required_argument,  0, 'w' },
+        { "flow-control",      required_argument,  0, 'f' },
+        { "record",            required_argument,  0, 'r' },
+        { "server-aggregation", no_argument,       0, 'a' },
+        { "compress",          no_argument,        0, 'z' },
         { NULL,                required_argument,  0, '-' },
         { 0, 0, 0, 0 }
     };
@@ -670,9 +864,12 @@ int main (int argc, char **argv)
     context.ctx.oa_aggregation_period_ns = 1000000000ULL;
 
     while (!opt_done &&
-           (opt = getopt_long(argc, argv, "c:hH:m:Mp:P:-nNO:o:", long_options, NULL)) != -1)
+           (opt = getopt_long(argc, argv, "ac:d:f:hH:m:Mp:P:-nNO:o:r:z", long_options, NULL)) != -1)
     {
         switch (opt) {
+        case 'a':
+            context.server_aggregation = true;
+            break;
         case 'h':
             usage();
             return EXIT_SUCCESS;
@@ -701,6 +898,12 @@ int main (int argc, char **argv)
             }
             break;
         }
+        case 'd':
+            context.derived_counters =
+                realloc(context.derived_counters,
+                        (context.n_derived_counters + 1) * sizeof(context.derived_counters[0]));
+            context.derived_counters[context.n_derived_counters++] = optarg;
+            break;
         case 'p':
             port = atoi(optarg);
             break;
@@ -728,6 +931,19 @@ int main (int argc, char **argv)
         case 'w':
             context.max_idle_child_time_ms = atof(optarg) * 1000.0f;
             break;
+        case 'f':
+            if (!parse_flow_control(optarg, &context.ctx.oa_flow_control)) {
+                comment("Unknown flow control policy '%s'\n", optarg);
+                return EXIT_FAILURE;
+            }
+            break;
+        case 'r':
+            if (!gputop_client_context_start_capture(&context.ctx, optarg))
+                return EXIT_FAILURE;
+            break;
+        case 'z':
+            context.ctx.oa_compressed_frames = true;
+            break;
         case '-':
             opt_done = true;
             break;
@@ -744,7 +960,9 @@ int main (int argc, char **argv)
     uv_signal_init(loop, &child_process_handle);
     uv_signal_start_oneshot(&child_process_handle, on_child_process_exit, SIGCHLD);
 
-    gputop_connect(host, port, on_ready, on_data, on_close, NULL);
+    gputop_connection_t *conn =
+        gputop_connect(host, port, on_ready, on_data, on_close, NULL);
+    gputop_connection_set_msg_pool(conn, on_msg_alloc, on_msg_release, on_msg);
 
     gputop_client_pretty_print_value(GPUTOP_PERFQUERY_COUNTER_UNITS_NS,
                                      context.ctx.oa_aggregation_period_ns,
@@ -770,6 +988,7 @@ int main (int argc, char **argv)
     uv_signal_stop(&child_process_handle);
 
     gputop_client_context_reset(&context.ctx, NULL);
+    gputop_client_context_stop_capture(&context.ctx);
 
     comment("Finished.\n");
 